@@ -0,0 +1,37 @@
+#ifndef ARKIN_SHADER_PACK_H
+#define ARKIN_SHADER_PACK_H
+
+#include "arkin_core.h"
+
+// Loads shaders from a pack written by the tool with '--pack'.
+//
+// The pack is mapped into memory and blobs are only decompressed the first
+// time they're requested. Every function may be called from any thread.
+
+typedef struct ShaderPack ShaderPack;
+
+// Runs 'job' once for every index below 'count' and returns once all of
+// them finished. Jobs may run in parallel.
+typedef void (*ShaderPackJob)(void *data, U32 index);
+typedef struct ShaderPackJobSystem ShaderPackJobSystem;
+struct ShaderPackJobSystem {
+    void (*run)(void *userdata, ShaderPackJob job, void *data, U32 count);
+    void *userdata;
+};
+
+// Returns NULL if the file can't be mapped or isn't a valid pack.
+extern ShaderPack *shader_pack_open(const char *path);
+extern void shader_pack_close(ShaderPack *pack);
+
+// Returns the SPIR-V of a blob, named '<program>.vert', '<program>.frag',
+// '<program>.comp' or '<program>.spv'. The data stays valid until the pack
+// is closed. Returns an empty string if the pack has no such blob or it's
+// corrupt.
+extern ArStr shader_pack_get(ShaderPack *pack, ArStr name);
+
+// Asks the kernel to read the named blobs ahead of time and decompresses
+// the compressed ones, spread over the jobs of 'jobs', or on the calling
+// thread if 'jobs.run' is NULL. Unknown names are ignored.
+extern void shader_pack_prefetch(ShaderPack *pack, const ArStr *names, U32 count, ShaderPackJobSystem jobs);
+
+#endif
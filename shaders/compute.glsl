@@ -0,0 +1,21 @@
+#comp cs
+layout (local_size_x = 64) in;
+
+layout (binding = 0) buffer Values {
+    float values[];
+} data;
+
+layout (push_constant) uniform Params {
+    float scale;
+    uint count;
+} params;
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if (i < params.count) {
+        data.values[i] *= params.scale;
+    }
+}
+#end
+
+#compute_program ScaleShader cs
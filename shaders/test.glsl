@@ -59,7 +59,7 @@ layout (push_constant) uniform Consts {
     mat4 some_matrix;
 } consts;
 
-layout (binding = 0) uniform sampler2D samp;
+layout (binding = 2) uniform sampler2D samp;
 
 layout (location = 0) in vec3 v_pos;
 layout (location = 1) in vec2 v_uv;
@@ -79,8 +79,8 @@ layout (location = 0) out vec4 frag_color;
 
 layout (location = 0) in vec2 f_uv;
 
-layout (binding = 0) uniform sampler2D samp;
-layout (binding = 1) uniform sampler2D other_samp;
+layout (binding = 2) uniform sampler2D samp;
+layout (binding = 3) uniform sampler2D other_samp;
 
 void main() {
     vec2 uv = half_value(f_uv);
@@ -88,4 +88,7 @@ void main() {
 }
 #end
 
+#vertex_format v_uv R16G16_SFLOAT
+#mediump_output frag_color
+
 #program TestShader vs fs
@@ -9,8 +9,37 @@
 typedef enum {
     SHADER_TYPE_VERTEX,
     SHADER_TYPE_FRAGMENT,
+    SHADER_TYPE_COMPUTE,
 } ShaderType;
 
+// The parser's #line directives name files, which glslang only accepts
+// with GL_GOOGLE_cpp_style_line_directive. #version has to come before
+// anything else so it's moved to the top, its line left empty.
+static ArStr enable_line_directives(ArArena *arena, ArStr glsl) {
+    const ArStr extension = ar_str_lit("#extension GL_GOOGLE_cpp_style_line_directive : require\n");
+
+    U64 i = 0;
+    while (i < glsl.len) {
+        U64 start = i;
+        while (i < glsl.len && glsl.data[i] != '\n') {
+            i++;
+        }
+        ArStr line = ar_str_trim(ar_str(&glsl.data[start], i - start));
+        if (line.len >= 8 && memcmp(line.data, "#version", 8) == 0) {
+            ArStr before = ar_str(glsl.data, start);
+            ArStr after = ar_str_chop_start(glsl, i);
+            return ar_str_pushf(arena, "%.*s\n%.*s%.*s%.*s",
+                    (I32) line.len, line.data,
+                    (I32) extension.len, extension.data,
+                    (I32) before.len, before.data,
+                    (I32) after.len, after.data);
+        }
+        i++;
+    }
+
+    return ar_str_pushf(arena, "%.*s%.*s", (I32) extension.len, extension.data, (I32) glsl.len, glsl.data);
+}
+
 static glslang_shader_t *create_shader(ArArena *arena, ArStr glsl, ShaderType type) {
     glslang_stage_t stage;
     switch (type) {
@@ -20,10 +49,13 @@ static glslang_shader_t *create_shader(ArArena *arena, ArStr glsl, ShaderType ty
         case SHADER_TYPE_FRAGMENT:
             stage = GLSLANG_STAGE_FRAGMENT;
             break;
+        case SHADER_TYPE_COMPUTE:
+            stage = GLSLANG_STAGE_COMPUTE;
+            break;
     }
 
     ArTemp scratch = ar_scratch_get(&arena, 1);
-    const char *code_cstr = ar_str_to_cstr(arena, glsl);
+    const char *code_cstr = ar_str_to_cstr(arena, enable_line_directives(scratch.arena, glsl));
     glslang_input_t input = {
         .language = GLSLANG_SOURCE_GLSL,
         .stage = stage,
@@ -65,11 +97,158 @@ static glslang_shader_t *create_shader(ArArena *arena, ArStr glsl, ShaderType ty
     return shader;
 }
 
-CompiledShader compile_shader(ArArena *arena, ParsedShader shader) {
-    glslang_initialize_process();
+// glslang is initialized on the first compile rather than at startup so runs
+// that turn out to have nothing to compile never pay for it.
+static B8 glslang_initialized = false;
+
+static void initialize_glslang(void) {
+    if (!glslang_initialized) {
+        glslang_initialize_process();
+        glslang_initialized = true;
+    }
+}
+
+void compiler_terminate(void) {
+    if (glslang_initialized) {
+        glslang_finalize_process();
+        glslang_initialized = false;
+    }
+    reflection_terminate();
+}
+
+static ArStr canonicalize(ArArena *arena, ArStr name, ArStr spv) {
+    ArStr canonical = spv_canonicalize(arena, spv);
+    ar_info("%.*s: Canonicalized SPIR-V from %llu to %llu bytes.",
+            (I32) name.len, name.data,
+            (unsigned long long) spv.len, (unsigned long long) canonical.len);
+    return canonical;
+}
 
-    glslang_shader_t *vertex_shader = create_shader(arena, shader.program.vertex_source, SHADER_TYPE_VERTEX);
-    glslang_shader_t *fragment_shader = create_shader(arena, shader.program.fragment_source, SHADER_TYPE_FRAGMENT);
+// Debug information adds the OpLines the cost report needs, otherwise the
+// options are glslang_program_SPIRV_generate()'s.
+static ArStr generate_spv(ArArena *arena, glslang_program_t *program, glslang_stage_t stage, B8 debug_info) {
+    glslang_spv_options_t spv_options = {
+        .generate_debug_info = debug_info,
+        .disable_optimizer = true,
+        .validate = true,
+    };
+    glslang_program_SPIRV_generate_with_options(program, stage, &spv_options);
+    U64 len = glslang_program_SPIRV_get_size(program) * sizeof(U32);
+    U8 *data = ar_arena_push_arr_no_zero(arena, U8, len);
+    glslang_program_SPIRV_get(program, (U32 *) data);
+    const char *spirv_messages = glslang_program_SPIRV_get_messages(program);
+    if (spirv_messages != NULL) {
+        ar_info("GLSLANG SPIR-V messages: %s", spirv_messages);
+    }
+    return ar_str(data, len);
+}
+
+// Falls back to the unprocessed source when the preprocessor can't handle
+// it, glslang preprocesses it either way.
+static ArStr preprocess_stage(ArArena *arena, Preprocessor *pp, ArStrList parts, ArStr source, const char *stage) {
+    ArStr output;
+    if (!preprocess(pp, arena, parts, &output)) {
+        ar_info("Leaving the %s stage to the glslang preprocessor.", stage);
+        return source;
+    }
+    return output;
+}
+
+// Compute programs are a single stage, none of the passes between the
+// vertex and fragment stages apply.
+static CompiledShader compile_compute(ArArena *arena, ParsedShader shader, Options options) {
+    ArStr compute_source = shader.program.compute_source;
+    if (options.preprocess) {
+        Preprocessor *pp = preprocessor_create(arena);
+        compute_source = preprocess_stage(arena, pp, shader.program.compute_parts, compute_source, "compute");
+    }
+
+    glslang_shader_t *compute_shader = create_shader(arena, compute_source, SHADER_TYPE_COMPUTE);
+
+    glslang_program_t *program = glslang_program_create();
+    glslang_program_add_shader(program, compute_shader);
+
+    if (!glslang_program_link(program, GLSLANG_MSG_SPV_RULES_BIT | GLSLANG_MSG_VULKAN_RULES_BIT)) {
+        ar_error("GLSLANG: Linking failed.");
+        ar_error("%s", glslang_program_get_info_log(program));
+        ar_error("%s", glslang_program_get_info_debug_log(program));
+        glslang_program_delete(program);
+        glslang_shader_delete(compute_shader);
+        return (CompiledShader) {0};
+    }
+
+    ArStr compute_spv = generate_spv(arena, program, GLSLANG_STAGE_COMPUTE, options.cost_report);
+
+    glslang_program_delete(program);
+    glslang_shader_delete(compute_shader);
+
+    if (options.cost_report) {
+        compute_spv = spv_report_line_costs(arena, shader.program.name, "compute", compute_spv);
+    }
+
+    CompiledShader compiled = {
+        .name = shader.program.name,
+        .compute.spv = compute_spv,
+    };
+    compiled.compute.reflection = reflect_spv(arena, compute_spv, options.backends, compiled.compute.sources);
+
+    for (U32 i = 0; i < BACKEND_COUNT; i++) {
+        if ((options.backends & (1 << i)) && compiled.compute.sources[i].len == 0) {
+            return (CompiledShader) {0};
+        }
+    }
+
+    if (options.cpu_output.len != 0) {
+        compiled.cpu_source = cross_compile_cpp(arena, compute_spv);
+        if (compiled.cpu_source.len == 0) {
+            return (CompiledShader) {0};
+        }
+    }
+
+    // After reflection and the CPU harness, both describe the whole block.
+    spv_trim_push_constants(arena, compiled.name, "compute", &compiled.compute.spv, &compiled.compute.reflection.push_constant_range);
+
+    compiled.binding_count = merge_bindings(arena, &compiled.compute.reflection, 1, &compiled.bindings);
+    compiled.push_constant_range_count = merge_push_constant_ranges(arena, &compiled.compute.reflection, 1, &compiled.push_constant_ranges);
+
+    // Reflection needs the names, only canonicalize what gets written.
+    if (options.canonicalize) {
+        compiled.compute.spv = canonicalize(arena, compiled.name, compiled.compute.spv);
+    }
+
+    if (options.validate && !spv_validate(compiled.name, "compute", compiled.compute.spv)) {
+        return (CompiledShader) {0};
+    }
+
+    return compiled;
+}
+
+CompiledShader compile_shader(ArArena *arena, ParsedShader shader, Options options) {
+    initialize_glslang();
+
+    if (shader.program.compute_source.len != 0) {
+        return compile_compute(arena, shader, options);
+    }
+    if (options.cpu_output.len != 0) {
+        ar_error("%.*s: Only compute programs can run on the CPU.", (I32) shader.program.name.len, shader.program.name.data);
+        return (CompiledShader) {0};
+    }
+
+    ArStr vertex_source = shader.program.vertex_source;
+    ArStr fragment_source = shader.program.fragment_source;
+    if (options.preprocess) {
+        Preprocessor *pp = preprocessor_create(arena);
+        vertex_source = preprocess_stage(arena, pp, shader.program.vertex_parts, vertex_source, "vertex");
+        fragment_source = preprocess_stage(arena, pp, shader.program.fragment_parts, fragment_source, "fragment");
+
+        U32 hits;
+        U32 misses;
+        preprocessor_stats(pp, &hits, &misses);
+        ar_info("Preprocessed %u parts, %u from cache.", hits + misses, hits);
+    }
+
+    glslang_shader_t *vertex_shader = create_shader(arena, vertex_source, SHADER_TYPE_VERTEX);
+    glslang_shader_t *fragment_shader = create_shader(arena, fragment_source, SHADER_TYPE_FRAGMENT);
 
     glslang_program_t *program = glslang_program_create();
     glslang_program_add_shader(program, vertex_shader);
@@ -85,41 +264,90 @@ CompiledShader compile_shader(ArArena *arena, ParsedShader shader) {
         return (CompiledShader) {0};
     }
 
-    glslang_program_SPIRV_generate(program, GLSLANG_STAGE_VERTEX);
-    U64 len = glslang_program_SPIRV_get_size(program) * sizeof(U32);
-    U8 *data = ar_arena_push_arr_no_zero(arena, U8, len);
-    glslang_program_SPIRV_get(program, (U32 *) data);
-    const char *spirv_messages = glslang_program_SPIRV_get_messages(program);
-    if (spirv_messages != NULL) {
-        ar_info("GLSLANG SPIR-V messages: %s", spirv_messages);
-    }
-    ArStr vertex_spv = ar_str(data, len);
-
-    glslang_program_SPIRV_generate(program, GLSLANG_STAGE_FRAGMENT);
-    len = glslang_program_SPIRV_get_size(program) * sizeof(U32);
-    data = ar_arena_push_arr_no_zero(arena, U8, len);
-    glslang_program_SPIRV_get(program, (U32 *) data);
-    spirv_messages = glslang_program_SPIRV_get_messages(program);
-    if (spirv_messages != NULL) {
-        ar_info("GLSLANG SPIR-V messages: %s", spirv_messages);
-    }
-    ArStr fragment_spv = ar_str(data, len);
+    ArStr vertex_spv = generate_spv(arena, program, GLSLANG_STAGE_VERTEX, options.cost_report);
+    ArStr fragment_spv = generate_spv(arena, program, GLSLANG_STAGE_FRAGMENT, options.cost_report);
 
     glslang_program_delete(program);
     glslang_shader_delete(vertex_shader);
     glslang_shader_delete(fragment_shader);
 
-    glslang_finalize_process();
+    if (options.cost_report) {
+        vertex_spv = spv_report_line_costs(arena, shader.program.name, "vertex", vertex_spv);
+        fragment_spv = spv_report_line_costs(arena, shader.program.name, "fragment", fragment_spv);
+    }
+
+    // Reflection only sees the interface that's left.
+    if (options.eliminate_varyings && !spv_eliminate_varyings(arena, shader.program.name, &vertex_spv, &fragment_spv)) {
+        return (CompiledShader) {0};
+    }
+
+    // After varying elimination so code it removed doesn't count as
+    // accessing push constants.
+    if (options.reorder_push_constants) {
+        spv_reorder_push_constants(arena, shader.program.name, &vertex_spv, &fragment_spv);
+    }
+
+    // Reflection doesn't care about precision, relax before anything
+    // consumes the fragment module so the GLSL ES backend sees it too.
+    if (options.precision_report || options.relax_precision) {
+        fragment_spv = spv_relax_precision(arena, shader.program.name, fragment_spv, shader.mediump_outputs, options.relax_precision);
+    }
 
-    return (CompiledShader) {
+    CompiledShader compiled = {
         .name = shader.program.name,
-        .vertex = {
-            .spv = vertex_spv,
-            .reflection = reflect_spv(arena, vertex_spv),
-        },
-        .fragment = {
-            .spv = fragment_spv,
-            .reflection = reflect_spv(arena, fragment_spv),
-        },
+        .vertex.spv = vertex_spv,
+        .fragment.spv = fragment_spv,
     };
+    compiled.vertex.reflection = reflect_spv(arena, vertex_spv, options.backends, compiled.vertex.sources);
+    compiled.fragment.reflection = reflect_spv(arena, fragment_spv, options.backends, compiled.fragment.sources);
+
+    for (U32 i = 0; i < BACKEND_COUNT; i++) {
+        if ((options.backends & (1 << i)) &&
+                (compiled.vertex.sources[i].len == 0 || compiled.fragment.sources[i].len == 0)) {
+            return (CompiledShader) {0};
+        }
+    }
+
+    // After reflection so the header describes the whole block.
+    spv_trim_push_constants(arena, compiled.name, "vertex", &compiled.vertex.spv, &compiled.vertex.reflection.push_constant_range);
+    spv_trim_push_constants(arena, compiled.name, "fragment", &compiled.fragment.spv, &compiled.fragment.reflection.push_constant_range);
+
+    ReflectedStage stages[] = {
+        compiled.vertex.reflection,
+        compiled.fragment.reflection,
+    };
+    compiled.binding_count = merge_bindings(arena, stages, ar_arrlen(stages), &compiled.bindings);
+    compiled.push_constant_range_count = merge_push_constant_ranges(arena, stages, ar_arrlen(stages), &compiled.push_constant_ranges);
+
+    if (options.single_module) {
+        ArStr modules[] = {compiled.vertex.spv, compiled.fragment.spv};
+        compiled.spv = spv_link(arena, modules, ar_arrlen(modules));
+    }
+
+    // Reflection needs the names, only canonicalize what gets written.
+    if (options.canonicalize) {
+        CompiledStage *stages_to_remap[] = {&compiled.vertex, &compiled.fragment};
+        for (U32 i = 0; i < ar_arrlen(stages_to_remap); i++) {
+            stages_to_remap[i]->spv = canonicalize(arena, compiled.name, stages_to_remap[i]->spv);
+        }
+        if (compiled.spv.len != 0) {
+            compiled.spv = canonicalize(arena, compiled.name, compiled.spv);
+        }
+    }
+
+    // Validate what actually gets written, after linking and remapping.
+    if (options.validate) {
+        B8 valid = true;
+        if (compiled.spv.len != 0) {
+            valid &= spv_validate(compiled.name, "linked", compiled.spv);
+        } else {
+            valid &= spv_validate(compiled.name, "vertex", compiled.vertex.spv);
+            valid &= spv_validate(compiled.name, "fragment", compiled.fragment.spv);
+        }
+        if (!valid) {
+            return (CompiledShader) {0};
+        }
+    }
+
+    return compiled;
 }
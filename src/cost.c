@@ -0,0 +1,191 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Attributes the instructions of a module compiled with debug information
+// to the source lines their OpLines point at. The parser's #line directives
+// make those the lines of the files the modules were written in, so shared
+// includes show up as themselves rather than as part of every program.
+//
+// Instruction counts are a static estimate, nothing is weighted by how
+// often it runs or how expensive it is on a GPU.
+
+#define COST_REPORT_LINES 16
+
+typedef struct LineCost LineCost;
+struct LineCost {
+    // OpString of the file.
+    U32 file;
+    U32 line;
+    U32 count;
+};
+
+// Instructions which only give the function structure.
+static B8 is_structural(U32 opcode) {
+    switch (opcode) {
+        case SpvOpFunction:
+        case SpvOpFunctionParameter:
+        case SpvOpFunctionEnd:
+        case SpvOpLabel:
+        case SpvOpVariable:
+        case SpvOpSelectionMerge:
+        case SpvOpLoopMerge:
+        case SpvOpLine:
+        case SpvOpNoLine:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// An OpLine applies until the end of its block.
+static B8 is_terminator(U32 opcode) {
+    switch (opcode) {
+        case SpvOpBranch:
+        case SpvOpBranchConditional:
+        case SpvOpSwitch:
+        case SpvOpReturn:
+        case SpvOpReturnValue:
+        case SpvOpKill:
+        case SpvOpTerminateInvocation:
+        case SpvOpUnreachable:
+        case SpvOpFunctionEnd:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static I32 compare_by_location(const void *a, const void *b) {
+    const LineCost *_a = a;
+    const LineCost *_b = b;
+    if (_a->file != _b->file) {
+        return _a->file > _b->file ? 1 : -1;
+    }
+    return (_a->line > _b->line) - (_a->line < _b->line);
+}
+
+static I32 compare_by_count(const void *a, const void *b) {
+    const LineCost *_a = a;
+    const LineCost *_b = b;
+    if (_a->count != _b->count) {
+        return _a->count < _b->count ? 1 : -1;
+    }
+    return compare_by_location(a, b);
+}
+
+// OpSource keeps the language and version, the file and the embedded
+// source text only exist for debuggers.
+static B8 is_line_info(SpvInstruction inst) {
+    switch (inst.opcode) {
+        case SpvOpLine:
+        case SpvOpNoLine:
+        case SpvOpString:
+        case SpvOpSourceContinued:
+        case SpvOpModuleProcessed:
+            return true;
+        default:
+            return false;
+    }
+}
+
+ArStr spv_report_line_costs(ArArena *arena, ArStr name, const char *stage, ArStr spv) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    SpvModule module = spv_parse_module(scratch.arena, spv);
+    if (module.bound == 0) {
+        ar_scratch_release(&scratch);
+        return spv;
+    }
+
+    ArStr *strings = ar_arena_push_arr(scratch.arena, ArStr, module.bound);
+    LineCost *costs = ar_arena_push_arr_no_zero(scratch.arena, LineCost, module.instruction_count);
+    U32 cost_count = 0;
+    U32 total = 0;
+    U32 unlocated = 0;
+
+    LineCost current = {0};
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        if (inst.opcode == SpvOpString) {
+            strings[inst.words[1]] = ar_str_cstr((char *) &inst.words[2]);
+            continue;
+        }
+        if (module.sections[i] != SPV_SECTION_FUNCTION) {
+            continue;
+        }
+
+        if (inst.opcode == SpvOpLine) {
+            current = (LineCost) {
+                .file = inst.words[1],
+                .line = inst.words[2],
+            };
+        } else if (inst.opcode == SpvOpNoLine) {
+            current = (LineCost) {0};
+        }
+
+        if (!is_structural(inst.opcode)) {
+            total++;
+            if (current.file != 0) {
+                costs[cost_count] = current;
+                costs[cost_count].count = 1;
+                cost_count++;
+            } else {
+                unlocated++;
+            }
+        }
+
+        if (is_terminator(inst.opcode)) {
+            current = (LineCost) {0};
+        }
+    }
+
+    // Merge the instructions of every line.
+    qsort(costs, cost_count, sizeof(LineCost), compare_by_location);
+    U32 line_count = 0;
+    for (U32 i = 0; i < cost_count; i++) {
+        if (line_count > 0 && compare_by_location(&costs[line_count - 1], &costs[i]) == 0) {
+            costs[line_count - 1].count++;
+        } else {
+            costs[line_count] = costs[i];
+            line_count++;
+        }
+    }
+    qsort(costs, line_count, sizeof(LineCost), compare_by_count);
+
+    ar_info("%.*s: %u %s instructions from %u source lines, %u without a line.",
+            (I32) name.len, name.data, total, stage, line_count, unlocated);
+    for (U32 i = 0; i < line_count && i < COST_REPORT_LINES; i++) {
+        ArStr file = strings[costs[i].file];
+        ar_info("%.*s:   %.*s:%u: %u instructions (%u%%)",
+                (I32) name.len, name.data,
+                (I32) file.len, file.data, costs[i].line,
+                costs[i].count, costs[i].count * 100 / total);
+    }
+
+    // The written module stays the same as one compiled without debug
+    // information.
+    U32 *words = ar_arena_push_arr_no_zero(arena, U32, spv.len / sizeof(U32));
+    memcpy(words, spv.data, SPV_HEADER_WORDS * sizeof(U32));
+    U64 offset = SPV_HEADER_WORDS;
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        if (is_line_info(inst)) {
+            continue;
+        }
+        U32 word_count = inst.word_count;
+        if (inst.opcode == SpvOpSource && word_count > 3) {
+            word_count = 3;
+        }
+        words[offset] = (word_count << SpvWordCountShift) | inst.opcode;
+        memcpy(&words[offset + 1], &inst.words[1], (word_count - 1) * sizeof(U32));
+        offset += word_count;
+    }
+
+    ar_scratch_release(&scratch);
+    return ar_str((const U8 *) words, offset * sizeof(U32));
+}
@@ -0,0 +1,316 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+#include <stdio.h>
+#include <string.h>
+
+// Runs compute programs on the CPU, for debugging kernels and for machines
+// without a GPU. SPIRV-Cross' C++ backend turns the kernel into a class
+// running every invocation of one workgroup in a loop, the harness spreads
+// the workgroups of a dispatch across a thread pool created once and reused
+// by every dispatch:
+//
+//     #define <NAME>_CPU_IMPLEMENTATION
+//     #include "<NAME>_cpu.h"
+//
+// in one C++ file built with SPIRV-Cross' 'include' directory on the path
+// compiles the kernel, everything else can include the header from C.
+//
+// Workers claim runs of consecutive workgroups from an atomic counter
+// instead of one at a time, so small workgroups don't contend on it and the
+// compiler gets a hot loop over invocations to vectorize. Each worker, and
+// the thread dispatching, owns a shader instance for the life of the pool,
+// shared variables live in it and are reused by every workgroup the worker
+// runs.
+//
+// Invocations of a workgroup run one after another, a barrier() would wait
+// for invocations that haven't started yet. Kernels with barriers are
+// refused.
+
+// Workgroups a worker claims at once.
+#define CPU_WORKGROUP_BATCH 16
+
+static B8 uses_barriers(ArStr spv) {
+    U64 offset = 0;
+    SpvInstruction inst;
+    while (spv_next_instruction(spv, &offset, &inst)) {
+        if (inst.opcode == SpvOpControlBarrier) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static B8 is_include(ArStr line) {
+    line = ar_str_trim(line);
+    return line.len >= 8 && memcmp(line.data, "#include", 8) == 0;
+}
+
+// The generated code defines SPIRV-Cross' entry points as globals, wrapping
+// it in a namespace lets several kernels link into one program. Includes
+// are moved out of the namespace.
+static void write_kernel(FILE *fp, ArStr source, const char *name_space) {
+    for (U32 pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            fprintf(fp, "\n");
+            fprintf(fp, "namespace %s {\n", name_space);
+        }
+
+        U64 i = 0;
+        while (i < source.len) {
+            U64 start = i;
+            while (i < source.len && source.data[i] != '\n') {
+                i++;
+            }
+            ArStr line = ar_str(&source.data[start], i - start);
+            if (is_include(line) == (pass == 0)) {
+                fprintf(fp, "%.*s\n", (I32) line.len, line.data);
+            }
+            i++;
+        }
+    }
+    fprintf(fp, "}\n");
+}
+
+B8 write_cpu_harness(ArArena *arena, CompiledShader shader, ArStr path) {
+    I32 name_len = shader.name.len;
+    const U8 *name = shader.name.data;
+
+    if (uses_barriers(shader.compute.spv)) {
+        ar_error("%.*s: Kernels with barriers can't run on the CPU, invocations of a workgroup run one after another.", name_len, name);
+        return false;
+    }
+
+    const char *cpath = ar_str_to_cstr(arena, path);
+    FILE *fp = fopen(cpath, "wb");
+    if (fp == NULL) {
+        ar_error("Failed to open file %s.", cpath);
+        return false;
+    }
+
+    const U32 *size = shader.compute.reflection.workgroup_size;
+    U32 invocations = size[0] * size[1] * size[2];
+    // C++ doesn't allow empty arrays.
+    U32 buffer_count = shader.binding_count > 0 ? shader.binding_count : 1;
+
+    fprintf(fp, "#ifndef %.*s_CPU_HEADER\n", name_len, name);
+    fprintf(fp, "#define %.*s_CPU_HEADER\n", name_len, name);
+    fprintf(fp, "\n");
+    fprintf(fp, "#include <stddef.h>\n");
+    fprintf(fp, "#include <stdint.h>\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "#ifdef __cplusplus\n");
+    fprintf(fp, "extern \"C\" {\n");
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "#define %.*s_CPU_WORKGROUP_INVOCATIONS %u\n", name_len, name, invocations);
+    fprintf(fp, "#define %.*s_CPU_BINDING_COUNT %llu\n", name_len, name, (unsigned long long) shader.binding_count);
+    fprintf(fp, "\n");
+
+    // Buffers are read and written in place.
+    fprintf(fp, "// One pointer in 'buffers' per binding, in the order listed.\n");
+    fprintf(fp, "typedef struct %.*s_CpuResources %.*s_CpuResources;\n", name_len, name, name_len, name);
+    fprintf(fp, "struct %.*s_CpuResources {\n", name_len, name);
+    fprintf(fp, "    void *buffers[%u];\n", buffer_count);
+    for (U32 i = 0; i < shader.binding_count; i++) {
+        ReflectedBinding binding = shader.bindings[i];
+        fprintf(fp, "    // %u: %.*s, set %u, binding %u\n", i, (I32) binding.name.len, binding.name.data, binding.set, binding.binding);
+    }
+    fprintf(fp, "    const void *push_constants;\n");
+    fprintf(fp, "    size_t push_constant_size;\n");
+    fprintf(fp, "};\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "// Workers waiting for dispatches. The thread dispatching works along with\n");
+    fprintf(fp, "// them, a 'thread_count' of 0 uses one thread per hardware thread.\n");
+    fprintf(fp, "typedef struct %.*s_CpuPool %.*s_CpuPool;\n", name_len, name, name_len, name);
+    fprintf(fp, "%.*s_CpuPool *%.*s_cpu_pool_create(uint32_t thread_count);\n", name_len, name, name_len, name);
+    fprintf(fp, "void %.*s_cpu_pool_destroy(%.*s_CpuPool *pool);\n", name_len, name, name_len, name);
+    fprintf(fp, "\n");
+    fprintf(fp, "// Runs every workgroup of the grid on the pool and returns when all\n");
+    fprintf(fp, "// finished. Only one thread may dispatch to a pool at a time.\n");
+    fprintf(fp, "void %.*s_cpu_dispatch(%.*s_CpuPool *pool, const %.*s_CpuResources *resources, uint32_t x, uint32_t y, uint32_t z);\n",
+            name_len, name, name_len, name, name_len, name);
+    fprintf(fp, "// Dispatches the grid 'iterations' times and returns the invocations run per\n");
+    fprintf(fp, "// second.\n");
+    fprintf(fp, "double %.*s_cpu_benchmark(%.*s_CpuPool *pool, const %.*s_CpuResources *resources, uint32_t x, uint32_t y, uint32_t z, uint32_t iterations);\n",
+            name_len, name, name_len, name, name_len, name);
+    fprintf(fp, "\n");
+    fprintf(fp, "#ifdef __cplusplus\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+
+    char name_space[512] = {0};
+    snprintf(name_space, 512, "%.*s_Cpu", name_len, name);
+
+    fprintf(fp, "#if defined(%.*s_CPU_IMPLEMENTATION) && !defined(%.*s_CPU_IMPLEMENTED)\n", name_len, name, name_len, name);
+    fprintf(fp, "#define %.*s_CPU_IMPLEMENTED\n", name_len, name);
+    fprintf(fp, "#include <algorithm>\n");
+    fprintf(fp, "#include <atomic>\n");
+    fprintf(fp, "#include <chrono>\n");
+    fprintf(fp, "#include <condition_variable>\n");
+    fprintf(fp, "#include <mutex>\n");
+    fprintf(fp, "#include <thread>\n");
+    fprintf(fp, "#include <vector>\n");
+    write_kernel(fp, shader.cpu_source, name_space);
+    fprintf(fp, "\n");
+
+    fprintf(fp, "namespace %s {\n", name_space);
+    fprintf(fp, "static const uint32_t BINDINGS[%u][2] = {", buffer_count);
+    for (U32 i = 0; i < shader.binding_count; i++) {
+        fprintf(fp, "%s{%u, %u}", i == 0 ? "" : ", ", shader.bindings[i].set, shader.bindings[i].binding);
+    }
+    fprintf(fp, "};\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "struct Job {\n");
+    fprintf(fp, "    const %.*s_CpuResources *resources;\n", name_len, name);
+    fprintf(fp, "    uint32_t grid[3];\n");
+    fprintf(fp, "};\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "static void run_workgroups(spirv_cross_shader_t *shader, Job job, std::atomic<uint64_t> *next) {\n");
+    fprintf(fp, "    const spirv_cross_interface *iface = spirv_cross_get_interface();\n");
+    fprintf(fp, "    for (uint32_t i = 0; i < %.*s_CPU_BINDING_COUNT; i++) {\n", name_len, name);
+    fprintf(fp, "        void *buffer = job.resources->buffers[i];\n");
+    fprintf(fp, "        spirv_cross_set_resource(shader, BINDINGS[i][0], BINDINGS[i][1], &buffer, sizeof(buffer));\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    if (job.resources->push_constant_size != 0) {\n");
+    fprintf(fp, "        spirv_cross_set_push_constant(shader, const_cast<void *>(job.resources->push_constants), job.resources->push_constant_size);\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    uint32_t num_work_groups[3] = {job.grid[0], job.grid[1], job.grid[2]};\n");
+    fprintf(fp, "    spirv_cross_set_builtin(shader, SPIRV_CROSS_BUILTIN_NUM_WORK_GROUPS, num_work_groups, sizeof(num_work_groups));\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "    uint64_t total = (uint64_t) job.grid[0] * job.grid[1] * job.grid[2];\n");
+    fprintf(fp, "    for (;;) {\n");
+    fprintf(fp, "        uint64_t first = next->fetch_add(%u);\n", CPU_WORKGROUP_BATCH);
+    fprintf(fp, "        if (first >= total) {\n");
+    fprintf(fp, "            break;\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "        uint64_t last = std::min(first + %u, total);\n", CPU_WORKGROUP_BATCH);
+    fprintf(fp, "        for (uint64_t i = first; i < last; i++) {\n");
+    fprintf(fp, "            uint32_t work_group_id[3] = {\n");
+    fprintf(fp, "                (uint32_t) (i %% job.grid[0]),\n");
+    fprintf(fp, "                (uint32_t) (i / job.grid[0] %% job.grid[1]),\n");
+    fprintf(fp, "                (uint32_t) (i / job.grid[0] / job.grid[1]),\n");
+    fprintf(fp, "            };\n");
+    fprintf(fp, "            spirv_cross_set_builtin(shader, SPIRV_CROSS_BUILTIN_WORK_GROUP_ID, work_group_id, sizeof(work_group_id));\n");
+    fprintf(fp, "            iface->invoke(shader);\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "\n");
+
+    // Dispatches bump 'generation' and wait until no worker is 'busy', so
+    // every worker sees every dispatch exactly once.
+    fprintf(fp, "struct %.*s_CpuPool {\n", name_len, name);
+    fprintf(fp, "    std::vector<std::thread> workers;\n");
+    fprintf(fp, "    spirv_cross_shader_t *shader;\n");
+    fprintf(fp, "    std::mutex mutex;\n");
+    fprintf(fp, "    std::condition_variable wake;\n");
+    fprintf(fp, "    std::condition_variable done;\n");
+    fprintf(fp, "    uint64_t generation;\n");
+    fprintf(fp, "    uint32_t busy;\n");
+    fprintf(fp, "    bool stop;\n");
+    fprintf(fp, "    %s::Job job;\n", name_space);
+    fprintf(fp, "    std::atomic<uint64_t> next;\n");
+    fprintf(fp, "};\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "namespace %s {\n", name_space);
+    fprintf(fp, "static void work(%.*s_CpuPool *pool) {\n", name_len, name);
+    fprintf(fp, "    const spirv_cross_interface *iface = spirv_cross_get_interface();\n");
+    fprintf(fp, "    spirv_cross_shader_t *shader = iface->construct();\n");
+    fprintf(fp, "    uint64_t seen = 0;\n");
+    fprintf(fp, "    for (;;) {\n");
+    fprintf(fp, "        Job job;\n");
+    fprintf(fp, "        {\n");
+    fprintf(fp, "            std::unique_lock<std::mutex> lock(pool->mutex);\n");
+    fprintf(fp, "            pool->wake.wait(lock, [&] { return pool->stop || pool->generation != seen; });\n");
+    fprintf(fp, "            if (pool->stop) {\n");
+    fprintf(fp, "                break;\n");
+    fprintf(fp, "            }\n");
+    fprintf(fp, "            seen = pool->generation;\n");
+    fprintf(fp, "            job = pool->job;\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "        run_workgroups(shader, job, &pool->next);\n");
+    fprintf(fp, "        std::lock_guard<std::mutex> lock(pool->mutex);\n");
+    fprintf(fp, "        pool->busy--;\n");
+    fprintf(fp, "        if (pool->busy == 0) {\n");
+    fprintf(fp, "            pool->done.notify_one();\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    iface->destruct(shader);\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "%.*s_CpuPool *%.*s_cpu_pool_create(uint32_t thread_count) {\n", name_len, name, name_len, name);
+    fprintf(fp, "    if (thread_count == 0) {\n");
+    fprintf(fp, "        thread_count = std::max(std::thread::hardware_concurrency(), 1u);\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    %.*s_CpuPool *pool = new %.*s_CpuPool();\n", name_len, name, name_len, name);
+    fprintf(fp, "    pool->shader = %s::spirv_cross_get_interface()->construct();\n", name_space);
+    fprintf(fp, "    for (uint32_t i = 1; i < thread_count; i++) {\n");
+    fprintf(fp, "        pool->workers.emplace_back(%s::work, pool);\n", name_space);
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    return pool;\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "void %.*s_cpu_pool_destroy(%.*s_CpuPool *pool) {\n", name_len, name, name_len, name);
+    fprintf(fp, "    {\n");
+    fprintf(fp, "        std::lock_guard<std::mutex> lock(pool->mutex);\n");
+    fprintf(fp, "        pool->stop = true;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    pool->wake.notify_all();\n");
+    fprintf(fp, "    for (std::thread &worker : pool->workers) {\n");
+    fprintf(fp, "        worker.join();\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    %s::spirv_cross_get_interface()->destruct(pool->shader);\n", name_space);
+    fprintf(fp, "    delete pool;\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "void %.*s_cpu_dispatch(%.*s_CpuPool *pool, const %.*s_CpuResources *resources, uint32_t x, uint32_t y, uint32_t z) {\n",
+            name_len, name, name_len, name, name_len, name);
+    fprintf(fp, "    if ((uint64_t) x * y * z == 0) {\n");
+    fprintf(fp, "        return;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    %s::Job job = {resources, {x, y, z}};\n", name_space);
+    fprintf(fp, "    {\n");
+    fprintf(fp, "        std::lock_guard<std::mutex> lock(pool->mutex);\n");
+    fprintf(fp, "        pool->job = job;\n");
+    fprintf(fp, "        pool->next.store(0);\n");
+    fprintf(fp, "        pool->busy = (uint32_t) pool->workers.size();\n");
+    fprintf(fp, "        pool->generation++;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    pool->wake.notify_all();\n");
+    fprintf(fp, "    %s::run_workgroups(pool->shader, job, &pool->next);\n", name_space);
+    fprintf(fp, "    std::unique_lock<std::mutex> lock(pool->mutex);\n");
+    fprintf(fp, "    pool->done.wait(lock, [&] { return pool->busy == 0; });\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "double %.*s_cpu_benchmark(%.*s_CpuPool *pool, const %.*s_CpuResources *resources, uint32_t x, uint32_t y, uint32_t z, uint32_t iterations) {\n",
+            name_len, name, name_len, name, name_len, name);
+    fprintf(fp, "    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();\n");
+    fprintf(fp, "    for (uint32_t i = 0; i < iterations; i++) {\n");
+    fprintf(fp, "        %.*s_cpu_dispatch(pool, resources, x, y, z);\n", name_len, name);
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;\n");
+    fprintf(fp, "    double invocations = (double) x * y * z * %.*s_CPU_WORKGROUP_INVOCATIONS * iterations;\n", name_len, name);
+    fprintf(fp, "    return elapsed.count() > 0.0 ? invocations / elapsed.count() : 0.0;\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "#endif\n");
+
+    fclose(fp);
+
+    ar_info("%.*s: Wrote CPU harness to %s.", name_len, name, cpath);
+    return true;
+}
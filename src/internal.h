@@ -1,6 +1,7 @@
 #pragma once
 
 #include "arkin_core.h"
+#include "pack_format.h"
 
 typedef struct ParsedShader ParsedShader;
 struct ParsedShader {
@@ -8,11 +9,89 @@ struct ParsedShader {
         ArStr name;
         ArStr vertex_source;
         ArStr fragment_source;
+        // Only set for compute programs, which have no other stages.
+        ArStr compute_source;
+        // The sources split at every included module, joining them gives
+        // the sources above.
+        ArStrList vertex_parts;
+        ArStrList fragment_parts;
+        ArStrList compute_parts;
     } program;
     ArHashMap *ctypes;
+    // Vertex input name to format name from 'vertex_format'.
+    ArHashMap *vertex_formats;
+    // Path of every included file.
+    ArStrList includes;
+    // Fragment outputs 'mediump_output' allows relaxing.
+    ArStrList mediump_outputs;
 };
 
-extern ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths);
+// 'filepath' is what #line directives in the sources name the input.
+extern ParsedShader parse_shader(ArArena *arena, ArStr filepath, ArStr source, ArStrList paths);
+
+// Source languages SPIRV-Cross can emit next to the SPIR-V.
+typedef enum {
+    BACKEND_GLSL_ES,
+    BACKEND_GLSL_330,
+    BACKEND_HLSL,
+    BACKEND_MSL,
+
+    BACKEND_COUNT,
+} Backend;
+
+// Names used by '--emit'.
+extern const ArStr BACKEND_NAMES[BACKEND_COUNT];
+
+typedef struct Options Options;
+struct Options {
+    ArStr input;
+    // minUniformBufferOffsetAlignment used to round uniform block sizes.
+    U32 uniform_alignment;
+    // Link both stages into one SPIR-V module.
+    B8 single_module;
+    // Strip debug information and renumber ids by content.
+    B8 canonicalize;
+    // Run the SPIRV-Tools validator on every written module.
+    B8 validate;
+    // Report fragment values that fit in half precision.
+    B8 precision_report;
+    // Decorate those values RelaxedPrecision in the written module.
+    B8 relax_precision;
+    // Use the suggested compressed format of vertex inputs without a
+    // 'vertex_format'.
+    B8 compress_vertex;
+    // Remove vertex outputs the fragment stage doesn't read.
+    B8 eliminate_varyings;
+    // Reorder push constant members so the ones each stage accesses are
+    // contiguous.
+    B8 reorder_push_constants;
+    // Report the SPIR-V instructions of every source line.
+    B8 cost_report;
+    // Preprocess the sources before passing them to glslang, sharing the
+    // work between modules included by both stages.
+    B8 preprocess;
+    // Bit mask of backends, by 'Backend', to emit source for.
+    U32 backends;
+    // Write a C++17 header with constexpr SPIR-V and block traits.
+    B8 cpp;
+    // Render this template instead of writing the C header.
+    ArStr template_path;
+    ArStr output;
+    // Skip the run if nothing recorded in this manifest changed.
+    ArStr manifest;
+    // Add the SPIR-V to this pack.
+    ArStr pack;
+    // Compact the pack when too much of it is dead.
+    B8 compact;
+    // Programs loaded together, compaction places them next to each other.
+    ArStr pack_usage;
+    // Compress the pack against a shared dictionary.
+    B8 pack_compress;
+    // Alignment of usage groups in the pack.
+    U32 pack_page_size;
+    // Write a C++ harness running the compute program on the CPU.
+    ArStr cpu_output;
+};
 
 // NOTE: Booleans reflect into unsigned integers.
 // bool -> uint
@@ -61,6 +140,9 @@ typedef enum {
     REFLECTED_DATA_TYPE_COUNT,
 } ReflectedDataType;
 
+// GLSL name of every data type, as used by 'ctypedef'.
+extern const ArStr REFLECTED_DATA_TYPE_NAMES[REFLECTED_DATA_TYPE_COUNT];
+
 typedef struct ReflectedType ReflectedType;
 struct ReflectedType {
     ReflectedDataType data_type;
@@ -74,6 +156,20 @@ struct ReflectedType {
     U32 vec_size;
     U32 cols;
 
+    // Declared size in bytes of a block or struct member.
+    U32 size;
+    // Byte offset of a struct member within its parent.
+    U32 offset;
+    // Stride of the outermost array dimension of a struct member.
+    U32 array_stride;
+    // Stride between the columns of a matrix struct member.
+    U32 matrix_stride;
+
+    // Only set for blocks. Push constants have no set or binding.
+    ArStr instance_name;
+    U32 set;
+    U32 binding;
+
     U32 member_count;
     ReflectedType *members;
 };
@@ -85,16 +181,84 @@ typedef enum {
     REFLECTION_INDEX_COUNT,
 } ReflectionIndex;
 
+typedef enum {
+    DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+    DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+    DESCRIPTOR_TYPE_STORAGE_IMAGE,
+    DESCRIPTOR_TYPE_SAMPLER,
+
+    DESCRIPTOR_TYPE_COUNT,
+} DescriptorType;
+
+typedef enum {
+    SHADER_STAGE_VERTEX = 1 << 0,
+    SHADER_STAGE_FRAGMENT = 1 << 1,
+    SHADER_STAGE_COMPUTE = 1 << 2,
+} ShaderStageFlags;
+
+typedef struct ReflectedBinding ReflectedBinding;
+struct ReflectedBinding {
+    // Instance name of the resource, 'ubo' instead of 'UniformBufferObject'.
+    ArStr name;
+    DescriptorType type;
+    U32 set;
+    U32 binding;
+    // Number of descriptors, 1 if not an array and 0 if runtime sized.
+    U32 count;
+    B8 runtime_array;
+    // Mask of ShaderStageFlags the binding is used in.
+    U32 stages;
+    // Mask of ShaderStageFlags indexing the binding with nonuniformEXT.
+    U32 non_uniform_stages;
+};
+
+typedef struct ReflectedInput ReflectedInput;
+struct ReflectedInput {
+    ArStr name;
+    U32 location;
+    ReflectedDataType data_type;
+    U32 vec_size;
+    // Matrices take one location per column.
+    U32 cols;
+};
+
+typedef struct PushConstantRange PushConstantRange;
+struct PushConstantRange {
+    // Mask of ShaderStageFlags.
+    U32 stages;
+    // Multiples of 4 as VkPushConstantRange requires.
+    U32 offset;
+    U32 size;
+};
+
 typedef struct ReflectedStage ReflectedStage;
 struct ReflectedStage {
     ReflectedType *types[REFLECTION_INDEX_COUNT];
     Usize count[REFLECTION_INDEX_COUNT];
+
+    ReflectedBinding *bindings;
+    Usize binding_count;
+
+    // Only reflected for the vertex stage, sorted by location.
+    ReflectedInput *inputs;
+    Usize input_count;
+
+    // Bytes of the push constant block covering every member the stage
+    // accesses, 'size' is 0 if it accesses none.
+    PushConstantRange push_constant_range;
+
+    // Only reflected for the compute stage.
+    U32 workgroup_size[3];
 };
 
 typedef struct CompiledStage CompiledStage;
 struct CompiledStage {
     ArStr spv;
     ReflectedStage reflection;
+    // Cross-compiled from 'spv' for every backend in 'Options.backends'.
+    ArStr sources[BACKEND_COUNT];
 };
 
 typedef struct CompiledShader CompiledShader;
@@ -102,10 +266,287 @@ struct CompiledShader {
     ArStr name;
     CompiledStage vertex;
     CompiledStage fragment;
+    // Only set for compute programs, 'vertex' and 'fragment' are empty.
+    CompiledStage compute;
+    // SPIRV-Cross' C++ of the compute stage when writing a CPU harness.
+    ArStr cpu_source;
+    // Both stages in one module when linking a single module, otherwise
+    // empty.
+    ArStr spv;
+
+    // Bindings of all stages, sorted by set and binding.
+    ReflectedBinding *bindings;
+    Usize binding_count;
+
+    // One range per stage accessing push constants, stages with the same
+    // range share it. Sorted by offset.
+    PushConstantRange *push_constant_ranges;
+    Usize push_constant_range_count;
+};
+
+extern CompiledShader compile_shader(ArArena *arena, ParsedShader shader, Options options);
+// Finalizes glslang and SPIRV-Cross if anything initialized them.
+extern void compiler_terminate(void);
+// Reflects the module and cross-compiles it to every backend in the
+// 'backends' mask, all from a single parse.
+extern ReflectedStage reflect_spv(ArArena *arena, ArStr spv, U32 backends, ArStr sources[BACKEND_COUNT]);
+extern void reflection_terminate(void);
+// Compiles the module to C++ implementing SPIRV-Cross' shader interface.
+extern ArStr cross_compile_cpp(ArArena *arena, ArStr spv);
+// Merges the bindings of multiple stages into one list sorted by set and
+// binding. Returns the number of merged bindings.
+extern Usize merge_bindings(ArArena *arena, const ReflectedStage *stages, U32 stage_count, ReflectedBinding **bindings);
+// Collects the push constant range of every stage, merging identical ones.
+// Returns the number of ranges.
+extern Usize merge_push_constant_ranges(ArArena *arena, const ReflectedStage *stages, U32 stage_count, PushConstantRange **ranges);
+
+typedef struct MemberLookupEntry MemberLookupEntry;
+struct MemberLookupEntry {
+    // Member path such as 'ubo.projection' or 'types.structure[1].arr'.
+    ArStr path;
+    // member_hash(path, 0), 0 marks an empty slot.
+    U32 hash;
+    B8 push_constant;
+    U32 set;
+    U32 binding;
+    U32 offset;
+    U32 size;
+    ReflectedDataType data_type;
+};
+
+// Perfect hash table over the members of every block in a program. A path
+// is found at 'member_hash(path, seeds[member_hash(path, 0) % seed_count])'
+// masked by 'table_size - 1'.
+typedef struct MemberLookup MemberLookup;
+struct MemberLookup {
+    MemberLookupEntry *table;
+    U32 table_size;
+    U32 *seeds;
+    U32 seed_count;
+};
+
+extern MemberLookup build_member_lookup(ArArena *arena, CompiledShader shader);
+extern U32 member_hash(ArStr str, U32 seed);
+
+//
+// Vertex formats
+//
+typedef enum {
+    VERTEX_FORMAT_R32_SFLOAT,
+    VERTEX_FORMAT_R32G32_SFLOAT,
+    VERTEX_FORMAT_R32G32B32_SFLOAT,
+    VERTEX_FORMAT_R32G32B32A32_SFLOAT,
+    VERTEX_FORMAT_R32_SINT,
+    VERTEX_FORMAT_R32G32_SINT,
+    VERTEX_FORMAT_R32G32B32_SINT,
+    VERTEX_FORMAT_R32G32B32A32_SINT,
+    VERTEX_FORMAT_R32_UINT,
+    VERTEX_FORMAT_R32G32_UINT,
+    VERTEX_FORMAT_R32G32B32_UINT,
+    VERTEX_FORMAT_R32G32B32A32_UINT,
+
+    // Compressed formats, all read as floats.
+    VERTEX_FORMAT_R16G16_SFLOAT,
+    VERTEX_FORMAT_R16G16B16A16_SFLOAT,
+    VERTEX_FORMAT_R16G16_UNORM,
+    VERTEX_FORMAT_R16G16_SNORM,
+    VERTEX_FORMAT_R16G16B16A16_UNORM,
+    VERTEX_FORMAT_R16G16B16A16_SNORM,
+    VERTEX_FORMAT_R8G8B8A8_UNORM,
+    VERTEX_FORMAT_R8G8B8A8_SNORM,
+    VERTEX_FORMAT_A2B10G10R10_UNORM_PACK32,
+    VERTEX_FORMAT_A2B10G10R10_SNORM_PACK32,
+
+    VERTEX_FORMAT_COUNT,
+} VertexFormat;
+
+typedef struct VertexFormatInfo VertexFormatInfo;
+struct VertexFormatInfo {
+    // VkFormat without the 'VK_FORMAT_' prefix.
+    ArStr name;
+    // C type of one element and the number of elements.
+    const char *ctype;
+    U32 ctype_count;
+    U32 size;
+    U32 components;
+    // Scalar type the shader reads.
+    ReflectedDataType data_type;
+};
+
+extern const VertexFormatInfo VERTEX_FORMATS[VERTEX_FORMAT_COUNT];
+
+// Picks a format for every vertex input, the 'vertex_format' of the input if
+// it has one, otherwise the suggested compressed format when 'compress' is
+// set and the uncompressed format when not. Suggestions which aren't used
+// are reported. Returns NULL if a 'vertex_format' is invalid.
+extern VertexFormat *choose_vertex_formats(ArArena *arena, ReflectedStage stage, const ArHashMap *overrides, B8 compress);
+
+//
+// Manifest
+//
+extern U64 hash_options(ArArena *arena, I32 argc, char **argv);
+// True if the manifest exists and none of the options, inputs or the output
+// it records changed.
+extern B8 manifest_up_to_date(ArArena *arena, ArStr path, U64 options_hash);
+// 'outputs' holds every file the run wrote, the header or template output,
+// the pack and the CPU harness.
+extern void manifest_write(ArArena *arena, ArStr path, U64 options_hash, ArStrList inputs, ArStrList outputs);
+
+//
+// Packs
+//
+// Default alignment of usage groups, the largest page size of common targets
+// (Apple arm64 and many Android devices use 16 KiB pages).
+#define PACK_PAGE_SIZE 16384
+// Fraction of dead bytes above which '--compact' rewrites the pack.
+#define PACK_COMPACT_THRESHOLD 0.25f
+
+typedef struct PackBlob PackBlob;
+struct PackBlob {
+    ArStr name;
+    ArStr data;
 };
 
-extern CompiledShader compile_shader(ArArena *arena, ParsedShader shader);
-extern ReflectedStage reflect_spv(ArArena *arena, ArStr spv);
+typedef struct PackOptions PackOptions;
+struct PackOptions {
+    // Rewrite the pack when too much of it is dead, the blobs aren't laid
+    // out as 'usage' asks for or 'compress' changed.
+    B8 compact;
+    // Contents of the usage file, programs loaded together.
+    ArStr usage;
+    // Compress blobs against a dictionary shared by the pack.
+    B8 compress;
+    // Alignment of usage groups, recorded in the pack. PACK_PAGE_SIZE when 0.
+    U32 page_size;
+};
+
+// Adds the blobs to the pack at 'path', creating it if needed. Blobs whose
+// contents didn't change are left in place, changed ones are appended and
+// replace the old entry.
+extern B8 pack_update(ArArena *arena, ArStr path, const PackBlob *blobs, U32 blob_count, PackOptions options);
+
+//
+// Preprocessor
+//
+typedef struct Preprocessor Preprocessor;
+// Parts preprocessed by the same preprocessor share a cache.
+extern Preprocessor *preprocessor_create(ArArena *arena);
+// Expands the macros and conditionals of the sources split into 'parts'.
+// Returns false if the sources need something only glslang's preprocessor
+// handles, they should be passed on unchanged then.
+extern B8 preprocess(Preprocessor *pp, ArArena *arena, ArStrList parts, ArStr *output);
+extern void preprocessor_stats(const Preprocessor *pp, U32 *hits, U32 *misses);
+
+//
+// Templates
+//
+typedef struct Template Template;
+
+typedef struct TemplateInput TemplateInput;
+struct TemplateInput {
+    CompiledShader shader;
+    // Indexed by ReflectedDataType, empty if the type has no 'ctypedef'.
+    const ArStr *ctypes;
+};
+
+// Returns NULL if the template has errors.
+extern Template *template_compile(ArArena *arena, ArStr source, ArStr filepath);
+extern ArStr template_render(ArArena *arena, const Template *template, TemplateInput input);
+
+//
+// SPIR-V
+//
+#define SPV_HEADER_WORDS 5
+
+typedef struct SpvInstruction SpvInstruction;
+struct SpvInstruction {
+    U16 opcode;
+    U16 word_count;
+    // Includes the opcode word.
+    const U32 *words;
+};
+
+// Logical layout of a module, in order.
+typedef enum {
+    SPV_SECTION_CAPABILITY,
+    SPV_SECTION_EXTENSION,
+    SPV_SECTION_EXT_INST_IMPORT,
+    SPV_SECTION_MEMORY_MODEL,
+    SPV_SECTION_ENTRY_POINT,
+    SPV_SECTION_EXECUTION_MODE,
+    SPV_SECTION_DEBUG_SOURCE,
+    SPV_SECTION_DEBUG_NAME,
+    SPV_SECTION_DEBUG_MODULE_PROCESSED,
+    SPV_SECTION_ANNOTATION,
+    // Types, constants and global variables.
+    SPV_SECTION_GLOBAL,
+    SPV_SECTION_FUNCTION,
+
+    SPV_SECTION_COUNT,
+} SpvSection;
+
+typedef struct SpvModule SpvModule;
+struct SpvModule {
+    ArStr spv;
+    U32 bound;
+    U32 instruction_count;
+    SpvInstruction *instructions;
+    SpvSection *sections;
+};
+
+extern U32 spv_bound(ArStr spv);
+// Decodes the instruction at word 'offset' and advances past it. An offset
+// of 0 starts at the first instruction after the header.
+extern B8 spv_next_instruction(ArStr spv, U64 *offset, SpvInstruction *instruction);
+// Returns an array indexed by id, true for every variable accessed through
+// a NonUniform decorated access chain or index.
+extern B8 *spv_find_non_uniform_variables(ArArena *arena, ArStr spv);
+extern SpvModule spv_parse_module(ArArena *arena, ArStr spv);
+// 0 if the instruction has no result.
+extern U32 spv_result_id(SpvInstruction instruction);
+extern U32 spv_result_type(SpvInstruction instruction);
+// Writes the word index of every id operand, including the result type and
+// result id, to 'positions' which must hold 'word_count' entries. Returns
+// the number of ids.
+extern U32 spv_id_operands(SpvInstruction instruction, U16 *positions);
+// Links modules with one entry point each into a single module sharing
+// identical declarations and functions.
+extern ArStr spv_link(ArArena *arena, const ArStr *modules, U32 module_count);
+// Strips debug information and renumbers ids deterministically from their
+// declarations, see remap.c.
+extern ArStr spv_canonicalize(ArArena *arena, ArStr spv);
+// Reports fragment values which fit in half precision, see precision.c.
+// Outputs stay full precision unless named in 'mediump_outputs'. Returns
+// 'spv' with them decorated RelaxedPrecision if 'relax' is set, otherwise
+// 'spv' itself.
+extern ArStr spv_relax_precision(ArArena *arena, ArStr name, ArStr spv, ArStrList mediump_outputs, B8 relax);
+// Reports the instructions of a module compiled with debug information by
+// the source line they came from, see cost.c. Returns 'spv' without the
+// line information.
+extern ArStr spv_report_line_costs(ArArena *arena, ArStr name, const char *stage, ArStr spv);
+// Removes vertex outputs the fragment stage doesn't read and the code only
+// they needed, see varyings.c. Returns false if either module is invalid.
+extern B8 spv_eliminate_varyings(ArArena *arena, ArStr name, ArStr *vertex_spv, ArStr *fragment_spv);
+// Reorders the members of the push constant block shared by both stages,
+// vertex only members first, then shared and fragment only ones, see
+// push_constants.c. Leaves the modules alone if the stages declare
+// different blocks.
+extern void spv_reorder_push_constants(ArArena *arena, ArStr name, ArStr *vertex_spv, ArStr *fragment_spv);
+// Removes the push constant members the stage doesn't access from its
+// declaration and sets 'range' to the bytes the declaration spans, which
+// Vulkan requires to lie within the stage's range, see push_constants.c.
+extern void spv_trim_push_constants(ArArena *arena, ArStr name, const char *stage, ArStr *spv, PushConstantRange *range);
+// Validates against the Vulkan environment glslang targets. Always fails
+// when built without SPIRV-Tools.
+extern B8 spv_validate(ArStr name, const char *stage, ArStr spv);
+
+//
+// CPU
+//
+// Writes 'shader.cpu_source' with a harness running the compute program's
+// workgroups across a thread pool, see cpu.c. Returns false if the kernel
+// can't run on the CPU.
+extern B8 write_cpu_harness(ArArena *arena, CompiledShader shader, ArStr path);
 
 //
 // Utils
@@ -0,0 +1,642 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+#include <string.h>
+
+// Links the per-stage modules glslang generates into a single module. Every
+// id is renumbered into one id space. Types, constants and resource variables
+// which are declared identically, decorations included, are emitted once and
+// so are functions with identical bodies.
+
+typedef struct InstructionList InstructionList;
+struct InstructionList {
+    SpvInstruction *instructions;
+    U32 count;
+};
+
+typedef struct LinkedFunction LinkedFunction;
+struct LinkedFunction {
+    U32 id;
+    // Range of the function in the function section.
+    U32 first;
+    U32 count;
+    B8 entry_point;
+};
+
+typedef struct DeclarationSlot DeclarationSlot;
+struct DeclarationSlot {
+    U32 hash;
+    const U32 *key;
+    U32 key_len;
+    U32 id;
+};
+
+typedef struct Linker Linker;
+struct Linker {
+    ArArena *arena;
+    U32 bound;
+    U32 version;
+    U32 generator;
+
+    InstructionList sections[SPV_SECTION_COUNT];
+    B8 has_memory_model;
+
+    LinkedFunction *functions;
+    U32 function_count;
+    // Indexed by linked id.
+    B8 *function_local;
+
+    DeclarationSlot *declarations;
+    U32 declaration_capacity;
+
+    // Id operand positions of the instruction being processed.
+    U16 *positions;
+};
+
+// State of the module currently being linked, indexed by its own ids.
+typedef struct Source Source;
+struct Source {
+    SpvModule module;
+    // Linked id of every id, 0 until assigned.
+    U32 *map;
+    // Ids whose declaration was merged with an earlier one.
+    B8 *dropped;
+    B8 *function_local;
+    B8 *entry_point;
+
+    // Annotations targeting each id, offsets into 'decorations'.
+    U32 *decoration_starts;
+    U32 *decorations;
+};
+
+static U32 hash_words(const U32 *words, U32 count) {
+    U32 hash = 2166136261u;
+    for (U32 i = 0; i < count; i++) {
+        hash ^= words[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static B8 words_equal(const U32 *a, U32 a_len, const U32 *b, U32 b_len) {
+    return a_len == b_len && memcmp(a, b, a_len * sizeof(U32)) == 0;
+}
+
+static U32 link_id(Linker *linker, Source *source, U32 id) {
+    if (source->map[id] == 0) {
+        source->map[id] = linker->bound;
+        linker->bound++;
+    }
+    return source->map[id];
+}
+
+static SpvInstruction remap_instruction(Linker *linker, Source *source, SpvInstruction inst) {
+    U32 *words = ar_arena_push_arr_no_zero(linker->arena, U32, inst.word_count);
+    memcpy(words, inst.words, inst.word_count * sizeof(U32));
+
+    U32 id_count = spv_id_operands(inst, linker->positions);
+    for (U32 i = 0; i < id_count; i++) {
+        words[linker->positions[i]] = link_id(linker, source, words[linker->positions[i]]);
+    }
+
+    inst.words = words;
+    return inst;
+}
+
+static void emit(Linker *linker, SpvSection section, SpvInstruction inst) {
+    InstructionList *list = &linker->sections[section];
+    list->instructions[list->count] = inst;
+    list->count++;
+}
+
+static B8 section_contains(const Linker *linker, SpvSection section, SpvInstruction inst) {
+    const InstructionList *list = &linker->sections[section];
+    for (U32 i = 0; i < list->count; i++) {
+        SpvInstruction other = list->instructions[i];
+        if (other.opcode == inst.opcode && words_equal(&other.words[1], other.word_count - 1, &inst.words[1], inst.word_count - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static B8 is_mergeable(SpvInstruction inst) {
+    switch (inst.opcode) {
+        case SpvOpTypeVoid:
+        case SpvOpTypeBool:
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+        case SpvOpTypeImage:
+        case SpvOpTypeSampler:
+        case SpvOpTypeSampledImage:
+        case SpvOpTypeArray:
+        case SpvOpTypeRuntimeArray:
+        case SpvOpTypeStruct:
+        case SpvOpTypePointer:
+        case SpvOpTypeFunction:
+        case SpvOpConstantTrue:
+        case SpvOpConstantFalse:
+        case SpvOpConstant:
+        case SpvOpConstantComposite:
+        case SpvOpConstantNull:
+        case SpvOpSpecConstantTrue:
+        case SpvOpSpecConstantFalse:
+        case SpvOpSpecConstant:
+        case SpvOpSpecConstantComposite:
+        case SpvOpSpecConstantOp:
+        case SpvOpUndef:
+            return true;
+
+        // Resources are shared between stages, interface and private
+        // variables belong to their stage.
+        case SpvOpVariable:
+            switch (inst.words[3]) {
+                case SpvStorageClassUniformConstant:
+                case SpvStorageClassUniform:
+                case SpvStorageClassPushConstant:
+                case SpvStorageClassStorageBuffer:
+                    return true;
+                default:
+                    return false;
+            }
+
+        default:
+            return false;
+    }
+}
+
+// Declaration with its result id zeroed followed by every annotation of the
+// result, without the target, so that only identically decorated ids merge.
+static U32 *declaration_key(Linker *linker, Source *source, SpvInstruction inst, U32 *key_len) {
+    U32 result = spv_result_id(inst);
+    U32 start = source->decoration_starts[result];
+    U32 end = source->decoration_starts[result + 1];
+
+    U32 len = inst.word_count;
+    for (U32 i = start; i < end; i++) {
+        len += source->module.instructions[source->decorations[i]].word_count;
+    }
+
+    // Annotations are sorted so their order doesn't matter.
+    ArTemp scratch = ar_scratch_get(&linker->arena, 1);
+    U32 *order = ar_arena_push_arr_no_zero(scratch.arena, U32, end - start);
+    for (U32 i = 0; i < end - start; i++) {
+        SpvInstruction decoration = source->module.instructions[source->decorations[start + i]];
+        U32 j = i;
+        while (j > 0) {
+            SpvInstruction prev = source->module.instructions[order[j - 1]];
+            I32 cmp = (prev.words[0] > decoration.words[0]) - (prev.words[0] < decoration.words[0]);
+            if (cmp == 0) {
+                cmp = memcmp(&prev.words[2], &decoration.words[2], (prev.word_count - 2) * sizeof(U32));
+            }
+            if (cmp <= 0) {
+                break;
+            }
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = source->decorations[start + i];
+    }
+
+    U32 *key = ar_arena_push_arr_no_zero(linker->arena, U32, len);
+    memcpy(key, inst.words, inst.word_count * sizeof(U32));
+    U32 id_count = spv_id_operands(inst, linker->positions);
+    for (U32 i = 0; i < id_count; i++) {
+        U32 *word = &key[linker->positions[i]];
+        *word = *word == result ? 0 : link_id(linker, source, *word);
+    }
+
+    U32 offset = inst.word_count;
+    for (U32 i = 0; i < end - start; i++) {
+        SpvInstruction decoration = source->module.instructions[order[i]];
+        key[offset] = decoration.words[0];
+        memcpy(&key[offset + 1], &decoration.words[2], (decoration.word_count - 2) * sizeof(U32));
+        offset += decoration.word_count - 1;
+    }
+
+    ar_scratch_release(&scratch);
+
+    *key_len = offset;
+    return key;
+}
+
+static void link_declaration(Linker *linker, Source *source, SpvInstruction inst) {
+    U32 result = spv_result_id(inst);
+
+    // Forward referenced ids already have a linked id and are never merged.
+    if (!is_mergeable(inst) || source->map[result] != 0) {
+        emit(linker, SPV_SECTION_GLOBAL, remap_instruction(linker, source, inst));
+        return;
+    }
+
+    U32 key_len = 0;
+    U32 *key = declaration_key(linker, source, inst, &key_len);
+    U32 hash = hash_words(key, key_len);
+
+    U32 mask = linker->declaration_capacity - 1;
+    U32 slot = hash & mask;
+    while (linker->declarations[slot].key != NULL) {
+        DeclarationSlot declaration = linker->declarations[slot];
+        if (declaration.hash == hash && words_equal(declaration.key, declaration.key_len, key, key_len)) {
+            source->map[result] = declaration.id;
+            source->dropped[result] = true;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    linker->declarations[slot] = (DeclarationSlot) {
+        .hash = hash,
+        .key = key,
+        .key_len = key_len,
+        .id = link_id(linker, source, result),
+    };
+    emit(linker, SPV_SECTION_GLOBAL, remap_instruction(linker, source, inst));
+}
+
+static B8 is_debug_line(SpvInstruction inst) {
+    return inst.opcode == SpvOpLine || inst.opcode == SpvOpNoLine;
+}
+
+// Compares a function of the source module against an already linked one.
+// Ids local to the functions only have to correspond one to one, every
+// other id has to already be linked to the same id.
+static B8 functions_match(Linker *linker, Source *source, const SpvInstruction *function, U32 count, LinkedFunction linked, U32 *local_pairs, U32 *linked_pairs) {
+    memset(local_pairs, 0, source->module.bound * sizeof(U32));
+    memset(linked_pairs, 0, linker->bound * sizeof(U32));
+
+    const SpvInstruction *other = &linker->sections[SPV_SECTION_FUNCTION].instructions[linked.first];
+    U16 *positions = linker->positions;
+    U32 i = 0;
+    U32 j = 0;
+    for (;;) {
+        while (i < count && is_debug_line(function[i])) {
+            i++;
+        }
+        while (j < linked.count && is_debug_line(other[j])) {
+            j++;
+        }
+        if (i == count || j == linked.count) {
+            return i == count && j == linked.count;
+        }
+
+        SpvInstruction a = function[i];
+        SpvInstruction b = other[j];
+        if (a.opcode != b.opcode || a.word_count != b.word_count) {
+            return false;
+        }
+
+        U32 id_count = spv_id_operands(a, positions);
+        U32 next_id = 0;
+        for (U32 k = 1; k < a.word_count; k++) {
+            B8 is_id = next_id < id_count && positions[next_id] == k;
+            if (!is_id) {
+                if (a.words[k] != b.words[k]) {
+                    return false;
+                }
+                continue;
+            }
+            next_id++;
+
+            U32 id = a.words[k];
+            U32 linked_id = b.words[k];
+            if (a.opcode == SpvOpFunction && k == 2) {
+                continue;
+            }
+
+            if (source->function_local[id]) {
+                if (local_pairs[id] == 0) {
+                    if (!linker->function_local[linked_id] || linked_pairs[linked_id] != 0) {
+                        return false;
+                    }
+                    local_pairs[id] = linked_id;
+                    linked_pairs[linked_id] = id;
+                } else if (local_pairs[id] != linked_id) {
+                    return false;
+                }
+            } else if (source->map[id] == 0 || source->map[id] != linked_id) {
+                return false;
+            }
+        }
+
+        i++;
+        j++;
+    }
+}
+
+static void link_functions(Linker *linker, Source *source, U32 first, U32 count) {
+    ArTemp scratch = ar_scratch_get(&linker->arena, 1);
+
+    // Split the function section into functions.
+    const SpvInstruction *instructions = &source->module.instructions[first];
+    U32 function_count = 0;
+    for (U32 i = 0; i < count; i++) {
+        if (instructions[i].opcode == SpvOpFunction) {
+            function_count++;
+        }
+    }
+
+    LinkedFunction *functions = ar_arena_push_arr(scratch.arena, LinkedFunction, function_count);
+    U32 function_index = 0;
+    for (U32 i = 0; i < count; i++) {
+        SpvInstruction inst = instructions[i];
+        if (inst.opcode == SpvOpFunction) {
+            functions[function_index] = (LinkedFunction) {
+                .id = inst.words[2],
+                .first = i,
+                .entry_point = source->entry_point[inst.words[2]],
+            };
+        } else {
+            U32 result = spv_result_id(inst);
+            if (result != 0) {
+                source->function_local[result] = true;
+            }
+        }
+
+        functions[function_index].count++;
+        if (inst.opcode == SpvOpFunctionEnd) {
+            function_index++;
+        }
+    }
+
+    // Matching a function can make the functions calling it match, repeat
+    // until nothing changes. Only functions linked from earlier modules are
+    // candidates.
+    U32 candidate_count = linker->function_count;
+    B8 *merged = ar_arena_push_arr(scratch.arena, B8, function_count);
+    U32 *local_pairs = ar_arena_push_arr_no_zero(scratch.arena, U32, source->module.bound);
+    U32 *linked_pairs = ar_arena_push_arr_no_zero(scratch.arena, U32, linker->bound);
+    B8 changed = true;
+    while (changed) {
+        changed = false;
+        for (U32 i = 0; i < function_count; i++) {
+            if (merged[i] || functions[i].entry_point) {
+                continue;
+            }
+
+            for (U32 j = 0; j < candidate_count; j++) {
+                LinkedFunction candidate = linker->functions[j];
+                if (candidate.entry_point) {
+                    continue;
+                }
+
+                if (functions_match(linker, source, &instructions[functions[i].first], functions[i].count, candidate, local_pairs, linked_pairs)) {
+                    merged[i] = true;
+                    changed = true;
+                    source->map[functions[i].id] = candidate.id;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (U32 i = 0; i < function_count; i++) {
+        LinkedFunction function = functions[i];
+        if (merged[i]) {
+            source->dropped[function.id] = true;
+            for (U32 j = 0; j < function.count; j++) {
+                U32 result = spv_result_id(instructions[function.first + j]);
+                if (result != 0) {
+                    source->dropped[result] = true;
+                }
+            }
+            continue;
+        }
+
+        InstructionList *section = &linker->sections[SPV_SECTION_FUNCTION];
+        function.first = section->count;
+        for (U32 j = 0; j < function.count; j++) {
+            SpvInstruction inst = remap_instruction(linker, source, instructions[functions[i].first + j]);
+            U32 result = spv_result_id(inst);
+            if (result != 0 && inst.opcode != SpvOpFunction) {
+                linker->function_local[result] = true;
+            }
+            emit(linker, SPV_SECTION_FUNCTION, inst);
+        }
+        function.id = source->map[function.id];
+        linker->functions[linker->function_count] = function;
+        linker->function_count++;
+    }
+
+    ar_scratch_release(&scratch);
+}
+
+static U32 annotation_target(SpvInstruction inst) {
+    switch (inst.opcode) {
+        case SpvOpDecorate:
+        case SpvOpDecorateId:
+        case SpvOpDecorateString:
+        case SpvOpMemberDecorate:
+        case SpvOpMemberDecorateString:
+        case SpvOpName:
+        case SpvOpMemberName:
+            return inst.words[1];
+        default:
+            return 0;
+    }
+}
+
+static void link_module(Linker *linker, SpvModule module) {
+    ArTemp scratch = ar_scratch_get(&linker->arena, 1);
+
+    Source source = {
+        .module = module,
+        .map = ar_arena_push_arr(scratch.arena, U32, module.bound),
+        .dropped = ar_arena_push_arr(scratch.arena, B8, module.bound),
+        .function_local = ar_arena_push_arr(scratch.arena, B8, module.bound),
+        .entry_point = ar_arena_push_arr(scratch.arena, B8, module.bound),
+        .decoration_starts = ar_arena_push_arr(scratch.arena, U32, module.bound + 1),
+    };
+
+    const U32 *header = (const U32 *) module.spv.data;
+    if (header[1] > linker->version) {
+        linker->version = header[1];
+    }
+    if (linker->generator == 0) {
+        linker->generator = header[2];
+    }
+
+    // Group the decorations by target.
+    U32 decoration_count = 0;
+    U32 function_first = module.instruction_count;
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        if (module.sections[i] == SPV_SECTION_ANNOTATION) {
+            U32 target = annotation_target(inst);
+            if (target != 0 && target < module.bound) {
+                source.decoration_starts[target + 1]++;
+                decoration_count++;
+            }
+        } else if (module.sections[i] == SPV_SECTION_ENTRY_POINT) {
+            source.entry_point[inst.words[2]] = true;
+        } else if (module.sections[i] == SPV_SECTION_FUNCTION && function_first == module.instruction_count) {
+            function_first = i;
+        }
+    }
+    for (U32 i = 0; i < module.bound; i++) {
+        source.decoration_starts[i + 1] += source.decoration_starts[i];
+    }
+    source.decorations = ar_arena_push_arr_no_zero(scratch.arena, U32, decoration_count);
+    U32 *fill = ar_arena_push_arr(scratch.arena, U32, module.bound);
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        if (module.sections[i] != SPV_SECTION_ANNOTATION) {
+            continue;
+        }
+        U32 target = annotation_target(module.instructions[i]);
+        if (target != 0 && target < module.bound) {
+            source.decorations[source.decoration_starts[target] + fill[target]] = i;
+            fill[target]++;
+        }
+    }
+
+    // Declarations first since everything else references them.
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        switch (module.sections[i]) {
+            case SPV_SECTION_CAPABILITY:
+            case SPV_SECTION_EXTENSION:
+            case SPV_SECTION_DEBUG_MODULE_PROCESSED:
+                if (!section_contains(linker, module.sections[i], inst)) {
+                    emit(linker, module.sections[i], inst);
+                }
+                break;
+
+            case SPV_SECTION_EXT_INST_IMPORT: {
+                // Compare the name only.
+                InstructionList *list = &linker->sections[SPV_SECTION_EXT_INST_IMPORT];
+                B8 found = false;
+                for (U32 j = 0; j < list->count; j++) {
+                    SpvInstruction other = list->instructions[j];
+                    if (words_equal(&other.words[2], other.word_count - 2, &inst.words[2], inst.word_count - 2)) {
+                        source.map[inst.words[1]] = other.words[1];
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found) {
+                    emit(linker, SPV_SECTION_EXT_INST_IMPORT, remap_instruction(linker, &source, inst));
+                }
+            } break;
+
+            case SPV_SECTION_MEMORY_MODEL:
+                if (!linker->has_memory_model) {
+                    emit(linker, SPV_SECTION_MEMORY_MODEL, inst);
+                    linker->has_memory_model = true;
+                }
+                break;
+
+            case SPV_SECTION_GLOBAL:
+                link_declaration(linker, &source, inst);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    link_functions(linker, &source, function_first, module.instruction_count - function_first);
+
+    // Entry points, debug information and annotations. Whatever targets a
+    // merged id already exists in the linked module.
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        switch (module.sections[i]) {
+            case SPV_SECTION_ENTRY_POINT:
+            case SPV_SECTION_EXECUTION_MODE:
+            case SPV_SECTION_DEBUG_SOURCE:
+                emit(linker, module.sections[i], remap_instruction(linker, &source, inst));
+                break;
+
+            case SPV_SECTION_DEBUG_NAME:
+            case SPV_SECTION_ANNOTATION: {
+                U32 target = annotation_target(inst);
+                if (target < module.bound && source.dropped[target]) {
+                    break;
+                }
+                emit(linker, module.sections[i], remap_instruction(linker, &source, inst));
+            } break;
+
+            default:
+                break;
+        }
+    }
+
+    ar_scratch_release(&scratch);
+}
+
+ArStr spv_link(ArArena *arena, const ArStr *modules, U32 module_count) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    Linker linker = {
+        .arena = scratch.arena,
+        .bound = 1,
+        .positions = ar_arena_push_arr_no_zero(scratch.arena, U16, UINT16_MAX),
+    };
+
+    // Upper bounds for everything sized by the linked module.
+    SpvModule *parsed = ar_arena_push_arr_no_zero(scratch.arena, SpvModule, module_count);
+    U32 section_capacity[SPV_SECTION_COUNT] = {0};
+    U32 bound = 1;
+    U32 function_capacity = 0;
+    for (U32 i = 0; i < module_count; i++) {
+        parsed[i] = spv_parse_module(scratch.arena, modules[i]);
+        if (parsed[i].bound == 0) {
+            ar_scratch_release(&scratch);
+            return (ArStr) {0};
+        }
+
+        bound += parsed[i].bound;
+        for (U32 j = 0; j < parsed[i].instruction_count; j++) {
+            section_capacity[parsed[i].sections[j]]++;
+            if (parsed[i].instructions[j].opcode == SpvOpFunction) {
+                function_capacity++;
+            }
+        }
+    }
+
+    for (U32 i = 0; i < SPV_SECTION_COUNT; i++) {
+        linker.sections[i].instructions = ar_arena_push_arr_no_zero(scratch.arena, SpvInstruction, section_capacity[i]);
+    }
+    linker.functions = ar_arena_push_arr_no_zero(scratch.arena, LinkedFunction, function_capacity);
+    linker.function_local = ar_arena_push_arr(scratch.arena, B8, bound);
+    linker.declaration_capacity = 1;
+    while (linker.declaration_capacity < section_capacity[SPV_SECTION_GLOBAL] * 2) {
+        linker.declaration_capacity <<= 1;
+    }
+    linker.declarations = ar_arena_push_arr(scratch.arena, DeclarationSlot, linker.declaration_capacity);
+
+    for (U32 i = 0; i < module_count; i++) {
+        link_module(&linker, parsed[i]);
+    }
+
+    U64 word_count = SPV_HEADER_WORDS;
+    for (U32 i = 0; i < SPV_SECTION_COUNT; i++) {
+        for (U32 j = 0; j < linker.sections[i].count; j++) {
+            word_count += linker.sections[i].instructions[j].word_count;
+        }
+    }
+
+    U32 *words = ar_arena_push_arr_no_zero(arena, U32, word_count);
+    words[0] = SpvMagicNumber;
+    words[1] = linker.version;
+    words[2] = linker.generator;
+    words[3] = linker.bound;
+    words[4] = 0;
+
+    U64 offset = SPV_HEADER_WORDS;
+    for (U32 i = 0; i < SPV_SECTION_COUNT; i++) {
+        for (U32 j = 0; j < linker.sections[i].count; j++) {
+            SpvInstruction inst = linker.sections[i].instructions[j];
+            memcpy(&words[offset], inst.words, inst.word_count * sizeof(U32));
+            offset += inst.word_count;
+        }
+    }
+
+    ar_scratch_release(&scratch);
+
+    return ar_str((const U8 *) words, word_count * sizeof(U32));
+}
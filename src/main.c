@@ -3,6 +3,8 @@
 
 #include "internal.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 // void print_reflected_type(ReflectedType t, U32 level) {
 //     U8 spaces[1024] = {0};
@@ -49,7 +51,7 @@ void _info(ArStr str, const char *file, U32 line) {
 }
 #define info(str) _info(str, __FILE__, __LINE__);
 
-void write_reflected_type(FILE *fp, const ArHashMap *ctypes, const char *prefix, ReflectedType type, U32 level) {
+void write_reflected_type(FILE *fp, const ArStr *ctypes, const char *prefix, ReflectedType type, U32 level) {
     if (type.data_type == REFLECTED_DATA_TYPE_STRUCT && level == 0) {
         fprintf(fp, "typedef struct %s_%.*s %s_%.*s;\n",
             prefix, (I32) type.name.len, type.name.data,
@@ -78,44 +80,7 @@ void write_reflected_type(FILE *fp, const ArHashMap *ctypes, const char *prefix,
         }
         fprintf(fp, "%s} %.*s", spaces, (I32) type.name.len, type.name.data);
     } else {
-        const ArStr type_name[REFLECTED_DATA_TYPE_COUNT] = {
-            ar_str_lit("ERR::Unkown"),
-
-            ar_str_lit("void"),
-            ar_str_lit("struct"),
-            ar_str_lit("sampler"),
-
-            ar_str_lit("int"),
-            ar_str_lit("uint"),
-            ar_str_lit("float"),
-            ar_str_lit("double"),
-
-            ar_str_lit("ivec2"),
-            ar_str_lit("uvec2"),
-            ar_str_lit("vec2"),
-            ar_str_lit("dvec2"),
-
-            ar_str_lit("ivec3"),
-            ar_str_lit("uvec3"),
-            ar_str_lit("vec3"),
-            ar_str_lit("dvec3"),
-
-            ar_str_lit("ivec4"),
-            ar_str_lit("uvec4"),
-            ar_str_lit("vec4"),
-            ar_str_lit("dvec4"),
-
-            ar_str_lit("mat2"),
-            ar_str_lit("dmat2"),
-
-            ar_str_lit("mat3"),
-            ar_str_lit("dmat3"),
-
-            ar_str_lit("mat4"),
-            ar_str_lit("dmat4"),
-        };
-
-        ArStr user_type = ar_hash_map_get(ctypes, type_name[type.data_type], ArStr);
+        ArStr user_type = ctypes[type.data_type];
         if (user_type.len != 0) {
             fprintf(fp, "%s%.*s %.*s", spaces, (I32) user_type.len, user_type.data, (I32) type.name.len, type.name.data);
         } else {
@@ -162,7 +127,7 @@ void write_reflected_type(FILE *fp, const ArHashMap *ctypes, const char *prefix,
     fprintf(fp, ";\n");
 }
 
-void write_reflected_types(FILE *fp, const ArHashMap *ctypes, const char *prefix, ReflectedStage stage) {
+void write_reflected_types(FILE *fp, const ArStr *ctypes, const char *prefix, ReflectedStage stage) {
     for (U32 i = 0; i < REFLECTION_INDEX_COUNT; i++) {
         for (U32 j = 0; j < stage.count[i]; j++) {
             write_reflected_type(fp, ctypes, prefix, stage.types[i][j], 0);
@@ -170,48 +135,561 @@ void write_reflected_types(FILE *fp, const ArHashMap *ctypes, const char *prefix
     }
 }
 
-const char *test = "hehe"
-                    "wow";
+void write_uniform_ring(FILE *fp, U32 alignment) {
+    fprintf(fp, "#ifndef SHADER_UNIFORM_RING\n");
+    fprintf(fp, "#define SHADER_UNIFORM_RING\n");
+    fprintf(fp, "#include <string.h>\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "#ifndef SHADER_UNIFORM_ALIGNMENT\n");
+    fprintf(fp, "#define SHADER_UNIFORM_ALIGNMENT %u\n", alignment);
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "#define SHADER_UNIFORM_ALIGN(size) (((size) + SHADER_UNIFORM_ALIGNMENT - 1) & ~(SHADER_UNIFORM_ALIGNMENT - 1))\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "// Per-frame bump allocator over a mapped uniform buffer. Reset 'head' to 0\n");
+    fprintf(fp, "// once the frame using the ring has completed.\n");
+    fprintf(fp, "typedef struct ShaderUniformRing ShaderUniformRing;\n");
+    fprintf(fp, "struct ShaderUniformRing {\n");
+    fprintf(fp, "    unsigned char *data;\n");
+    fprintf(fp, "    unsigned long long size;\n");
+    fprintf(fp, "    unsigned long long head;\n");
+    fprintf(fp, "};\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "// Advances the ring by 'aligned_size'. Returns the dynamic offset of the\n");
+    fprintf(fp, "// allocation or 0xffffffff if the ring is full.\n");
+    fprintf(fp, "static inline unsigned int shader_uniform_ring_alloc(ShaderUniformRing *ring, unsigned long long aligned_size) {\n");
+    fprintf(fp, "    if (ring->head + aligned_size > ring->size) {\n");
+    fprintf(fp, "        return 0xffffffffu;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    unsigned long long offset = ring->head;\n");
+    fprintf(fp, "    ring->head += aligned_size;\n");
+    fprintf(fp, "    return (unsigned int) offset;\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "// Copies 'size' bytes of data already in the block layout into the ring.\n");
+    fprintf(fp, "static inline unsigned int shader_uniform_ring_push(ShaderUniformRing *ring, const void *data, unsigned long long size, unsigned long long aligned_size) {\n");
+    fprintf(fp, "    unsigned int offset = shader_uniform_ring_alloc(ring, aligned_size);\n");
+    fprintf(fp, "    if (offset != 0xffffffffu) {\n");
+    fprintf(fp, "        memcpy(ring->data + offset, data, size);\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    return offset;\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+}
 
-void write_header(CompiledShader shader, const ArHashMap *ctypes, const char *filepath) {
-    FILE *fp = fopen(filepath, "wb");
+static U32 component_size(ReflectedDataType data_type) {
+    switch (data_type) {
+        case REFLECTED_DATA_TYPE_F64:
+        case REFLECTED_DATA_TYPE_DVEC2:
+        case REFLECTED_DATA_TYPE_DVEC3:
+        case REFLECTED_DATA_TYPE_DVEC4:
+        case REFLECTED_DATA_TYPE_DMAT2:
+        case REFLECTED_DATA_TYPE_DMAT3:
+        case REFLECTED_DATA_TYPE_DMAT4:
+            return 8;
+        default:
+            return 4;
+    }
+}
 
-    fprintf(fp, "#ifndef %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
-    fprintf(fp, "#define %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
+// Copies the member of the C struct at 'path' to 'offset' in 'dst'. The C
+// struct is packed by C rules, the block by std140 which pads array
+// elements, vec3s and matrix columns, so every element is copied to the
+// offset reflection gave it. 'loop' numbers the loop variables.
+void write_member_copy(FILE *fp, ReflectedType member, const char *path, const char *offset, U32 loop, U32 level) {
+    char element_path[512];
+    char element_offset[512];
+    snprintf(element_path, sizeof(element_path), "%s", path);
+    snprintf(element_offset, sizeof(element_offset), "%s", offset);
+
+    // Outermost dimension first, see write_reflected_type().
+    U32 stride = member.array_stride;
+    for (I32 i = member.array_dimensions - 1; i >= 0; i--) {
+        U32 len = member.array_dimension_lengths[i];
+        fprintf(fp, "%*sfor (unsigned int i%u = 0; i%u < %u; i%u++) {\n", level * 4, "", loop, loop, len, loop);
+        U32 path_len = strlen(element_path);
+        U32 offset_len = strlen(element_offset);
+        snprintf(&element_path[path_len], sizeof(element_path) - path_len, "[i%u]", loop);
+        snprintf(&element_offset[offset_len], sizeof(element_offset) - offset_len, " + i%u * %u", loop, stride);
+        if (i > 0) {
+            stride /= member.array_dimension_lengths[i - 1];
+        }
+        loop++;
+        level++;
+    }
 
+    if (member.data_type == REFLECTED_DATA_TYPE_STRUCT) {
+        for (U32 i = 0; i < member.member_count; i++) {
+            ReflectedType child = member.members[i];
+            char child_path[512];
+            char child_offset[512];
+            snprintf(child_path, sizeof(child_path), "%s.%.*s", element_path, (I32) child.name.len, child.name.data);
+            snprintf(child_offset, sizeof(child_offset), "%s + %u", element_offset, child.offset);
+            write_member_copy(fp, child, child_path, child_offset, loop, level);
+        }
+    } else if (member.cols > 1) {
+        // Columns are packed in the C type, whatever 'ctypedef' it has.
+        U32 column_size = member.vec_size * component_size(member.data_type);
+        for (U32 i = 0; i < member.cols; i++) {
+            fprintf(fp, "%*smemcpy(dst + %s + %u, (const unsigned char *) &%s + %u * (sizeof(%s) / %u), %u);\n",
+                    level * 4, "", element_offset, i * member.matrix_stride,
+                    element_path, i, element_path, member.cols, column_size);
+        }
+    } else {
+        U32 size = member.vec_size * component_size(member.data_type);
+        fprintf(fp, "%*smemcpy(dst + %s, &%s, %u);\n", level * 4, "", element_offset, element_path, size);
+    }
+
+    for (U32 i = 0; i < member.array_dimensions; i++) {
+        level--;
+        fprintf(fp, "%*s}\n", level * 4, "");
+    }
+}
+
+void write_uniform_ring_helpers(FILE *fp, const char *prefix, ReflectedStage stage) {
+    for (U32 i = 0; i < stage.count[REFLECTION_INDEX_UNIFORM_BUFFER]; i++) {
+        ReflectedType type = stage.types[REFLECTION_INDEX_UNIFORM_BUFFER][i];
+        I32 name_len = type.name.len;
+        const U8 *name = type.name.data;
+
+        fprintf(fp, "#define %s_%.*s_SIZE %u\n", prefix, name_len, name, type.size);
+        fprintf(fp, "#define %s_%.*s_ALIGNED_SIZE SHADER_UNIFORM_ALIGN(%s_%.*s_SIZE)\n",
+                prefix, name_len, name,
+                prefix, name_len, name);
+
+        // Writes the block in its std140 layout, 'block' must hold _SIZE bytes.
+        fprintf(fp, "static inline void %s_%.*s_write(void *block, const %s_%.*s *data) {\n",
+                prefix, name_len, name,
+                prefix, name_len, name);
+        fprintf(fp, "    unsigned char *dst = (unsigned char *) block;\n");
+        for (U32 j = 0; j < type.member_count; j++) {
+            ReflectedType member = type.members[j];
+            char path[512];
+            char offset[512];
+            snprintf(path, sizeof(path), "data->%.*s", (I32) member.name.len, member.name.data);
+            snprintf(offset, sizeof(offset), "%u", member.offset);
+            write_member_copy(fp, member, path, offset, 0, 1);
+        }
+        fprintf(fp, "}\n");
+        fprintf(fp, "\n");
+
+        fprintf(fp, "static inline unsigned int %s_%.*s_push(ShaderUniformRing *ring, const %s_%.*s *data) {\n",
+                prefix, name_len, name,
+                prefix, name_len, name);
+        fprintf(fp, "    unsigned int offset = shader_uniform_ring_alloc(ring, %s_%.*s_ALIGNED_SIZE);\n",
+                prefix, name_len, name);
+        fprintf(fp, "    if (offset != 0xffffffffu) {\n");
+        fprintf(fp, "        %s_%.*s_write(ring->data + offset, data);\n", prefix, name_len, name);
+        fprintf(fp, "    }\n");
+        fprintf(fp, "    return offset;\n");
+        fprintf(fp, "}\n");
+        fprintf(fp, "\n");
+    }
+}
+
+const char *DATA_TYPE_ENUMS[REFLECTED_DATA_TYPE_COUNT] = {
+    "SHADER_DATA_TYPE_UNKNOWN",
+
+    "SHADER_DATA_TYPE_VOID",
+    "SHADER_DATA_TYPE_STRUCT",
+    "SHADER_DATA_TYPE_SAMPLER",
+
+    "SHADER_DATA_TYPE_INT",
+    "SHADER_DATA_TYPE_UINT",
+    "SHADER_DATA_TYPE_FLOAT",
+    "SHADER_DATA_TYPE_DOUBLE",
+
+    "SHADER_DATA_TYPE_IVEC2",
+    "SHADER_DATA_TYPE_UVEC2",
+    "SHADER_DATA_TYPE_VEC2",
+    "SHADER_DATA_TYPE_DVEC2",
+
+    "SHADER_DATA_TYPE_IVEC3",
+    "SHADER_DATA_TYPE_UVEC3",
+    "SHADER_DATA_TYPE_VEC3",
+    "SHADER_DATA_TYPE_DVEC3",
+
+    "SHADER_DATA_TYPE_IVEC4",
+    "SHADER_DATA_TYPE_UVEC4",
+    "SHADER_DATA_TYPE_VEC4",
+    "SHADER_DATA_TYPE_DVEC4",
+
+    "SHADER_DATA_TYPE_MAT2",
+    "SHADER_DATA_TYPE_DMAT2",
+
+    "SHADER_DATA_TYPE_MAT3",
+    "SHADER_DATA_TYPE_DMAT3",
+
+    "SHADER_DATA_TYPE_MAT4",
+    "SHADER_DATA_TYPE_DMAT4",
+};
+
+void write_member_lookup(FILE *fp, ArArena *arena, CompiledShader shader) {
+    MemberLookup lookup = build_member_lookup(arena, shader);
+    I32 name_len = shader.name.len;
+    const U8 *name = shader.name.data;
+
+    fprintf(fp, "// Member lookup\n");
+    fprintf(fp, "#ifndef SHADER_MEMBER_LOOKUP\n");
+    fprintf(fp, "#define SHADER_MEMBER_LOOKUP\n");
+    fprintf(fp, "#include <string.h>\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "typedef enum {\n");
+    for (U32 i = 0; i < REFLECTED_DATA_TYPE_COUNT; i++) {
+        fprintf(fp, "    %s,\n", DATA_TYPE_ENUMS[i]);
+    }
+    fprintf(fp, "} ShaderDataType;\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "// Set of members belonging to the push constant block.\n");
+    fprintf(fp, "#define SHADER_PUSH_CONSTANT_SET 0xffffffffu\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "typedef struct ShaderMember ShaderMember;\n");
+    fprintf(fp, "struct ShaderMember {\n");
+    fprintf(fp, "    const char *path;\n");
+    fprintf(fp, "    unsigned int hash;\n");
+    fprintf(fp, "    unsigned int set;\n");
+    fprintf(fp, "    unsigned int binding;\n");
+    fprintf(fp, "    unsigned int offset;\n");
+    fprintf(fp, "    unsigned int size;\n");
+    fprintf(fp, "    ShaderDataType type;\n");
+    fprintf(fp, "};\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "static inline unsigned int shader_member_hash(const char *path, unsigned int seed) {\n");
+    fprintf(fp, "    unsigned int hash = 2166136261u + seed * 0x9e3779b9u;\n");
+    fprintf(fp, "    while (*path != '\\0') {\n");
+    fprintf(fp, "        hash ^= (unsigned char) *path;\n");
+    fprintf(fp, "        hash *= 16777619u;\n");
+    fprintf(fp, "        path++;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    hash ^= hash >> 16;\n");
+    fprintf(fp, "    hash *= 0x85ebca6bu;\n");
+    fprintf(fp, "    hash ^= hash >> 13;\n");
+    fprintf(fp, "    hash *= 0xc2b2ae35u;\n");
+    fprintf(fp, "    hash ^= hash >> 16;\n");
+    fprintf(fp, "    return hash;\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "#endif\n");
     fprintf(fp, "\n");
-    fprintf(fp, "// Vertex\n");
 
-    // Create push constants and uniform buffer types.
-    char prefix[512] = {0};
-    snprintf(prefix, 512, "%.*s_VS", (I32) shader.name.len, shader.name.data);
-    write_reflected_types(fp, ctypes, prefix, shader.vertex.reflection);
+    fprintf(fp, "static const unsigned int %.*s_MEMBER_SEEDS[%u] = {", name_len, name, lookup.seed_count);
+    for (U32 i = 0; i < lookup.seed_count; i++) {
+        if (i % 16 == 0) {
+            fprintf(fp, "\n   ");
+        }
+        fprintf(fp, " %u,", lookup.seeds[i]);
+    }
+    fprintf(fp, "\n};\n");
+    fprintf(fp, "\n");
 
-    // Create SPV source variable.
-    U32 len = fprintf(fp, "const char* %.*s_VS_SOURCE = \"", (I32) shader.name.len, shader.name.data);
-    for (U64 i = 0; i < shader.vertex.spv.len; i++) {
-        fprintf(fp, "\\x%.2x", shader.vertex.spv.data[i]);
-        if ((i + 1) % 20 == 0) {
-            fprintf(fp, "\"\n");
-            for (U32 j = 0; j < len-1; j++) {
-                fputc(' ', fp);
+    fprintf(fp, "static const ShaderMember %.*s_MEMBERS[%u] = {\n", name_len, name, lookup.table_size);
+    for (U32 i = 0; i < lookup.table_size; i++) {
+        MemberLookupEntry entry = lookup.table[i];
+        if (entry.path.len == 0) {
+            fprintf(fp, "    {0},\n");
+            continue;
+        }
+
+        U32 set = entry.set;
+        if (entry.push_constant) {
+            set = 0xffffffff;
+        }
+        fprintf(fp, "    {\"%.*s\", 0x%08xu, 0x%08xu, %u, %u, %u, %s},\n",
+                (I32) entry.path.len, entry.path.data,
+                entry.hash,
+                set,
+                entry.binding,
+                entry.offset,
+                entry.size,
+                DATA_TYPE_ENUMS[entry.data_type]);
+    }
+    fprintf(fp, "};\n");
+    fprintf(fp, "\n");
+
+    fprintf(fp, "// Returns NULL if 'path' isn't a member of any block in the program.\n");
+    fprintf(fp, "static inline const ShaderMember *%.*s_find_member(const char *path) {\n", name_len, name);
+    fprintf(fp, "    unsigned int hash = shader_member_hash(path, 0);\n");
+    fprintf(fp, "    unsigned int seed = %.*s_MEMBER_SEEDS[hash %% %uu];\n", name_len, name, lookup.seed_count);
+    fprintf(fp, "    const ShaderMember *member = &%.*s_MEMBERS[shader_member_hash(path, seed) & %uu];\n", name_len, name, lookup.table_size - 1);
+    fprintf(fp, "    // The hash only rules out most misses, unknown paths can collide with a\n");
+    fprintf(fp, "    // member.\n");
+    fprintf(fp, "    if (member->path == 0 || member->hash != hash || strcmp(member->path, path) != 0) {\n");
+    fprintf(fp, "        return 0;\n");
+    fprintf(fp, "    }\n");
+    fprintf(fp, "    return member;\n");
+    fprintf(fp, "}\n");
+    fprintf(fp, "\n");
+}
+
+void write_vk_stage_flags(FILE *fp, U32 stages) {
+    if (stages == 0) {
+        fprintf(fp, "0");
+        return;
+    }
+
+    const char *separator = "";
+    if (stages & SHADER_STAGE_VERTEX) {
+        fprintf(fp, "%sVK_SHADER_STAGE_VERTEX_BIT", separator);
+        separator = " | ";
+    }
+    if (stages & SHADER_STAGE_FRAGMENT) {
+        fprintf(fp, "%sVK_SHADER_STAGE_FRAGMENT_BIT", separator);
+        separator = " | ";
+    }
+    if (stages & SHADER_STAGE_COMPUTE) {
+        fprintf(fp, "%sVK_SHADER_STAGE_COMPUTE_BIT", separator);
+        separator = " | ";
+    }
+}
+
+void write_push_constant_ranges(FILE *fp, CompiledShader shader) {
+    if (shader.push_constant_range_count == 0) {
+        return;
+    }
+
+    I32 name_len = shader.name.len;
+    const U8 *name = shader.name.data;
+
+    // Ranges only cover the members each stage accesses. Pushing bytes
+    // where ranges overlap takes the stages of all of them.
+    fprintf(fp, "// Push constant ranges\n");
+    fprintf(fp, "#ifdef VK_VERSION_1_0\n");
+    fprintf(fp, "static const VkPushConstantRange %.*s_PUSH_CONSTANT_RANGES[] = {\n", name_len, name);
+    for (U32 i = 0; i < shader.push_constant_range_count; i++) {
+        PushConstantRange range = shader.push_constant_ranges[i];
+        fprintf(fp, "    {");
+        write_vk_stage_flags(fp, range.stages);
+        fprintf(fp, ", %u, %u},\n", range.offset, range.size);
+    }
+    fprintf(fp, "};\n");
+    fprintf(fp, "#define %.*s_PUSH_CONSTANT_RANGE_COUNT %llu\n", name_len, name, (unsigned long long) shader.push_constant_range_count);
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+}
+
+void write_descriptor_sets(FILE *fp, CompiledShader shader) {
+    const char *vk_descriptor_types[DESCRIPTOR_TYPE_COUNT] = {
+        "VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER",
+        "VK_DESCRIPTOR_TYPE_STORAGE_BUFFER",
+        "VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER",
+        "VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE",
+        "VK_DESCRIPTOR_TYPE_STORAGE_IMAGE",
+        "VK_DESCRIPTOR_TYPE_SAMPLER",
+    };
+
+    const char *vk_descriptor_infos[DESCRIPTOR_TYPE_COUNT] = {
+        "VkDescriptorBufferInfo",
+        "VkDescriptorBufferInfo",
+        "VkDescriptorImageInfo",
+        "VkDescriptorImageInfo",
+        "VkDescriptorImageInfo",
+        "VkDescriptorImageInfo",
+    };
+
+    if (shader.binding_count == 0) {
+        return;
+    }
+
+    I32 name_len = shader.name.len;
+    const U8 *name = shader.name.data;
+
+    // Descriptor update templates are core in Vulkan 1.1 so only emit them
+    // when the includer has pulled in a new enough Vulkan header.
+    fprintf(fp, "// Descriptor sets\n");
+    fprintf(fp, "#ifdef VK_VERSION_1_1\n");
+    fprintf(fp, "#include <stddef.h>\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "// Upper bound of runtime sized descriptor arrays.\n");
+    fprintf(fp, "#ifndef SHADER_MAX_VARIABLE_DESCRIPTORS\n");
+    fprintf(fp, "#define SHADER_MAX_VARIABLE_DESCRIPTORS 4096\n");
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+
+    // Bindings are sorted by set so each set is a contiguous range.
+    U32 first = 0;
+    while (first < shader.binding_count) {
+        U32 set = shader.bindings[first].set;
+        U32 last = first;
+        B8 runtime_array = false;
+        B8 non_uniform = false;
+        U32 template_entry_count = 0;
+        while (last < shader.binding_count && shader.bindings[last].set == set) {
+            runtime_array |= shader.bindings[last].runtime_array;
+            non_uniform |= shader.bindings[last].non_uniform_stages != 0;
+            template_entry_count += !shader.bindings[last].runtime_array;
+            last++;
+        }
+
+        fprintf(fp, "static const VkDescriptorSetLayoutBinding %.*s_SET%u_BINDINGS[] = {\n", name_len, name, set);
+        for (U32 i = first; i < last; i++) {
+            ReflectedBinding binding = shader.bindings[i];
+            fprintf(fp, "    {%u, %s, ", binding.binding, vk_descriptor_types[binding.type]);
+            if (binding.runtime_array) {
+                fprintf(fp, "SHADER_MAX_VARIABLE_DESCRIPTORS");
+            } else {
+                fprintf(fp, "%u", binding.count);
             }
-            fputc('\"', fp);
+            fprintf(fp, ", ");
+            write_vk_stage_flags(fp, binding.stages);
+            fprintf(fp, ", NULL},\n");
         }
+        fprintf(fp, "};\n");
+        fprintf(fp, "#define %.*s_SET%u_BINDING_COUNT %u\n", name_len, name, set, last - first);
+        fprintf(fp, "\n");
+
+        // Runtime sized arrays are variable count and need not be fully
+        // populated. The count must be supplied at allocation through
+        // VkDescriptorSetVariableDescriptorCountAllocateInfo.
+        if (runtime_array) {
+            fprintf(fp, "#ifdef VK_VERSION_1_2\n");
+            fprintf(fp, "static const VkDescriptorBindingFlags %.*s_SET%u_BINDING_FLAGS[] = {\n", name_len, name, set);
+            for (U32 i = first; i < last; i++) {
+                if (shader.bindings[i].runtime_array) {
+                    fprintf(fp, "    VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT,\n");
+                } else {
+                    fprintf(fp, "    0,\n");
+                }
+            }
+            fprintf(fp, "};\n");
+            fprintf(fp, "#endif\n");
+            fprintf(fp, "#define %.*s_SET%u_REQUIRES_RUNTIME_DESCRIPTOR_ARRAY 1\n", name_len, name, set);
+            fprintf(fp, "\n");
+        }
+
+        // Stages which need the matching shader*ArrayNonUniformIndexing
+        // feature for each binding.
+        if (non_uniform) {
+            fprintf(fp, "static const VkShaderStageFlags %.*s_SET%u_NON_UNIFORM_STAGES[] = {\n", name_len, name, set);
+            for (U32 i = first; i < last; i++) {
+                fprintf(fp, "    ");
+                write_vk_stage_flags(fp, shader.bindings[i].non_uniform_stages);
+                fprintf(fp, ",\n");
+            }
+            fprintf(fp, "};\n");
+            fprintf(fp, "#define %.*s_SET%u_REQUIRES_NON_UNIFORM_INDEXING 1\n", name_len, name, set);
+            fprintf(fp, "\n");
+        }
+
+        // Struct matching the template layout, one descriptor info per
+        // array element. Runtime sized arrays have no fixed size and are
+        // left to vkUpdateDescriptorSets.
+        if (template_entry_count == 0) {
+            first = last;
+            continue;
+        }
+
+        fprintf(fp, "typedef struct %.*s_Set%u %.*s_Set%u;\n", name_len, name, set, name_len, name, set);
+        fprintf(fp, "struct %.*s_Set%u {\n", name_len, name, set);
+        for (U32 i = first; i < last; i++) {
+            ReflectedBinding binding = shader.bindings[i];
+            if (binding.runtime_array) {
+                continue;
+            }
+            fprintf(fp, "    %s %.*s", vk_descriptor_infos[binding.type], (I32) binding.name.len, binding.name.data);
+            if (binding.count > 1) {
+                fprintf(fp, "[%u]", binding.count);
+            }
+            fprintf(fp, ";\n");
+        }
+        fprintf(fp, "};\n");
+        fprintf(fp, "\n");
+
+        fprintf(fp, "static const VkDescriptorUpdateTemplateEntry %.*s_SET%u_TEMPLATE_ENTRIES[] = {\n", name_len, name, set);
+        for (U32 i = first; i < last; i++) {
+            ReflectedBinding binding = shader.bindings[i];
+            if (binding.runtime_array) {
+                continue;
+            }
+            fprintf(fp, "    {%u, 0, %u, %s, offsetof(%.*s_Set%u, %.*s), sizeof(%s)},\n",
+                    binding.binding,
+                    binding.count,
+                    vk_descriptor_types[binding.type],
+                    name_len, name, set,
+                    (I32) binding.name.len, binding.name.data,
+                    vk_descriptor_infos[binding.type]);
+        }
+        fprintf(fp, "};\n");
+        fprintf(fp, "#define %.*s_SET%u_TEMPLATE_ENTRY_COUNT %u\n", name_len, name, set, template_entry_count);
+        fprintf(fp, "\n");
+
+        first = last;
     }
-    fprintf(fp, "\";\n");
 
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+}
+
+void write_vertex_inputs(FILE *fp, CompiledShader shader, const ArStr *ctypes, const VertexFormat *formats) {
+    ReflectedStage stage = shader.vertex.reflection;
+    if (stage.input_count == 0) {
+        return;
+    }
+
+    I32 name_len = shader.name.len;
+    const U8 *name = shader.name.data;
+
+    fprintf(fp, "// Vertex input\n");
+    fprintf(fp, "typedef struct %.*s_Vertex %.*s_Vertex;\n", name_len, name, name_len, name);
+    fprintf(fp, "struct %.*s_Vertex {\n", name_len, name);
+    for (U32 i = 0; i < stage.input_count; i++) {
+        ReflectedInput input = stage.inputs[i];
+        VertexFormatInfo format = VERTEX_FORMATS[formats[i]];
+        I32 input_len = input.name.len;
+        const U8 *input_name = input.name.data;
+
+        // Uncompressed inputs keep the 'ctypedef' of their type.
+        ArStr user_type = ctypes[input.data_type];
+        B8 uncompressed = formats[i] <= VERTEX_FORMAT_R32G32B32A32_UINT;
+        if (uncompressed && user_type.len != 0) {
+            fprintf(fp, "    %.*s %.*s;\n", (I32) user_type.len, user_type.data, input_len, input_name);
+        } else if (input.cols > 1) {
+            fprintf(fp, "    %s %.*s[%u][%u];\n", format.ctype, input_len, input_name, input.cols, format.ctype_count);
+        } else if (format.ctype_count > 1) {
+            fprintf(fp, "    %s %.*s[%u];\n", format.ctype, input_len, input_name, format.ctype_count);
+        } else {
+            fprintf(fp, "    %s %.*s;\n", format.ctype, input_len, input_name);
+        }
+    }
+    fprintf(fp, "};\n");
     fprintf(fp, "\n");
-    fprintf(fp, "// Fragment\n");
 
-    // Create push constants and uniform buffer types.
-    snprintf(prefix, 512, "%.*s_FS", (I32) shader.name.len, shader.name.data);
-    write_reflected_types(fp, ctypes, prefix, shader.fragment.reflection);
+    fprintf(fp, "#ifdef VK_VERSION_1_0\n");
+    fprintf(fp, "#include <stddef.h>\n");
+    fprintf(fp, "\n");
+    fprintf(fp, "static const VkVertexInputBindingDescription %.*s_VERTEX_BINDING = {0, sizeof(%.*s_Vertex), VK_VERTEX_INPUT_RATE_VERTEX};\n",
+            name_len, name, name_len, name);
+    fprintf(fp, "\n");
 
-    // Create SPV source variable.
-    len = fprintf(fp, "const char* %.*s_FS_SOURCE = \"", (I32) shader.name.len, shader.name.data);
-    for (U64 i = 0; i < shader.fragment.spv.len; i++) {
-        fprintf(fp, "\\x%.2x", shader.fragment.spv.data[i]);
+    U32 attribute_count = 0;
+    fprintf(fp, "static const VkVertexInputAttributeDescription %.*s_VERTEX_ATTRIBUTES[] = {\n", name_len, name);
+    for (U32 i = 0; i < stage.input_count; i++) {
+        ReflectedInput input = stage.inputs[i];
+        VertexFormatInfo format = VERTEX_FORMATS[formats[i]];
+        for (U32 j = 0; j < input.cols; j++) {
+            fprintf(fp, "    {%u, 0, VK_FORMAT_%.*s, offsetof(%.*s_Vertex, %.*s)",
+                    input.location + j,
+                    (I32) format.name.len, format.name.data,
+                    name_len, name,
+                    (I32) input.name.len, input.name.data);
+            if (j > 0) {
+                fprintf(fp, " + %u", j * format.size);
+            }
+            fprintf(fp, "},\n");
+            attribute_count++;
+        }
+    }
+    fprintf(fp, "};\n");
+    fprintf(fp, "#define %.*s_VERTEX_ATTRIBUTE_COUNT %u\n", name_len, name, attribute_count);
+    fprintf(fp, "#endif\n");
+    fprintf(fp, "\n");
+}
+
+const char *test = "hehe"
+                    "wow";
+
+void write_spv_source(FILE *fp, const char *name, ArStr spv) {
+    U32 len = fprintf(fp, "const char* %s = \"", name);
+    for (U64 i = 0; i < spv.len; i++) {
+        fprintf(fp, "\\x%.2x", spv.data[i]);
         if ((i + 1) % 20 == 0) {
             fprintf(fp, "\"\n");
             for (U32 j = 0; j < len-1; j++) {
@@ -221,13 +699,296 @@ void write_header(CompiledShader shader, const ArHashMap *ctypes, const char *fi
         }
     }
     fprintf(fp, "\";\n");
+}
+
+void write_spv_array(FILE *fp, const char *name, ArStr spv) {
+    const U32 *words = (const U32 *) spv.data;
+    U64 word_count = spv.len / sizeof(U32);
+    fprintf(fp, "inline constexpr std::array<uint32_t, %llu> %s = {", (unsigned long long) word_count, name);
+    for (U64 i = 0; i < word_count; i++) {
+        if (i % 8 == 0) {
+            fprintf(fp, "\n   ");
+        }
+        fprintf(fp, " 0x%.8x,", words[i]);
+    }
+    fprintf(fp, "\n};\n");
+}
+
+// Same bit values as VkShaderStageFlagBits so the traits don't depend on the
+// Vulkan header.
+U32 vk_stage_bits(U32 stages) {
+    U32 bits = 0;
+    if (stages & SHADER_STAGE_VERTEX) {
+        bits |= 0x01;
+    }
+    if (stages & SHADER_STAGE_FRAGMENT) {
+        bits |= 0x10;
+    }
+    if (stages & SHADER_STAGE_COMPUTE) {
+        bits |= 0x20;
+    }
+    return bits;
+}
+
+void write_block_traits(FILE *fp, CompiledShader shader, const char *prefix, ReflectedStage stage) {
+    // Push constants are a single range shared by every stage declaring
+    // them.
+    U32 push_constant_stages = 0;
+    if (shader.vertex.reflection.count[REFLECTION_INDEX_PUSH_CONSTANT] > 0) {
+        push_constant_stages |= SHADER_STAGE_VERTEX;
+    }
+    if (shader.fragment.reflection.count[REFLECTION_INDEX_PUSH_CONSTANT] > 0) {
+        push_constant_stages |= SHADER_STAGE_FRAGMENT;
+    }
+    if (shader.compute.reflection.count[REFLECTION_INDEX_PUSH_CONSTANT] > 0) {
+        push_constant_stages |= SHADER_STAGE_COMPUTE;
+    }
+
+    for (U32 i = 0; i < REFLECTION_INDEX_COUNT; i++) {
+        for (U32 j = 0; j < stage.count[i]; j++) {
+            ReflectedType type = stage.types[i][j];
+            B8 push_constant = i == REFLECTION_INDEX_PUSH_CONSTANT;
+
+            U32 stages = push_constant_stages;
+            if (!push_constant) {
+                stages = 0;
+                for (U32 k = 0; k < shader.binding_count; k++) {
+                    if (shader.bindings[k].set == type.set && shader.bindings[k].binding == type.binding) {
+                        stages = shader.bindings[k].stages;
+                        break;
+                    }
+                }
+            }
+
+            fprintf(fp, "template <>\n");
+            fprintf(fp, "struct ShaderBlockTraits<%s_%.*s> {\n", prefix, (I32) type.name.len, type.name.data);
+            fprintf(fp, "    static constexpr bool push_constant = %s;\n", push_constant ? "true" : "false");
+            fprintf(fp, "    static constexpr uint32_t set = %u;\n", push_constant ? 0 : type.set);
+            fprintf(fp, "    static constexpr uint32_t binding = %u;\n", push_constant ? 0 : type.binding);
+            fprintf(fp, "    static constexpr uint32_t size = %u;\n", type.size);
+            fprintf(fp, "    static constexpr uint32_t stages = 0x%.2xu;\n", vk_stage_bits(stages));
+            fprintf(fp, "    static constexpr std::array<uint32_t, %u> member_offsets = {", type.member_count);
+            for (U32 k = 0; k < type.member_count; k++) {
+                fprintf(fp, "%s%u", k == 0 ? "" : ", ", type.members[k].offset);
+            }
+            fprintf(fp, "};\n");
+            fprintf(fp, "    static constexpr std::array<uint32_t, %u> member_sizes = {", type.member_count);
+            for (U32 k = 0; k < type.member_count; k++) {
+                fprintf(fp, "%s%u", k == 0 ? "" : ", ", type.members[k].size);
+            }
+            fprintf(fp, "};\n");
+            fprintf(fp, "};\n");
+            fprintf(fp, "\n");
+        }
+    }
+}
+
+void write_spv(FILE *fp, const char *name, ArStr spv, Options options) {
+    if (options.cpp) {
+        write_spv_array(fp, name, spv);
+    } else {
+        write_spv_source(fp, name, spv);
+    }
+}
+
+// Names of the backend sources in the header.
+static const char *BACKEND_SUFFIXES[BACKEND_COUNT] = {
+    "GLSL_ES",
+    "GLSL_330",
+    "HLSL",
+    "MSL",
+};
+
+// Writes text as a string literal, one literal per line.
+void write_text_source(FILE *fp, const char *name, ArStr text) {
+    fprintf(fp, "static const char %s[] =\n", name);
+    fprintf(fp, "    \"");
+    for (U64 i = 0; i < text.len; i++) {
+        U8 c = text.data[i];
+        if (c == '\n') {
+            fprintf(fp, "\\n\"");
+            if (i + 1 < text.len) {
+                fprintf(fp, "\n    \"");
+            }
+            continue;
+        }
+        if (c == '\\' || c == '"') {
+            fputc('\\', fp);
+        }
+        fputc(c, fp);
+    }
+    if (text.len == 0 || text.data[text.len - 1] != '\n') {
+        fputc('"', fp);
+    }
+    fprintf(fp, ";\n");
+}
+
+void write_backend_sources(FILE *fp, const char *prefix, CompiledStage stage, Options options) {
+    for (U32 i = 0; i < BACKEND_COUNT; i++) {
+        if (!(options.backends & (1 << i))) {
+            continue;
+        }
+        char name[512] = {0};
+        snprintf(name, 512, "%s_%s", prefix, BACKEND_SUFFIXES[i]);
+        write_text_source(fp, name, stage.sources[i]);
+    }
+}
+
+// Looks up the 'ctypedef' of every data type once instead of per member.
+void resolve_ctypes(const ArHashMap *ctypes, ArStr resolved[REFLECTED_DATA_TYPE_COUNT]) {
+    for (U32 i = 0; i < REFLECTED_DATA_TYPE_COUNT; i++) {
+        ArStr name = REFLECTED_DATA_TYPE_NAMES[i];
+        resolved[i] = ar_hash_map_get(ctypes, name, ArStr);
+    }
+}
+
+B8 write_template(ArArena *arena, CompiledShader shader, const ArStr *ctypes, Options options) {
+    ArStr source = read_file(arena, options.template_path);
+    if (source.data == NULL) {
+        return false;
+    }
+
+    Template *template = template_compile(arena, source, options.template_path);
+    if (template == NULL) {
+        return false;
+    }
+
+    TemplateInput input = {
+        .shader = shader,
+        .ctypes = ctypes,
+    };
+    ArStr output = template_render(arena, template, input);
+
+    const char *filepath = ar_str_to_cstr(arena, options.output);
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL) {
+        ar_error("Failed to open file %s.", filepath);
+        return false;
+    }
+    fwrite(output.data, 1, output.len, fp);
+    fclose(fp);
+
+    return true;
+}
+
+// Types, SPIR-V and backend sources of one stage, prefixed '<NAME>_VS',
+// '<NAME>_FS' or '<NAME>_CS'.
+void write_stage(FILE *fp, CompiledShader shader, const ArStr *ctypes, Options options, const char *prefix, CompiledStage stage) {
+    // Create push constants and uniform buffer types.
+    write_reflected_types(fp, ctypes, prefix, stage.reflection);
+    write_uniform_ring_helpers(fp, prefix, stage.reflection);
+    if (options.cpp) {
+        write_block_traits(fp, shader, prefix, stage.reflection);
+    }
+
+    // Create SPV source variable.
+    if (shader.spv.len == 0) {
+        char name[512] = {0};
+        snprintf(name, 512, "%s_SOURCE", prefix);
+        write_spv(fp, name, stage.spv, options);
+    }
+    write_backend_sources(fp, prefix, stage, options);
+}
+
+void write_header(ArArena *arena, CompiledShader shader, const ArStr *ctypes, const VertexFormat *vertex_formats, Options options, const char *filepath) {
+    FILE *fp = fopen(filepath, "wb");
+
+    fprintf(fp, "#ifndef %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
+    fprintf(fp, "#define %.*s_HEADER\n", (I32) shader.name.len, shader.name.data);
+
+    if (options.cpp) {
+        fprintf(fp, "\n");
+        fprintf(fp, "#include <array>\n");
+        fprintf(fp, "#include <cstdint>\n");
+        fprintf(fp, "\n");
+        fprintf(fp, "// Compile time metadata of a uniform buffer or push constant block.\n");
+        fprintf(fp, "// 'stages' holds VkShaderStageFlagBits.\n");
+        fprintf(fp, "#ifndef SHADER_BLOCK_TRAITS\n");
+        fprintf(fp, "#define SHADER_BLOCK_TRAITS\n");
+        fprintf(fp, "template <typename T>\n");
+        fprintf(fp, "struct ShaderBlockTraits;\n");
+        fprintf(fp, "#endif\n");
+    }
+
+    if (shader.vertex.reflection.count[REFLECTION_INDEX_UNIFORM_BUFFER] > 0 ||
+            shader.fragment.reflection.count[REFLECTION_INDEX_UNIFORM_BUFFER] > 0 ||
+            shader.compute.reflection.count[REFLECTION_INDEX_UNIFORM_BUFFER] > 0) {
+        fprintf(fp, "\n");
+        write_uniform_ring(fp, options.uniform_alignment);
+    }
+
+    char prefix[512] = {0};
+    if (shader.compute.spv.len != 0) {
+        fprintf(fp, "\n");
+        fprintf(fp, "// Compute\n");
+        snprintf(prefix, 512, "%.*s_CS", (I32) shader.name.len, shader.name.data);
+        write_stage(fp, shader, ctypes, options, prefix, shader.compute);
+
+        const U32 *size = shader.compute.reflection.workgroup_size;
+        fprintf(fp, "#define %s_WORKGROUP_SIZE_X %u\n", prefix, size[0]);
+        fprintf(fp, "#define %s_WORKGROUP_SIZE_Y %u\n", prefix, size[1]);
+        fprintf(fp, "#define %s_WORKGROUP_SIZE_Z %u\n", prefix, size[2]);
+    } else {
+        fprintf(fp, "\n");
+        fprintf(fp, "// Vertex\n");
+        snprintf(prefix, 512, "%.*s_VS", (I32) shader.name.len, shader.name.data);
+        write_stage(fp, shader, ctypes, options, prefix, shader.vertex);
+
+        fprintf(fp, "\n");
+        fprintf(fp, "// Fragment\n");
+        snprintf(prefix, 512, "%.*s_FS", (I32) shader.name.len, shader.name.data);
+        write_stage(fp, shader, ctypes, options, prefix, shader.fragment);
+    }
+
+    // Both stages share one module, each stage has its own 'main' entry
+    // point.
+    if (shader.spv.len != 0) {
+        fprintf(fp, "\n");
+        fprintf(fp, "// Vertex and fragment\n");
+        char name[512] = {0};
+        snprintf(name, 512, "%.*s_SOURCE", (I32) shader.name.len, shader.name.data);
+        write_spv(fp, name, shader.spv, options);
+    }
 
     fprintf(fp, "\n");
+    write_vertex_inputs(fp, shader, ctypes, vertex_formats);
+    write_push_constant_ranges(fp, shader);
+    write_descriptor_sets(fp, shader);
+    write_member_lookup(fp, arena, shader);
+
     fprintf(fp, "#endif\n");
 
     fclose(fp);
 }
 
+// Blobs are named after the program and stage, '<name>.vert',
+// '<name>.frag', '<name>.comp' or '<name>.spv' for a single module.
+B8 write_pack(ArArena *arena, CompiledShader shader, Options options) {
+    PackBlob blobs[2];
+    U32 blob_count = 0;
+    if (shader.compute.spv.len != 0) {
+        blobs[blob_count++] = (PackBlob) {ar_str_pushf(arena, "%.*s.comp", (I32) shader.name.len, shader.name.data), shader.compute.spv};
+    } else if (shader.spv.len != 0) {
+        blobs[blob_count++] = (PackBlob) {ar_str_pushf(arena, "%.*s.spv", (I32) shader.name.len, shader.name.data), shader.spv};
+    } else {
+        blobs[blob_count++] = (PackBlob) {ar_str_pushf(arena, "%.*s.vert", (I32) shader.name.len, shader.name.data), shader.vertex.spv};
+        blobs[blob_count++] = (PackBlob) {ar_str_pushf(arena, "%.*s.frag", (I32) shader.name.len, shader.name.data), shader.fragment.spv};
+    }
+
+    PackOptions pack_options = {
+        .compact = options.compact,
+        .compress = options.pack_compress,
+        .page_size = options.pack_page_size,
+    };
+    if (options.pack_usage.len != 0) {
+        pack_options.usage = read_file(arena, options.pack_usage);
+        if (pack_options.usage.data == NULL) {
+            return false;
+        }
+    }
+    return pack_update(arena, options.pack, blobs, blob_count, pack_options);
+}
+
 I32 main(I32 argc, char **argv) {
     arkin_init(&(ArkinCoreDesc) {
             .error.callback = ar_log_error_callback
@@ -236,24 +997,219 @@ I32 main(I32 argc, char **argv) {
 
     test_dirname();
 
-    if (argc < 2) {
+    Options options = {
+        // Largest alignment Vulkan allows, valid on every device.
+        .uniform_alignment = 256,
+        .pack_page_size = PACK_PAGE_SIZE,
+        .output = ar_str_lit("header.h"),
+    };
+
+    B8 failed = false;
+    for (I32 i = 1; i < argc; i++) {
+        ArStr arg = ar_str_cstr(argv[i]);
+        if (ar_str_match(arg, ar_str_lit("--uniform-alignment"), AR_STR_MATCH_FLAG_EXACT)) {
+            if (i + 1 >= argc) {
+                ar_error("%s: Expected an alignment.", argv[i]);
+                failed = true;
+                break;
+            }
+            i++;
+            U32 alignment = strtoul(argv[i], NULL, 10);
+            if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+                ar_error("%s: Uniform alignment must be a power of two.", argv[i]);
+                failed = true;
+                break;
+            }
+            options.uniform_alignment = alignment;
+        } else if (ar_str_match(arg, ar_str_lit("--pack-page-size"), AR_STR_MATCH_FLAG_EXACT)) {
+            if (i + 1 >= argc) {
+                ar_error("%s: Expected a page size.", argv[i]);
+                failed = true;
+                break;
+            }
+            i++;
+            U32 page_size = strtoul(argv[i], NULL, 10);
+            if (page_size < PACK_BLOB_ALIGNMENT || (page_size & (page_size - 1)) != 0) {
+                ar_error("%s: Page size must be a power of two.", argv[i]);
+                failed = true;
+                break;
+            }
+            options.pack_page_size = page_size;
+        } else if (ar_str_match(arg, ar_str_lit("--single-module"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.single_module = true;
+        } else if (ar_str_match(arg, ar_str_lit("--remap"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.canonicalize = true;
+        } else if (ar_str_match(arg, ar_str_lit("--validate"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.validate = true;
+        } else if (ar_str_match(arg, ar_str_lit("--precision"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.precision_report = true;
+        } else if (ar_str_match(arg, ar_str_lit("--relax-precision"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.relax_precision = true;
+        } else if (ar_str_match(arg, ar_str_lit("--eliminate-varyings"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.eliminate_varyings = true;
+        } else if (ar_str_match(arg, ar_str_lit("--reorder-push-constants"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.reorder_push_constants = true;
+        } else if (ar_str_match(arg, ar_str_lit("--cost"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.cost_report = true;
+        } else if (ar_str_match(arg, ar_str_lit("--compress-vertex"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.compress_vertex = true;
+        } else if (ar_str_match(arg, ar_str_lit("--preprocess"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.preprocess = true;
+        } else if (ar_str_match(arg, ar_str_lit("--emit"), AR_STR_MATCH_FLAG_EXACT)) {
+            if (i + 1 >= argc) {
+                ar_error("%s: Expected a backend.", argv[i]);
+                failed = true;
+                break;
+            }
+            i++;
+            ArStr backend = ar_str_cstr(argv[i]);
+            U32 j = 0;
+            while (j < BACKEND_COUNT && !ar_str_match(backend, BACKEND_NAMES[j], AR_STR_MATCH_FLAG_EXACT)) {
+                j++;
+            }
+            if (j == BACKEND_COUNT) {
+                ar_error("%s: Unknown backend, expected glsl-es, glsl330, hlsl or msl.", argv[i]);
+                failed = true;
+                break;
+            }
+            options.backends |= 1 << j;
+        } else if (ar_str_match(arg, ar_str_lit("--compact"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.compact = true;
+        } else if (ar_str_match(arg, ar_str_lit("--pack-compress"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.pack_compress = true;
+        } else if (ar_str_match(arg, ar_str_lit("--cpp"), AR_STR_MATCH_FLAG_EXACT)) {
+            options.cpp = true;
+        } else if (ar_str_match(arg, ar_str_lit("--template"), AR_STR_MATCH_FLAG_EXACT) ||
+                ar_str_match(arg, ar_str_lit("--output"), AR_STR_MATCH_FLAG_EXACT) ||
+                ar_str_match(arg, ar_str_lit("--manifest"), AR_STR_MATCH_FLAG_EXACT) ||
+                ar_str_match(arg, ar_str_lit("--pack"), AR_STR_MATCH_FLAG_EXACT) ||
+                ar_str_match(arg, ar_str_lit("--pack-usage"), AR_STR_MATCH_FLAG_EXACT) ||
+                ar_str_match(arg, ar_str_lit("--cpu"), AR_STR_MATCH_FLAG_EXACT)) {
+            if (i + 1 >= argc) {
+                ar_error("%s: Expected a path.", argv[i]);
+                failed = true;
+                break;
+            }
+            i++;
+            if (ar_str_match(arg, ar_str_lit("--template"), AR_STR_MATCH_FLAG_EXACT)) {
+                options.template_path = ar_str_cstr(argv[i]);
+            } else if (ar_str_match(arg, ar_str_lit("--manifest"), AR_STR_MATCH_FLAG_EXACT)) {
+                options.manifest = ar_str_cstr(argv[i]);
+            } else if (ar_str_match(arg, ar_str_lit("--pack"), AR_STR_MATCH_FLAG_EXACT)) {
+                options.pack = ar_str_cstr(argv[i]);
+            } else if (ar_str_match(arg, ar_str_lit("--pack-usage"), AR_STR_MATCH_FLAG_EXACT)) {
+                options.pack_usage = ar_str_cstr(argv[i]);
+            } else if (ar_str_match(arg, ar_str_lit("--cpu"), AR_STR_MATCH_FLAG_EXACT)) {
+                options.cpu_output = ar_str_cstr(argv[i]);
+            } else {
+                options.output = ar_str_cstr(argv[i]);
+            }
+        } else {
+            options.input = arg;
+        }
+    }
+
+    if (!failed && options.input.len == 0) {
         ar_error("No input file provided.");
+        failed = true;
+    }
+
+    if (failed) {
         ar_arena_destroy(&arena);
         arkin_terminate();
         return 1;
     }
-    ArStr filepath = ar_str_cstr(argv[1]);
+    // Nothing but the manifest has to be read when the output is up to
+    // date, glslang isn't even initialized.
+    U64 options_hash = hash_options(arena, argc, argv);
+    if (options.manifest.len != 0 && manifest_up_to_date(arena, options.manifest, options_hash)) {
+        ar_info("%.*s is up to date.", (I32) options.output.len, options.output.data);
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return 0;
+    }
+
+    ArStr filepath = options.input;
     ArStr file = read_file(arena, filepath);
 
     ArStrList path_list = {0};
-    ArStr file_dir = dirname(ar_str_cstr(argv[1]));
+    ArStr file_dir = dirname(filepath);
     ar_str_list_push(arena, &path_list, file_dir);
     ar_str_list_push(arena, &path_list, ar_str_lit("."));
 
-    ParsedShader parsed = parse_shader(arena, file, path_list);
-    CompiledShader compiled = compile_shader(arena, parsed);
+    ParsedShader parsed = parse_shader(arena, filepath, file, path_list);
+    CompiledShader compiled = compile_shader(arena, parsed, options);
+    compiler_terminate();
+    if (compiled.name.len == 0) {
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return 1;
+    }
+
+    ArStr ctypes[REFLECTED_DATA_TYPE_COUNT];
+    resolve_ctypes(parsed.ctypes, ctypes);
+
+    VertexFormat *vertex_formats = choose_vertex_formats(arena, compiled.vertex.reflection, parsed.vertex_formats, options.compress_vertex);
+    if (vertex_formats == NULL) {
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return 1;
+    }
+
+    if (options.template_path.len != 0) {
+        if (compiled.compute.spv.len != 0) {
+            ar_error("%.*s: Templates only support vertex and fragment programs.", (I32) compiled.name.len, compiled.name.data);
+            ar_arena_destroy(&arena);
+            arkin_terminate();
+            return 1;
+        }
+        if (!write_template(arena, compiled, ctypes, options)) {
+            ar_arena_destroy(&arena);
+            arkin_terminate();
+            return 1;
+        }
+    } else {
+        write_header(arena, compiled, ctypes, vertex_formats, options, ar_str_to_cstr(arena, options.output));
+    }
+
+    if (options.pack.len != 0 && !write_pack(arena, compiled, options)) {
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return 1;
+    }
 
-    write_header(compiled, parsed.ctypes, "header.h");
+    if (options.cpu_output.len != 0 && !write_cpu_harness(arena, compiled, options.cpu_output)) {
+        ar_arena_destroy(&arena);
+        arkin_terminate();
+        return 1;
+    }
+
+    if (options.manifest.len != 0) {
+        ArStrList inputs = {0};
+        ar_str_list_push(arena, &inputs, options.input);
+        for (ArStrListNode *curr = parsed.includes.first; curr != NULL; curr = curr->next) {
+            ar_str_list_push(arena, &inputs, curr->str);
+        }
+        if (options.template_path.len != 0) {
+            ar_str_list_push(arena, &inputs, options.template_path);
+        }
+        if (options.pack_usage.len != 0) {
+            ar_str_list_push(arena, &inputs, options.pack_usage);
+        }
+
+        // A pack shared by several programs is an output of each of them,
+        // another program updating it reruns this one, which then finds its
+        // blobs unchanged.
+        ArStrList outputs = {0};
+        ar_str_list_push(arena, &outputs, options.output);
+        if (options.pack.len != 0) {
+            ar_str_list_push(arena, &outputs, options.pack);
+        }
+        if (options.cpu_output.len != 0) {
+            ar_str_list_push(arena, &outputs, options.cpu_output);
+        }
+        manifest_write(arena, options.manifest, options_hash, inputs, outputs);
+    }
 
     ar_arena_destroy(&arena);
     arkin_terminate();
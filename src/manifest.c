@@ -0,0 +1,180 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// The manifest records the options and every file a run read or wrote:
+//
+//     shader_tool manifest 1
+//     options <hash>
+//     input <size> <mtime> <hash> <path>
+//     output <size> <mtime> <hash> <path>
+//
+// A file whose size and modification time match is assumed unchanged,
+// otherwise it's hashed so touching a file doesn't force a rebuild. Files
+// modified in the same second the manifest is written could change again
+// without their modification time changing, those are always hashed.
+
+#define MANIFEST_HEADER "shader_tool manifest 1"
+
+typedef struct FileStamp FileStamp;
+struct FileStamp {
+    U64 size;
+    I64 mtime;
+    U64 hash;
+};
+
+static B8 stat_file(const char *path, FileStamp *stamp) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtime;
+    return true;
+}
+
+static B8 hash_file(ArArena *arena, const char *path, U64 *hash) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    fseek(fp, 0, SEEK_END);
+    U64 len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    U8 *buffer = ar_arena_push_no_zero(scratch.arena, len);
+    U64 read = fread(buffer, 1, len, fp);
+    fclose(fp);
+
+    *hash = ar_fvn1a_hash(buffer, read);
+    ar_scratch_release(&scratch);
+    return read == len;
+}
+
+static B8 file_unchanged(ArArena *arena, const char *path, FileStamp recorded) {
+    FileStamp current;
+    if (!stat_file(path, &current)) {
+        return false;
+    }
+    if (current.size != recorded.size) {
+        return false;
+    }
+    if (current.mtime == recorded.mtime) {
+        return true;
+    }
+    return hash_file(arena, path, &current.hash) && current.hash == recorded.hash;
+}
+
+U64 hash_options(ArArena *arena, I32 argc, char **argv) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    ArStrList args = {0};
+    for (I32 i = 1; i < argc; i++) {
+        ar_str_list_push(scratch.arena, &args, ar_str_cstr(argv[i]));
+        // Separate arguments so 'a b' and 'ab' differ.
+        ar_str_list_push(scratch.arena, &args, ar_str_lit("\n"));
+    }
+    ArStr joined = ar_str_list_join(scratch.arena, args);
+    U64 hash = ar_fvn1a_hash(joined.data, joined.len);
+
+    ar_scratch_release(&scratch);
+    return hash;
+}
+
+B8 manifest_up_to_date(ArArena *arena, ArStr path, U64 options_hash) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    const char *cpath = ar_str_to_cstr(scratch.arena, path);
+    FILE *fp = fopen(cpath, "rb");
+    if (fp == NULL) {
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    B8 up_to_date = true;
+    B8 has_output = false;
+    U32 line_number = 0;
+    char line[4096];
+    while (up_to_date && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        line_number++;
+
+        if (line_number == 1) {
+            up_to_date = strcmp(line, MANIFEST_HEADER) == 0;
+            continue;
+        }
+
+        unsigned long long hash = 0;
+        if (sscanf(line, "options %llx", &hash) == 1) {
+            up_to_date = hash == options_hash;
+            continue;
+        }
+
+        char kind[8] = {0};
+        unsigned long long size = 0;
+        long long mtime = 0;
+        I32 path_start = 0;
+        if (sscanf(line, "%7s %llu %lld %llx %n", kind, &size, &mtime, &hash, &path_start) != 4 || path_start == 0) {
+            up_to_date = false;
+            break;
+        }
+
+        FileStamp recorded = {
+            .size = size,
+            .mtime = mtime,
+            .hash = hash,
+        };
+        up_to_date = file_unchanged(scratch.arena, &line[path_start], recorded);
+        has_output |= strcmp(kind, "output") == 0;
+    }
+    fclose(fp);
+
+    ar_scratch_release(&scratch);
+    return up_to_date && has_output;
+}
+
+static void write_entry(ArArena *arena, FILE *fp, const char *kind, ArStr path) {
+    const char *cpath = ar_str_to_cstr(arena, path);
+    FileStamp stamp = {0};
+    stat_file(cpath, &stamp);
+    hash_file(arena, cpath, &stamp.hash);
+    if (stamp.mtime >= (I64) time(NULL)) {
+        stamp.mtime = -1;
+    }
+    fprintf(fp, "%s %llu %lld %016llx %s\n",
+            kind,
+            (unsigned long long) stamp.size,
+            (long long) stamp.mtime,
+            (unsigned long long) stamp.hash,
+            cpath);
+}
+
+void manifest_write(ArArena *arena, ArStr path, U64 options_hash, ArStrList inputs, ArStrList outputs) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    const char *cpath = ar_str_to_cstr(scratch.arena, path);
+    FILE *fp = fopen(cpath, "wb");
+    if (fp == NULL) {
+        ar_error("Failed to open file %s.", cpath);
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    fprintf(fp, "%s\n", MANIFEST_HEADER);
+    fprintf(fp, "options %016llx\n", (unsigned long long) options_hash);
+    for (ArStrListNode *curr = inputs.first; curr != NULL; curr = curr->next) {
+        write_entry(scratch.arena, fp, "input", curr->str);
+    }
+    for (ArStrListNode *curr = outputs.first; curr != NULL; curr = curr->next) {
+        write_entry(scratch.arena, fp, "output", curr->str);
+    }
+    fclose(fp);
+
+    ar_scratch_release(&scratch);
+}
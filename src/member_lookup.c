@@ -0,0 +1,283 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <stdlib.h>
+
+typedef struct EntryNode EntryNode;
+struct EntryNode {
+    EntryNode *next;
+    MemberLookupEntry entry;
+};
+
+typedef struct Collector Collector;
+struct Collector {
+    ArArena *arena;
+    EntryNode *entries;
+    U32 count;
+    // Set, binding and kind of the block currently being collected.
+    MemberLookupEntry block;
+};
+
+U32 member_hash(ArStr str, U32 seed) {
+    // FNV-1a with a seeded offset basis.
+    U32 hash = 2166136261u + seed * 0x9e3779b9u;
+    for (U64 i = 0; i < str.len; i++) {
+        hash ^= str.data[i];
+        hash *= 16777619u;
+    }
+
+    // Murmur3 finalizer so the low bits used for indexing are well mixed.
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+static void add_entry(Collector *collector, ArStr path, U32 offset, U32 size, ReflectedDataType data_type) {
+    EntryNode *node = ar_arena_push_arr(collector->arena, EntryNode, 1);
+    node->entry = collector->block;
+    node->entry.path = path;
+    node->entry.hash = member_hash(path, 0);
+    node->entry.offset = offset;
+    node->entry.size = size;
+    node->entry.data_type = data_type;
+    ar_sll_stack_push(collector->entries, node);
+    collector->count++;
+}
+
+static void collect_members(Collector *collector, ArStr parent, U32 base_offset, ReflectedType type);
+
+// Expands every element of an array of structs, starting at the outermost
+// dimension.
+static void collect_elements(Collector *collector, ArStr parent, U32 base_offset, ReflectedType type, U32 dimension, U32 stride) {
+    U32 len = type.array_dimension_lengths[dimension];
+    U32 inner_stride = 0;
+    if (dimension > 0) {
+        inner_stride = stride / type.array_dimension_lengths[dimension - 1];
+    }
+
+    for (U32 i = 0; i < len; i++) {
+        ArStr path = ar_str_pushf(collector->arena, "%.*s[%u]", (I32) parent.len, parent.data, i);
+        U32 offset = base_offset + i * stride;
+        add_entry(collector, path, offset, stride, REFLECTED_DATA_TYPE_STRUCT);
+
+        if (dimension > 0) {
+            collect_elements(collector, path, offset, type, dimension - 1, inner_stride);
+        } else {
+            collect_members(collector, path, offset, type);
+        }
+    }
+}
+
+static void collect_members(Collector *collector, ArStr parent, U32 base_offset, ReflectedType type) {
+    for (U32 i = 0; i < type.member_count; i++) {
+        ReflectedType member = type.members[i];
+        ArStr path = ar_str_pushf(collector->arena, "%.*s.%.*s",
+                (I32) parent.len, parent.data,
+                (I32) member.name.len, member.name.data);
+        U32 offset = base_offset + member.offset;
+        add_entry(collector, path, offset, member.size, member.data_type);
+
+        // Arrays of anything but structs are looked up as a whole.
+        if (member.data_type != REFLECTED_DATA_TYPE_STRUCT) {
+            continue;
+        }
+
+        if (member.array_dimensions == 0) {
+            collect_members(collector, path, offset, member);
+        } else {
+            collect_elements(collector, path, offset, member, member.array_dimensions - 1, member.array_stride);
+        }
+    }
+}
+
+static I32 compare_u32(const void *a, const void *b) {
+    U32 _a = *(const U32 *) a;
+    U32 _b = *(const U32 *) b;
+    return (_a > _b) - (_a < _b);
+}
+
+MemberLookup build_member_lookup(ArArena *arena, CompiledShader shader) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    Collector collector = {
+        .arena = scratch.arena,
+    };
+
+    // The same block is usually visible to several stages, only collect it
+    // once.
+    const ReflectedStage stages[] = {
+        shader.vertex.reflection,
+        shader.fragment.reflection,
+        shader.compute.reflection,
+    };
+    MemberLookupEntry *blocks[ar_arrlen(stages) * REFLECTION_INDEX_COUNT] = {0};
+    Usize block_counts[ar_arrlen(stages) * REFLECTION_INDEX_COUNT] = {0};
+    U32 block_list_count = 0;
+
+    for (U32 i = 0; i < ar_arrlen(stages); i++) {
+        for (U32 j = 0; j < REFLECTION_INDEX_COUNT; j++) {
+            MemberLookupEntry *added = ar_arena_push_arr(scratch.arena, MemberLookupEntry, stages[i].count[j]);
+            U32 added_count = 0;
+
+            for (U32 k = 0; k < stages[i].count[j]; k++) {
+                ReflectedType block = stages[i].types[j][k];
+                MemberLookupEntry key = {
+                    .push_constant = j == REFLECTION_INDEX_PUSH_CONSTANT,
+                    .set = block.set,
+                    .binding = block.binding,
+                };
+
+                B8 duplicate = false;
+                for (U32 l = 0; l < block_list_count && !duplicate; l++) {
+                    for (U32 m = 0; m < block_counts[l]; m++) {
+                        if (blocks[l][m].push_constant == key.push_constant &&
+                                (key.push_constant ||
+                                 (blocks[l][m].set == key.set && blocks[l][m].binding == key.binding))) {
+                            duplicate = true;
+                            break;
+                        }
+                    }
+                }
+                if (duplicate) {
+                    continue;
+                }
+                added[added_count] = key;
+                added_count++;
+
+                collector.block = key;
+                add_entry(&collector, block.instance_name, 0, block.size, REFLECTED_DATA_TYPE_STRUCT);
+                collect_members(&collector, block.instance_name, 0, block);
+            }
+
+            blocks[block_list_count] = added;
+            block_counts[block_list_count] = added_count;
+            block_list_count++;
+        }
+    }
+
+    // Flatten the collected entries, dropping any path whose hash collides
+    // with another since the lookup identifies entries by hash alone.
+    U32 *hashes = ar_arena_push_arr_no_zero(scratch.arena, U32, collector.count);
+    U32 hash_index = 0;
+    for (EntryNode *node = collector.entries; node != NULL; node = node->next) {
+        hashes[hash_index] = node->entry.hash;
+        hash_index++;
+    }
+    qsort(hashes, collector.count, sizeof(U32), compare_u32);
+
+    MemberLookupEntry *entries = ar_arena_push_arr_no_zero(scratch.arena, MemberLookupEntry, collector.count);
+    U32 entry_count = 0;
+    for (EntryNode *node = collector.entries; node != NULL; node = node->next) {
+        U32 *found = bsearch(&node->entry.hash, hashes, collector.count, sizeof(U32), compare_u32);
+        B8 collides = (found > hashes && found[-1] == node->entry.hash) ||
+            (found < hashes + collector.count - 1 && found[1] == node->entry.hash);
+        if (collides) {
+            ar_error("%.*s: Member path hash collides with another member, it will not be found by the lookup table.",
+                    (I32) node->entry.path.len, node->entry.path.data);
+            continue;
+        }
+        entries[entry_count] = node->entry;
+        entry_count++;
+    }
+
+    // Hash and displace: entries are grouped into buckets by their unseeded
+    // hash and every bucket, largest first, searches for a seed placing all
+    // of its entries into free slots.
+    U32 table_size = 1;
+    while (table_size < entry_count + entry_count / 4) {
+        table_size <<= 1;
+    }
+    U32 seed_count = entry_count / 2 + 1;
+
+    U32 *bucket_sizes = ar_arena_push_arr(scratch.arena, U32, seed_count);
+    for (U32 i = 0; i < entry_count; i++) {
+        bucket_sizes[entries[i].hash % seed_count]++;
+    }
+
+    U32 *bucket_starts = ar_arena_push_arr(scratch.arena, U32, seed_count + 1);
+    for (U32 i = 0; i < seed_count; i++) {
+        bucket_starts[i + 1] = bucket_starts[i] + bucket_sizes[i];
+    }
+
+    U32 *bucket_entries = ar_arena_push_arr_no_zero(scratch.arena, U32, entry_count);
+    U32 *bucket_fill = ar_arena_push_arr(scratch.arena, U32, seed_count);
+    for (U32 i = 0; i < entry_count; i++) {
+        U32 bucket = entries[i].hash % seed_count;
+        bucket_entries[bucket_starts[bucket] + bucket_fill[bucket]] = i;
+        bucket_fill[bucket]++;
+    }
+
+    // Insertion sort of bucket indices by size, largest first.
+    U32 *bucket_order = ar_arena_push_arr_no_zero(scratch.arena, U32, seed_count);
+    for (U32 i = 0; i < seed_count; i++) {
+        U32 j = i;
+        while (j > 0 && bucket_sizes[bucket_order[j - 1]] < bucket_sizes[i]) {
+            bucket_order[j] = bucket_order[j - 1];
+            j--;
+        }
+        bucket_order[j] = i;
+    }
+
+    MemberLookup lookup = {0};
+    const U32 max_seed = 1 << 16;
+    U32 *slots = ar_arena_push_arr_no_zero(scratch.arena, U32, entry_count);
+    for (;;) {
+        lookup.table_size = table_size;
+        lookup.seed_count = seed_count;
+        lookup.table = ar_arena_push_arr(arena, MemberLookupEntry, table_size);
+        lookup.seeds = ar_arena_push_arr(arena, U32, seed_count);
+
+        B8 placed_all = true;
+        for (U32 i = 0; i < seed_count && placed_all; i++) {
+            U32 bucket = bucket_order[i];
+            U32 size = bucket_sizes[bucket];
+            if (size == 0) {
+                break;
+            }
+
+            B8 placed = false;
+            for (U32 seed = 1; seed < max_seed && !placed; seed++) {
+                placed = true;
+                for (U32 j = 0; j < size && placed; j++) {
+                    MemberLookupEntry entry = entries[bucket_entries[bucket_starts[bucket] + j]];
+                    U32 slot = member_hash(entry.path, seed) & (table_size - 1);
+                    if (lookup.table[slot].path.len != 0) {
+                        placed = false;
+                    }
+                    for (U32 k = 0; k < j && placed; k++) {
+                        if (slots[k] == slot) {
+                            placed = false;
+                        }
+                    }
+                    slots[j] = slot;
+                }
+
+                if (placed) {
+                    lookup.seeds[bucket] = seed;
+                    for (U32 j = 0; j < size; j++) {
+                        lookup.table[slots[j]] = entries[bucket_entries[bucket_starts[bucket] + j]];
+                        lookup.table[slots[j]].path = ar_str_push_copy(arena, lookup.table[slots[j]].path);
+                    }
+                }
+            }
+
+            placed_all = placed;
+        }
+
+        if (placed_all) {
+            break;
+        }
+
+        // Give the buckets more room and start over.
+        table_size <<= 1;
+    }
+
+    ar_scratch_release(&scratch);
+
+    return lookup;
+}
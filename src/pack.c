@@ -0,0 +1,659 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A pack holds the SPIR-V of many programs in one file, laid out as
+// described in pack_format.h.
+//
+// The index always comes last. Updating a pack only appends the blobs which
+// changed and a new index after the old one, blobs which didn't change keep
+// their offset so binary patches between two versions of a pack stay small.
+// The header is written last, an interrupted update leaves it pointing at
+// the old index. Replaced blobs are tombstoned and their space, like that of
+// old indexes, is only reclaimed by compaction, which moves every blob.
+// Compaction also orders the blobs by a usage file when given one and
+// compresses them against a dictionary trained over all of them, stored
+// once before the first blob.
+//
+// A pack shared by several programs is updated by parallel build steps, the
+// whole update holds an exclusive lock on the file.
+
+typedef struct Pack Pack;
+struct Pack {
+    PackHeader header;
+    PackEntry *entries;
+    // Names of the entries, indexed by 'name_offset'.
+    U8 *names;
+    U32 names_len;
+};
+
+static U64 align_up(U64 value, U64 alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static ArStr entry_name(const Pack *pack, PackEntry entry) {
+    return ar_str(&pack->names[entry.name_offset], entry.name_len);
+}
+
+static B8 read_pack(ArArena *arena, FILE *fp, Pack *pack) {
+    if (fread(&pack->header, sizeof(PackHeader), 1, fp) != 1 ||
+            pack->header.magic != PACK_MAGIC ||
+            pack->header.version != PACK_VERSION) {
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    U64 file_len = ftell(fp);
+    U64 entries_len = (U64) pack->header.entry_count * sizeof(PackEntry);
+    if (pack->header.index_offset + entries_len > file_len) {
+        return false;
+    }
+
+    fseek(fp, pack->header.index_offset, SEEK_SET);
+    pack->entries = ar_arena_push_arr_no_zero(arena, PackEntry, pack->header.entry_count);
+    if (fread(pack->entries, sizeof(PackEntry), pack->header.entry_count, fp) != pack->header.entry_count) {
+        return false;
+    }
+
+    // An interrupted update can leave bytes after the index, the names end
+    // where the last one does.
+    U64 names_available = file_len - pack->header.index_offset - entries_len;
+    U64 names_len = 0;
+    for (U32 i = 0; i < pack->header.entry_count; i++) {
+        PackEntry entry = pack->entries[i];
+        U64 name_end = (U64) entry.name_offset + entry.name_len;
+        if (name_end > names_available ||
+                entry.offset + entry.size > pack->header.index_offset) {
+            return false;
+        }
+        if (name_end > names_len) {
+            names_len = name_end;
+        }
+    }
+
+    pack->names_len = names_len;
+    pack->names = ar_arena_push_arr_no_zero(arena, U8, pack->names_len);
+    if (fread(pack->names, 1, pack->names_len, fp) != pack->names_len) {
+        return false;
+    }
+
+    return true;
+}
+
+static void write_padding(FILE *fp, U64 len) {
+    static const U8 zeroes[64] = {0};
+    while (len > 0) {
+        U64 chunk = len < sizeof(zeroes) ? len : sizeof(zeroes);
+        fwrite(zeroes, 1, chunk, fp);
+        len -= chunk;
+    }
+}
+
+// Writes the index at the end of the blobs and points the header at it once
+// the blobs and index are on disk.
+static B8 write_index(FILE *fp, Pack *pack) {
+    fseek(fp, pack->header.index_offset, SEEK_SET);
+    fwrite(pack->entries, sizeof(PackEntry), pack->header.entry_count, fp);
+    fwrite(pack->names, 1, pack->names_len, fp);
+    U64 end = ftell(fp);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&pack->header, sizeof(PackHeader), 1, fp);
+    fflush(fp);
+
+    // Drops whatever an interrupted update left after the old index.
+    return ftruncate(fileno(fp), end) == 0 && !ferror(fp);
+}
+
+// Bytes held by tombstones and replaced indexes.
+static U64 dead_bytes(const Pack *pack) {
+    U64 dead = pack->header.dead_index_bytes;
+    for (U32 i = 0; i < pack->header.entry_count; i++) {
+        if (pack->entries[i].flags & PACK_ENTRY_FLAG_TOMBSTONE) {
+            dead += align_up(pack->entries[i].size, PACK_BLOB_ALIGNMENT);
+        }
+    }
+    return dead;
+}
+
+// A program or blob name from the usage file and the group it's in.
+typedef struct UsageName UsageName;
+struct UsageName {
+    ArStr name;
+    U32 group;
+};
+
+// The usage file lists the programs loaded together, one per line, with
+// groups separated by empty lines. A group can be a level or a recorded load
+// trace. Lines starting with '#' are comments.
+static UsageName *parse_usage(ArArena *arena, ArStr usage, U32 *count) {
+    U32 capacity = 1;
+    for (U64 i = 0; i < usage.len; i++) {
+        capacity += usage.data[i] == '\n';
+    }
+    UsageName *names = ar_arena_push_arr_no_zero(arena, UsageName, capacity);
+    *count = 0;
+
+    U32 group = 0;
+    B8 group_empty = true;
+    U64 start = 0;
+    for (U64 i = 0; i <= usage.len; i++) {
+        if (i < usage.len && usage.data[i] != '\n') {
+            continue;
+        }
+        ArStr line = ar_str_trim(ar_str(&usage.data[start], i - start));
+        start = i + 1;
+
+        if (line.len == 0) {
+            if (!group_empty) {
+                group++;
+                group_empty = true;
+            }
+        } else if (line.data[0] != '#') {
+            names[*count] = (UsageName) {line, group};
+            (*count)++;
+            group_empty = false;
+        }
+    }
+
+    return names;
+}
+
+// Usage can name a program, matching all of its blobs, or a single blob.
+static B8 usage_matches(ArStr usage_name, ArStr blob_name) {
+    if (ar_str_match(usage_name, blob_name, AR_STR_MATCH_FLAG_EXACT)) {
+        return true;
+    }
+    return blob_name.len > usage_name.len &&
+        blob_name.data[usage_name.len] == '.' &&
+        ar_str_match(ar_str(blob_name.data, usage_name.len), usage_name, AR_STR_MATCH_FLAG_EXACT);
+}
+
+static B8 is_live_blob(PackEntry entry) {
+    return !(entry.flags & (PACK_ENTRY_FLAG_TOMBSTONE | PACK_ENTRY_FLAG_DICTIONARY));
+}
+
+// Returns the live dictionary, or NULL if the pack has none.
+static PackEntry *find_dictionary(const Pack *pack) {
+    for (U32 i = 0; i < pack->header.entry_count; i++) {
+        PackEntry *entry = &pack->entries[i];
+        if ((entry->flags & PACK_ENTRY_FLAG_DICTIONARY) && !(entry->flags & PACK_ENTRY_FLAG_TOMBSTONE)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Reads a blob as it was added, decompressing it if needed. Returns an
+// empty string on failure.
+static ArStr read_blob(ArArena *arena, FILE *fp, PackEntry entry, ArStr dictionary) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    U8 *stored = ar_arena_push_arr_no_zero(scratch.arena, U8, entry.size);
+    fseek(fp, entry.offset, SEEK_SET);
+    B8 read = fread(stored, 1, entry.size, fp) == entry.size;
+
+    ArStr blob = {0};
+    if (read && !(entry.flags & PACK_ENTRY_FLAG_COMPRESSED)) {
+        blob = ar_str_push_copy(arena, ar_str(stored, entry.size));
+    } else if (read) {
+        U8 *raw = ar_arena_push_arr_no_zero(arena, U8, entry.raw_size);
+        if (pack_decompress(dictionary, ar_str(stored, entry.size), raw, entry.raw_size)) {
+            blob = ar_str(raw, entry.raw_size);
+        }
+    }
+
+    ar_scratch_release(&scratch);
+    return blob;
+}
+
+// Plans where every live blob goes when the pack is rewritten, starting at
+// 'start'. Blobs of a usage group are placed together starting on a new
+// 'page_size' page, in the order they're first used, so loading the group
+// reads a few contiguous pages. Blobs no group uses follow in their current
+// order. Returns the end of the last blob.
+static U64 plan_layout(ArArena *arena, const Pack *pack, U64 start, const UsageName *usage, U32 usage_count, U32 page_size, U32 *order, U64 *offsets, U32 *count) {
+    U32 entry_count = pack->header.entry_count;
+    B8 *placed = ar_arena_push_arr(arena, B8, entry_count);
+    U64 offset = start;
+    *count = 0;
+
+    B8 in_group = false;
+    U32 group = 0;
+    U64 group_start = 0;
+    for (U32 i = 0; i <= usage_count; i++) {
+        // Report the last group when it ends.
+        if (in_group && (i == usage_count || usage[i].group != group)) {
+            U64 pages = (align_up(offset, page_size) - group_start) / page_size;
+            ar_info("Usage group %u spans %llu pages.", group + 1, (unsigned long long) pages);
+            in_group = false;
+        }
+        if (i == usage_count) {
+            break;
+        }
+
+        for (U32 j = 0; j < entry_count; j++) {
+            PackEntry entry = pack->entries[j];
+            if (placed[j] || !is_live_blob(entry) ||
+                    !usage_matches(usage[i].name, entry_name(pack, entry))) {
+                continue;
+            }
+            if (!in_group) {
+                in_group = true;
+                group = usage[i].group;
+                offset = align_up(offset, page_size);
+                group_start = offset;
+            }
+            placed[j] = true;
+            order[*count] = j;
+            offsets[*count] = align_up(offset, PACK_BLOB_ALIGNMENT);
+            offset = offsets[*count] + entry.size;
+            (*count)++;
+        }
+    }
+
+    if (*count > 0) {
+        offset = align_up(offset, page_size);
+    }
+    for (U32 j = 0; j < entry_count; j++) {
+        if (placed[j] || !is_live_blob(pack->entries[j])) {
+            continue;
+        }
+        order[*count] = j;
+        offsets[*count] = align_up(offset, PACK_BLOB_ALIGNMENT);
+        offset = offsets[*count] + pack->entries[j].size;
+        (*count)++;
+    }
+
+    return offset;
+}
+
+// Where blobs start, after the dictionary if there is one.
+static U64 blobs_start(const Pack *pack) {
+    PackEntry *dictionary = find_dictionary(pack);
+    if (dictionary == NULL) {
+        return sizeof(PackHeader);
+    }
+    return dictionary->offset + dictionary->size;
+}
+
+// Rewrites the live blobs of the pack without tombstones, in the order the
+// usage asks for, usage groups aligned to 'page_size'. With 'compress' set
+// a new dictionary is trained over the blobs and stored first. The pack is
+// written next to the old one first so a failed rewrite leaves the old pack
+// intact.
+static B8 rewrite(ArArena *arena, FILE *fp, Pack *pack, const char *path, const UsageName *usage, U32 usage_count, U32 page_size, B8 compress) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    PackEntry *old_dictionary = find_dictionary(pack);
+    ArStr dictionary = {0};
+    if (old_dictionary != NULL) {
+        dictionary = read_blob(scratch.arena, fp, *old_dictionary, dictionary);
+    }
+
+    // The live blobs as they were added, with the size they'll be stored at.
+    Pack live = {
+        .header = pack->header,
+        .entries = ar_arena_push_arr_no_zero(scratch.arena, PackEntry, pack->header.entry_count),
+        .names = pack->names,
+        .names_len = pack->names_len,
+    };
+    live.header.entry_count = 0;
+    U64 raw_len = 0;
+    for (U32 i = 0; i < pack->header.entry_count; i++) {
+        PackEntry entry = pack->entries[i];
+        if (is_live_blob(entry)) {
+            live.entries[live.header.entry_count] = entry;
+            live.header.entry_count++;
+            raw_len += entry.raw_size;
+        }
+    }
+    // Where the live blobs are read from.
+    PackEntry *sources = ar_arena_push_arr_no_zero(scratch.arena, PackEntry, live.header.entry_count);
+    memcpy(sources, live.entries, live.header.entry_count * sizeof(PackEntry));
+
+    // Blobs are read one at a time, only the training sample and the
+    // compressed blobs are held in memory at once. The sample is spread
+    // evenly over the pack.
+    ArStr new_dictionary = {0};
+    if (compress) {
+        U32 stride = raw_len / PACK_TRAINING_SAMPLE_SIZE + 1;
+        ArTemp temp = ar_temp_begin(scratch.arena);
+        ArStr *samples = ar_arena_push_arr_no_zero(temp.arena, ArStr, live.header.entry_count / stride + 1);
+        U32 sample_count = 0;
+        for (U32 i = 0; i < live.header.entry_count; i += stride) {
+            samples[sample_count] = read_blob(temp.arena, fp, sources[i], dictionary);
+            sample_count++;
+        }
+        new_dictionary = pack_train_dictionary(arena, samples, sample_count);
+        ar_temp_end(&temp);
+    }
+
+    // Compressed blobs are kept for writing, uncompressed ones are read
+    // again when they're written.
+    ArStr *stored = ar_arena_push_arr(scratch.arena, ArStr, live.header.entry_count);
+    U64 stored_len = 0;
+    for (U32 i = 0; i < live.header.entry_count; i++) {
+        PackEntry *entry = &live.entries[i];
+        if (new_dictionary.len != 0) {
+            ArTemp temp = ar_temp_begin(scratch.arena);
+            ArStr raw = read_blob(temp.arena, fp, sources[i], dictionary);
+            if (raw.len != entry->raw_size) {
+                ar_error("%s: Failed to read a blob while rewriting.", path);
+                ar_temp_end(&temp);
+                ar_scratch_release(&scratch);
+                return false;
+            }
+            ArStr compressed = pack_compress(temp.arena, new_dictionary, raw);
+            if (compressed.len != 0) {
+                stored[i] = ar_str_push_copy(arena, compressed);
+            }
+            ar_temp_end(&temp);
+        }
+
+        entry->flags &= ~PACK_ENTRY_FLAG_COMPRESSED;
+        entry->size = entry->raw_size;
+        if (stored[i].len != 0) {
+            entry->flags |= PACK_ENTRY_FLAG_COMPRESSED;
+            entry->size = stored[i].len;
+        }
+        stored_len += entry->size;
+    }
+
+    U64 start = sizeof(PackHeader);
+    if (new_dictionary.len != 0) {
+        start += new_dictionary.len;
+    }
+    U32 *order = ar_arena_push_arr_no_zero(scratch.arena, U32, live.header.entry_count);
+    U64 *offsets = ar_arena_push_arr_no_zero(scratch.arena, U64, live.header.entry_count);
+    U32 count = 0;
+    U64 end = plan_layout(scratch.arena, &live, start, usage, usage_count, page_size, order, offsets, &count);
+
+    const char *temp_path = ar_str_to_cstr(scratch.arena, ar_str_pushf(scratch.arena, "%s.tmp", path));
+    FILE *out = fopen(temp_path, "w+b");
+    if (out == NULL) {
+        ar_error("Failed to open file %s.", temp_path);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    Pack rewritten = {
+        .header = pack->header,
+        .entries = ar_arena_push_arr_no_zero(scratch.arena, PackEntry, count + 1),
+        .names = ar_arena_push_arr_no_zero(scratch.arena, U8, pack->names_len),
+    };
+    rewritten.header.entry_count = 0;
+    rewritten.header.dead_index_bytes = 0;
+    rewritten.header.page_size = page_size;
+    fwrite(&rewritten.header, sizeof(PackHeader), 1, out);
+    U64 offset = sizeof(PackHeader);
+
+    if (new_dictionary.len != 0) {
+        fwrite(new_dictionary.data, 1, new_dictionary.len, out);
+        rewritten.entries[0] = (PackEntry) {
+            .offset = offset,
+            .size = new_dictionary.len,
+            .raw_size = new_dictionary.len,
+            .hash = ar_fvn1a_hash(new_dictionary.data, new_dictionary.len),
+            .flags = PACK_ENTRY_FLAG_DICTIONARY,
+        };
+        rewritten.header.entry_count++;
+        offset += new_dictionary.len;
+    }
+
+    for (U32 i = 0; i < count; i++) {
+        PackEntry entry = live.entries[order[i]];
+        ArStr data = stored[order[i]];
+        ArTemp temp = ar_temp_begin(scratch.arena);
+        if (data.len == 0) {
+            data = read_blob(temp.arena, fp, sources[order[i]], dictionary);
+            if (data.len != entry.raw_size) {
+                ar_error("%s: Failed to read a blob while rewriting.", path);
+                ar_temp_end(&temp);
+                fclose(out);
+                remove(temp_path);
+                ar_scratch_release(&scratch);
+                return false;
+            }
+        }
+
+        write_padding(out, offsets[i] - offset);
+        fwrite(data.data, 1, data.len, out);
+        offset = offsets[i] + data.len;
+        ar_temp_end(&temp);
+
+        ArStr name = entry_name(&live, entry);
+        memcpy(&rewritten.names[rewritten.names_len], name.data, name.len);
+        entry.name_offset = rewritten.names_len;
+        entry.offset = offsets[i];
+        rewritten.names_len += name.len;
+        rewritten.entries[rewritten.header.entry_count] = entry;
+        rewritten.header.entry_count++;
+    }
+    rewritten.header.index_offset = align_up(end, PACK_BLOB_ALIGNMENT);
+    write_padding(out, rewritten.header.index_offset - offset);
+
+    B8 written = write_index(out, &rewritten);
+    written &= fclose(out) == 0;
+    if (!written || rename(temp_path, path) != 0) {
+        ar_error("%s: Failed to rewrite the pack.", path);
+        remove(temp_path);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    ar_info("%s: Rewrote %llu bytes of blobs as %llu.", path,
+            (unsigned long long) pack->header.index_offset,
+            (unsigned long long) rewritten.header.index_offset);
+    if (new_dictionary.len != 0) {
+        ar_info("%s: Compressed %llu bytes of SPIR-V to %llu with a %llu byte dictionary.", path,
+                (unsigned long long) raw_len,
+                (unsigned long long) stored_len,
+                (unsigned long long) new_dictionary.len);
+    }
+    ar_scratch_release(&scratch);
+    return true;
+}
+
+// Opens the pack, creating it if needed, and waits for the lock on it. A
+// compaction holding the lock replaces the file, the new one is locked
+// then.
+static FILE *open_locked(const char *path) {
+    for (;;) {
+        I32 fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return NULL;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+            close(fd);
+            return NULL;
+        }
+
+        struct stat opened;
+        struct stat current;
+        if (fstat(fd, &opened) == 0 && stat(path, &current) == 0 &&
+                opened.st_dev == current.st_dev && opened.st_ino == current.st_ino) {
+            FILE *fp = fdopen(fd, "r+b");
+            if (fp == NULL) {
+                close(fd);
+            }
+            return fp;
+        }
+        close(fd);
+    }
+}
+
+B8 pack_update(ArArena *arena, ArStr path, const PackBlob *blobs, U32 blob_count, PackOptions options) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    if (options.page_size == 0) {
+        options.page_size = PACK_PAGE_SIZE;
+    }
+
+    const char *cpath = ar_str_to_cstr(scratch.arena, path);
+    FILE *fp = open_locked(cpath);
+    if (fp == NULL) {
+        ar_error("Failed to open file %s.", cpath);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+    // Closing the file releases the lock, the rename of a compaction
+    // happens before.
+    fseek(fp, 0, SEEK_END);
+    B8 created = ftell(fp) == 0;
+    fseek(fp, 0, SEEK_SET);
+
+    Pack pack = {
+        .header = {
+            .magic = PACK_MAGIC,
+            .version = PACK_VERSION,
+            .index_offset = sizeof(PackHeader),
+            .page_size = options.page_size,
+        },
+    };
+    if (!created && !read_pack(scratch.arena, fp, &pack)) {
+        ar_error("%s: Not a valid shader pack.", cpath);
+        fclose(fp);
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    // New blobs are compressed against the dictionary the pack already
+    // has, a new one is only trained when the pack is rewritten.
+    ArStr dictionary = {0};
+    PackEntry *dictionary_entry = find_dictionary(&pack);
+    if (options.compress && dictionary_entry != NULL) {
+        dictionary = read_blob(scratch.arena, fp, *dictionary_entry, dictionary);
+    }
+
+    // The old index stays intact until the new header is written.
+    U64 old_index_offset = pack.header.index_offset;
+    U64 old_index_end = old_index_offset + (U64) pack.header.entry_count * sizeof(PackEntry) + pack.names_len;
+
+    // Room for every blob being new.
+    U32 capacity = pack.header.entry_count + blob_count;
+    PackEntry *entries = ar_arena_push_arr_no_zero(scratch.arena, PackEntry, capacity);
+    memcpy(entries, pack.entries, pack.header.entry_count * sizeof(PackEntry));
+    pack.entries = entries;
+    U64 names_capacity = pack.names_len;
+    for (U32 i = 0; i < blob_count; i++) {
+        names_capacity += blobs[i].name.len;
+    }
+    U8 *names = ar_arena_push_arr_no_zero(scratch.arena, U8, names_capacity);
+    memcpy(names, pack.names, pack.names_len);
+    pack.names = names;
+
+    // New blobs go after the old index, the new index follows them.
+    U64 offset = old_index_end;
+    U32 appended = 0;
+    for (U32 i = 0; i < blob_count; i++) {
+        PackBlob blob = blobs[i];
+        U64 hash = ar_fvn1a_hash(blob.data.data, blob.data.len);
+
+        PackEntry *existing = NULL;
+        for (U32 j = 0; j < pack.header.entry_count; j++) {
+            PackEntry *entry = &pack.entries[j];
+            if (is_live_blob(*entry) &&
+                    ar_str_match(entry_name(&pack, *entry), blob.name, AR_STR_MATCH_FLAG_EXACT)) {
+                existing = entry;
+                break;
+            }
+        }
+        if (existing != NULL && existing->hash == hash && existing->raw_size == blob.data.len) {
+            continue;
+        }
+
+        U32 name_offset = pack.names_len;
+        if (existing != NULL) {
+            existing->flags |= PACK_ENTRY_FLAG_TOMBSTONE;
+            name_offset = existing->name_offset;
+        } else {
+            memcpy(&pack.names[pack.names_len], blob.name.data, blob.name.len);
+            pack.names_len += blob.name.len;
+        }
+
+        ArStr data = blob.data;
+        U32 flags = 0;
+        if (dictionary.len != 0) {
+            ArStr compressed = pack_compress(scratch.arena, dictionary, blob.data);
+            if (compressed.len != 0) {
+                data = compressed;
+                flags = PACK_ENTRY_FLAG_COMPRESSED;
+            }
+        }
+
+        U64 aligned = align_up(offset, PACK_BLOB_ALIGNMENT);
+        fseek(fp, offset, SEEK_SET);
+        write_padding(fp, aligned - offset);
+        fwrite(data.data, 1, data.len, fp);
+        offset = aligned + data.len;
+
+        pack.entries[pack.header.entry_count] = (PackEntry) {
+            .offset = aligned,
+            .size = data.len,
+            .raw_size = blob.data.len,
+            .hash = hash,
+            .name_offset = name_offset,
+            .name_len = blob.name.len,
+            .flags = flags,
+        };
+        pack.header.entry_count++;
+        appended++;
+    }
+
+    B8 written = true;
+    if (appended > 0 || created) {
+        U64 index_offset = align_up(offset, PACK_BLOB_ALIGNMENT);
+        fseek(fp, offset, SEEK_SET);
+        write_padding(fp, index_offset - offset);
+        pack.header.index_offset = index_offset;
+        pack.header.dead_index_bytes += old_index_end - old_index_offset;
+        written = write_index(fp, &pack);
+        if (!written) {
+            ar_error("%s: Failed to write the pack.", cpath);
+        }
+    }
+
+    U64 data_len = pack.header.index_offset - sizeof(PackHeader);
+    U64 dead = dead_bytes(&pack);
+    F32 fragmentation = data_len == 0 ? 0.0f : (F32) dead / data_len;
+    ar_info("%s: %u of %u blobs updated, %.1f%% of the pack is dead.",
+            cpath, appended, blob_count, fragmentation * 100.0f);
+
+    if (written && options.compact) {
+        U32 usage_count = 0;
+        UsageName *usage_names = parse_usage(scratch.arena, options.usage, &usage_count);
+
+        U32 *order = ar_arena_push_arr_no_zero(scratch.arena, U32, pack.header.entry_count);
+        U64 *offsets = ar_arena_push_arr_no_zero(scratch.arena, U64, pack.header.entry_count);
+        U32 count = 0;
+        plan_layout(scratch.arena, &pack, blobs_start(&pack), usage_names, usage_count, options.page_size, order, offsets, &count);
+
+        // Laid out differently than the usage asks for.
+        B8 reorder = false;
+        for (U32 i = 0; i < count && usage_count > 0; i++) {
+            reorder |= pack.entries[order[i]].offset != offsets[i];
+        }
+        // Compression was turned on or off since the last rewrite.
+        B8 recompress = options.compress != (find_dictionary(&pack) != NULL);
+        // Laid out for a different page size.
+        B8 repage = pack.header.page_size != options.page_size;
+
+        if (fragmentation > PACK_COMPACT_THRESHOLD || reorder || recompress || repage) {
+            written = rewrite(scratch.arena, fp, &pack, cpath, usage_names, usage_count, options.page_size, options.compress);
+        }
+    }
+
+    fclose(fp);
+    ar_scratch_release(&scratch);
+    return written;
+}
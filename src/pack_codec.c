@@ -0,0 +1,340 @@
+#include "arkin_core.h"
+#include "pack_format.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Blobs are compressed word by word against a dictionary shared by the
+// whole pack. Modules compiled by the same compiler repeat the same
+// capabilities, imports, types and decorations, often with the same ids, so
+// the dictionary is made of the instructions found in most blobs and every
+// blob is LZ compressed with the dictionary as the start of its window.
+//
+// A compressed blob is a sequence of
+//
+//     varint literal_count, literal words
+//     varint match_length - PACK_MIN_MATCH, varint distance - 1
+//
+// ending after the literals that complete the blob. Distances are in words
+// and reach back into the dictionary past the start of the blob.
+
+#define PACK_MIN_MATCH 2
+#define SPIRV_MAGIC 0x07230203
+#define HASH_BITS 14
+#define MAX_CHAIN 32
+
+//
+// Training
+//
+
+typedef struct Candidate Candidate;
+struct Candidate {
+    const U32 *words;
+    U32 word_count;
+    U64 hash;
+    // Number of blobs containing the instruction.
+    U32 blob_count;
+    // Last blob the instruction was counted for.
+    U32 last_blob;
+    // Order of first appearance, instructions seen next to each other stay
+    // next to each other for longer matches.
+    U32 first_seen;
+    B8 selected;
+};
+
+static B8 is_spirv(ArStr blob) {
+    return blob.len >= 5 * sizeof(U32) && blob.len % sizeof(U32) == 0 &&
+        ((const U32 *) blob.data)[0] == SPIRV_MAGIC;
+}
+
+static B8 same_words(const U32 *a, const U32 *b, U32 count) {
+    return memcmp(a, b, count * sizeof(U32)) == 0;
+}
+
+static I32 compare_by_score(const void *a, const void *b) {
+    const Candidate *_a = *(const Candidate **) a;
+    const Candidate *_b = *(const Candidate **) b;
+    U64 score_a = (U64) (_a->blob_count - 1) * _a->word_count;
+    U64 score_b = (U64) (_b->blob_count - 1) * _b->word_count;
+    if (score_a != score_b) {
+        return score_a > score_b ? -1 : 1;
+    }
+    return (_a->first_seen > _b->first_seen) - (_a->first_seen < _b->first_seen);
+}
+
+ArStr pack_train_dictionary(ArArena *arena, const ArStr *blobs, U32 blob_count) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // Whole blobs are sampled until the sample size is reached, which bounds
+    // the table below no matter how large the pack is.
+    U32 sample_count = 0;
+    U64 sample_words = 0;
+    U32 instruction_count = 0;
+    while (sample_count < blob_count && sample_words < PACK_TRAINING_SAMPLE_SIZE / sizeof(U32)) {
+        ArStr blob = blobs[sample_count];
+        sample_count++;
+        if (!is_spirv(blob)) {
+            continue;
+        }
+        const U32 *words = (const U32 *) blob.data;
+        U32 word_count = blob.len / sizeof(U32);
+        U32 j = 5;
+        while (j < word_count && (words[j] >> 16) != 0) {
+            instruction_count++;
+            j += words[j] >> 16;
+        }
+        sample_words += word_count;
+    }
+
+    // Open addressing over every distinct instruction, kept at most half
+    // full.
+    U32 slot_count = 64;
+    while (slot_count < instruction_count * 2) {
+        slot_count *= 2;
+    }
+    Candidate *slots = ar_arena_push_arr(scratch.arena, Candidate, slot_count);
+    U32 candidate_count = 0;
+
+    for (U32 i = 0; i < sample_count; i++) {
+        if (!is_spirv(blobs[i])) {
+            continue;
+        }
+        const U32 *words = (const U32 *) blobs[i].data;
+        U32 word_count = blobs[i].len / sizeof(U32);
+
+        U32 j = 5;
+        while (j < word_count) {
+            U32 len = words[j] >> 16;
+            if (len == 0 || j + len > word_count) {
+                break;
+            }
+
+            U64 hash = ar_fvn1a_hash(&words[j], len * sizeof(U32));
+            U32 slot = hash & (slot_count - 1);
+            while (slots[slot].words != NULL &&
+                    !(slots[slot].hash == hash && slots[slot].word_count == len &&
+                        same_words(slots[slot].words, &words[j], len))) {
+                slot = (slot + 1) & (slot_count - 1);
+            }
+
+            Candidate *candidate = &slots[slot];
+            if (candidate->words == NULL) {
+                *candidate = (Candidate) {
+                    .words = &words[j],
+                    .word_count = len,
+                    .hash = hash,
+                    .blob_count = 1,
+                    .last_blob = i,
+                    .first_seen = candidate_count,
+                };
+                candidate_count++;
+            } else if (candidate->last_blob != i) {
+                candidate->blob_count++;
+                candidate->last_blob = i;
+            }
+            j += len;
+        }
+    }
+
+    // Instructions only one blob uses gain nothing from the dictionary.
+    Candidate **shared = ar_arena_push_arr_no_zero(scratch.arena, Candidate *, candidate_count);
+    U32 shared_count = 0;
+    for (U32 i = 0; i < slot_count; i++) {
+        if (slots[i].words != NULL && slots[i].blob_count > 1) {
+            shared[shared_count] = &slots[i];
+            shared_count++;
+        }
+    }
+    qsort(shared, shared_count, sizeof(Candidate *), compare_by_score);
+
+    U32 dictionary_words = 0;
+    for (U32 i = 0; i < shared_count; i++) {
+        if (dictionary_words + shared[i]->word_count > PACK_DICTIONARY_SIZE / sizeof(U32)) {
+            continue;
+        }
+        shared[i]->selected = true;
+        dictionary_words += shared[i]->word_count;
+    }
+
+    // Instructions keep the order they were first seen in, neighbours in a
+    // module stay neighbours and matches can run across them.
+    Candidate **ordered = ar_arena_push_arr(scratch.arena, Candidate *, candidate_count);
+    for (U32 i = 0; i < slot_count; i++) {
+        if (slots[i].selected) {
+            ordered[slots[i].first_seen] = &slots[i];
+        }
+    }
+    U32 *dictionary = ar_arena_push_arr_no_zero(arena, U32, dictionary_words);
+    U32 written = 0;
+    for (U32 i = 0; i < candidate_count; i++) {
+        if (ordered[i] != NULL) {
+            memcpy(&dictionary[written], ordered[i]->words, ordered[i]->word_count * sizeof(U32));
+            written += ordered[i]->word_count;
+        }
+    }
+
+    ar_scratch_release(&scratch);
+    return ar_str((U8 *) dictionary, dictionary_words * sizeof(U32));
+}
+
+//
+// Compression
+//
+
+static U64 write_varint(U8 *out, U64 value) {
+    U64 len = 0;
+    while (value >= 0x80) {
+        out[len] = (value & 0x7f) | 0x80;
+        value >>= 7;
+        len++;
+    }
+    out[len] = value;
+    return len + 1;
+}
+
+static B8 read_varint(ArStr in, U64 *offset, U64 *value) {
+    *value = 0;
+    for (U32 shift = 0; shift < 64; shift += 7) {
+        if (*offset >= in.len) {
+            return false;
+        }
+        U8 byte = in.data[*offset];
+        (*offset)++;
+        *value |= (U64) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static U32 hash_pair(const U32 *words) {
+    U64 hash = ((U64) words[0] << 32 | words[1]) * 0x9e3779b97f4a7c15ull;
+    return hash >> (64 - HASH_BITS);
+}
+
+ArStr pack_compress(ArArena *arena, ArStr dictionary, ArStr data) {
+    if (data.len % sizeof(U32) != 0 || dictionary.len % sizeof(U32) != 0) {
+        return (ArStr) {0};
+    }
+
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // The window is the dictionary followed by the blob.
+    U32 dictionary_count = dictionary.len / sizeof(U32);
+    U32 data_count = data.len / sizeof(U32);
+    U32 window_count = dictionary_count + data_count;
+    U32 *window = ar_arena_push_arr_no_zero(scratch.arena, U32, window_count);
+    memcpy(window, dictionary.data, dictionary.len);
+    memcpy(&window[dictionary_count], data.data, data.len);
+
+    // Position + 1 of the last and previous occurrences of a word pair.
+    U32 *head = ar_arena_push_arr(scratch.arena, U32, 1 << HASH_BITS);
+    U32 *chain = ar_arena_push_arr_no_zero(scratch.arena, U32, window_count);
+    for (U32 i = 0; i + 1 < dictionary_count; i++) {
+        U32 hash = hash_pair(&window[i]);
+        chain[i] = head[hash];
+        head[hash] = i + 1;
+    }
+
+    // Every token is at least two words of input, or the final literals.
+    U64 capacity = data.len + (data_count / 2 + 2) * 3 * 10;
+    U8 *out = ar_arena_push_arr_no_zero(scratch.arena, U8, capacity);
+    U64 out_len = 0;
+
+    U32 literal_start = dictionary_count;
+    U32 i = dictionary_count;
+    while (i < window_count) {
+        U32 best_len = 0;
+        U32 best_pos = 0;
+        if (i + 1 < window_count) {
+            U32 hash = hash_pair(&window[i]);
+            U32 candidate = head[hash];
+            for (U32 depth = 0; candidate != 0 && depth < MAX_CHAIN; depth++) {
+                U32 pos = candidate - 1;
+                U32 len = 0;
+                while (i + len < window_count && window[pos + len] == window[i + len]) {
+                    len++;
+                }
+                if (len > best_len) {
+                    best_len = len;
+                    best_pos = pos;
+                }
+                candidate = chain[pos];
+            }
+            chain[i] = head[hash];
+            head[hash] = i + 1;
+        }
+
+        if (best_len < PACK_MIN_MATCH) {
+            i++;
+            continue;
+        }
+
+        U32 literal_count = i - literal_start;
+        out_len += write_varint(&out[out_len], literal_count);
+        memcpy(&out[out_len], &window[literal_start], literal_count * sizeof(U32));
+        out_len += literal_count * sizeof(U32);
+        out_len += write_varint(&out[out_len], best_len - PACK_MIN_MATCH);
+        out_len += write_varint(&out[out_len], i - best_pos - 1);
+
+        // Only the first pair of a match is indexed, enough for the
+        // repetition inside a module.
+        i += best_len;
+        literal_start = i;
+    }
+    U32 literal_count = window_count - literal_start;
+    out_len += write_varint(&out[out_len], literal_count);
+    memcpy(&out[out_len], &window[literal_start], literal_count * sizeof(U32));
+    out_len += literal_count * sizeof(U32);
+
+    ArStr compressed = {0};
+    if (out_len < data.len) {
+        compressed = ar_str_push_copy(arena, ar_str(out, out_len));
+    }
+
+    ar_scratch_release(&scratch);
+    return compressed;
+}
+
+B8 pack_decompress(ArStr dictionary, ArStr compressed, U8 *out, U64 raw_size) {
+    const U32 *dictionary_words = (const U32 *) dictionary.data;
+    U64 dictionary_count = dictionary.len / sizeof(U32);
+    U32 *words = (U32 *) out;
+    U64 word_count = raw_size / sizeof(U32);
+
+    U64 offset = 0;
+    U64 i = 0;
+    for (;;) {
+        U64 literal_count;
+        if (!read_varint(compressed, &offset, &literal_count) ||
+                literal_count > word_count - i ||
+                literal_count * sizeof(U32) > compressed.len - offset) {
+            return false;
+        }
+        memcpy(&words[i], &compressed.data[offset], literal_count * sizeof(U32));
+        offset += literal_count * sizeof(U32);
+        i += literal_count;
+        if (i == word_count) {
+            return offset == compressed.len;
+        }
+
+        U64 len;
+        U64 distance;
+        if (!read_varint(compressed, &offset, &len) || !read_varint(compressed, &offset, &distance)) {
+            return false;
+        }
+        len += PACK_MIN_MATCH;
+        distance++;
+        if (len > word_count - i || distance > dictionary_count + i) {
+            return false;
+        }
+
+        // Matches may overlap what they produce.
+        for (U64 j = 0; j < len; j++) {
+            U64 from = dictionary_count + i - distance;
+            words[i] = from < dictionary_count ? dictionary_words[from] : words[from - dictionary_count];
+            i++;
+        }
+    }
+}
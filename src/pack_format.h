@@ -0,0 +1,75 @@
+#pragma once
+
+#include "arkin_core.h"
+
+// Layout of shader packs, shared by the tool writing them and the runtime
+// loader.
+//
+//     PackHeader
+//     blobs, each aligned to PACK_BLOB_ALIGNMENT
+//     index: PackEntry[entry_count] followed by the entry names
+//
+// Indexes replaced by an update stay between the blobs as dead bytes until
+// the pack is compacted.
+//
+// Integers are stored in the byte order of the machine that wrote the pack,
+// the same as the SPIR-V in it.
+
+#define PACK_MAGIC 0x4b415053
+#define PACK_VERSION 2
+
+typedef struct PackHeader PackHeader;
+struct PackHeader {
+    U32 magic;
+    U32 version;
+    U64 index_offset;
+    U32 entry_count;
+    U32 flags;
+    // Bytes of replaced indexes between the blobs.
+    U64 dead_index_bytes;
+    // Alignment of usage groups, a power of two at least as large as the
+    // page size of the devices loading the pack.
+    U32 page_size;
+    U32 reserved;
+};
+
+#define PACK_BLOB_ALIGNMENT 8
+// Upper bound of the shared compression dictionary.
+#define PACK_DICTIONARY_SIZE (32 * 1024)
+// Upper bound of the SPIR-V the dictionary is trained on, about a hundred
+// times the dictionary like zstd's trainers sample.
+#define PACK_TRAINING_SAMPLE_SIZE (100 * PACK_DICTIONARY_SIZE)
+
+typedef enum {
+    // Replaced by a later entry of the same name, its bytes are dead.
+    PACK_ENTRY_FLAG_TOMBSTONE = 1 << 0,
+    // Compressed against the dictionary.
+    PACK_ENTRY_FLAG_COMPRESSED = 1 << 1,
+    // The dictionary itself, nameless and never compressed.
+    PACK_ENTRY_FLAG_DICTIONARY = 1 << 2,
+} PackEntryFlags;
+
+typedef struct PackEntry PackEntry;
+struct PackEntry {
+    U64 offset;
+    // Size in the pack.
+    U64 size;
+    // Size of the blob once loaded.
+    U64 raw_size;
+    U64 hash;
+    U32 name_offset;
+    U32 name_len;
+    U32 flags;
+    U32 reserved;
+};
+
+// Builds a dictionary of the instructions most blobs share. Only the first
+// blobs up to PACK_TRAINING_SAMPLE_SIZE are looked at, callers pass a
+// sample spread over the pack.
+extern ArStr pack_train_dictionary(ArArena *arena, const ArStr *blobs, U32 blob_count);
+// Returns 'data' compressed against 'dictionary', or an empty string if it
+// doesn't get any smaller.
+extern ArStr pack_compress(ArArena *arena, ArStr dictionary, ArStr data);
+// Decompresses into 'out' which has room for the 'raw_size' bytes the blob
+// had. Returns false if the data is corrupt.
+extern B8 pack_decompress(ArStr dictionary, ArStr compressed, U8 *out, U64 raw_size);
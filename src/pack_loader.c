@@ -0,0 +1,271 @@
+#include "arkin_core.h"
+#include "pack_format.h"
+#include "shader_pack.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Blobs stored uncompressed are returned straight from the mapping, the
+// rest are decompressed into their own allocation by whichever thread asks
+// for them first while any other thread asking waits for it.
+
+typedef enum {
+    BLOB_STATE_UNLOADED,
+    BLOB_STATE_LOADING,
+    BLOB_STATE_READY,
+    BLOB_STATE_FAILED,
+} BlobState;
+
+typedef struct LoadedBlob LoadedBlob;
+struct LoadedBlob {
+    const PackEntry *entry;
+    ArStr name;
+    // BlobState, only accessed atomically.
+    U32 state;
+    ArStr data;
+};
+
+struct ShaderPack {
+    const U8 *map;
+    U64 map_len;
+    ArStr dictionary;
+
+    LoadedBlob *blobs;
+    U32 blob_count;
+    // Open addressing over 'blobs' by name, index + 1 and 0 is empty.
+    U32 *slots;
+    U32 slot_count;
+};
+
+static U32 find_slot(const ShaderPack *pack, ArStr name) {
+    U32 mask = pack->slot_count - 1;
+    U32 slot = ar_fvn1a_hash(name.data, name.len) & mask;
+    while (pack->slots[slot] != 0 &&
+            !ar_str_match(pack->blobs[pack->slots[slot] - 1].name, name, AR_STR_MATCH_FLAG_EXACT)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static LoadedBlob *find_blob(const ShaderPack *pack, ArStr name) {
+    U32 index = pack->slots[find_slot(pack, name)];
+    return index == 0 ? NULL : &pack->blobs[index - 1];
+}
+
+// Checks the index so nothing read later can point outside of the mapping.
+static B8 validate(const U8 *map, U64 map_len) {
+    if (map_len < sizeof(PackHeader)) {
+        return false;
+    }
+    const PackHeader *header = (const PackHeader *) map;
+    if (header->magic != PACK_MAGIC || header->version != PACK_VERSION ||
+            header->index_offset % PACK_BLOB_ALIGNMENT != 0 ||
+            header->page_size == 0 || (header->page_size & (header->page_size - 1)) != 0 ||
+            header->index_offset > map_len ||
+            (U64) header->entry_count * sizeof(PackEntry) > map_len - header->index_offset) {
+        return false;
+    }
+
+    const PackEntry *entries = (const PackEntry *) &map[header->index_offset];
+    U64 names_offset = header->index_offset + (U64) header->entry_count * sizeof(PackEntry);
+    for (U32 i = 0; i < header->entry_count; i++) {
+        PackEntry entry = entries[i];
+        if (entry.offset > header->index_offset || entry.size > header->index_offset - entry.offset ||
+                (U64) entry.name_offset + entry.name_len > map_len - names_offset) {
+            return false;
+        }
+        if (!(entry.flags & PACK_ENTRY_FLAG_COMPRESSED) && entry.size != entry.raw_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ShaderPack *shader_pack_open(const char *path) {
+    I32 fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    U64 map_len = st.st_size;
+    void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive.
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (!validate(map, map_len)) {
+        munmap(map, map_len);
+        return NULL;
+    }
+
+    const PackHeader *header = map;
+    const PackEntry *entries = (const PackEntry *) ((const U8 *) map + header->index_offset);
+    const U8 *names = (const U8 *) &entries[header->entry_count];
+
+    ShaderPack *pack = calloc(1, sizeof(ShaderPack));
+    pack->map = map;
+    pack->map_len = map_len;
+    pack->blobs = calloc(header->entry_count, sizeof(LoadedBlob));
+    pack->slot_count = 16;
+    while (pack->slot_count < header->entry_count * 2) {
+        pack->slot_count *= 2;
+    }
+    pack->slots = calloc(pack->slot_count, sizeof(U32));
+
+    for (U32 i = 0; i < header->entry_count; i++) {
+        const PackEntry *entry = &entries[i];
+        if (entry->flags & PACK_ENTRY_FLAG_TOMBSTONE) {
+            continue;
+        }
+        if (entry->flags & PACK_ENTRY_FLAG_DICTIONARY) {
+            pack->dictionary = ar_str((U8 *) &pack->map[entry->offset], entry->size);
+            continue;
+        }
+
+        LoadedBlob *blob = &pack->blobs[pack->blob_count];
+        *blob = (LoadedBlob) {
+            .entry = entry,
+            .name = ar_str((U8 *) &names[entry->name_offset], entry->name_len),
+        };
+        if (!(entry->flags & PACK_ENTRY_FLAG_COMPRESSED)) {
+            blob->state = BLOB_STATE_READY;
+            blob->data = ar_str((U8 *) &pack->map[entry->offset], entry->size);
+        }
+
+        U32 slot = find_slot(pack, blob->name);
+        if (pack->slots[slot] != 0) {
+            // Only one live entry per name is ever written.
+            continue;
+        }
+        pack->blob_count++;
+        pack->slots[slot] = pack->blob_count;
+    }
+
+    return pack;
+}
+
+void shader_pack_close(ShaderPack *pack) {
+    if (pack == NULL) {
+        return;
+    }
+    for (U32 i = 0; i < pack->blob_count; i++) {
+        if (pack->blobs[i].entry->flags & PACK_ENTRY_FLAG_COMPRESSED) {
+            free((void *) pack->blobs[i].data.data);
+        }
+    }
+    munmap((void *) pack->map, pack->map_len);
+    free(pack->blobs);
+    free(pack->slots);
+    free(pack);
+}
+
+static ArStr load(ShaderPack *pack, LoadedBlob *blob) {
+    U32 state = __atomic_load_n(&blob->state, __ATOMIC_ACQUIRE);
+    if (state == BLOB_STATE_UNLOADED) {
+        U32 expected = BLOB_STATE_UNLOADED;
+        if (__atomic_compare_exchange_n(&blob->state, &expected, BLOB_STATE_LOADING,
+                    false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            const PackEntry *entry = blob->entry;
+            U8 *data = malloc(entry->raw_size);
+            ArStr compressed = ar_str((U8 *) &pack->map[entry->offset], entry->size);
+            B8 loaded = data != NULL && pack_decompress(pack->dictionary, compressed, data, entry->raw_size);
+            if (loaded) {
+                blob->data = ar_str(data, entry->raw_size);
+            } else {
+                free(data);
+            }
+            __atomic_store_n(&blob->state, loaded ? BLOB_STATE_READY : BLOB_STATE_FAILED, __ATOMIC_RELEASE);
+        }
+    }
+
+    // Another thread is decompressing the blob, which takes microseconds.
+    while ((state = __atomic_load_n(&blob->state, __ATOMIC_ACQUIRE)) == BLOB_STATE_LOADING) {
+        sched_yield();
+    }
+
+    if (state != BLOB_STATE_READY) {
+        return (ArStr) {0};
+    }
+    return blob->data;
+}
+
+ArStr shader_pack_get(ShaderPack *pack, ArStr name) {
+    LoadedBlob *blob = find_blob(pack, name);
+    if (blob == NULL) {
+        return (ArStr) {0};
+    }
+    return load(pack, blob);
+}
+
+typedef struct Prefetch Prefetch;
+struct Prefetch {
+    ShaderPack *pack;
+    LoadedBlob **blobs;
+};
+
+static void prefetch_job(void *data, U32 index) {
+    Prefetch *prefetch = data;
+    load(prefetch->pack, prefetch->blobs[index]);
+}
+
+static I32 compare_by_offset(const void *a, const void *b) {
+    U64 offset_a = (*(const LoadedBlob **) a)->entry->offset;
+    U64 offset_b = (*(const LoadedBlob **) b)->entry->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+void shader_pack_prefetch(ShaderPack *pack, const ArStr *names, U32 count, ShaderPackJobSystem jobs) {
+    LoadedBlob **blobs = malloc(count * sizeof(LoadedBlob *));
+    U32 blob_count = 0;
+    for (U32 i = 0; i < count; i++) {
+        LoadedBlob *blob = find_blob(pack, names[i]);
+        if (blob != NULL) {
+            blobs[blob_count] = blob;
+            blob_count++;
+        }
+    }
+
+    // Uncompressed blobs are ready from the start but still have to be
+    // paged in, every blob gets the advice. Jobs are handed out in pack
+    // order, reads of a usage group stay sequential.
+    qsort(blobs, blob_count, sizeof(LoadedBlob *), compare_by_offset);
+    U64 page_size = sysconf(_SC_PAGESIZE);
+    for (U32 i = 0; i < blob_count; i++) {
+        const PackEntry *entry = blobs[i]->entry;
+        U64 start = entry->offset & ~(page_size - 1);
+        madvise((void *) &pack->map[start], entry->offset + entry->size - start, MADV_WILLNEED);
+    }
+
+    // Only blobs still waiting to be decompressed need a job.
+    U32 job_count = 0;
+    for (U32 i = 0; i < blob_count; i++) {
+        if (__atomic_load_n(&blobs[i]->state, __ATOMIC_ACQUIRE) == BLOB_STATE_UNLOADED) {
+            blobs[job_count] = blobs[i];
+            job_count++;
+        }
+    }
+
+    Prefetch prefetch = {
+        .pack = pack,
+        .blobs = blobs,
+    };
+    if (jobs.run != NULL) {
+        jobs.run(jobs.userdata, prefetch_job, &prefetch, job_count);
+    } else {
+        for (U32 i = 0; i < job_count; i++) {
+            prefetch_job(&prefetch, i);
+        }
+    }
+
+    free(blobs);
+}
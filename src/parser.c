@@ -2,15 +2,21 @@
 #include "arkin_log.h"
 #include "internal.h"
 
+#include <string.h>
+
 typedef struct FileParser FileParser;
 struct FileParser {
     FileParser *next;
 
+    ArStr path;
     ArStr source;
     U32 i;
     U32 token_start;
     U32 token_end;
     U32 last_token_end;
+    // Line of the character at 'line_offset'.
+    U32 line;
+    U32 line_offset;
 };
 
 U8 file_parser_peek(FileParser parser) {
@@ -21,32 +27,159 @@ U8 file_parser_peek_next(FileParser parser) {
     return parser.source.data[parser.i + 1];
 }
 
+// Parts are located in order so lines are counted on from the last call.
+static U32 file_parser_line(FileParser *parser, U32 offset) {
+    while (parser->line_offset < offset) {
+        if (parser->source.data[parser->line_offset] == '\n') {
+            parser->line++;
+        }
+        parser->line_offset++;
+    }
+    return parser->line;
+}
+
 typedef enum {
     MODULE_NONE,
     MODULE_MODULE,
     MODULE_VERT,
     MODULE_FRAG,
+    MODULE_COMP,
 } ModuleType;
 
 typedef struct Module Module;
 struct Module {
     ArStr code;
+    // Pieces 'code' was joined from, each included module is one piece.
+    ArStrList parts;
+    // Per part, whether it's the code of an included module.
+    B8 *included;
     ModuleType type;
+    // Parameters of a generic module, '#include_module' substitutes its
+    // arguments for them.
+    ArStr *params;
+    U32 param_count;
+};
+
+// Module names are interned once and referred to by id everywhere else.
+// Generated libraries can define many thousands of modules so the table
+// uses open addressing over ids and grows instead of chaining.
+typedef U32 SymbolId;
+
+typedef struct Symbol Symbol;
+struct Symbol {
+    ArStr name;
+    U64 hash;
+};
+
+typedef struct SymbolTable SymbolTable;
+struct SymbolTable {
+    ArArena *arena;
+    // Indexed by id, id 0 is never used.
+    Symbol *symbols;
+    Module *modules;
+    U32 count;
+    U32 capacity;
+    // Power of two, at most half full. 0 marks an empty slot.
+    SymbolId *slots;
+    U32 slot_count;
 };
 
+static SymbolTable symbol_table_init(ArArena *arena) {
+    SymbolTable table = {
+        .arena = arena,
+        .count = 1,
+        .capacity = 64,
+        .slot_count = 128,
+    };
+    table.symbols = ar_arena_push_arr(arena, Symbol, table.capacity);
+    table.modules = ar_arena_push_arr(arena, Module, table.capacity);
+    table.slots = ar_arena_push_arr(arena, SymbolId, table.slot_count);
+    return table;
+}
+
+static U32 symbol_slot(const SymbolTable *table, ArStr name, U64 hash) {
+    U32 mask = table->slot_count - 1;
+    U32 slot = hash & mask;
+    while (table->slots[slot] != 0) {
+        const Symbol *symbol = &table->symbols[table->slots[slot]];
+        if (symbol->hash == hash && ar_str_match(symbol->name, name, AR_STR_MATCH_FLAG_EXACT)) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void symbol_table_grow(SymbolTable *table) {
+    U32 capacity = table->capacity * 2;
+    Symbol *symbols = ar_arena_push_arr(table->arena, Symbol, capacity);
+    Module *modules = ar_arena_push_arr(table->arena, Module, capacity);
+    memcpy(symbols, table->symbols, table->count * sizeof(Symbol));
+    memcpy(modules, table->modules, table->count * sizeof(Module));
+    table->symbols = symbols;
+    table->modules = modules;
+    table->capacity = capacity;
+
+    table->slot_count = capacity * 2;
+    table->slots = ar_arena_push_arr(table->arena, SymbolId, table->slot_count);
+    for (SymbolId id = 1; id < table->count; id++) {
+        Symbol symbol = table->symbols[id];
+        table->slots[symbol_slot(table, symbol.name, symbol.hash)] = id;
+    }
+}
+
+// Returns 0 if the name has never been interned.
+static SymbolId symbol_find(const SymbolTable *table, ArStr name) {
+    U64 hash = ar_fvn1a_hash(name.data, name.len);
+    return table->slots[symbol_slot(table, name, hash)];
+}
+
+static SymbolId symbol_intern(SymbolTable *table, ArStr name) {
+    U64 hash = ar_fvn1a_hash(name.data, name.len);
+    U32 slot = symbol_slot(table, name, hash);
+    if (table->slots[slot] != 0) {
+        return table->slots[slot];
+    }
+
+    if (table->count == table->capacity) {
+        symbol_table_grow(table);
+        slot = symbol_slot(table, name, hash);
+    }
+
+    SymbolId id = table->count;
+    table->count++;
+    table->symbols[id] = (Symbol) {
+        .name = ar_str_push_copy(table->arena, name),
+        .hash = hash,
+    };
+    table->slots[slot] = id;
+    return id;
+}
+
 typedef struct Parser Parser;
 struct Parser {
     ArArena *arena;
+    // Outlives the parse, holds what's returned in the ParsedShader.
+    ArArena *result_arena;
+    ArStrList includes;
+    ArStrList mediump_outputs;
     FileParser *file_parser_stack;
     ModuleType current_module;
     ArStrList module_parts;
-    ArHashMap *module_map;
+    B8 *module_part_included;
+    U32 module_part_count;
+    U32 module_part_capacity;
+    SymbolTable modules;
     ArHashMap *ctype_map;
-    ArStr module_name;
+    ArHashMap *vertex_format_map;
+    SymbolId module_id;
+    ArStr *module_params;
+    U32 module_param_count;
     struct {
         ArStr name;
         Module vert;
         Module frag;
+        Module comp;
     } program;
 };
 
@@ -71,10 +204,14 @@ typedef enum {
     TOKEN_MODULE,
     TOKEN_VERT,
     TOKEN_FRAG,
+    TOKEN_COMP,
     TOKEN_PROGRAM,
+    TOKEN_COMPUTE_PROGRAM,
     TOKEN_INCLUDE,
     TOKEN_INCLUDE_MODULE,
     TOKEN_CTYPEDEF,
+    TOKEN_VERTEX_FORMAT,
+    TOKEN_MEDIUMP_OUTPUT,
 
     TOKEN_ERROR,
     TOKEN_GLSL,
@@ -85,10 +222,14 @@ const ArStr KEYWORDS[] = {
     ar_str_lit("module"),
     ar_str_lit("vert"),
     ar_str_lit("frag"),
+    ar_str_lit("comp"),
     ar_str_lit("program"),
+    ar_str_lit("compute_program"),
     ar_str_lit("include"),
     ar_str_lit("include_module"),
     ar_str_lit("ctypedef"),
+    ar_str_lit("vertex_format"),
+    ar_str_lit("mediump_output"),
 };
 
 const U32 KEYWORD_ARG_COUNT[] = {
@@ -96,10 +237,14 @@ const U32 KEYWORD_ARG_COUNT[] = {
     1,
     1,
     1,
+    1,
     3,
+    2,
     1,
     1,
     2,
+    2,
+    1,
 };
 
 typedef struct Token Token;
@@ -127,8 +272,16 @@ ArStrList split_statement(ArArena *arena, ArStr statement) {
             i++;
         }
 
+        // Whitespace inside parentheses doesn't split, 'blur(9, vec4)' is
+        // one word.
         U32 start = i;
-        while (!ar_char_is_whitespace(statement.data[i])) {
+        U32 depth = 0;
+        while (i < statement.len && (depth > 0 || !ar_char_is_whitespace(statement.data[i]))) {
+            if (statement.data[i] == '(') {
+                depth++;
+            } else if (statement.data[i] == ')' && depth > 0) {
+                depth--;
+            }
             i++;
         }
         U32 end = i - 1;
@@ -189,17 +342,256 @@ Token tokenize_statement_list(ArArena *err_arena, ArStrList statement_list) {
     return token;
 }
 
+// Parts are pushed along with whether they're an included module's code,
+// those are left alone when a generic module is instantiated.
+static void push_part(Parser *parser, ArStr part, B8 included) {
+    if (parser->module_part_count == parser->module_part_capacity) {
+        U32 capacity = parser->module_part_capacity == 0 ? 16 : parser->module_part_capacity * 2;
+        B8 *grown = ar_arena_push_arr_no_zero(parser->arena, B8, capacity);
+        if (parser->module_part_count > 0) {
+            memcpy(grown, parser->module_part_included, parser->module_part_count * sizeof(B8));
+        }
+        parser->module_part_included = grown;
+        parser->module_part_capacity = capacity;
+    }
+    parser->module_part_included[parser->module_part_count] = included;
+    parser->module_part_count++;
+    ar_str_list_push(parser->arena, &parser->module_parts, part);
+}
+
+// Pushes 'source[start, end]' as a module part with a #line directive in
+// front of it, so glslang's messages and the OpLines of the SPIR-V refer to
+// the file the part came from rather than the joined sources. The
+// directives stay in the module's code and locate it wherever it's
+// included. A part continuing the line of a directive gets its directive
+// after the first newline.
+static void push_module_part(Parser *parser, U32 start, U32 end) {
+    FileParser *file_parser = parser->file_parser_stack;
+    ArStr source = file_parser->source;
+
+    U32 line_start = start;
+    if (start > 0 && source.data[start - 1] != '\n') {
+        while (line_start <= end && source.data[line_start] != '\n') {
+            line_start++;
+        }
+        line_start++;
+    }
+
+    ArStr module_part;
+    if (line_start <= end) {
+        ArStr head = line_start > start ? ar_str_sub(source, start, line_start - 1) : (ArStr) {0};
+        ArStr tail = ar_str_sub(source, line_start, end);
+        module_part = ar_str_pushf(parser->arena, "%.*s#line %u \"%.*s\"\n%.*s",
+                (I32) head.len, head.data,
+                file_parser_line(file_parser, line_start),
+                (I32) file_parser->path.len, file_parser->path.data,
+                (I32) tail.len, tail.data);
+    } else {
+        module_part = ar_str_push_copy(parser->arena, ar_str_sub(source, start, end));
+    }
+    push_part(parser, module_part, false);
+}
+
 void add_module_part(Parser *parser) {
     FileParser *file_parser = parser->file_parser_stack;
     if (file_parser->token_start - file_parser->last_token_end == 2) {
         return;
     }
-    ArStr module_part = ar_str_sub(file_parser->source, file_parser->last_token_end, file_parser->token_start - 1);
-    module_part = ar_str_push_copy(parser->arena, module_part);
-    ar_str_list_push(parser->arena, &parser->module_parts, module_part);
+    push_module_part(parser, file_parser->last_token_end, file_parser->token_start - 1);
+}
+
+void parse(Parser *parser, ArStr path, ArStr source, ArStrList paths);
+
+static B8 is_ident_char(U8 c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static B8 is_ident(ArStr str) {
+    if (str.len == 0 || (str.data[0] >= '0' && str.data[0] <= '9')) {
+        return false;
+    }
+    for (U64 i = 0; i < str.len; i++) {
+        if (!is_ident_char(str.data[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Splits 'name(a, b)' into the name and its trimmed arguments, a name
+// without parentheses has none. Returns false if the parentheses are
+// malformed.
+static B8 parse_signature(ArArena *arena, ArStr signature, ArStr *name, ArStrList *args) {
+    *args = AR_STR_LIST_INIT;
+    U64 open = ar_str_find_char(signature, '(', 0);
+    *name = ar_str_sub(signature, 0, open - 1);
+    if (open == signature.len) {
+        return true;
+    }
+    if (signature.data[signature.len - 1] != ')') {
+        return false;
+    }
+
+    ArStr list = ar_str_trim(ar_str_sub(signature, open + 1, signature.len - 2));
+    if (list.len == 0) {
+        return true;
+    }
+    U32 depth = 0;
+    U64 start = 0;
+    for (U64 i = 0; i <= list.len; i++) {
+        U8 c = i < list.len ? list.data[i] : ',';
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (depth == 0) {
+                return false;
+            }
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            ArStr arg = ar_str_trim(ar_str_sub(list, start, i - 1));
+            if (arg.len == 0) {
+                return false;
+            }
+            ar_str_list_push(arena, args, arg);
+            start = i + 1;
+        }
+    }
+    return depth == 0;
+}
+
+// Replaces every identifier naming a parameter with its argument.
+static ArStr substitute(ArArena *arena, ArStr code, const ArStr *params, const ArStr *args, U32 count) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    ArStrList pieces = AR_STR_LIST_INIT;
+
+    U64 copied = 0;
+    U64 i = 0;
+    while (i < code.len) {
+        // Only #line directives have strings, paths are left alone.
+        if (code.data[i] == '"') {
+            i++;
+            while (i < code.len && code.data[i] != '"' && code.data[i] != '\n') {
+                i++;
+            }
+            i++;
+            continue;
+        }
+        if (!is_ident_char(code.data[i])) {
+            i++;
+            continue;
+        }
+
+        // Numbers are scanned whole so '1e3' never matches a parameter 'e3'.
+        U64 start = i;
+        while (i < code.len && is_ident_char(code.data[i])) {
+            i++;
+        }
+        ArStr word = ar_str_sub(code, start, i - 1);
+        for (U32 j = 0; j < count; j++) {
+            if (ar_str_match(word, params[j], AR_STR_MATCH_FLAG_EXACT)) {
+                ar_str_list_push(scratch.arena, &pieces, ar_str_sub(code, copied, start - 1));
+                ar_str_list_push(scratch.arena, &pieces, args[j]);
+                copied = i;
+                break;
+            }
+        }
+    }
+    ar_str_list_push(scratch.arena, &pieces, ar_str_chop_start(code, copied));
+
+    ArStr result = ar_str_list_join(arena, pieces);
+    ar_scratch_release(&scratch);
+    return result;
+}
+
+// Drops the whitespace of an argument except a single space between two
+// identifiers or numbers, so differently spaced arguments are the same.
+static ArStr normalize_arg(ArArena *arena, ArStr arg) {
+    U8 *data = ar_arena_push_arr_no_zero(arena, U8, arg.len);
+    U64 len = 0;
+    for (U64 i = 0; i < arg.len; i++) {
+        if (!ar_char_is_whitespace(arg.data[i])) {
+            data[len] = arg.data[i];
+            len++;
+            continue;
+        }
+        while (i + 1 < arg.len && ar_char_is_whitespace(arg.data[i + 1])) {
+            i++;
+        }
+        if (len > 0 && i + 1 < arg.len && is_ident_char(data[len - 1]) && is_ident_char(arg.data[i + 1])) {
+            data[len] = ' ';
+            len++;
+        }
+    }
+    return ar_str(data, len);
 }
 
-void parse(Parser *parser, ArStr source, ArStrList paths);
+// Instances are memoized under 'name(a,b)', a name no module can be
+// declared with, so every distinct argument tuple is substituted once.
+// Only the generic's own parts are substituted, modules it includes keep
+// their identifiers.
+static Module *instantiate(Parser *parser, ArStr name, ArStrList args) {
+    SymbolTable *modules = &parser->modules;
+    SymbolId id = symbol_find(modules, name);
+    Module *generic = &modules->modules[id];
+    if (id == 0 || generic->type == MODULE_NONE) {
+        ar_error("%.*s: Module couldn't be found.", (I32) name.len, name.data);
+        return NULL;
+    }
+
+    ArTemp scratch = ar_scratch_get(&parser->arena, 1);
+
+    U32 arg_count = 0;
+    for (ArStrListNode *curr = args.first; curr != NULL; curr = curr->next) {
+        arg_count++;
+    }
+    if (arg_count != generic->param_count) {
+        ar_error("%.*s: Expected %u module argument(s), got %u.", (I32) name.len, name.data, generic->param_count, arg_count);
+        ar_scratch_release(&scratch);
+        return NULL;
+    }
+    if (arg_count == 0) {
+        ar_scratch_release(&scratch);
+        return generic;
+    }
+
+    ArStr *arg_array = ar_arena_push_arr_no_zero(scratch.arena, ArStr, arg_count);
+    ArStrList key = AR_STR_LIST_INIT;
+    ar_str_list_push(scratch.arena, &key, name);
+    arg_count = 0;
+    for (ArStrListNode *curr = args.first; curr != NULL; curr = curr->next) {
+        arg_array[arg_count] = normalize_arg(parser->arena, curr->str);
+        ar_str_list_push(scratch.arena, &key, arg_count == 0 ? ar_str_lit("(") : ar_str_lit(","));
+        ar_str_list_push(scratch.arena, &key, arg_array[arg_count]);
+        arg_count++;
+    }
+    ar_str_list_push(scratch.arena, &key, ar_str_lit(")"));
+
+    SymbolId instance_id = symbol_intern(modules, ar_str_list_join(scratch.arena, key));
+    // Interning may have grown the table.
+    generic = &modules->modules[id];
+    Module *instance = &modules->modules[instance_id];
+    if (instance->type == MODULE_NONE) {
+        ArStrList parts = AR_STR_LIST_INIT;
+        U32 i = 0;
+        for (ArStrListNode *curr = generic->parts.first; curr != NULL; curr = curr->next) {
+            ArStr part = curr->str;
+            if (!generic->included[i]) {
+                part = substitute(parser->arena, part, generic->params, arg_array, arg_count);
+            }
+            ar_str_list_push(parser->arena, &parts, part);
+            i++;
+        }
+        *instance = (Module) {
+            .code = ar_str_trim(ar_str_list_join(parser->arena, parts)),
+            .parts = parts,
+            .included = generic->included,
+            .type = MODULE_MODULE,
+        };
+    }
+
+    ar_scratch_release(&scratch);
+    return instance;
+}
 
 void expand_token(Parser *parser, Token token, ArStrList paths) {
     switch (token.type) {
@@ -213,34 +605,75 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
 
             Module module = {
                 .code = ar_str_trim(ar_str_list_join(parser->arena, parser->module_parts)),
+                .parts = parser->module_parts,
+                .included = parser->module_part_included,
                 .type = parser->current_module,
+                .params = parser->module_params,
+                .param_count = parser->module_param_count,
             };
-            B8 unique = ar_hash_map_insert(parser->module_map, parser->module_name, module);
-            if (!unique) {
-                ar_error("%.*s: Module has already been defined.", (I32) parser->module_name.len, parser->module_name.data);
+            Module *existing = &parser->modules.modules[parser->module_id];
+            if (existing->type != MODULE_NONE) {
+                ArStr name = parser->modules.symbols[parser->module_id].name;
+                ar_error("%.*s: Module has already been defined.", (I32) name.len, name.data);
+            } else {
+                *existing = module;
             }
 
             parser->current_module = MODULE_NONE;
-            parser->module_name = (ArStr) {0};
+            parser->module_id = 0;
             parser->module_parts = AR_STR_LIST_INIT;
+            parser->module_part_included = NULL;
+            parser->module_part_count = 0;
+            parser->module_part_capacity = 0;
+            parser->module_params = NULL;
+            parser->module_param_count = 0;
 
             break;
-        case TOKEN_MODULE:
+        case TOKEN_MODULE: {
             if (parser->current_module != MODULE_NONE) {
                 ar_error("%.*s: New module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
 
-            parser->module_name = token.args[0];
+            ArTemp scratch = ar_scratch_get(&parser->arena, 1);
+            ArStr name;
+            ArStrList params;
+            if (!parse_signature(scratch.arena, token.args[0], &name, &params)) {
+                ar_error("%.*s: Malformed module parameters.", (I32) token.args[0].len, token.args[0].data);
+                ar_scratch_release(&scratch);
+                break;
+            }
+
+            U32 param_count = 0;
+            for (ArStrListNode *curr = params.first; curr != NULL; curr = curr->next) {
+                param_count++;
+            }
+            parser->module_params = ar_arena_push_arr_no_zero(parser->arena, ArStr, param_count);
+            parser->module_param_count = 0;
+            for (ArStrListNode *curr = params.first; curr != NULL; curr = curr->next) {
+                if (!is_ident(curr->str)) {
+                    ar_error("%.*s: Module parameter %.*s isn't an identifier.", (I32) name.len, name.data, (I32) curr->str.len, curr->str.data);
+                    continue;
+                }
+                parser->module_params[parser->module_param_count] = ar_str_push_copy(parser->arena, curr->str);
+                parser->module_param_count++;
+            }
+
+            parser->module_id = symbol_intern(&parser->modules, name);
             parser->current_module = MODULE_MODULE;
-            break;
+            ar_scratch_release(&scratch);
+        } break;
         case TOKEN_VERT:
             if (parser->current_module != MODULE_NONE) {
                 ar_error("%.*s: New vertex module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
+            if (ar_str_find_char(token.args[0], '(', 0) != token.args[0].len) {
+                ar_error("%.*s: Only modules can take parameters.", (I32) token.args[0].len, token.args[0].data);
+                break;
+            }
 
-            parser->module_name = token.args[0];
+            parser->module_id = symbol_intern(&parser->modules, token.args[0]);
             parser->current_module = MODULE_VERT;
             break;
         case TOKEN_FRAG:
@@ -248,10 +681,27 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
                 ar_error("%.*s: New fragment module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
                 break;
             }
+            if (ar_str_find_char(token.args[0], '(', 0) != token.args[0].len) {
+                ar_error("%.*s: Only modules can take parameters.", (I32) token.args[0].len, token.args[0].data);
+                break;
+            }
 
-            parser->module_name = token.args[0];
+            parser->module_id = symbol_intern(&parser->modules, token.args[0]);
             parser->current_module = MODULE_FRAG;
             break;
+        case TOKEN_COMP:
+            if (parser->current_module != MODULE_NONE) {
+                ar_error("%.*s: New compute module started before ending the last module.", (I32) token.args[0].len, token.args[0].data);
+                break;
+            }
+            if (ar_str_find_char(token.args[0], '(', 0) != token.args[0].len) {
+                ar_error("%.*s: Only modules can take parameters.", (I32) token.args[0].len, token.args[0].data);
+                break;
+            }
+
+            parser->module_id = symbol_intern(&parser->modules, token.args[0]);
+            parser->current_module = MODULE_COMP;
+            break;
         case TOKEN_PROGRAM: {
             ArStr name = token.args[0];
             ArStr vert_module_key = token.args[1];
@@ -262,8 +712,8 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
                 break;
             }
 
-            Module vert_module = ar_hash_map_get(parser->module_map, vert_module_key, Module);
-            Module frag_module = ar_hash_map_get(parser->module_map, frag_module_key, Module);
+            Module vert_module = parser->modules.modules[symbol_find(&parser->modules, vert_module_key)];
+            Module frag_module = parser->modules.modules[symbol_find(&parser->modules, frag_module_key)];
 
             B8 failed = false;
             if (vert_module.type != MODULE_VERT) {
@@ -282,6 +732,24 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
             parser->program.vert = vert_module;
             parser->program.frag = frag_module;
         } break;
+        case TOKEN_COMPUTE_PROGRAM: {
+            ArStr name = token.args[0];
+            ArStr comp_module_key = token.args[1];
+
+            if (parser->program.name.data != NULL) {
+                ar_error("%.*s: Program has already been defined.", (I32) name.len, name.data);
+                break;
+            }
+
+            Module comp_module = parser->modules.modules[symbol_find(&parser->modules, comp_module_key)];
+            if (comp_module.type != MODULE_COMP) {
+                ar_error("%.*s: Compute module not found.", (I32) comp_module_key.len, comp_module_key.data);
+                break;
+            }
+
+            parser->program.name = name;
+            parser->program.comp = comp_module;
+        } break;
         case TOKEN_INCLUDE:
             if (paths.first == NULL) {
                 ar_error("Cannot include files without providing search paths.");
@@ -305,24 +773,32 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
                 ar_error("Couldn't find file %.*s, in the provided paths.", (I32) token.args[0].len, token.args[0].data);
             } else {
                 fclose(fp);
+                ar_str_list_push(parser->result_arena, &parser->includes, ar_str_push_copy(parser->result_arena, path));
             }
 
             ArStr imported_file = read_file(scratch.arena, path);
             ArStr path_dir = dirname(path);
             ar_str_list_push_front(scratch.arena, &paths, path_dir);
             ar_str_list_pop(&paths);
-            parse(parser, imported_file, paths);
+            parse(parser, path, imported_file, paths);
 
             ar_scratch_release(&scratch);
 
             break;
         case TOKEN_INCLUDE_MODULE: {
-            ArStr module_value = ar_hash_map_get(parser->module_map, token.args[0], ArStr);
-            if (module_value.data == NULL) {
-                ar_error("%.*s: Module couldn't be found.", (I32) token.args[0].len, token.args[0].data);
+            ArTemp scratch = ar_scratch_get(&parser->arena, 1);
+            ArStr name;
+            ArStrList args;
+            if (!parse_signature(scratch.arena, token.args[0], &name, &args)) {
+                ar_error("%.*s: Malformed module arguments.", (I32) token.args[0].len, token.args[0].data);
+                ar_scratch_release(&scratch);
                 break;
             }
-            ar_str_list_push(parser->arena, &parser->module_parts, module_value);
+            Module *module = instantiate(parser, name, args);
+            if (module != NULL) {
+                push_part(parser, module->code, true);
+            }
+            ar_scratch_release(&scratch);
         } break;
         case TOKEN_CTYPEDEF: {
             ArArena *hm_arena = ar_hash_map_get_arena(parser->ctype_map);
@@ -330,6 +806,15 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
             ArStr ctype = ar_str_push_copy(hm_arena, token.args[1]);
             ar_hash_map_insert(parser->ctype_map, glsl_type, ctype);
         } break;
+        case TOKEN_VERTEX_FORMAT: {
+            ArArena *hm_arena = ar_hash_map_get_arena(parser->vertex_format_map);
+            ArStr input = ar_str_push_copy(hm_arena, token.args[0]);
+            ArStr format = ar_str_push_copy(hm_arena, token.args[1]);
+            ar_hash_map_insert(parser->vertex_format_map, input, format);
+        } break;
+        case TOKEN_MEDIUMP_OUTPUT:
+            ar_str_list_push(parser->result_arena, &parser->mediump_outputs, ar_str_push_copy(parser->result_arena, token.args[0]));
+            break;
 
         case TOKEN_ERROR:
             ar_error("%.*s", (I32) token.error.len, token.error.data);
@@ -343,9 +828,11 @@ void expand_token(Parser *parser, Token token, ArStrList paths) {
     }
 }
 
-void parse(Parser *parser, ArStr source, ArStrList paths) {
+void parse(Parser *parser, ArStr path, ArStr source, ArStrList paths) {
     FileParser file_parser = {
+        .path = path,
         .source = source,
+        .line = 1,
     };
 
     ar_sll_stack_push(parser->file_parser_stack, &file_parser);
@@ -370,10 +857,7 @@ void parse(Parser *parser, ArStr source, ArStrList paths) {
             file_parser.token_end = file_parser.i;
 
             if (token.type == TOKEN_GLSL) {
-                FileParser *file_parser = parser->file_parser_stack;
-                ArStr module_part = ar_str_sub(file_parser->source, file_parser->token_start, file_parser->token_end);
-                module_part = ar_str_push_copy(parser->arena, module_part);
-                ar_str_list_push(parser->arena, &parser->module_parts, module_part);
+                push_module_part(parser, file_parser.token_start, file_parser.token_end);
             }
             ar_scratch_release(&scratch);
         }
@@ -398,21 +882,57 @@ static B8 str_eq(const void *a, const void *b, U64 len) {
     return ar_str_match(*_a, *_b, AR_STR_MATCH_FLAG_EXACT);
 }
 
-ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths) {
+// Copies the parts of a module, trimmed the same way as its code so they
+// join to exactly the same text.
+static ArStrList copy_parts(ArArena *arena, ArStrList parts) {
     ArTemp scratch = ar_scratch_get(&arena, 1);
 
-    ArHashMapDesc module_map_desc = {
-        .arena = scratch.arena,
-        .capacity = 32,
+    U32 count = 0;
+    for (ArStrListNode *curr = parts.first; curr != NULL; curr = curr->next) {
+        count++;
+    }
+    ArStr *trimmed = ar_arena_push_arr_no_zero(scratch.arena, ArStr, count);
+    count = 0;
+    for (ArStrListNode *curr = parts.first; curr != NULL; curr = curr->next) {
+        trimmed[count] = curr->str;
+        count++;
+    }
 
-        .hash_func = hash_str,
-        .eq_func = str_eq,
+    U32 first = 0;
+    while (first < count) {
+        ArStr *part = &trimmed[first];
+        while (part->len > 0 && ar_char_is_whitespace(part->data[0])) {
+            *part = ar_str_chop_start(*part, 1);
+        }
+        if (part->len != 0) {
+            break;
+        }
+        first++;
+    }
+    while (count > first) {
+        ArStr *part = &trimmed[count - 1];
+        while (part->len > 0 && ar_char_is_whitespace(part->data[part->len - 1])) {
+            *part = ar_str_chop_end(*part, 1);
+        }
+        if (part->len != 0) {
+            break;
+        }
+        count--;
+    }
 
-        .key_size = sizeof(ArStr),
-        .value_size = sizeof(Module),
-        .null_value = &(Module) {0},
-    };
+    ArStrList copy = AR_STR_LIST_INIT;
+    for (U32 i = first; i < count; i++) {
+        ar_str_list_push(arena, &copy, ar_str_push_copy(arena, trimmed[i]));
+    }
 
+    ar_scratch_release(&scratch);
+    return copy;
+}
+
+ParsedShader parse_shader(ArArena *arena, ArStr filepath, ArStr source, ArStrList paths) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // Keyed by GLSL type names so it never grows past a few dozen entries.
     ArHashMapDesc ctype_map_desc = {
         .arena = arena,
         .capacity = 32,
@@ -425,21 +945,33 @@ ParsedShader parse_shader(ArArena *arena, ArStr source, ArStrList paths) {
         .null_value = &(ArStr) {0},
     };
 
+    // Same layout as the ctype map, input name to format name.
+    ArHashMapDesc vertex_format_map_desc = ctype_map_desc;
+
     Parser parser = {
         .arena = scratch.arena,
-        .module_map = ar_hash_map_init(module_map_desc),
+        .result_arena = arena,
+        .modules = symbol_table_init(scratch.arena),
         .ctype_map = ar_hash_map_init(ctype_map_desc),
+        .vertex_format_map = ar_hash_map_init(vertex_format_map_desc),
     };
 
-    parse(&parser, source, paths);
+    parse(&parser, filepath, source, paths);
 
     ParsedShader shader = {
         .program = {
             .name = ar_str_push_copy(arena, parser.program.name),
             .vertex_source = ar_str_push_copy(arena, parser.program.vert.code),
             .fragment_source = ar_str_push_copy(arena, parser.program.frag.code),
+            .compute_source = ar_str_push_copy(arena, parser.program.comp.code),
+            .vertex_parts = copy_parts(arena, parser.program.vert.parts),
+            .fragment_parts = copy_parts(arena, parser.program.frag.parts),
+            .compute_parts = copy_parts(arena, parser.program.comp.parts),
         },
         .ctypes = parser.ctype_map,
+        .vertex_formats = parser.vertex_format_map,
+        .includes = parser.includes,
+        .mediump_outputs = parser.mediump_outputs,
     };
 
     ar_scratch_release(&scratch);
@@ -0,0 +1,566 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+#include <string.h>
+
+// Finds fragment stage values which can be computed in half precision. Fp16
+// runs at roughly twice the rate of fp32 on mobile GPUs and halves register
+// pressure.
+//
+// Values are relaxed optimistically and then narrowed to a fixpoint in two
+// directions:
+//  - Forward, a value is relaxable if it's an interpolant, a texture result,
+//    an fp16 representable constant or simple arithmetic on relaxable values.
+//    Anything read from uniforms, built-ins or through memory we can't follow
+//    isn't.
+//  - Backward, a value requires full precision if it's a texture coordinate,
+//    converted to an integer, passed to a function or otherwise consumed by
+//    something we don't know the precision needs of. Outputs are stored
+//    at attachment precision, which only the shader knows. They require
+//    full precision unless '#mediump_output <name>' allows relaxing them.
+// Locals live in function variables in glslang's output, so variables are
+// followed through whole loads and stores.
+
+// GLSL.std.450 instructions which behave in half precision, by number.
+static const B8 GLSL_STD_450_RELAXABLE[] = {
+    [1] = true,  // Round
+    [2] = true,  // RoundEven
+    [3] = true,  // Trunc
+    [4] = true,  // FAbs
+    [6] = true,  // FSign
+    [8] = true,  // Floor
+    [9] = true,  // Ceil
+    [10] = true, // Fract
+    [13] = true, // Sin
+    [14] = true, // Cos
+    [26] = true, // Pow
+    [29] = true, // Exp2
+    [30] = true, // Log2
+    [31] = true, // Sqrt
+    [32] = true, // InverseSqrt
+    [37] = true, // FMin
+    [40] = true, // FMax
+    [43] = true, // FClamp
+    [46] = true, // FMix
+    [48] = true, // Step
+    [49] = true, // SmoothStep
+    [50] = true, // Fma
+    [66] = true, // Length
+    [67] = true, // Distance
+    [68] = true, // Cross
+    [69] = true, // Normalize
+    [70] = true, // FaceForward
+    [71] = true, // Reflect
+};
+
+typedef enum {
+    OPERATION_NONE,
+    // Moves components around without computing anything.
+    OPERATION_MOVE,
+    OPERATION_ARITHMETIC,
+} Operation;
+
+typedef struct Precision Precision;
+struct Precision {
+    SpvModule module;
+    U32 glsl_std_450;
+
+    U32 *types;
+    // Per type, number of components if it's a 32-bit float scalar or vector.
+    U32 *float_components;
+    // Per type, true for booleans and boolean vectors.
+    B8 *bools;
+    // Per variable.
+    U32 *storage;
+    U32 *pointee;
+    B8 *builtin;
+    // Variable an access chain is rooted in.
+    U32 *roots;
+    ArStr *names;
+    // Per variable, outputs named by '#mediump_output'.
+    B8 *mediump_outputs;
+
+    B8 *relaxable;
+    B8 *required;
+    U16 *positions;
+};
+
+static Operation operation_of(const Precision *precision, SpvInstruction inst) {
+    switch (inst.opcode) {
+        case SpvOpVectorShuffle:
+        case SpvOpCompositeConstruct:
+        case SpvOpCompositeExtract:
+        case SpvOpCompositeInsert:
+        case SpvOpCopyObject:
+        case SpvOpSelect:
+        case SpvOpPhi:
+            return OPERATION_MOVE;
+
+        case SpvOpFNegate:
+        case SpvOpFAdd:
+        case SpvOpFSub:
+        case SpvOpFMul:
+        case SpvOpFDiv:
+        case SpvOpVectorTimesScalar:
+        case SpvOpDot:
+            return OPERATION_ARITHMETIC;
+
+        case SpvOpExtInst: {
+            U32 number = inst.words[4];
+            if (inst.words[3] == precision->glsl_std_450 &&
+                    number < ar_arrlen(GLSL_STD_450_RELAXABLE) &&
+                    GLSL_STD_450_RELAXABLE[number]) {
+                return OPERATION_ARITHMETIC;
+            }
+            return OPERATION_NONE;
+        }
+
+        default:
+            return OPERATION_NONE;
+    }
+}
+
+static B8 is_comparison(U16 opcode) {
+    return opcode >= SpvOpFOrdEqual && opcode <= SpvOpFUnordGreaterThanEqual;
+}
+
+static B8 is_texture_read(U16 opcode) {
+    switch (opcode) {
+        case SpvOpImageSampleImplicitLod:
+        case SpvOpImageSampleExplicitLod:
+        case SpvOpImageSampleProjImplicitLod:
+        case SpvOpImageSampleProjExplicitLod:
+        case SpvOpImageFetch:
+        case SpvOpImageGather:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static B8 is_float(const Precision *precision, U32 id) {
+    return precision->float_components[precision->types[id]] != 0;
+}
+
+// Labels, the extended instruction set and conditions don't affect the
+// precision of a result.
+static B8 is_relaxable_operand(const Precision *precision, U32 id) {
+    if (is_float(precision, id)) {
+        return precision->relaxable[id];
+    }
+    return precision->types[id] == 0 || precision->bools[precision->types[id]];
+}
+
+static U32 root_of(const Precision *precision, U32 pointer) {
+    return precision->roots[pointer] != 0 ? precision->roots[pointer] : pointer;
+}
+
+static B8 is_float_variable(const Precision *precision, U32 variable, U32 storage) {
+    return precision->storage[variable] == storage &&
+        precision->float_components[precision->pointee[variable]] != 0 &&
+        !precision->builtin[variable];
+}
+
+// Clears the relaxable flag of everything depending on a full precision
+// value. Returns true if anything changed.
+static B8 narrow_relaxable(Precision *precision) {
+    SpvModule *module = &precision->module;
+    B8 *relaxable = precision->relaxable;
+    B8 changed = false;
+
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (module->sections[i] != SPV_SECTION_FUNCTION) {
+            continue;
+        }
+
+        if (inst.opcode == SpvOpStore || (inst.opcode == SpvOpVariable && inst.word_count > 4)) {
+            U32 pointer = inst.opcode == SpvOpStore ? inst.words[1] : inst.words[2];
+            U32 value = inst.opcode == SpvOpStore ? inst.words[2] : inst.words[4];
+            U32 variable = root_of(precision, pointer);
+            if (relaxable[variable] && (variable != pointer || !relaxable[value])) {
+                relaxable[variable] = false;
+                changed = true;
+            }
+            continue;
+        }
+
+        U32 result = spv_result_id(inst);
+        if (result == 0 || !relaxable[result] || inst.opcode == SpvOpVariable) {
+            continue;
+        }
+
+        B8 value = false;
+        if (inst.opcode == SpvOpLoad) {
+            U32 pointer = inst.words[3];
+            if (precision->roots[pointer] == 0) {
+                value = is_float_variable(precision, pointer, SpvStorageClassInput) ||
+                    (is_float_variable(precision, pointer, SpvStorageClassFunction) && relaxable[pointer]);
+            }
+        } else if (is_texture_read(inst.opcode)) {
+            value = true;
+        } else if (operation_of(precision, inst) != OPERATION_NONE) {
+            value = true;
+            U32 id_count = spv_id_operands(inst, precision->positions);
+            for (U32 j = 0; j < id_count; j++) {
+                U32 id = inst.words[precision->positions[j]];
+                if (precision->positions[j] > 2 && !is_relaxable_operand(precision, id)) {
+                    value = false;
+                }
+            }
+        }
+
+        if (!value) {
+            relaxable[result] = false;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static B8 require(Precision *precision, U32 id) {
+    U32 variable = root_of(precision, id);
+    if (precision->storage[variable] == SpvStorageClassFunction) {
+        id = variable;
+    } else if (!is_float(precision, id)) {
+        return false;
+    }
+
+    if (precision->required[id]) {
+        return false;
+    }
+    precision->required[id] = true;
+    return true;
+}
+
+// Marks everything a full precision value is computed from as full precision.
+// Returns true if anything changed.
+static B8 widen_required(Precision *precision) {
+    SpvModule *module = &precision->module;
+    B8 *required = precision->required;
+    B8 changed = false;
+
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (module->sections[i] != SPV_SECTION_FUNCTION) {
+            continue;
+        }
+
+        switch (inst.opcode) {
+            case SpvOpLoad:
+                if (required[inst.words[2]]) {
+                    changed |= require(precision, inst.words[3]);
+                }
+                continue;
+
+            case SpvOpStore: {
+                U32 variable = root_of(precision, inst.words[1]);
+                if (precision->mediump_outputs[variable]) {
+                    continue;
+                }
+                if (precision->storage[variable] != SpvStorageClassFunction || required[variable]) {
+                    changed |= require(precision, inst.words[2]);
+                }
+                continue;
+            }
+
+            case SpvOpVariable:
+                if (inst.word_count > 4 && required[inst.words[2]]) {
+                    changed |= require(precision, inst.words[4]);
+                }
+                continue;
+
+            case SpvOpLabel:
+            case SpvOpFunction:
+            case SpvOpFunctionEnd:
+            case SpvOpAccessChain:
+            case SpvOpInBoundsAccessChain:
+                continue;
+
+            default:
+                break;
+        }
+
+        U32 result = spv_result_id(inst);
+        B8 requires_operands = true;
+        if (operation_of(precision, inst) != OPERATION_NONE) {
+            requires_operands = required[result];
+        } else if (is_comparison(inst.opcode)) {
+            requires_operands = false;
+        }
+        if (!requires_operands) {
+            continue;
+        }
+
+        U32 id_count = spv_id_operands(inst, precision->positions);
+        for (U32 j = 0; j < id_count; j++) {
+            U32 id = inst.words[precision->positions[j]];
+            if (id != result && id != spv_result_type(inst)) {
+                changed |= require(precision, id);
+            }
+        }
+    }
+
+    return changed;
+}
+
+static ArStr string_operand(SpvInstruction inst, U32 word) {
+    const char *cstr = (const char *) &inst.words[word];
+    U64 max = (inst.word_count - word) * sizeof(U32);
+    U64 len = 0;
+    while (len < max && cstr[len] != '\0') {
+        len++;
+    }
+    return ar_str((const U8 *) cstr, len);
+}
+
+static void report_variable(const Precision *precision, ArStr name, const char *qualifier, U32 variable) {
+    ArStr variable_name = precision->names[variable];
+    if (variable_name.len == 0) {
+        return;
+    }
+    ar_info("%.*s:   mediump %s %.*s (%u components)",
+            (I32) name.len, name.data,
+            qualifier,
+            (I32) variable_name.len, variable_name.data,
+            precision->float_components[precision->pointee[variable]]);
+}
+
+static B8 list_contains(ArStrList list, ArStr str) {
+    for (ArStrListNode *curr = list.first; curr != NULL; curr = curr->next) {
+        if (ar_str_match(curr->str, str, AR_STR_MATCH_FLAG_EXACT)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ArStr spv_relax_precision(ArArena *arena, ArStr name, ArStr spv, ArStrList mediump_outputs, B8 relax) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    Precision precision = {
+        .module = spv_parse_module(scratch.arena, spv),
+    };
+    SpvModule *module = &precision.module;
+    U32 bound = module->bound;
+    if (bound == 0) {
+        ar_scratch_release(&scratch);
+        return spv;
+    }
+
+    precision.types = ar_arena_push_arr(scratch.arena, U32, bound);
+    precision.float_components = ar_arena_push_arr(scratch.arena, U32, bound);
+    precision.bools = ar_arena_push_arr(scratch.arena, B8, bound);
+    precision.storage = ar_arena_push_arr_no_zero(scratch.arena, U32, bound);
+    precision.pointee = ar_arena_push_arr(scratch.arena, U32, bound);
+    precision.builtin = ar_arena_push_arr(scratch.arena, B8, bound);
+    precision.roots = ar_arena_push_arr(scratch.arena, U32, bound);
+    precision.names = ar_arena_push_arr(scratch.arena, ArStr, bound);
+    precision.mediump_outputs = ar_arena_push_arr(scratch.arena, B8, bound);
+    precision.relaxable = ar_arena_push_arr(scratch.arena, B8, bound);
+    precision.required = ar_arena_push_arr(scratch.arena, B8, bound);
+    precision.positions = ar_arena_push_arr_no_zero(scratch.arena, U16, UINT16_MAX);
+    memset(precision.storage, 0xff, bound * sizeof(U32));
+    B8 *decorated = ar_arena_push_arr(scratch.arena, B8, bound);
+
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        U32 result = spv_result_id(inst);
+        if (result != 0) {
+            precision.types[result] = spv_result_type(inst);
+        }
+
+        switch (inst.opcode) {
+            case SpvOpExtInstImport:
+                if (ar_str_match(string_operand(inst, 2), ar_str_lit("GLSL.std.450"), AR_STR_MATCH_FLAG_EXACT)) {
+                    precision.glsl_std_450 = result;
+                }
+                break;
+            case SpvOpName:
+                precision.names[inst.words[1]] = string_operand(inst, 2);
+                break;
+            case SpvOpDecorate:
+                if (inst.words[2] == SpvDecorationBuiltIn) {
+                    precision.builtin[inst.words[1]] = true;
+                } else if (inst.words[2] == SpvDecorationRelaxedPrecision) {
+                    decorated[inst.words[1]] = true;
+                }
+                break;
+            case SpvOpTypeFloat:
+                precision.float_components[result] = inst.words[2] == 32;
+                break;
+            case SpvOpTypeBool:
+                precision.bools[result] = true;
+                break;
+            case SpvOpTypeVector:
+                if (precision.float_components[inst.words[2]] != 0) {
+                    precision.float_components[result] = inst.words[3];
+                }
+                precision.bools[result] = precision.bools[inst.words[2]];
+                break;
+            case SpvOpTypePointer:
+                precision.storage[result] = inst.words[2];
+                precision.pointee[result] = inst.words[3];
+                break;
+            case SpvOpVariable:
+                precision.storage[result] = inst.words[3];
+                precision.pointee[result] = precision.pointee[inst.words[1]];
+                // Locals start out relaxed like every other value.
+                precision.relaxable[result] = is_float_variable(&precision, result, SpvStorageClassFunction);
+                precision.mediump_outputs[result] = is_float_variable(&precision, result, SpvStorageClassOutput) &&
+                    list_contains(mediump_outputs, precision.names[result]);
+                break;
+            case SpvOpAccessChain:
+            case SpvOpInBoundsAccessChain:
+                precision.roots[result] = root_of(&precision, inst.words[3]);
+                break;
+
+            // Constants outside the fp16 range stay full precision.
+            case SpvOpConstant:
+                if (precision.float_components[inst.words[1]] != 0) {
+                    F32 value;
+                    memcpy(&value, &inst.words[3], sizeof(value));
+                    precision.relaxable[result] = value >= -65504.0f && value <= 65504.0f;
+                }
+                break;
+            case SpvOpConstantComposite:
+                if (precision.float_components[inst.words[1]] != 0) {
+                    precision.relaxable[result] = true;
+                    for (U32 j = 3; j < inst.word_count; j++) {
+                        precision.relaxable[result] &= precision.relaxable[inst.words[j]];
+                    }
+                }
+                break;
+            case SpvOpConstantNull:
+            case SpvOpUndef:
+                precision.relaxable[result] = true;
+                break;
+
+            default:
+                if (result != 0 && module->sections[i] == SPV_SECTION_FUNCTION) {
+                    precision.relaxable[result] = is_float(&precision, result);
+                }
+                break;
+        }
+    }
+
+    while (narrow_relaxable(&precision));
+    while (widen_required(&precision));
+
+    B8 *candidates = ar_arena_push_arr(scratch.arena, B8, bound);
+    U32 operation_count = 0;
+    U32 relaxed_operation_count = 0;
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        U32 result = spv_result_id(inst);
+        if (module->sections[i] != SPV_SECTION_FUNCTION || result == 0 || !is_float(&precision, result)) {
+            continue;
+        }
+
+        B8 candidate = precision.relaxable[result] && !precision.required[result];
+        if (operation_of(&precision, inst) == OPERATION_ARITHMETIC) {
+            operation_count++;
+            relaxed_operation_count += candidate;
+        }
+        candidates[result] = candidate;
+    }
+
+    // Interface variables are candidates when every access is.
+    B8 *variables = ar_arena_push_arr(scratch.arena, B8, bound);
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (inst.opcode == SpvOpVariable) {
+            U32 result = inst.words[2];
+            variables[result] = is_float_variable(&precision, result, SpvStorageClassInput) ||
+                precision.mediump_outputs[result] ||
+                (is_float_variable(&precision, result, SpvStorageClassFunction) &&
+                 precision.relaxable[result] && !precision.required[result]);
+        }
+    }
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (module->sections[i] != SPV_SECTION_FUNCTION) {
+            continue;
+        }
+        if (inst.opcode == SpvOpLoad) {
+            U32 variable = root_of(&precision, inst.words[3]);
+            if (precision.storage[variable] == SpvStorageClassInput && (variable != inst.words[3] || !candidates[inst.words[2]])) {
+                variables[variable] = false;
+            }
+        } else if (inst.opcode == SpvOpStore) {
+            U32 variable = root_of(&precision, inst.words[1]);
+            if (precision.storage[variable] == SpvStorageClassOutput && (variable != inst.words[1] || !precision.relaxable[inst.words[2]])) {
+                variables[variable] = false;
+            }
+        }
+    }
+
+    ar_info("%.*s: %u of %u fragment float operations (%u%%) fit in half precision.",
+            (I32) name.len, name.data,
+            relaxed_operation_count, operation_count,
+            operation_count == 0 ? 0 : relaxed_operation_count * 100 / operation_count);
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (inst.opcode != SpvOpVariable || !variables[inst.words[2]]) {
+            continue;
+        }
+
+        const char *qualifiers[] = {"local", "in", "out"};
+        U32 qualifier = 0;
+        if (inst.words[3] == SpvStorageClassInput) {
+            qualifier = 1;
+        } else if (inst.words[3] == SpvStorageClassOutput) {
+            qualifier = 2;
+        }
+        report_variable(&precision, name, qualifiers[qualifier], inst.words[2]);
+    }
+
+    if (!relax) {
+        ar_scratch_release(&scratch);
+        return spv;
+    }
+
+    // Interface variables of the fragment stage have to match the vertex
+    // outputs, only their loads are relaxed.
+    U32 decoration_count = 0;
+    for (U32 id = 0; id < bound; id++) {
+        if (precision.storage[id] == SpvStorageClassInput) {
+            variables[id] = false;
+        }
+        if ((candidates[id] || variables[id]) && !decorated[id]) {
+            decoration_count++;
+        }
+    }
+
+    U64 word_count = spv.len / sizeof(U32) + decoration_count * 3;
+    U32 *words = ar_arena_push_arr_no_zero(arena, U32, word_count);
+    memcpy(words, spv.data, SPV_HEADER_WORDS * sizeof(U32));
+    U64 offset = SPV_HEADER_WORDS;
+    B8 inserted = false;
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (!inserted && module->sections[i] > SPV_SECTION_ANNOTATION) {
+            for (U32 id = 0; id < bound; id++) {
+                if ((candidates[id] || variables[id]) && !decorated[id]) {
+                    words[offset + 0] = (3 << SpvWordCountShift) | SpvOpDecorate;
+                    words[offset + 1] = id;
+                    words[offset + 2] = SpvDecorationRelaxedPrecision;
+                    offset += 3;
+                }
+            }
+            inserted = true;
+        }
+
+        memcpy(&words[offset], inst.words, inst.word_count * sizeof(U32));
+        offset += inst.word_count;
+    }
+
+    ar_info("%.*s: Relaxed precision of %u fragment values.", (I32) name.len, name.data, decoration_count);
+
+    ar_scratch_release(&scratch);
+
+    return ar_str((const U8 *) words, word_count * sizeof(U32));
+}
@@ -0,0 +1,1195 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Expands macros and conditionals before the sources reach glslang.
+//
+// The sources of a stage are preprocessed part by part, every included module
+// being one part. The output of a part only depends on its text and the
+// macros defined before it, so it's cached by both and the second stage or
+// variant including the same module with the same defines reuses the
+// expansion along with the defines the part made.
+//
+// Only what's needed to expand the sources is implemented. #version,
+// #extension, #pragma, #line and #error are left for glslang. The macros
+// glslang's preamble defines for the client are defined up front, anything
+// depending on ones which also depend on the #version or #extensions, like
+// GL_ES or __VERSION__ in a condition, makes the stage fall back to being
+// preprocessed by glslang alone.
+
+#define MAX_CONDITIONAL_DEPTH 64
+
+typedef struct Macro Macro;
+struct Macro {
+    ArStr name;
+    U64 hash;
+    B8 defined;
+    B8 function_like;
+    ArStr *params;
+    U32 param_count;
+    ArStr body;
+    // Hash of the whole definition.
+    U64 definition;
+    // Set while the macro's own expansion is rescanned so it isn't expanded
+    // recursively.
+    B8 expanding;
+};
+
+typedef struct MacroOp MacroOp;
+struct MacroOp {
+    B8 undef;
+    Macro macro;
+};
+
+typedef struct Conditional Conditional;
+struct Conditional {
+    // Emitting the current branch.
+    B8 active;
+    // Any branch has been emitted or the enclosing block is inactive.
+    B8 taken;
+    B8 seen_else;
+};
+
+typedef struct CachedPart CachedPart;
+struct CachedPart {
+    // The part and how it started, compared on a hash hit.
+    ArStr text;
+    B8 line_start;
+    B8 started_in_comment;
+    U64 text_hash;
+    U64 state;
+    ArStr output;
+    MacroOp *ops;
+    U32 op_count;
+    // Whether the part ends inside a block comment.
+    B8 in_comment;
+    // Index + 1 of the next part in the same bucket.
+    U32 next;
+};
+
+typedef struct Buffer Buffer;
+struct Buffer {
+    ArArena *arena;
+    U8 *data;
+    U64 len;
+    U64 capacity;
+};
+
+#define CACHE_BUCKET_COUNT 1024
+
+struct Preprocessor {
+    ArArena *arena;
+
+    // Open addressing over 'macros' by name, 0 is empty.
+    Macro *macros;
+    U32 macro_count;
+    U32 macro_capacity;
+    U32 *slots;
+    U32 slot_count;
+    // Xor of the definitions of every defined macro.
+    U64 state;
+
+    Conditional conditionals[MAX_CONDITIONAL_DEPTH];
+    U32 depth;
+    // Set while inside a block comment, directives there are ignored like
+    // glslang does.
+    B8 in_comment;
+
+    // Defines and undefs made by the part being preprocessed.
+    MacroOp *ops;
+    U32 op_count;
+    U32 op_capacity;
+
+    CachedPart *cache;
+    U32 cache_count;
+    U32 cache_capacity;
+    U32 buckets[CACHE_BUCKET_COUNT];
+
+    U32 hits;
+    U32 misses;
+    // Set when the stage has to be left to glslang.
+    B8 failed;
+};
+
+static void buffer_push(Buffer *buffer, ArStr str) {
+    if (buffer->len + str.len > buffer->capacity) {
+        U64 capacity = buffer->capacity * 2;
+        if (capacity < buffer->len + str.len) {
+            capacity = buffer->len + str.len;
+        }
+        if (capacity < 256) {
+            capacity = 256;
+        }
+        U8 *data = ar_arena_push_arr_no_zero(buffer->arena, U8, capacity);
+        if (buffer->len > 0) {
+            memcpy(data, buffer->data, buffer->len);
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    if (str.len > 0) {
+        memcpy(&buffer->data[buffer->len], str.data, str.len);
+        buffer->len += str.len;
+    }
+}
+
+static ArStr buffer_str(Buffer buffer) {
+    return ar_str(buffer.data, buffer.len);
+}
+
+static void push_newlines(Buffer *buffer, U32 count) {
+    for (U32 i = 0; i < count; i++) {
+        buffer_push(buffer, ar_str_lit("\n"));
+    }
+}
+
+static B8 is_ident_start(U8 c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static B8 is_ident_char(U8 c) {
+    return is_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+static B8 is_digit(U8 c) {
+    return c >= '0' && c <= '9';
+}
+
+static B8 is_space(U8 c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static U64 scan_ident(ArStr text, U64 i) {
+    while (i < text.len && is_ident_char(text.data[i])) {
+        i++;
+    }
+    return i;
+}
+
+// Numbers are skipped whole so suffixes and exponents aren't taken for
+// identifiers.
+static U64 scan_number(ArStr text, U64 i) {
+    while (i < text.len) {
+        U8 c = text.data[i];
+        if (is_ident_char(c) || c == '.') {
+            i++;
+        } else if ((c == '+' || c == '-') && (text.data[i - 1] == 'e' || text.data[i - 1] == 'E')) {
+            i++;
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+static U64 skip_space(ArStr text, U64 i) {
+    while (i < text.len && is_space(text.data[i])) {
+        i++;
+    }
+    return i;
+}
+
+static U32 count_newlines(ArStr text) {
+    U32 count = 0;
+    for (U64 i = 0; i < text.len; i++) {
+        count += text.data[i] == '\n';
+    }
+    return count;
+}
+
+static U64 mix(U64 hash, U64 value) {
+    hash ^= value;
+    hash *= 0x100000001b3ull;
+    return hash;
+}
+
+//
+// Macro table
+//
+
+static U32 macro_slot(const Preprocessor *pp, ArStr name, U64 hash) {
+    U32 mask = pp->slot_count - 1;
+    U32 slot = hash & mask;
+    while (pp->slots[slot] != 0) {
+        const Macro *macro = &pp->macros[pp->slots[slot] - 1];
+        if (macro->hash == hash && ar_str_match(macro->name, name, AR_STR_MATCH_FLAG_EXACT)) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static Macro *find_macro(const Preprocessor *pp, ArStr name) {
+    U64 hash = ar_fvn1a_hash(name.data, name.len);
+    U32 index = pp->slots[macro_slot(pp, name, hash)];
+    if (index == 0 || !pp->macros[index - 1].defined) {
+        return NULL;
+    }
+    return &pp->macros[index - 1];
+}
+
+static Macro *get_macro(Preprocessor *pp, ArStr name, U64 hash) {
+    U32 slot = macro_slot(pp, name, hash);
+    if (pp->slots[slot] != 0) {
+        return &pp->macros[pp->slots[slot] - 1];
+    }
+
+    if (pp->macro_count == pp->macro_capacity) {
+        U32 capacity = pp->macro_capacity * 2;
+        Macro *macros = ar_arena_push_arr(pp->arena, Macro, capacity);
+        memcpy(macros, pp->macros, pp->macro_count * sizeof(Macro));
+        pp->macros = macros;
+        pp->macro_capacity = capacity;
+
+        pp->slot_count = capacity * 2;
+        pp->slots = ar_arena_push_arr(pp->arena, U32, pp->slot_count);
+        for (U32 i = 0; i < pp->macro_count; i++) {
+            pp->slots[macro_slot(pp, macros[i].name, macros[i].hash)] = i + 1;
+        }
+        slot = macro_slot(pp, name, hash);
+    }
+
+    Macro *macro = &pp->macros[pp->macro_count];
+    *macro = (Macro) {
+        .name = name,
+        .hash = hash,
+    };
+    pp->macro_count++;
+    pp->slots[slot] = pp->macro_count;
+    return macro;
+}
+
+static void record(Preprocessor *pp, MacroOp op) {
+    if (pp->op_count == pp->op_capacity) {
+        U32 capacity = pp->op_capacity == 0 ? 16 : pp->op_capacity * 2;
+        MacroOp *ops = ar_arena_push_arr_no_zero(pp->arena, MacroOp, capacity);
+        if (pp->op_count > 0) {
+            memcpy(ops, pp->ops, pp->op_count * sizeof(MacroOp));
+        }
+        pp->ops = ops;
+        pp->op_capacity = capacity;
+    }
+    pp->ops[pp->op_count] = op;
+    pp->op_count++;
+}
+
+static void define_macro(Preprocessor *pp, Macro definition) {
+    Macro *macro = get_macro(pp, definition.name, definition.hash);
+    if (macro->defined) {
+        pp->state ^= macro->definition;
+    }
+    *macro = definition;
+    macro->defined = true;
+    macro->expanding = false;
+    pp->state ^= macro->definition;
+    record(pp, (MacroOp) {.macro = definition});
+}
+
+static void undef_macro(Preprocessor *pp, ArStr name) {
+    Macro *macro = find_macro(pp, name);
+    if (macro != NULL) {
+        pp->state ^= macro->definition;
+        macro->defined = false;
+    }
+    record(pp, (MacroOp) {
+        .undef = true,
+        .macro = {.name = name, .hash = ar_fvn1a_hash(name.data, name.len)},
+    });
+}
+
+// Defined by glslang's preamble for GLSLANG_CLIENT_VULKAN, the client
+// compiler.c compiles for, whatever the #version.
+static const char *PREDEFINED_MACROS[] = {
+    "VULKAN 100",
+};
+
+static void parse_define(Preprocessor *pp, ArStr rest);
+
+static void reset(Preprocessor *pp) {
+    memset(pp->slots, 0, pp->slot_count * sizeof(U32));
+    pp->macro_count = 0;
+    pp->state = 0;
+    pp->depth = 0;
+    pp->in_comment = false;
+    pp->failed = false;
+
+    for (U32 i = 0; i < ar_arrlen(PREDEFINED_MACROS); i++) {
+        parse_define(pp, ar_str_cstr((char *) PREDEFINED_MACROS[i]));
+    }
+    pp->op_count = 0;
+}
+
+//
+// Expansion
+//
+
+static void expand_text(Preprocessor *pp, ArStr text, Buffer *out);
+
+// Parses the arguments of a function-like macro starting at the '('.
+// Returns the index after the ')' or 0 if they don't end within 'text'.
+static U64 parse_args(ArArena *arena, ArStr text, U64 i, ArStr **args, U32 *arg_count) {
+    U32 capacity = 8;
+    *args = ar_arena_push_arr_no_zero(arena, ArStr, capacity);
+    *arg_count = 0;
+
+    i++;
+    U64 start = i;
+    U32 nesting = 0;
+    while (i < text.len) {
+        U8 c = text.data[i];
+        if (c == '(') {
+            nesting++;
+        } else if (c == ')' && nesting > 0) {
+            nesting--;
+        } else if ((c == ',' && nesting == 0) || c == ')') {
+            if (*arg_count == capacity) {
+                ArStr *grown = ar_arena_push_arr_no_zero(arena, ArStr, capacity * 2);
+                memcpy(grown, *args, capacity * sizeof(ArStr));
+                *args = grown;
+                capacity *= 2;
+            }
+            (*args)[*arg_count] = ar_str_trim(ar_str(&text.data[start], i - start));
+            (*arg_count)++;
+            start = i + 1;
+            if (c == ')') {
+                return i + 1;
+            }
+        }
+        i++;
+    }
+    return 0;
+}
+
+static B8 is_paste(ArStr body, U64 i) {
+    return i + 1 < body.len && body.data[i] == '#' && body.data[i + 1] == '#';
+}
+
+// Substitutes the arguments into the body. Arguments next to '##' are used
+// as written, the others fully expanded first.
+static void substitute(Preprocessor *pp, Macro *macro, ArStr *args, Buffer *out) {
+    ArStr body = macro->body;
+    U64 i = 0;
+    B8 after_paste = false;
+    while (i < body.len) {
+        U8 c = body.data[i];
+        if (is_paste(body, i)) {
+            // Drop the whitespace on both sides of the operator.
+            while (out->len > 0 && is_space(out->data[out->len - 1])) {
+                out->len--;
+            }
+            i = skip_space(body, i + 2);
+            after_paste = true;
+            continue;
+        }
+
+        if (is_ident_start(c)) {
+            U64 end = scan_ident(body, i);
+            ArStr ident = ar_str(&body.data[i], end - i);
+            U64 next = skip_space(body, end);
+            B8 before_paste = is_paste(body, next);
+
+            U32 param = macro->param_count;
+            for (U32 j = 0; j < macro->param_count; j++) {
+                if (ar_str_match(ident, macro->params[j], AR_STR_MATCH_FLAG_EXACT)) {
+                    param = j;
+                    break;
+                }
+            }
+
+            if (param == macro->param_count) {
+                buffer_push(out, ident);
+            } else if (after_paste || before_paste) {
+                buffer_push(out, args[param]);
+            } else {
+                expand_text(pp, args[param], out);
+            }
+            i = end;
+            after_paste = false;
+            continue;
+        }
+
+        if (is_digit(c)) {
+            U64 end = scan_number(body, i);
+            buffer_push(out, ar_str(&body.data[i], end - i));
+            i = end;
+        } else {
+            buffer_push(out, ar_str(&body.data[i], 1));
+            i++;
+        }
+        if (!is_space(c)) {
+            after_paste = false;
+        }
+    }
+}
+
+// Expands every macro in 'text'. Comments and newlines are kept as is.
+static void expand_text(Preprocessor *pp, ArStr text, Buffer *out) {
+    ArTemp scratch = ar_scratch_get(&out->arena, 1);
+
+    U64 copied = 0;
+    U64 i = 0;
+    while (i < text.len && !pp->failed) {
+        U8 c = text.data[i];
+
+        if (c == '/' && i + 1 < text.len && text.data[i + 1] == '/') {
+            while (i < text.len && text.data[i] != '\n') {
+                i++;
+            }
+            continue;
+        }
+        if (c == '/' && i + 1 < text.len && text.data[i + 1] == '*') {
+            i += 2;
+            while (i + 1 < text.len && !(text.data[i] == '*' && text.data[i + 1] == '/')) {
+                i++;
+            }
+            i += 2;
+            continue;
+        }
+        if (is_digit(c) || (c == '.' && i + 1 < text.len && is_digit(text.data[i + 1]))) {
+            i = scan_number(text, i);
+            continue;
+        }
+        if (!is_ident_start(c)) {
+            i++;
+            continue;
+        }
+
+        U64 end = scan_ident(text, i);
+        Macro *macro = find_macro(pp, ar_str(&text.data[i], end - i));
+        if (macro == NULL || macro->expanding) {
+            i = end;
+            continue;
+        }
+
+        ArStr *args = NULL;
+        U32 arg_count = 0;
+        U64 next = end;
+        if (macro->function_like) {
+            U64 paren = end;
+            while (paren < text.len && (is_space(text.data[paren]) || text.data[paren] == '\n')) {
+                paren++;
+            }
+            // A function-like macro without arguments is just a name.
+            if (paren >= text.len || text.data[paren] != '(') {
+                i = end;
+                continue;
+            }
+            next = parse_args(scratch.arena, text, paren, &args, &arg_count);
+            if (next == 0) {
+                pp->failed = true;
+                break;
+            }
+            // 'F()' passes one empty argument.
+            if (macro->param_count == 0 && arg_count == 1 && args[0].len == 0) {
+                arg_count = 0;
+            }
+            if (arg_count != macro->param_count) {
+                pp->failed = true;
+                break;
+            }
+        }
+
+        buffer_push(out, ar_str(&text.data[copied], i - copied));
+
+        Buffer substituted = {.arena = scratch.arena};
+        substitute(pp, macro, args, &substituted);
+        Buffer expanded = {.arena = scratch.arena};
+        macro->expanding = true;
+        expand_text(pp, buffer_str(substituted), &expanded);
+        macro->expanding = false;
+
+        // The expansion is rescanned along with the rest of the text (C99
+        // 6.10.3.4), which only changes anything when it ends in the name
+        // of a function-like macro whose arguments follow it.
+        ArStr result = buffer_str(expanded);
+        U64 tail = result.len;
+        while (tail > 0 && is_ident_char(result.data[tail - 1])) {
+            tail--;
+        }
+        Macro *tail_macro = NULL;
+        if (tail < result.len && is_ident_start(result.data[tail])) {
+            tail_macro = find_macro(pp, ar_str_chop_start(result, tail));
+        }
+        if (tail_macro != NULL && tail_macro->function_like && !tail_macro->expanding) {
+            buffer_push(out, ar_str(result.data, tail));
+            push_newlines(out, count_newlines(ar_str(&text.data[end], next - end)));
+
+            Buffer rest = {.arena = scratch.arena};
+            buffer_push(&rest, ar_str_chop_start(result, tail));
+            buffer_push(&rest, ar_str_chop_start(text, next));
+            expand_text(pp, buffer_str(rest), out);
+            copied = text.len;
+            break;
+        }
+        buffer_push(out, result);
+
+        // Keep the line count when the arguments spanned several lines.
+        push_newlines(out, count_newlines(ar_str(&text.data[end], next - end)));
+
+        i = next;
+        copied = next;
+    }
+    buffer_push(out, ar_str(&text.data[copied], text.len - copied));
+
+    ar_scratch_release(&scratch);
+}
+
+//
+// Conditions
+//
+
+typedef struct Expression Expression;
+struct Expression {
+    ArStr text;
+    U64 i;
+    B8 failed;
+};
+
+static I64 parse_ternary(Expression *expr);
+
+// Names glslang may predefine depending on the version and target.
+static B8 is_predefined_name(ArStr name) {
+    return (name.len > 3 && memcmp(name.data, "GL_", 3) == 0) ||
+        (name.len > 2 && memcmp(name.data, "__", 2) == 0);
+}
+
+static void expression_skip(Expression *expr) {
+    expr->i = skip_space(expr->text, expr->i);
+}
+
+static B8 expression_match(Expression *expr, const char *op) {
+    expression_skip(expr);
+    U64 len = strlen(op);
+    if (expr->i + len > expr->text.len || memcmp(&expr->text.data[expr->i], op, len) != 0) {
+        return false;
+    }
+    // Don't match '<' in '<<' or '&' in '&&'.
+    if (len == 1 && expr->i + 1 < expr->text.len) {
+        U8 next = expr->text.data[expr->i + 1];
+        U8 c = op[0];
+        if ((c == '<' || c == '>') && (next == c || next == '=')) {
+            return false;
+        }
+        if ((c == '&' || c == '|') && next == c) {
+            return false;
+        }
+        if ((c == '!' || c == '=') && next == '=') {
+            return false;
+        }
+    }
+    expr->i += len;
+    return true;
+}
+
+static I64 parse_primary(Expression *expr) {
+    expression_skip(expr);
+    if (expr->i >= expr->text.len) {
+        expr->failed = true;
+        return 0;
+    }
+
+    U8 c = expr->text.data[expr->i];
+    if (c == '(') {
+        expr->i++;
+        I64 value = parse_ternary(expr);
+        if (!expression_match(expr, ")")) {
+            expr->failed = true;
+        }
+        return value;
+    }
+
+    if (is_digit(c)) {
+        U64 end = scan_number(expr->text, expr->i);
+        char number[64] = {0};
+        U64 len = end - expr->i;
+        if (len >= sizeof(number)) {
+            expr->failed = true;
+            return 0;
+        }
+        memcpy(number, &expr->text.data[expr->i], len);
+        expr->i = end;
+        return strtoll(number, NULL, 0);
+    }
+
+    // Identifiers left after expansion aren't macros and evaluate to 0,
+    // unless glslang could have predefined them.
+    if (is_ident_start(c)) {
+        U64 end = scan_ident(expr->text, expr->i);
+        ArStr ident = ar_str(&expr->text.data[expr->i], end - expr->i);
+        expr->i = end;
+        if (is_predefined_name(ident)) {
+            expr->failed = true;
+        }
+        return 0;
+    }
+
+    expr->failed = true;
+    return 0;
+}
+
+static I64 parse_unary(Expression *expr) {
+    if (expression_match(expr, "!")) {
+        return !parse_unary(expr);
+    }
+    if (expression_match(expr, "~")) {
+        return ~parse_unary(expr);
+    }
+    if (expression_match(expr, "-")) {
+        return -parse_unary(expr);
+    }
+    if (expression_match(expr, "+")) {
+        return parse_unary(expr);
+    }
+    return parse_primary(expr);
+}
+
+static I64 parse_multiplicative(Expression *expr) {
+    I64 value = parse_unary(expr);
+    for (;;) {
+        if (expression_match(expr, "*")) {
+            value *= parse_unary(expr);
+        } else if (expression_match(expr, "/") || expression_match(expr, "%")) {
+            B8 modulo = expr->text.data[expr->i - 1] == '%';
+            I64 rhs = parse_unary(expr);
+            if (rhs == 0) {
+                expr->failed = true;
+                return 0;
+            }
+            value = modulo ? value % rhs : value / rhs;
+        } else {
+            return value;
+        }
+    }
+}
+
+static I64 parse_additive(Expression *expr) {
+    I64 value = parse_multiplicative(expr);
+    for (;;) {
+        if (expression_match(expr, "+")) {
+            value += parse_multiplicative(expr);
+        } else if (expression_match(expr, "-")) {
+            value -= parse_multiplicative(expr);
+        } else {
+            return value;
+        }
+    }
+}
+
+static I64 parse_shift(Expression *expr) {
+    I64 value = parse_additive(expr);
+    for (;;) {
+        if (expression_match(expr, "<<")) {
+            value <<= parse_additive(expr);
+        } else if (expression_match(expr, ">>")) {
+            value >>= parse_additive(expr);
+        } else {
+            return value;
+        }
+    }
+}
+
+static I64 parse_relational(Expression *expr) {
+    I64 value = parse_shift(expr);
+    for (;;) {
+        if (expression_match(expr, "<=")) {
+            value = value <= parse_shift(expr);
+        } else if (expression_match(expr, ">=")) {
+            value = value >= parse_shift(expr);
+        } else if (expression_match(expr, "<")) {
+            value = value < parse_shift(expr);
+        } else if (expression_match(expr, ">")) {
+            value = value > parse_shift(expr);
+        } else {
+            return value;
+        }
+    }
+}
+
+static I64 parse_equality(Expression *expr) {
+    I64 value = parse_relational(expr);
+    for (;;) {
+        if (expression_match(expr, "==")) {
+            value = value == parse_relational(expr);
+        } else if (expression_match(expr, "!=")) {
+            value = value != parse_relational(expr);
+        } else {
+            return value;
+        }
+    }
+}
+
+static I64 parse_bit_and(Expression *expr) {
+    I64 value = parse_equality(expr);
+    while (expression_match(expr, "&")) {
+        value &= parse_equality(expr);
+    }
+    return value;
+}
+
+static I64 parse_bit_xor(Expression *expr) {
+    I64 value = parse_bit_and(expr);
+    while (expression_match(expr, "^")) {
+        value ^= parse_bit_and(expr);
+    }
+    return value;
+}
+
+static I64 parse_bit_or(Expression *expr) {
+    I64 value = parse_bit_xor(expr);
+    while (expression_match(expr, "|")) {
+        value |= parse_bit_xor(expr);
+    }
+    return value;
+}
+
+static I64 parse_logical_and(Expression *expr) {
+    I64 value = parse_bit_or(expr);
+    while (expression_match(expr, "&&")) {
+        I64 rhs = parse_bit_or(expr);
+        value = value && rhs;
+    }
+    return value;
+}
+
+static I64 parse_logical_or(Expression *expr) {
+    I64 value = parse_logical_and(expr);
+    while (expression_match(expr, "||")) {
+        I64 rhs = parse_logical_and(expr);
+        value = value || rhs;
+    }
+    return value;
+}
+
+static I64 parse_ternary(Expression *expr) {
+    I64 condition = parse_logical_or(expr);
+    if (!expression_match(expr, "?")) {
+        return condition;
+    }
+    I64 a = parse_ternary(expr);
+    if (!expression_match(expr, ":")) {
+        expr->failed = true;
+        return 0;
+    }
+    I64 b = parse_ternary(expr);
+    return condition ? a : b;
+}
+
+// Evaluates an #if or #elif condition. 'defined' is resolved before the
+// rest is expanded.
+static B8 evaluate(Preprocessor *pp, ArStr condition) {
+    ArTemp scratch = ar_scratch_get(NULL, 0);
+    Buffer resolved = {.arena = scratch.arena};
+
+    U64 copied = 0;
+    U64 i = 0;
+    while (i < condition.len) {
+        if (!is_ident_start(condition.data[i])) {
+            i++;
+            continue;
+        }
+        U64 end = scan_ident(condition, i);
+        if (!ar_str_match(ar_str(&condition.data[i], end - i), ar_str_lit("defined"), AR_STR_MATCH_FLAG_EXACT)) {
+            i = end;
+            continue;
+        }
+
+        U64 j = skip_space(condition, end);
+        B8 paren = j < condition.len && condition.data[j] == '(';
+        if (paren) {
+            j = skip_space(condition, j + 1);
+        }
+        U64 name_end = scan_ident(condition, j);
+        ArStr name = ar_str(&condition.data[j], name_end - j);
+        j = skip_space(condition, name_end);
+        if (name.len == 0 || (paren && (j >= condition.len || condition.data[j] != ')'))) {
+            pp->failed = true;
+            break;
+        }
+        if (paren) {
+            j++;
+        }
+
+        B8 defined = find_macro(pp, name) != NULL;
+        if (!defined && is_predefined_name(name)) {
+            pp->failed = true;
+            break;
+        }
+
+        buffer_push(&resolved, ar_str(&condition.data[copied], i - copied));
+        buffer_push(&resolved, defined ? ar_str_lit(" 1 ") : ar_str_lit(" 0 "));
+        i = j;
+        copied = j;
+    }
+    buffer_push(&resolved, ar_str(&condition.data[copied], condition.len - copied));
+
+    Buffer expanded = {.arena = scratch.arena};
+    expand_text(pp, buffer_str(resolved), &expanded);
+
+    Expression expr = {
+        .text = buffer_str(expanded),
+    };
+    I64 value = parse_ternary(&expr);
+    expression_skip(&expr);
+    if (expr.failed || expr.i != expr.text.len) {
+        pp->failed = true;
+    }
+
+    ar_scratch_release(&scratch);
+    return value != 0;
+}
+
+//
+// Directives
+//
+
+static B8 is_active(const Preprocessor *pp) {
+    return pp->depth == 0 || pp->conditionals[pp->depth - 1].active;
+}
+
+static void push_conditional(Preprocessor *pp, B8 condition) {
+    if (pp->depth == MAX_CONDITIONAL_DEPTH) {
+        pp->failed = true;
+        return;
+    }
+    B8 parent = is_active(pp);
+    pp->conditionals[pp->depth] = (Conditional) {
+        .active = parent && condition,
+        .taken = !parent || condition,
+    };
+    pp->depth++;
+}
+
+// Removes comments and joins continued lines.
+static ArStr clean_directive(ArArena *arena, ArStr line) {
+    Buffer clean = {.arena = arena};
+    U64 i = 0;
+    while (i < line.len) {
+        U8 c = line.data[i];
+        if (c == '\\' && i + 1 < line.len && line.data[i + 1] == '\n') {
+            i += 2;
+        } else if (c == '/' && i + 1 < line.len && line.data[i + 1] == '/') {
+            break;
+        } else if (c == '/' && i + 1 < line.len && line.data[i + 1] == '*') {
+            i += 2;
+            while (i + 1 < line.len && !(line.data[i] == '*' && line.data[i + 1] == '/')) {
+                i++;
+            }
+            i += 2;
+            buffer_push(&clean, ar_str_lit(" "));
+        } else {
+            buffer_push(&clean, ar_str(&line.data[i], 1));
+            i++;
+        }
+    }
+    return ar_str_trim(buffer_str(clean));
+}
+
+static void parse_define(Preprocessor *pp, ArStr rest) {
+    U64 name_end = scan_ident(rest, 0);
+    if (name_end == 0) {
+        pp->failed = true;
+        return;
+    }
+
+    ArStr name = ar_str_push_copy(pp->arena, ar_str(rest.data, name_end));
+    Macro macro = {
+        .name = name,
+        .hash = ar_fvn1a_hash(name.data, name.len),
+    };
+    U64 definition = mix(macro.hash, 0);
+
+    U64 i = name_end;
+    // Only a '(' directly after the name makes a function-like macro.
+    if (i < rest.len && rest.data[i] == '(') {
+        macro.function_like = true;
+        definition = mix(definition, '(');
+
+        U32 capacity = 0;
+        for (U64 j = i; j < rest.len && rest.data[j] != ')'; j++) {
+            capacity += rest.data[j] == ',' || rest.data[j] == '(';
+        }
+        macro.params = ar_arena_push_arr_no_zero(pp->arena, ArStr, capacity);
+
+        i = skip_space(rest, i + 1);
+        while (i < rest.len && rest.data[i] != ')') {
+            U64 end = scan_ident(rest, i);
+            if (end == i || macro.param_count == capacity) {
+                pp->failed = true;
+                return;
+            }
+            ArStr param = ar_str_push_copy(pp->arena, ar_str(&rest.data[i], end - i));
+            macro.params[macro.param_count] = param;
+            macro.param_count++;
+            definition = mix(definition, ar_fvn1a_hash(param.data, param.len));
+
+            i = skip_space(rest, end);
+            if (i < rest.len && rest.data[i] == ',') {
+                i = skip_space(rest, i + 1);
+            }
+        }
+        if (i >= rest.len) {
+            pp->failed = true;
+            return;
+        }
+        i++;
+    }
+
+    macro.body = ar_str_push_copy(pp->arena, ar_str_trim(ar_str_chop_start(rest, i)));
+    macro.definition = mix(definition, ar_fvn1a_hash(macro.body.data, macro.body.len));
+    define_macro(pp, macro);
+}
+
+// Handles the directive 'line', which starts at the '#' and includes its
+// continuation lines and trailing newline.
+static void directive(Preprocessor *pp, ArStr line, Buffer *out) {
+    ArTemp scratch = ar_scratch_get(&out->arena, 1);
+
+    ArStr clean = clean_directive(scratch.arena, ar_str_chop_start(line, 1));
+    U64 name_end = scan_ident(clean, 0);
+    ArStr name = ar_str(clean.data, name_end);
+    ArStr rest = ar_str_trim(ar_str_chop_start(clean, name_end));
+
+    B8 emit = false;
+    if (ar_str_match(name, ar_str_lit("ifdef"), AR_STR_MATCH_FLAG_EXACT) ||
+            ar_str_match(name, ar_str_lit("ifndef"), AR_STR_MATCH_FLAG_EXACT)) {
+        B8 defined = find_macro(pp, rest) != NULL;
+        if (!defined && is_predefined_name(rest)) {
+            pp->failed = true;
+        }
+        B8 negate = name.len == 6;
+        push_conditional(pp, defined != negate);
+    } else if (ar_str_match(name, ar_str_lit("if"), AR_STR_MATCH_FLAG_EXACT)) {
+        push_conditional(pp, is_active(pp) && evaluate(pp, rest));
+    } else if (ar_str_match(name, ar_str_lit("elif"), AR_STR_MATCH_FLAG_EXACT)) {
+        if (pp->depth == 0 || pp->conditionals[pp->depth - 1].seen_else) {
+            pp->failed = true;
+        } else {
+            Conditional *conditional = &pp->conditionals[pp->depth - 1];
+            conditional->active = !conditional->taken && evaluate(pp, rest);
+            conditional->taken |= conditional->active;
+        }
+    } else if (ar_str_match(name, ar_str_lit("else"), AR_STR_MATCH_FLAG_EXACT)) {
+        if (pp->depth == 0 || pp->conditionals[pp->depth - 1].seen_else) {
+            pp->failed = true;
+        } else {
+            Conditional *conditional = &pp->conditionals[pp->depth - 1];
+            conditional->active = !conditional->taken;
+            conditional->taken = true;
+            conditional->seen_else = true;
+        }
+    } else if (ar_str_match(name, ar_str_lit("endif"), AR_STR_MATCH_FLAG_EXACT)) {
+        if (pp->depth == 0) {
+            pp->failed = true;
+        } else {
+            pp->depth--;
+        }
+    } else if (!is_active(pp)) {
+        // Skipped.
+    } else if (ar_str_match(name, ar_str_lit("define"), AR_STR_MATCH_FLAG_EXACT)) {
+        parse_define(pp, rest);
+    } else if (ar_str_match(name, ar_str_lit("undef"), AR_STR_MATCH_FLAG_EXACT)) {
+        undef_macro(pp, ar_str_push_copy(pp->arena, rest));
+    } else {
+        // #version, #extension, #pragma, #line and #error are glslang's.
+        emit = true;
+    }
+
+    if (emit) {
+        buffer_push(out, line);
+    } else {
+        push_newlines(out, count_newlines(line));
+    }
+
+    ar_scratch_release(&scratch);
+}
+
+// Returns the end of the line starting at 'i', past its newline and any
+// continued lines.
+static U64 line_end(ArStr text, U64 i) {
+    while (i < text.len) {
+        if (text.data[i] == '\n' && !(i > 0 && text.data[i - 1] == '\\')) {
+            return i + 1;
+        }
+        i++;
+    }
+    return i;
+}
+
+static B8 is_directive_line(ArStr text, U64 i) {
+    i = skip_space(text, i);
+    return i < text.len && text.data[i] == '#';
+}
+
+// Returns whether a block comment is open at 'end', 'open' being whether one
+// is at 'start'.
+static B8 scan_comments(ArStr text, U64 start, U64 end, B8 open) {
+    U64 i = start;
+    while (i < end) {
+        if (open) {
+            if (text.data[i] == '*' && i + 1 < end && text.data[i + 1] == '/') {
+                open = false;
+                i++;
+            }
+        } else if (text.data[i] == '/' && i + 1 < end && text.data[i + 1] == '*') {
+            open = true;
+            i++;
+        } else if (text.data[i] == '/' && i + 1 < end && text.data[i + 1] == '/') {
+            while (i + 1 < end && text.data[i + 1] != '\n') {
+                i++;
+            }
+        }
+        i++;
+    }
+    return open;
+}
+
+// 'line_start' is false when the part continues a line of the previous one,
+// its first line can't be a directive then.
+static void preprocess_part(Preprocessor *pp, ArStr text, B8 line_start, Buffer *out) {
+    U64 i = 0;
+    while (i < text.len && !pp->failed) {
+        if ((i > 0 || line_start) && !pp->in_comment && is_directive_line(text, i)) {
+            U64 end = line_end(text, i);
+            U64 hash = skip_space(text, i);
+            buffer_push(out, ar_str(&text.data[i], hash - i));
+            directive(pp, ar_str(&text.data[hash], end - hash), out);
+            pp->in_comment = scan_comments(text, i, end, false);
+            i = end;
+            continue;
+        }
+
+        // Expand everything up to the next directive at once, macro
+        // arguments may span lines. Lines starting inside a block comment
+        // are never directives.
+        U64 end = line_end(text, i);
+        pp->in_comment = scan_comments(text, i, end, pp->in_comment);
+        while (end < text.len && (pp->in_comment || !is_directive_line(text, end))) {
+            U64 next = line_end(text, end);
+            pp->in_comment = scan_comments(text, end, next, pp->in_comment);
+            end = next;
+        }
+        ArStr region = ar_str(&text.data[i], end - i);
+        if (is_active(pp)) {
+            expand_text(pp, region, out);
+        } else {
+            push_newlines(out, count_newlines(region));
+        }
+        i = end;
+    }
+}
+
+//
+// Cache
+//
+
+static CachedPart *find_cached(Preprocessor *pp, ArStr text, B8 line_start, U64 text_hash, U64 state) {
+    U32 index = pp->buckets[mix(text_hash, state) % CACHE_BUCKET_COUNT];
+    while (index != 0) {
+        CachedPart *part = &pp->cache[index - 1];
+        if (part->text_hash == text_hash && part->state == state &&
+                part->line_start == line_start && part->started_in_comment == pp->in_comment &&
+                ar_str_match(part->text, text, AR_STR_MATCH_FLAG_EXACT)) {
+            return part;
+        }
+        index = part->next;
+    }
+    return NULL;
+}
+
+static void add_cached(Preprocessor *pp, CachedPart part) {
+    if (pp->cache_count == pp->cache_capacity) {
+        U32 capacity = pp->cache_capacity == 0 ? 64 : pp->cache_capacity * 2;
+        CachedPart *cache = ar_arena_push_arr_no_zero(pp->arena, CachedPart, capacity);
+        if (pp->cache_count > 0) {
+            memcpy(cache, pp->cache, pp->cache_count * sizeof(CachedPart));
+        }
+        pp->cache = cache;
+        pp->cache_capacity = capacity;
+    }
+
+    U32 bucket = mix(part.text_hash, part.state) % CACHE_BUCKET_COUNT;
+    part.next = pp->buckets[bucket];
+    pp->cache[pp->cache_count] = part;
+    pp->cache_count++;
+    pp->buckets[bucket] = pp->cache_count;
+}
+
+Preprocessor *preprocessor_create(ArArena *arena) {
+    Preprocessor *pp = ar_arena_push_arr(arena, Preprocessor, 1);
+    pp->arena = arena;
+    pp->macro_capacity = 64;
+    pp->macros = ar_arena_push_arr(arena, Macro, pp->macro_capacity);
+    pp->slot_count = 128;
+    pp->slots = ar_arena_push_arr(arena, U32, pp->slot_count);
+    return pp;
+}
+
+B8 preprocess(Preprocessor *pp, ArArena *arena, ArStrList parts, ArStr *output) {
+    reset(pp);
+    Buffer out = {.arena = arena};
+
+    // Parts are only cached when they start and end outside of any
+    // conditional so nothing outside the part affects what it emits.
+    for (ArStrListNode *curr = parts.first; curr != NULL && !pp->failed; curr = curr->next) {
+        ArStr text = curr->str;
+        B8 line_start = out.len == 0 || out.data[out.len - 1] == '\n';
+        U64 text_hash = mix(mix(ar_fvn1a_hash(text.data, text.len), line_start), pp->in_comment);
+        B8 cacheable = pp->depth == 0;
+
+        if (cacheable) {
+            CachedPart *cached = find_cached(pp, text, line_start, text_hash, pp->state);
+            if (cached != NULL) {
+                buffer_push(&out, cached->output);
+                for (U32 i = 0; i < cached->op_count; i++) {
+                    if (cached->ops[i].undef) {
+                        undef_macro(pp, cached->ops[i].macro.name);
+                    } else {
+                        define_macro(pp, cached->ops[i].macro);
+                    }
+                }
+                pp->in_comment = cached->in_comment;
+                pp->hits++;
+                continue;
+            }
+        }
+
+        U64 state = pp->state;
+        B8 started_in_comment = pp->in_comment;
+        U64 start = out.len;
+        pp->op_count = 0;
+        preprocess_part(pp, text, line_start, &out);
+        pp->misses++;
+
+        if (cacheable && pp->depth == 0 && !pp->failed) {
+            CachedPart part = {
+                .text = ar_str_push_copy(pp->arena, text),
+                .line_start = line_start,
+                .started_in_comment = started_in_comment,
+                .text_hash = text_hash,
+                .state = state,
+                .output = ar_str_push_copy(pp->arena, ar_str(&out.data[start], out.len - start)),
+                .op_count = pp->op_count,
+                .in_comment = pp->in_comment,
+            };
+            part.ops = ar_arena_push_arr_no_zero(pp->arena, MacroOp, part.op_count);
+            memcpy(part.ops, pp->ops, part.op_count * sizeof(MacroOp));
+            add_cached(pp, part);
+        }
+    }
+
+    if (pp->failed || pp->depth != 0) {
+        return false;
+    }
+
+    *output = buffer_str(out);
+    return true;
+}
+
+void preprocessor_stats(const Preprocessor *pp, U32 *hits, U32 *misses) {
+    *hits = pp->hits;
+    *misses = pp->misses;
+}
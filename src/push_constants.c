@@ -0,0 +1,510 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+#include <string.h>
+
+// Reorders the members of the push constant block so the ones only the
+// vertex stage accesses come first, then the ones both stages access, then
+// the fragment only ones and last the ones nothing accesses, each group in
+// declaration order. The range of each stage then covers only what it
+// accesses and the stages overlap only in the members they share, so
+// pushing one stage's members doesn't require pushing the other's.
+//
+// Members are laid out again with the std430 rules push constants default
+// to, explicit offsets aren't kept. Blocks only accessed through access
+// chains into single members are reordered, a stage loading or passing
+// around the whole block depends on its member order.
+//
+// Vulkan requires the block a stage declares to lie within the stage's
+// push constant range, so after reflection the members a stage doesn't
+// access are also removed from its declaration, the others keep their
+// offsets. The range is then exactly what the declaration spans.
+
+typedef struct Block Block;
+struct Block {
+    SpvModule module;
+    // Per id, instruction index + 1 of the definition.
+    U32 *definitions;
+    // Per id, ArrayStride decoration.
+    U32 *array_strides;
+
+    // 0 if the stage declares no push constants.
+    U32 variable;
+    U32 type;
+    U32 member_count;
+    // Per member.
+    B8 *accessed;
+    // Set if anything but an access chain into a single member uses the
+    // block.
+    B8 whole;
+};
+
+typedef struct Layout Layout;
+struct Layout {
+    U32 size;
+    // 0 if the layout isn't known.
+    U32 alignment;
+};
+
+typedef struct IndexConstant IndexConstant;
+struct IndexConstant {
+    // Emitted after this instruction, the declaration of its type.
+    U32 after;
+    U32 type;
+    U32 id;
+    U32 value;
+};
+
+static SpvInstruction definition_of(const Block *block, U32 id) {
+    U32 index = id < block->module.bound ? block->definitions[id] : 0;
+    return index != 0 ? block->module.instructions[index - 1] : (SpvInstruction) {0};
+}
+
+static B8 is_access_chain(U32 opcode) {
+    return opcode == SpvOpAccessChain || opcode == SpvOpInBoundsAccessChain;
+}
+
+// True if the member is decorated with 'decoration', its literal goes to
+// 'value' if given.
+static B8 member_decoration(const Block *block, U32 type, U32 member, U32 decoration, U32 *value) {
+    const SpvModule *module = &block->module;
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (module->sections[i] != SPV_SECTION_ANNOTATION || inst.opcode != SpvOpMemberDecorate ||
+                inst.words[1] != type || inst.words[2] != member || inst.words[3] != decoration) {
+            continue;
+        }
+        if (value != NULL) {
+            *value = inst.word_count > 4 ? inst.words[4] : 0;
+        }
+        return true;
+    }
+    return false;
+}
+
+static U32 vector_alignment(U32 component_alignment, U32 count) {
+    return component_alignment * (count == 3 ? 4 : count);
+}
+
+static Layout member_layout(const Block *block, U32 type, U32 member);
+
+// std430 size and alignment of a value of 'type', strides are taken from
+// the decorations.
+static Layout layout_of(const Block *block, U32 type, U32 matrix_stride, B8 row_major) {
+    SpvInstruction inst = definition_of(block, type);
+    switch (inst.opcode) {
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+            return (Layout) {inst.words[2] / 8, inst.words[2] / 8};
+        case SpvOpTypeVector: {
+            Layout component = layout_of(block, inst.words[2], 0, false);
+            return (Layout) {component.size * inst.words[3], vector_alignment(component.alignment, inst.words[3])};
+        }
+        case SpvOpTypeMatrix: {
+            // Arrays of columns, or of rows when row major.
+            SpvInstruction column = definition_of(block, inst.words[2]);
+            Layout component = layout_of(block, column.words[2], 0, false);
+            U32 rows = column.words[3];
+            U32 cols = inst.words[3];
+            return (Layout) {
+                matrix_stride * (row_major ? rows : cols),
+                vector_alignment(component.alignment, row_major ? cols : rows),
+            };
+        }
+        case SpvOpTypeArray: {
+            // Lengths from specialization constants aren't known.
+            SpvInstruction length = definition_of(block, inst.words[3]);
+            Layout element = layout_of(block, inst.words[2], matrix_stride, row_major);
+            if (length.opcode != SpvOpConstant || block->array_strides[type] == 0) {
+                return (Layout) {0};
+            }
+            return (Layout) {block->array_strides[type] * length.words[3], element.alignment};
+        }
+        case SpvOpTypeStruct: {
+            Layout layout = {0};
+            for (U32 i = 0; i < inst.word_count - 2u; i++) {
+                U32 offset;
+                Layout member = member_layout(block, type, i);
+                if (member.alignment == 0 || !member_decoration(block, type, i, SpvDecorationOffset, &offset)) {
+                    return (Layout) {0};
+                }
+                if (member.alignment > layout.alignment) {
+                    layout.alignment = member.alignment;
+                }
+                if (offset + member.size > layout.size) {
+                    layout.size = offset + member.size;
+                }
+            }
+            if (layout.alignment != 0) {
+                layout.size = (layout.size + layout.alignment - 1) / layout.alignment * layout.alignment;
+            }
+            return layout;
+        }
+        default:
+            return (Layout) {0};
+    }
+}
+
+static Layout member_layout(const Block *block, U32 type, U32 member) {
+    SpvInstruction inst = definition_of(block, type);
+    U32 matrix_stride = 0;
+    member_decoration(block, type, member, SpvDecorationMatrixStride, &matrix_stride);
+    B8 row_major = member_decoration(block, type, member, SpvDecorationRowMajor, NULL);
+    return layout_of(block, inst.words[2 + member], matrix_stride, row_major);
+}
+
+// Finds the push constant block and the members the stage accesses.
+// Returns false if the module is invalid.
+static B8 analyze(ArArena *arena, ArStr spv, Block *block, U16 *positions) {
+    *block = (Block) {
+        .module = spv_parse_module(arena, spv),
+    };
+    SpvModule *module = &block->module;
+    U32 bound = module->bound;
+    if (bound == 0) {
+        return false;
+    }
+
+    block->definitions = ar_arena_push_arr(arena, U32, bound);
+    block->array_strides = ar_arena_push_arr(arena, U32, bound);
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        U32 result = spv_result_id(inst);
+        if (result != 0 && result < bound) {
+            block->definitions[result] = i + 1;
+        }
+
+        if (inst.opcode == SpvOpDecorate && inst.words[2] == SpvDecorationArrayStride && inst.word_count > 3) {
+            block->array_strides[inst.words[1]] = inst.words[3];
+        } else if (inst.opcode == SpvOpVariable && inst.words[3] == SpvStorageClassPushConstant && block->variable == 0) {
+            SpvInstruction pointer = definition_of(block, inst.words[1]);
+            SpvInstruction type = definition_of(block, pointer.words[3]);
+            if (type.opcode == SpvOpTypeStruct) {
+                block->variable = result;
+                block->type = type.words[1];
+                block->member_count = type.word_count - 2;
+            }
+        }
+    }
+
+    if (block->variable == 0) {
+        return true;
+    }
+
+    block->accessed = ar_arena_push_arr(arena, B8, block->member_count);
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (module->sections[i] < SPV_SECTION_GLOBAL || spv_result_id(inst) == block->variable) {
+            continue;
+        }
+
+        U32 id_count = spv_id_operands(inst, positions);
+        for (U32 j = 0; j < id_count; j++) {
+            if (inst.words[positions[j]] != block->variable) {
+                continue;
+            }
+
+            // Struct members are always indexed by constants.
+            SpvInstruction index = {0};
+            if (is_access_chain(inst.opcode) && positions[j] == 3 && inst.word_count > 4) {
+                index = definition_of(block, inst.words[4]);
+            }
+            if (index.opcode == SpvOpConstant && index.words[3] < block->member_count) {
+                block->accessed[index.words[3]] = true;
+            } else {
+                block->whole = true;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Writes the module with the block's members in 'order', renumbering the
+// member indices of names, decorations and access chains. Members missing
+// from 'order' are removed, their 'new_index' isn't read.
+static ArStr rewrite(ArArena *arena, const Block *block, const U32 *order, U32 order_count, const U32 *new_index, const U32 *new_offsets) {
+    const SpvModule *module = &block->module;
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // Index constants by signedness and value. Missing ones are declared
+    // right after their type.
+    U32 *index_constants[2] = {
+        ar_arena_push_arr(scratch.arena, U32, block->member_count),
+        ar_arena_push_arr(scratch.arena, U32, block->member_count),
+    };
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (inst.opcode != SpvOpConstant || inst.words[3] >= block->member_count) {
+            continue;
+        }
+        SpvInstruction type = definition_of(block, inst.words[1]);
+        if (type.opcode == SpvOpTypeInt && type.words[2] == 32 && index_constants[type.words[3] != 0][inst.words[3]] == 0) {
+            index_constants[type.words[3] != 0][inst.words[3]] = inst.words[2];
+        }
+    }
+    IndexConstant *new_constants = ar_arena_push_arr_no_zero(scratch.arena, IndexConstant, 2 * block->member_count);
+    U32 new_constant_count = 0;
+    U32 bound = module->bound;
+
+    // Only chains into the variable itself index the block, analyze() made
+    // sure they all index it with a constant.
+    U32 *chain_indices = ar_arena_push_arr(scratch.arena, U32, module->instruction_count);
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (!is_access_chain(inst.opcode) || inst.words[3] != block->variable) {
+            continue;
+        }
+        SpvInstruction index = definition_of(block, inst.words[4]);
+        SpvInstruction type = definition_of(block, index.words[1]);
+        U32 value = new_index[index.words[3]];
+        U32 *constant = &index_constants[type.words[3] != 0][value];
+        if (*constant == 0) {
+            *constant = bound;
+            new_constants[new_constant_count] = (IndexConstant) {
+                .after = block->definitions[index.words[1]] - 1,
+                .type = index.words[1],
+                .id = bound,
+                .value = value,
+            };
+            new_constant_count++;
+            bound++;
+        }
+        chain_indices[i] = *constant;
+    }
+
+    U32 *words = ar_arena_push_arr_no_zero(arena, U32, module->spv.len / sizeof(U32) + 8 * block->member_count);
+    memcpy(words, module->spv.data, SPV_HEADER_WORDS * sizeof(U32));
+    U64 offset = SPV_HEADER_WORDS;
+
+    // Per old member index.
+    B8 *kept = ar_arena_push_arr(scratch.arena, B8, block->member_count);
+    for (U32 i = 0; i < order_count; i++) {
+        kept[order[i]] = true;
+    }
+
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        U32 *out = &words[offset];
+        memcpy(out, inst.words, inst.word_count * sizeof(U32));
+        offset += inst.word_count;
+
+        switch (inst.opcode) {
+            case SpvOpTypeStruct:
+                if (inst.words[1] == block->type) {
+                    for (U32 j = 0; j < order_count; j++) {
+                        out[2 + j] = inst.words[2 + order[j]];
+                    }
+                    out[0] = ((2 + order_count) << SpvWordCountShift) | SpvOpTypeStruct;
+                    offset -= block->member_count - order_count;
+                }
+                break;
+            case SpvOpMemberName:
+            case SpvOpMemberDecorateString:
+                if (inst.words[1] == block->type && !kept[inst.words[2]]) {
+                    offset -= inst.word_count;
+                } else if (inst.words[1] == block->type) {
+                    out[2] = new_index[inst.words[2]];
+                }
+                break;
+            case SpvOpMemberDecorate:
+                if (inst.words[1] == block->type && !kept[inst.words[2]]) {
+                    offset -= inst.word_count;
+                } else if (inst.words[1] == block->type) {
+                    out[2] = new_index[inst.words[2]];
+                    if (inst.words[3] == SpvDecorationOffset) {
+                        out[4] = new_offsets[inst.words[2]];
+                    }
+                }
+                break;
+            case SpvOpAccessChain:
+            case SpvOpInBoundsAccessChain:
+                if (chain_indices[i] != 0) {
+                    out[4] = chain_indices[i];
+                }
+                break;
+            default:
+                break;
+        }
+
+        for (U32 j = 0; j < new_constant_count; j++) {
+            if (new_constants[j].after != i) {
+                continue;
+            }
+            words[offset + 0] = (4 << SpvWordCountShift) | SpvOpConstant;
+            words[offset + 1] = new_constants[j].type;
+            words[offset + 2] = new_constants[j].id;
+            words[offset + 3] = new_constants[j].value;
+            offset += 4;
+        }
+    }
+
+    words[3] = bound;
+
+    ar_scratch_release(&scratch);
+    return ar_str((const U8 *) words, offset * sizeof(U32));
+}
+
+void spv_reorder_push_constants(ArArena *arena, ArStr name, ArStr *vertex_spv, ArStr *fragment_spv) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    // Large enough for the operands of any instruction.
+    U16 *positions = ar_arena_push_arr_no_zero(scratch.arena, U16, 0xffff);
+
+    Block vertex;
+    Block fragment;
+    if (!analyze(scratch.arena, *vertex_spv, &vertex, positions) ||
+            !analyze(scratch.arena, *fragment_spv, &fragment, positions) ||
+            (vertex.variable == 0 && fragment.variable == 0)) {
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    const Block *block = vertex.variable != 0 ? &vertex : &fragment;
+    U32 member_count = block->member_count;
+    if (vertex.whole || fragment.whole) {
+        ar_info("%.*s: Push constants are used as a whole, leaving their member order.", (I32) name.len, name.data);
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    // Both stages have to agree on the layout they're rewritten to.
+    if (vertex.variable != 0 && fragment.variable != 0) {
+        B8 same = vertex.member_count == fragment.member_count;
+        for (U32 i = 0; i < member_count && same; i++) {
+            U32 vertex_offset = 0;
+            U32 fragment_offset = 0;
+            member_decoration(&vertex, vertex.type, i, SpvDecorationOffset, &vertex_offset);
+            member_decoration(&fragment, fragment.type, i, SpvDecorationOffset, &fragment_offset);
+            same = vertex_offset == fragment_offset &&
+                member_layout(&vertex, vertex.type, i).size == member_layout(&fragment, fragment.type, i).size;
+        }
+        if (!same) {
+            ar_info("%.*s: The stages declare different push constant blocks, leaving their member order.",
+                    (I32) name.len, name.data);
+            ar_scratch_release(&scratch);
+            return;
+        }
+    }
+
+    U32 *order = ar_arena_push_arr_no_zero(scratch.arena, U32, member_count);
+    U32 order_count = 0;
+    for (U32 group = 0; group < 4; group++) {
+        for (U32 i = 0; i < member_count; i++) {
+            B8 in_vertex = vertex.variable != 0 && vertex.accessed[i];
+            B8 in_fragment = fragment.variable != 0 && fragment.accessed[i];
+            U32 member_group = in_vertex ? (in_fragment ? 1 : 0) : (in_fragment ? 2 : 3);
+            if (member_group == group) {
+                order[order_count] = i;
+                order_count++;
+            }
+        }
+    }
+
+    U32 moved_count = 0;
+    for (U32 i = 0; i < member_count; i++) {
+        moved_count += order[i] != i;
+    }
+    if (moved_count == 0) {
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    // Indexed by the old member index.
+    U32 *new_index = ar_arena_push_arr_no_zero(scratch.arena, U32, member_count);
+    U32 *new_offsets = ar_arena_push_arr_no_zero(scratch.arena, U32, member_count);
+    Layout old_layout = layout_of(block, block->type, 0, false);
+    Layout new_layout = {0};
+    for (U32 i = 0; i < member_count; i++) {
+        Layout member = member_layout(block, block->type, order[i]);
+        if (member.alignment == 0) {
+            new_layout.alignment = 0;
+            break;
+        }
+        if (member.alignment > new_layout.alignment) {
+            new_layout.alignment = member.alignment;
+        }
+        U32 member_offset = (new_layout.size + member.alignment - 1) / member.alignment * member.alignment;
+        new_index[order[i]] = i;
+        new_offsets[order[i]] = member_offset;
+        new_layout.size = member_offset + member.size;
+    }
+    if (new_layout.alignment != 0) {
+        new_layout.size = (new_layout.size + new_layout.alignment - 1) / new_layout.alignment * new_layout.alignment;
+    }
+
+    // maxPushConstantsSize is small, never grow the block.
+    if (old_layout.alignment == 0 || new_layout.alignment == 0 || new_layout.size > old_layout.size) {
+        ar_info("%.*s: Reordering the push constant members doesn't fit their layout, leaving their member order.",
+                (I32) name.len, name.data);
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    if (vertex.variable != 0) {
+        *vertex_spv = rewrite(arena, &vertex, order, member_count, new_index, new_offsets);
+    }
+    if (fragment.variable != 0) {
+        *fragment_spv = rewrite(arena, &fragment, order, member_count, new_index, new_offsets);
+    }
+
+    ar_info("%.*s: Moved %u of %u push constant members to make the range of each stage contiguous.",
+            (I32) name.len, name.data, moved_count, member_count);
+
+    ar_scratch_release(&scratch);
+}
+
+void spv_trim_push_constants(ArArena *arena, ArStr name, const char *stage, ArStr *spv, PushConstantRange *range) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    U16 *positions = ar_arena_push_arr_no_zero(scratch.arena, U16, 0xffff);
+    Block block;
+    if (!analyze(scratch.arena, *spv, &block, positions) || block.variable == 0 || range->size == 0) {
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    // A block used as a whole keeps every member.
+    U32 *order = ar_arena_push_arr_no_zero(scratch.arena, U32, block.member_count);
+    U32 *new_index = ar_arena_push_arr_no_zero(scratch.arena, U32, block.member_count);
+    U32 *offsets = ar_arena_push_arr_no_zero(scratch.arena, U32, block.member_count);
+    U32 order_count = 0;
+    U32 start = 0xffffffff;
+    U32 end = 0;
+    for (U32 i = 0; i < block.member_count; i++) {
+        Layout member = member_layout(&block, block.type, i);
+        if (member.alignment == 0 || !member_decoration(&block, block.type, i, SpvDecorationOffset, &offsets[i])) {
+            ar_info("%.*s: The layout of the %s push constants isn't known, leaving their declaration.",
+                    (I32) name.len, name.data, stage);
+            ar_scratch_release(&scratch);
+            return;
+        }
+        if (!block.whole && !block.accessed[i]) {
+            continue;
+        }
+
+        order[order_count] = i;
+        new_index[i] = order_count;
+        order_count++;
+        if (offsets[i] < start) {
+            start = offsets[i];
+        }
+        if (offsets[i] + member.size > end) {
+            end = offsets[i] + member.size;
+        }
+    }
+    if (order_count == 0) {
+        ar_scratch_release(&scratch);
+        return;
+    }
+
+    if (order_count < block.member_count) {
+        *spv = rewrite(arena, &block, order, order_count, new_index, offsets);
+    }
+    range->offset = start & ~3u;
+    range->size = ((end + 3) & ~3u) - range->offset;
+
+    ar_scratch_release(&scratch);
+}
@@ -4,6 +4,50 @@
 
 #include <spirv_cross_c.h>
 
+const ArStr REFLECTED_DATA_TYPE_NAMES[REFLECTED_DATA_TYPE_COUNT] = {
+    ar_str_lit("ERR::Unkown"),
+
+    ar_str_lit("void"),
+    ar_str_lit("struct"),
+    ar_str_lit("sampler"),
+
+    ar_str_lit("int"),
+    ar_str_lit("uint"),
+    ar_str_lit("float"),
+    ar_str_lit("double"),
+
+    ar_str_lit("ivec2"),
+    ar_str_lit("uvec2"),
+    ar_str_lit("vec2"),
+    ar_str_lit("dvec2"),
+
+    ar_str_lit("ivec3"),
+    ar_str_lit("uvec3"),
+    ar_str_lit("vec3"),
+    ar_str_lit("dvec3"),
+
+    ar_str_lit("ivec4"),
+    ar_str_lit("uvec4"),
+    ar_str_lit("vec4"),
+    ar_str_lit("dvec4"),
+
+    ar_str_lit("mat2"),
+    ar_str_lit("dmat2"),
+
+    ar_str_lit("mat3"),
+    ar_str_lit("dmat3"),
+
+    ar_str_lit("mat4"),
+    ar_str_lit("dmat4"),
+};
+
+const ArStr BACKEND_NAMES[BACKEND_COUNT] = {
+    ar_str_lit("glsl-es"),
+    ar_str_lit("glsl330"),
+    ar_str_lit("hlsl"),
+    ar_str_lit("msl"),
+};
+
 static void error_cb(void *userdata, const char *error) {
     (void) userdata;
     ar_error("%s", error);
@@ -190,6 +234,17 @@ static ReflectedType reflect(ArArena *arena, spvc_compiler compiler, spvc_type t
                 spvc_type_id member_type_id = spvc_type_get_member_type(type, i);
                 spvc_type member_type = spvc_compiler_get_type_handle(compiler, member_type_id);
                 reflected.members[i] = reflect(arena, compiler, member_type, ar_str_cstr(member_name));
+
+                size_t member_size = 0;
+                spvc_compiler_get_declared_struct_member_size(compiler, type, i, &member_size);
+                reflected.members[i].size = member_size;
+                spvc_compiler_type_struct_member_offset(compiler, type, i, &reflected.members[i].offset);
+                if (reflected.members[i].array_dimensions > 0) {
+                    spvc_compiler_type_struct_member_array_stride(compiler, type, i, &reflected.members[i].array_stride);
+                }
+                if (reflected.members[i].cols > 1) {
+                    spvc_compiler_type_struct_member_matrix_stride(compiler, type, i, &reflected.members[i].matrix_stride);
+                }
             }
         } break;
 
@@ -211,19 +266,99 @@ static ReflectedType reflect(ArArena *arena, spvc_compiler compiler, spvc_type t
 }
 
 
-ReflectedStage reflect_spv(ArArena *arena, ArStr spv) {
-    ReflectedStage shader = {0}; 
+// Created on the first reflection and reused by every later one.
+static spvc_context ctx = NULL;
 
-    spvc_context ctx;
-    spvc_context_create(&ctx);
+void reflection_terminate(void) {
+    if (ctx != NULL) {
+        spvc_context_destroy(ctx);
+        ctx = NULL;
+    }
+}
 
-    spvc_context_set_error_callback(ctx, error_cb, NULL);
+// Compiles the parsed IR to 'backend'. The IR is copied unless 'last' is
+// set, the last user may take it over.
+static ArStr cross_compile(ArArena *arena, spvc_parsed_ir ir, Backend backend, B8 last) {
+    spvc_backend spvc_backends[BACKEND_COUNT] = {
+        [BACKEND_GLSL_ES] = SPVC_BACKEND_GLSL,
+        [BACKEND_GLSL_330] = SPVC_BACKEND_GLSL,
+        [BACKEND_HLSL] = SPVC_BACKEND_HLSL,
+        [BACKEND_MSL] = SPVC_BACKEND_MSL,
+    };
 
+    spvc_compiler compiler;
+    spvc_capture_mode mode = last ? SPVC_CAPTURE_MODE_TAKE_OWNERSHIP : SPVC_CAPTURE_MODE_COPY;
+    if (spvc_context_create_compiler(ctx, spvc_backends[backend], ir, mode, &compiler) != SPVC_SUCCESS) {
+        return (ArStr) {0};
+    }
+
+    spvc_compiler_options options;
+    spvc_compiler_create_compiler_options(compiler, &options);
+    switch (backend) {
+        case BACKEND_GLSL_ES:
+            spvc_compiler_options_set_uint(options, SPVC_COMPILER_OPTION_GLSL_VERSION, 300);
+            spvc_compiler_options_set_bool(options, SPVC_COMPILER_OPTION_GLSL_ES, true);
+            // Only values decorated RelaxedPrecision become mediump.
+            spvc_compiler_options_set_bool(options, SPVC_COMPILER_OPTION_GLSL_ES_DEFAULT_FLOAT_PRECISION_HIGHP, true);
+            break;
+        case BACKEND_GLSL_330:
+            spvc_compiler_options_set_uint(options, SPVC_COMPILER_OPTION_GLSL_VERSION, 330);
+            spvc_compiler_options_set_bool(options, SPVC_COMPILER_OPTION_GLSL_ES, false);
+            break;
+        case BACKEND_HLSL:
+            spvc_compiler_options_set_uint(options, SPVC_COMPILER_OPTION_HLSL_SHADER_MODEL, 50);
+            break;
+        case BACKEND_MSL:
+        case BACKEND_COUNT:
+            break;
+    }
+    spvc_compiler_install_compiler_options(compiler, options);
+
+    const char *source = NULL;
+    if (spvc_compiler_compile(compiler, &source) != SPVC_SUCCESS || source == NULL) {
+        return (ArStr) {0};
+    }
+    // The source lives in the context which is cleared after reflection.
+    return ar_str_push_copy(arena, ar_str_cstr((char *) source));
+}
+
+ArStr cross_compile_cpp(ArArena *arena, ArStr spv) {
+    if (ctx == NULL) {
+        spvc_context_create(&ctx);
+        spvc_context_set_error_callback(ctx, error_cb, NULL);
+    }
+
+    ArStr source = {0};
+    spvc_parsed_ir ir;
+    spvc_compiler compiler;
+    const char *cpp = NULL;
+    if (spvc_context_parse_spirv(ctx, (const SpvId *) spv.data, spv.len / sizeof(SpvId), &ir) == SPVC_SUCCESS &&
+            spvc_context_create_compiler(ctx, SPVC_BACKEND_CPP, ir, SPVC_CAPTURE_MODE_TAKE_OWNERSHIP, &compiler) == SPVC_SUCCESS &&
+            spvc_compiler_compile(compiler, &cpp) == SPVC_SUCCESS && cpp != NULL) {
+        source = ar_str_push_copy(arena, ar_str_cstr((char *) cpp));
+    } else {
+        ar_error("SPIRV-Cross: Failed to compile to C++.");
+    }
+
+    spvc_context_release_allocations(ctx);
+    return source;
+}
+
+ReflectedStage reflect_spv(ArArena *arena, ArStr spv, U32 backends, ArStr sources[BACKEND_COUNT]) {
+    ReflectedStage shader = {0}; 
+
+    if (ctx == NULL) {
+        spvc_context_create(&ctx);
+        spvc_context_set_error_callback(ctx, error_cb, NULL);
+    }
+
+    // The module is parsed once for reflection and every backend.
     spvc_parsed_ir ir;
     spvc_context_parse_spirv(ctx, (const SpvId *) spv.data, spv.len / sizeof(SpvId), &ir);
 
     spvc_compiler compiler;
-    spvc_context_create_compiler(ctx, SPVC_BACKEND_NONE, ir, SPVC_CAPTURE_MODE_TAKE_OWNERSHIP, &compiler);
+    spvc_capture_mode mode = backends != 0 ? SPVC_CAPTURE_MODE_COPY : SPVC_CAPTURE_MODE_TAKE_OWNERSHIP;
+    spvc_context_create_compiler(ctx, SPVC_BACKEND_NONE, ir, mode, &compiler);
 
     // Reflection
     spvc_resources resources;
@@ -244,10 +379,280 @@ ReflectedStage reflect_spv(ArArena *arena, ArStr spv) {
             spvc_type type = spvc_compiler_get_type_handle(compiler, resource.type_id);
 
             shader.types[i][j] = reflect(arena, compiler, type, ar_str_cstr(resource.name));
+
+            size_t size = 0;
+            spvc_type base_type = spvc_compiler_get_type_handle(compiler, resource.base_type_id);
+            spvc_compiler_get_declared_struct_size(compiler, base_type, &size);
+            shader.types[i][j].size = size;
+
+            ArStr instance_name = ar_str_cstr(spvc_compiler_get_name(compiler, resource.id));
+            if (instance_name.len == 0) {
+                instance_name = ar_str_cstr(resource.name);
+            }
+            shader.types[i][j].instance_name = ar_str_push_copy(arena, instance_name);
+            shader.types[i][j].set = spvc_compiler_get_decoration(compiler, resource.id, SpvDecorationDescriptorSet);
+            shader.types[i][j].binding = spvc_compiler_get_decoration(compiler, resource.id, SpvDecorationBinding);
+        }
+    }
+
+    // Vertex inputs
+    if (spvc_compiler_get_execution_model(compiler) == SpvExecutionModelVertex) {
+        const spvc_reflected_resource *list = NULL;
+        spvc_resources_get_resource_list_for_type(resources, SPVC_RESOURCE_TYPE_STAGE_INPUT, &list, &shader.input_count);
+        shader.inputs = ar_arena_push_arr(arena, ReflectedInput, shader.input_count);
+        for (U32 i = 0; i < shader.input_count; i++) {
+            spvc_type type = spvc_compiler_get_type_handle(compiler, list[i].type_id);
+            U32 vec_size = spvc_type_get_vector_size(type);
+            U32 cols = spvc_type_get_columns(type);
+            ReflectedInput input = {
+                .name = ar_str_push_copy(arena, ar_str_cstr(list[i].name)),
+                .location = spvc_compiler_get_decoration(compiler, list[i].id, SpvDecorationLocation),
+                .data_type = translate_type(spvc_type_get_basetype(type), vec_size, cols),
+                .vec_size = vec_size,
+                .cols = cols,
+            };
+
+            // Insertion sort by location.
+            U32 j = i;
+            while (j > 0 && shader.inputs[j - 1].location > input.location) {
+                shader.inputs[j] = shader.inputs[j - 1];
+                j--;
+            }
+            shader.inputs[j] = input;
+        }
+    }
+
+    // Workgroup size
+    if (spvc_compiler_get_execution_model(compiler) == SpvExecutionModelGLCompute) {
+        for (U32 i = 0; i < 3; i++) {
+            shader.workgroup_size[i] = spvc_compiler_get_execution_mode_argument_by_index(compiler, SpvExecutionModeLocalSize, i);
+        }
+    }
+
+    // Bindings
+    U32 stage = SHADER_STAGE_VERTEX;
+    if (spvc_compiler_get_execution_model(compiler) == SpvExecutionModelFragment) {
+        stage = SHADER_STAGE_FRAGMENT;
+    } else if (spvc_compiler_get_execution_model(compiler) == SpvExecutionModelGLCompute) {
+        stage = SHADER_STAGE_COMPUTE;
+    }
+
+    const struct {
+        spvc_resource_type resource_type;
+        DescriptorType descriptor_type;
+    } binding_types[] = {
+        {SPVC_RESOURCE_TYPE_UNIFORM_BUFFER, DESCRIPTOR_TYPE_UNIFORM_BUFFER},
+        {SPVC_RESOURCE_TYPE_STORAGE_BUFFER, DESCRIPTOR_TYPE_STORAGE_BUFFER},
+        {SPVC_RESOURCE_TYPE_SAMPLED_IMAGE, DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER},
+        {SPVC_RESOURCE_TYPE_SEPARATE_IMAGE, DESCRIPTOR_TYPE_SAMPLED_IMAGE},
+        {SPVC_RESOURCE_TYPE_STORAGE_IMAGE, DESCRIPTOR_TYPE_STORAGE_IMAGE},
+        {SPVC_RESOURCE_TYPE_SEPARATE_SAMPLERS, DESCRIPTOR_TYPE_SAMPLER},
+    };
+
+    const spvc_reflected_resource *binding_lists[ar_arrlen(binding_types)] = {0};
+    size_t binding_list_counts[ar_arrlen(binding_types)] = {0};
+    for (U32 i = 0; i < ar_arrlen(binding_types); i++) {
+        spvc_resources_get_resource_list_for_type(resources, binding_types[i].resource_type, &binding_lists[i], &binding_list_counts[i]);
+        shader.binding_count += binding_list_counts[i];
+    }
+
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    B8 *non_uniform = spv_find_non_uniform_variables(scratch.arena, spv);
+    U32 bound = spv_bound(spv);
+
+    shader.bindings = ar_arena_push_arr(arena, ReflectedBinding, shader.binding_count);
+    U32 binding_index = 0;
+    for (U32 i = 0; i < ar_arrlen(binding_types); i++) {
+        for (U32 j = 0; j < binding_list_counts[i]; j++) {
+            spvc_reflected_resource resource = binding_lists[i][j];
+            spvc_type type = spvc_compiler_get_type_handle(compiler, resource.type_id);
+
+            U32 count = 1;
+            B8 runtime_array = false;
+            for (U32 k = 0; k < spvc_type_get_num_array_dimensions(type); k++) {
+                if (!spvc_type_array_dimension_is_literal(type, k)) {
+                    ar_error("%s: Descriptor arrays sized by specialization constants are not supported.", resource.name);
+                    continue;
+                }
+
+                U32 len = spvc_type_get_array_dimension(type, k);
+                if (len == 0) {
+                    runtime_array = true;
+                }
+                count *= len;
+            }
+
+            // Prefer the instance name since the resource name of a buffer
+            // is the name of its block.
+            ArStr name = ar_str_cstr(spvc_compiler_get_name(compiler, resource.id));
+            if (name.len == 0) {
+                name = ar_str_cstr(resource.name);
+            }
+
+            shader.bindings[binding_index] = (ReflectedBinding) {
+                .name = ar_str_push_copy(arena, name),
+                .type = binding_types[i].descriptor_type,
+                .set = spvc_compiler_get_decoration(compiler, resource.id, SpvDecorationDescriptorSet),
+                .binding = spvc_compiler_get_decoration(compiler, resource.id, SpvDecorationBinding),
+                .count = count,
+                .runtime_array = runtime_array,
+                .stages = stage,
+            };
+            if (resource.id < bound && non_uniform[resource.id]) {
+                shader.bindings[binding_index].non_uniform_stages = stage;
+            }
+            binding_index++;
         }
     }
 
-    spvc_context_destroy(ctx);
+    ar_scratch_release(&scratch);
+
+    // Push constants. SPIRV-Cross follows the access chains into the block,
+    // loading all of it accesses every member.
+    const spvc_reflected_resource *push_constants = NULL;
+    size_t push_constant_count = 0;
+    spvc_resources_get_resource_list_for_type(resources, SPVC_RESOURCE_TYPE_PUSH_CONSTANT, &push_constants, &push_constant_count);
+    for (U32 i = 0; i < push_constant_count; i++) {
+        const spvc_buffer_range *ranges = NULL;
+        size_t range_count = 0;
+        spvc_compiler_get_active_buffer_ranges(compiler, push_constants[i].id, &ranges, &range_count);
+        if (range_count == 0) {
+            continue;
+        }
+
+        U32 start = ranges[0].offset;
+        U32 end = ranges[0].offset + ranges[0].range;
+        for (U32 j = 1; j < range_count; j++) {
+            if (ranges[j].offset < start) {
+                start = ranges[j].offset;
+            }
+            if (ranges[j].offset + ranges[j].range > end) {
+                end = ranges[j].offset + ranges[j].range;
+            }
+        }
+        start &= ~3u;
+        end = (end + 3) & ~3u;
+        shader.push_constant_range = (PushConstantRange) {
+            .stages = stage,
+            .offset = start,
+            .size = end - start,
+        };
+    }
+
+    for (U32 i = 0; i < BACKEND_COUNT; i++) {
+        if (!(backends & (1 << i))) {
+            continue;
+        }
+        B8 last = (backends >> (i + 1)) == 0;
+        sources[i] = cross_compile(arena, ir, i, last);
+        if (sources[i].len == 0) {
+            ar_error("SPIRV-Cross: Failed to compile to %.*s.", (I32) BACKEND_NAMES[i].len, BACKEND_NAMES[i].data);
+        }
+    }
+
+    // Frees the parsed IR and compilers but keeps the context around.
+    spvc_context_release_allocations(ctx);
 
     return shader;
 }
+
+Usize merge_bindings(ArArena *arena, const ReflectedStage *stages, U32 stage_count, ReflectedBinding **bindings) {
+    Usize total = 0;
+    for (U32 i = 0; i < stage_count; i++) {
+        total += stages[i].binding_count;
+    }
+
+    ReflectedBinding *merged = ar_arena_push_arr(arena, ReflectedBinding, total);
+    Usize count = 0;
+    for (U32 i = 0; i < stage_count; i++) {
+        for (U32 j = 0; j < stages[i].binding_count; j++) {
+            ReflectedBinding binding = stages[i].bindings[j];
+
+            ReflectedBinding *existing = NULL;
+            for (U32 k = 0; k < count; k++) {
+                if (merged[k].set == binding.set && merged[k].binding == binding.binding) {
+                    existing = &merged[k];
+                    break;
+                }
+            }
+
+            if (existing == NULL) {
+                merged[count] = binding;
+                count++;
+                continue;
+            }
+
+            if (existing->type != binding.type || existing->count != binding.count) {
+                ar_error("%.*s: Set %u binding %u is already used by %.*s with a different type.",
+                        (I32) binding.name.len, binding.name.data,
+                        binding.set, binding.binding,
+                        (I32) existing->name.len, existing->name.data);
+                continue;
+            }
+            existing->stages |= binding.stages;
+            existing->non_uniform_stages |= binding.non_uniform_stages;
+        }
+    }
+
+    // Insertion sort by set, then binding.
+    for (U32 i = 1; i < count; i++) {
+        ReflectedBinding binding = merged[i];
+        U32 j = i;
+        while (j > 0 && (merged[j - 1].set > binding.set ||
+                    (merged[j - 1].set == binding.set && merged[j - 1].binding > binding.binding))) {
+            merged[j] = merged[j - 1];
+            j--;
+        }
+        merged[j] = binding;
+    }
+
+    // A variable descriptor count is only allowed on the last binding of a
+    // set.
+    for (U32 i = 0; i < count; i++) {
+        if (merged[i].runtime_array && i + 1 < count && merged[i + 1].set == merged[i].set) {
+            ar_error("%.*s: Runtime sized descriptor arrays must use the highest binding in set %u.",
+                    (I32) merged[i].name.len, merged[i].name.data, merged[i].set);
+        }
+    }
+
+    *bindings = merged;
+    return count;
+}
+
+Usize merge_push_constant_ranges(ArArena *arena, const ReflectedStage *stages, U32 stage_count, PushConstantRange **ranges) {
+    PushConstantRange *merged = ar_arena_push_arr(arena, PushConstantRange, stage_count);
+    Usize count = 0;
+    for (U32 i = 0; i < stage_count; i++) {
+        PushConstantRange range = stages[i].push_constant_range;
+        if (range.size == 0) {
+            continue;
+        }
+
+        // Layouts allow only one range per stage, so ranges are merged
+        // only when they match exactly. Overlapping ones stay apart and
+        // pushing the bytes they share takes the stages of both.
+        PushConstantRange *existing = NULL;
+        for (U32 j = 0; j < count; j++) {
+            if (merged[j].offset == range.offset && merged[j].size == range.size) {
+                existing = &merged[j];
+                break;
+            }
+        }
+        if (existing != NULL) {
+            existing->stages |= range.stages;
+            continue;
+        }
+
+        // Insertion sort by offset.
+        U32 j = count;
+        while (j > 0 && merged[j - 1].offset > range.offset) {
+            merged[j] = merged[j - 1];
+            j--;
+        }
+        merged[j] = range;
+        count++;
+    }
+
+    *ranges = merged;
+    return count;
+}
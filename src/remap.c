@@ -0,0 +1,294 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Canonicalizes a module, similar to glslang's spirv-remap. Debug information
+// is stripped and every id is renumbered from the content it's declared with
+// rather than the order glslang happened to generate it in. Unrelated source
+// changes then leave most ids untouched which makes modules compress and
+// deduplicate better.
+//
+// Declarations and functions are placed into a slot of an id range twice
+// their count by their content hash, so a changed declaration only moves its
+// own id. Function local ids follow sequentially within each function.
+
+typedef struct RankedId RankedId;
+struct RankedId {
+    U32 hash;
+    U32 order;
+    U32 id;
+};
+
+static U32 mix(U32 hash, U32 word) {
+    hash ^= word;
+    hash *= 16777619u;
+    return hash;
+}
+
+static I32 compare_ranked(const void *a, const void *b) {
+    const RankedId *_a = a;
+    const RankedId *_b = b;
+    if (_a->hash != _b->hash) {
+        return (_a->hash > _b->hash) - (_a->hash < _b->hash);
+    }
+    return (_a->order > _b->order) - (_a->order < _b->order);
+}
+
+static B8 is_non_semantic_import(SpvInstruction inst) {
+    const char prefix[] = "NonSemantic.";
+    return (inst.word_count - 2) * sizeof(U32) >= sizeof(prefix) - 1 &&
+        memcmp(&inst.words[2], prefix, sizeof(prefix) - 1) == 0;
+}
+
+static B8 is_stripped(const SpvModule *module, U32 index, const B8 *non_semantic_sets) {
+    SpvInstruction inst = module->instructions[index];
+    switch (module->sections[index]) {
+        case SPV_SECTION_DEBUG_SOURCE:
+        case SPV_SECTION_DEBUG_NAME:
+        case SPV_SECTION_DEBUG_MODULE_PROCESSED:
+            return true;
+        default:
+            break;
+    }
+
+    switch (inst.opcode) {
+        case SpvOpLine:
+        case SpvOpNoLine:
+            return true;
+        case SpvOpExtInstImport:
+            return is_non_semantic_import(inst);
+        case SpvOpExtInst:
+            return non_semantic_sets[inst.words[3]];
+        case SpvOpExtension:
+            return strcmp((const char *) &inst.words[1], "SPV_KHR_non_semantic_info") == 0;
+        default:
+            return false;
+    }
+}
+
+// Hashes an instruction with its result left out. Ids hash as the hash of
+// their declaration or, inside functions, as their local index.
+static U32 hash_instruction(SpvInstruction inst, const U32 *hashes, const U32 *local_index, U16 *positions) {
+    U32 result = spv_result_id(inst);
+    U32 hash = mix(2166136261u, inst.words[0]);
+
+    U32 id_count = spv_id_operands(inst, positions);
+    U32 next_id = 0;
+    for (U32 i = 1; i < inst.word_count; i++) {
+        B8 is_id = next_id < id_count && positions[next_id] == i;
+        if (!is_id) {
+            hash = mix(hash, inst.words[i]);
+            continue;
+        }
+        next_id++;
+
+        U32 id = inst.words[i];
+        if (id == result) {
+            continue;
+        }
+        if (local_index != NULL && local_index[id] != 0) {
+            hash = mix(hash, local_index[id]);
+        } else {
+            hash = mix(hash, hashes[id]);
+        }
+    }
+
+    return hash;
+}
+
+ArStr spv_canonicalize(ArArena *arena, ArStr spv) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    SpvModule module = spv_parse_module(scratch.arena, spv);
+    if (module.bound == 0) {
+        ar_scratch_release(&scratch);
+        return spv;
+    }
+
+    U16 *positions = ar_arena_push_arr_no_zero(scratch.arena, U16, UINT16_MAX);
+    B8 *non_semantic_sets = ar_arena_push_arr(scratch.arena, B8, module.bound);
+    B8 *stripped = ar_arena_push_arr(scratch.arena, B8, module.instruction_count);
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        if (inst.opcode == SpvOpExtInstImport && is_non_semantic_import(inst)) {
+            non_semantic_sets[inst.words[1]] = true;
+        }
+    }
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        stripped[i] = is_stripped(&module, i, non_semantic_sets);
+    }
+
+    // Annotations and entry points are part of what an id is declared as,
+    // two inputs of the same type only differ by their location.
+    U32 *annotation_hashes = ar_arena_push_arr(scratch.arena, U32, module.bound);
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        if (stripped[i]) {
+            continue;
+        }
+
+        if (module.sections[i] == SPV_SECTION_ANNOTATION && inst.opcode != SpvOpDecorationGroup) {
+            U32 hash = 2166136261u;
+            hash = mix(hash, inst.words[0]);
+            for (U32 j = 2; j < inst.word_count; j++) {
+                hash = mix(hash, inst.words[j]);
+            }
+            // Summed so the order of the annotations doesn't matter.
+            annotation_hashes[inst.words[1]] += hash;
+        } else if (module.sections[i] == SPV_SECTION_ENTRY_POINT) {
+            U32 hash = 2166136261u;
+            for (U32 j = 0; j < inst.word_count; j++) {
+                if (j != 2) {
+                    hash = mix(hash, inst.words[j]);
+                }
+            }
+            annotation_hashes[inst.words[2]] += hash;
+        }
+    }
+
+    // Hash the declarations in order, every operand is declared before use
+    // apart from forward pointers which hash as 0.
+    U32 *hashes = ar_arena_push_arr(scratch.arena, U32, module.bound);
+    RankedId *ranked = ar_arena_push_arr_no_zero(scratch.arena, RankedId, module.bound);
+    U32 ranked_count = 0;
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        U32 result = spv_result_id(inst);
+        if (stripped[i] || result == 0 || module.sections[i] == SPV_SECTION_FUNCTION) {
+            continue;
+        }
+
+        hashes[result] = mix(hash_instruction(inst, hashes, NULL, positions), annotation_hashes[result]);
+        ranked[ranked_count] = (RankedId) {
+            .hash = hashes[result],
+            .order = ranked_count,
+            .id = result,
+        };
+        ranked_count++;
+    }
+
+    // Functions hash their body with local ids numbered in order of
+    // declaration. Callees and labels declared further down hash as 0.
+    U32 *local_index = ar_arena_push_arr(scratch.arena, U32, module.bound);
+    U32 function_id = 0;
+    U32 local_count = 0;
+    U32 function_hash = 0;
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        SpvInstruction inst = module.instructions[i];
+        if (stripped[i] || module.sections[i] != SPV_SECTION_FUNCTION) {
+            continue;
+        }
+
+        if (inst.opcode == SpvOpFunction) {
+            local_count = 0;
+            function_hash = hash_instruction(inst, hashes, NULL, positions);
+            function_id = inst.words[2];
+            continue;
+        }
+
+        U32 result = spv_result_id(inst);
+        if (result != 0) {
+            local_count++;
+            local_index[result] = local_count;
+        }
+        function_hash = mix(function_hash, hash_instruction(inst, hashes, local_index, positions));
+
+        if (inst.opcode == SpvOpFunctionEnd) {
+            hashes[function_id] = mix(function_hash, annotation_hashes[function_id]);
+            ranked[ranked_count] = (RankedId) {
+                .hash = hashes[function_id],
+                .order = ranked_count,
+                .id = function_id,
+            };
+            ranked_count++;
+        }
+    }
+
+    // Collisions are probed in hash order so they don't depend on the order
+    // glslang declared things in either.
+    qsort(ranked, ranked_count, sizeof(RankedId), compare_ranked);
+
+    U32 slot_count = 1;
+    while (slot_count < ranked_count * 2) {
+        slot_count <<= 1;
+    }
+    B8 *taken = ar_arena_push_arr(scratch.arena, B8, slot_count);
+    U32 *map = ar_arena_push_arr(scratch.arena, U32, module.bound);
+    for (U32 i = 0; i < ranked_count; i++) {
+        U32 slot = ranked[i].hash & (slot_count - 1);
+        while (taken[slot]) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        taken[slot] = true;
+        map[ranked[i].id] = slot + 1;
+    }
+    U32 bound = slot_count + 1;
+
+    // Function local ids follow, function by function in the same order.
+    // Index of the first instruction of every function by function id.
+    U32 *function_first = ar_arena_push_arr(scratch.arena, U32, module.bound);
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        if (module.instructions[i].opcode == SpvOpFunction) {
+            function_first[module.instructions[i].words[2]] = i;
+        }
+    }
+    for (U32 i = 0; i < ranked_count; i++) {
+        U32 first = function_first[ranked[i].id];
+        if (module.instructions[first].opcode != SpvOpFunction || module.instructions[first].words[2] != ranked[i].id) {
+            continue;
+        }
+
+        for (U32 j = first + 1; j < module.instruction_count; j++) {
+            SpvInstruction inst = module.instructions[j];
+            if (inst.opcode == SpvOpFunctionEnd) {
+                break;
+            }
+            U32 result = spv_result_id(inst);
+            if (!stripped[j] && result != 0 && map[result] == 0) {
+                map[result] = bound;
+                bound++;
+            }
+        }
+    }
+
+    U64 word_count = SPV_HEADER_WORDS;
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        if (!stripped[i]) {
+            word_count += module.instructions[i].word_count;
+        }
+    }
+
+    U32 *words = ar_arena_push_arr_no_zero(arena, U32, word_count);
+    memcpy(words, spv.data, SPV_HEADER_WORDS * sizeof(U32));
+    words[3] = bound;
+
+    U64 offset = SPV_HEADER_WORDS;
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        if (stripped[i]) {
+            continue;
+        }
+
+        SpvInstruction inst = module.instructions[i];
+        memcpy(&words[offset], inst.words, inst.word_count * sizeof(U32));
+        U32 id_count = spv_id_operands(inst, positions);
+        for (U32 j = 0; j < id_count; j++) {
+            U32 *word = &words[offset + positions[j]];
+            if (map[*word] == 0) {
+                // Only referenced by stripped instructions.
+                map[*word] = bound;
+                bound++;
+                words[3] = bound;
+            }
+            *word = map[*word];
+        }
+        offset += inst.word_count;
+    }
+
+    ar_scratch_release(&scratch);
+
+    return ar_str((const U8 *) words, word_count * sizeof(U32));
+}
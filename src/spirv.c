@@ -0,0 +1,561 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+
+U32 spv_bound(ArStr spv) {
+    if (spv.len < SPV_HEADER_WORDS * sizeof(U32)) {
+        return 0;
+    }
+    return ((const U32 *) spv.data)[3];
+}
+
+B8 spv_next_instruction(ArStr spv, U64 *offset, SpvInstruction *instruction) {
+    const U32 *words = (const U32 *) spv.data;
+    U64 word_count = spv.len / sizeof(U32);
+
+    if (*offset < SPV_HEADER_WORDS) {
+        *offset = SPV_HEADER_WORDS;
+    }
+    if (*offset >= word_count) {
+        return false;
+    }
+
+    U32 first = words[*offset];
+    instruction->opcode = first & SpvOpCodeMask;
+    instruction->word_count = first >> SpvWordCountShift;
+    instruction->words = &words[*offset];
+
+    if (instruction->word_count == 0 || *offset + instruction->word_count > word_count) {
+        ar_error("SPIR-V: Malformed instruction at word %llu.", (unsigned long long) *offset);
+        return false;
+    }
+
+    *offset += instruction->word_count;
+    return true;
+}
+
+B8 *spv_find_non_uniform_variables(ArArena *arena, ArStr spv) {
+    U32 bound = spv_bound(spv);
+    B8 *variables = ar_arena_push_arr(arena, B8, bound);
+
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+    B8 *non_uniform = ar_arena_push_arr(scratch.arena, B8, bound);
+    // Variable each access chain is rooted in.
+    U32 *roots = ar_arena_push_arr(scratch.arena, U32, bound);
+
+    U64 offset = 0;
+    SpvInstruction inst;
+    while (spv_next_instruction(spv, &offset, &inst)) {
+        switch (inst.opcode) {
+            case SpvOpDecorate:
+                if (inst.word_count >= 3 && inst.words[2] == SpvDecorationNonUniform && inst.words[1] < bound) {
+                    non_uniform[inst.words[1]] = true;
+                }
+                break;
+
+            // glslang decorates both the index and the resulting access
+            // chain, check both.
+            case SpvOpAccessChain:
+            case SpvOpInBoundsAccessChain:
+            case SpvOpPtrAccessChain:
+            case SpvOpInBoundsPtrAccessChain: {
+                if (inst.word_count < 4) {
+                    break;
+                }
+                U32 result = inst.words[2];
+                U32 base = inst.words[3];
+                if (result >= bound || base >= bound) {
+                    break;
+                }
+
+                U32 root = roots[base] != 0 ? roots[base] : base;
+                roots[result] = root;
+
+                B8 is_non_uniform = non_uniform[result];
+                for (U32 i = 4; i < inst.word_count; i++) {
+                    if (inst.words[i] < bound && non_uniform[inst.words[i]]) {
+                        is_non_uniform = true;
+                    }
+                }
+                if (is_non_uniform) {
+                    variables[root] = true;
+                }
+            } break;
+
+            default:
+                break;
+        }
+    }
+
+    ar_scratch_release(&scratch);
+
+    return variables;
+}
+
+static void add_range(U16 *positions, U32 *count, U32 from, U32 to, U32 word_count) {
+    for (U32 i = from; i < to && i < word_count; i++) {
+        positions[*count] = i;
+        (*count)++;
+    }
+}
+
+// Number of words taken by the literal string starting at 'words'.
+static U32 string_word_count(const U32 *words, U32 max) {
+    for (U32 i = 0; i < max; i++) {
+        U32 word = words[i];
+        if ((word & 0xff) == 0 || (word & 0xff00) == 0 || (word & 0xff0000) == 0 || (word & 0xff000000) == 0) {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+// Memory operands: a mask followed by the operands of each set bit, ids for
+// the scopes and a literal for the alignment. OpCopyMemory may carry two.
+static void add_memory_operands(U16 *positions, U32 *count, const U32 *words, U32 mask_index, U32 word_count) {
+    U32 i = mask_index;
+    while (i < word_count) {
+        U32 mask = words[i];
+        i++;
+        if (mask & SpvMemoryAccessAlignedMask) {
+            i++;
+        }
+        if (mask & SpvMemoryAccessMakePointerAvailableMask) {
+            add_range(positions, count, i, i + 1, word_count);
+            i++;
+        }
+        if (mask & SpvMemoryAccessMakePointerVisibleMask) {
+            add_range(positions, count, i, i + 1, word_count);
+            i++;
+        }
+    }
+}
+
+typedef enum {
+    RESULT_NONE,
+    RESULT_ID,
+    RESULT_TYPE_AND_ID,
+} ResultKind;
+
+static ResultKind result_kind(U32 opcode) {
+    switch (opcode) {
+        case SpvOpNop:
+        case SpvOpSourceContinued:
+        case SpvOpSource:
+        case SpvOpSourceExtension:
+        case SpvOpName:
+        case SpvOpMemberName:
+        case SpvOpLine:
+        case SpvOpNoLine:
+        case SpvOpExtension:
+        case SpvOpMemoryModel:
+        case SpvOpEntryPoint:
+        case SpvOpExecutionMode:
+        case SpvOpExecutionModeId:
+        case SpvOpCapability:
+        case SpvOpTypeForwardPointer:
+        case SpvOpStore:
+        case SpvOpCopyMemory:
+        case SpvOpCopyMemorySized:
+        case SpvOpDecorate:
+        case SpvOpDecorateId:
+        case SpvOpDecorateString:
+        case SpvOpMemberDecorate:
+        case SpvOpMemberDecorateString:
+        case SpvOpGroupDecorate:
+        case SpvOpGroupMemberDecorate:
+        case SpvOpFunctionEnd:
+        case SpvOpImageWrite:
+        case SpvOpEmitVertex:
+        case SpvOpEndPrimitive:
+        case SpvOpEmitStreamVertex:
+        case SpvOpEndStreamPrimitive:
+        case SpvOpControlBarrier:
+        case SpvOpMemoryBarrier:
+        case SpvOpAtomicStore:
+        case SpvOpLoopMerge:
+        case SpvOpSelectionMerge:
+        case SpvOpBranch:
+        case SpvOpBranchConditional:
+        case SpvOpSwitch:
+        case SpvOpKill:
+        case SpvOpReturn:
+        case SpvOpReturnValue:
+        case SpvOpUnreachable:
+        case SpvOpLifetimeStart:
+        case SpvOpLifetimeStop:
+        case SpvOpModuleProcessed:
+        case SpvOpTerminateInvocation:
+        case SpvOpDemoteToHelperInvocationEXT:
+        case SpvOpBeginInvocationInterlockEXT:
+        case SpvOpEndInvocationInterlockEXT:
+            return RESULT_NONE;
+
+        case SpvOpString:
+        case SpvOpExtInstImport:
+        case SpvOpDecorationGroup:
+        case SpvOpLabel:
+        case SpvOpTypeVoid:
+        case SpvOpTypeBool:
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+        case SpvOpTypeImage:
+        case SpvOpTypeSampler:
+        case SpvOpTypeSampledImage:
+        case SpvOpTypeArray:
+        case SpvOpTypeRuntimeArray:
+        case SpvOpTypeStruct:
+        case SpvOpTypeOpaque:
+        case SpvOpTypePointer:
+        case SpvOpTypeFunction:
+        case SpvOpTypeEvent:
+        case SpvOpTypeDeviceEvent:
+        case SpvOpTypeReserveId:
+        case SpvOpTypeQueue:
+        case SpvOpTypePipe:
+        case SpvOpTypePipeStorage:
+        case SpvOpTypeNamedBarrier:
+        case SpvOpTypeRayQueryKHR:
+        case SpvOpTypeAccelerationStructureKHR:
+            return RESULT_ID;
+
+        default:
+            return RESULT_TYPE_AND_ID;
+    }
+}
+
+U32 spv_result_id(SpvInstruction instruction) {
+    switch (result_kind(instruction.opcode)) {
+        case RESULT_NONE:
+            return 0;
+        case RESULT_ID:
+            return instruction.word_count > 1 ? instruction.words[1] : 0;
+        case RESULT_TYPE_AND_ID:
+            return instruction.word_count > 2 ? instruction.words[2] : 0;
+    }
+    return 0;
+}
+
+U32 spv_result_type(SpvInstruction instruction) {
+    if (result_kind(instruction.opcode) != RESULT_TYPE_AND_ID || instruction.word_count < 2) {
+        return 0;
+    }
+    return instruction.words[1];
+}
+
+U32 spv_id_operands(SpvInstruction instruction, U16 *positions) {
+    const U32 *words = instruction.words;
+    U32 word_count = instruction.word_count;
+    U32 count = 0;
+
+    // First word after the result.
+    U32 start = 1;
+    switch (result_kind(instruction.opcode)) {
+        case RESULT_NONE:
+            break;
+        case RESULT_ID:
+            add_range(positions, &count, 1, 2, word_count);
+            start = 2;
+            break;
+        case RESULT_TYPE_AND_ID:
+            add_range(positions, &count, 1, 3, word_count);
+            start = 3;
+            break;
+    }
+
+    switch (instruction.opcode) {
+        // Nothing but literals.
+        case SpvOpNop:
+        case SpvOpSourceContinued:
+        case SpvOpSourceExtension:
+        case SpvOpExtension:
+        case SpvOpModuleProcessed:
+        case SpvOpCapability:
+        case SpvOpMemoryModel:
+        case SpvOpString:
+        case SpvOpExtInstImport:
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+        case SpvOpTypeOpaque:
+        case SpvOpTypePipe:
+        case SpvOpConstant:
+        case SpvOpSpecConstant:
+        case SpvOpConstantSampler:
+            break;
+
+        // Source language and version followed by an optional file.
+        case SpvOpSource:
+            add_range(positions, &count, 3, 4, word_count);
+            break;
+
+        // A single target id followed by literals.
+        case SpvOpName:
+        case SpvOpMemberName:
+        case SpvOpLine:
+        case SpvOpExecutionMode:
+        case SpvOpDecorate:
+        case SpvOpDecorateString:
+        case SpvOpMemberDecorate:
+        case SpvOpMemberDecorateString:
+        case SpvOpTypeForwardPointer:
+        case SpvOpSelectionMerge:
+        case SpvOpLifetimeStart:
+        case SpvOpLifetimeStop:
+            add_range(positions, &count, 1, 2, word_count);
+            break;
+
+        case SpvOpDecorateId:
+        case SpvOpExecutionModeId:
+            add_range(positions, &count, 1, 2, word_count);
+            add_range(positions, &count, 3, word_count, word_count);
+            break;
+
+        case SpvOpGroupMemberDecorate:
+            add_range(positions, &count, 1, 2, word_count);
+            for (U32 i = 2; i + 1 < word_count; i += 2) {
+                add_range(positions, &count, i, i + 1, word_count);
+            }
+            break;
+
+        case SpvOpEntryPoint: {
+            add_range(positions, &count, 2, 3, word_count);
+            U32 interface = 3 + string_word_count(&words[3], word_count - 3);
+            add_range(positions, &count, interface, word_count, word_count);
+        } break;
+
+        // Set id, then a literal instruction number.
+        case SpvOpExtInst:
+            add_range(positions, &count, 3, 4, word_count);
+            add_range(positions, &count, 5, word_count, word_count);
+            break;
+
+        // Component type, then literal sizes.
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+        case SpvOpTypeImage:
+            add_range(positions, &count, 2, 3, word_count);
+            break;
+
+        // Literal storage class, then the pointee.
+        case SpvOpTypePointer:
+            add_range(positions, &count, 3, 4, word_count);
+            break;
+
+        case SpvOpSpecConstantOp:
+            switch (words[3]) {
+                case SpvOpVectorShuffle:
+                case SpvOpCompositeInsert:
+                    add_range(positions, &count, 4, 6, word_count);
+                    break;
+                case SpvOpCompositeExtract:
+                    add_range(positions, &count, 4, 5, word_count);
+                    break;
+                default:
+                    add_range(positions, &count, 4, word_count, word_count);
+                    break;
+            }
+            break;
+
+        // Literal function control or storage class, then an id.
+        case SpvOpFunction:
+        case SpvOpVariable:
+            add_range(positions, &count, 4, 5, word_count);
+            break;
+
+        case SpvOpLoad:
+            add_range(positions, &count, 3, 4, word_count);
+            add_memory_operands(positions, &count, words, 4, word_count);
+            break;
+        case SpvOpStore:
+        case SpvOpCopyMemory:
+            add_range(positions, &count, 1, 3, word_count);
+            add_memory_operands(positions, &count, words, 3, word_count);
+            break;
+        case SpvOpCopyMemorySized:
+            add_range(positions, &count, 1, 4, word_count);
+            add_memory_operands(positions, &count, words, 4, word_count);
+            break;
+
+        case SpvOpArrayLength:
+        case SpvOpCompositeExtract:
+            add_range(positions, &count, 3, 4, word_count);
+            break;
+        case SpvOpVectorShuffle:
+        case SpvOpCompositeInsert:
+            add_range(positions, &count, 3, 5, word_count);
+            break;
+
+        // Ids up to a literal image operands mask, then ids again.
+        case SpvOpImageSampleImplicitLod:
+        case SpvOpImageSampleExplicitLod:
+        case SpvOpImageSampleProjImplicitLod:
+        case SpvOpImageSampleProjExplicitLod:
+        case SpvOpImageFetch:
+        case SpvOpImageRead:
+        case SpvOpImageSparseSampleImplicitLod:
+        case SpvOpImageSparseSampleExplicitLod:
+        case SpvOpImageSparseSampleProjImplicitLod:
+        case SpvOpImageSparseSampleProjExplicitLod:
+        case SpvOpImageSparseFetch:
+        case SpvOpImageSparseRead:
+            add_range(positions, &count, 3, 5, word_count);
+            add_range(positions, &count, 6, word_count, word_count);
+            break;
+        case SpvOpImageSampleDrefImplicitLod:
+        case SpvOpImageSampleDrefExplicitLod:
+        case SpvOpImageSampleProjDrefImplicitLod:
+        case SpvOpImageSampleProjDrefExplicitLod:
+        case SpvOpImageGather:
+        case SpvOpImageDrefGather:
+        case SpvOpImageSparseSampleDrefImplicitLod:
+        case SpvOpImageSparseSampleDrefExplicitLod:
+        case SpvOpImageSparseSampleProjDrefImplicitLod:
+        case SpvOpImageSparseSampleProjDrefExplicitLod:
+        case SpvOpImageSparseGather:
+        case SpvOpImageSparseDrefGather:
+            add_range(positions, &count, 3, 6, word_count);
+            add_range(positions, &count, 7, word_count, word_count);
+            break;
+        case SpvOpImageWrite:
+            add_range(positions, &count, 1, 4, word_count);
+            add_range(positions, &count, 5, word_count, word_count);
+            break;
+
+        // Trailing literals are loop controls or branch weights.
+        case SpvOpLoopMerge:
+            add_range(positions, &count, 1, 3, word_count);
+            break;
+        case SpvOpBranchConditional:
+            add_range(positions, &count, 1, 4, word_count);
+            break;
+
+        // Selector and default, then literal/label pairs. Assumes 32-bit
+        // selectors which is all glslang generates without int64.
+        case SpvOpSwitch:
+            add_range(positions, &count, 1, 3, word_count);
+            for (U32 i = 3; i + 1 < word_count; i += 2) {
+                add_range(positions, &count, i + 1, i + 2, word_count);
+            }
+            break;
+
+        // Scope, then a literal group operation.
+        case SpvOpGroupIAdd:
+        case SpvOpGroupFAdd:
+        case SpvOpGroupFMin:
+        case SpvOpGroupUMin:
+        case SpvOpGroupSMin:
+        case SpvOpGroupFMax:
+        case SpvOpGroupUMax:
+        case SpvOpGroupSMax:
+        case SpvOpGroupNonUniformBallotBitCount:
+        case SpvOpGroupNonUniformIAdd:
+        case SpvOpGroupNonUniformFAdd:
+        case SpvOpGroupNonUniformIMul:
+        case SpvOpGroupNonUniformFMul:
+        case SpvOpGroupNonUniformSMin:
+        case SpvOpGroupNonUniformUMin:
+        case SpvOpGroupNonUniformFMin:
+        case SpvOpGroupNonUniformSMax:
+        case SpvOpGroupNonUniformUMax:
+        case SpvOpGroupNonUniformFMax:
+        case SpvOpGroupNonUniformBitwiseAnd:
+        case SpvOpGroupNonUniformBitwiseOr:
+        case SpvOpGroupNonUniformBitwiseXor:
+        case SpvOpGroupNonUniformLogicalAnd:
+        case SpvOpGroupNonUniformLogicalOr:
+        case SpvOpGroupNonUniformLogicalXor:
+            add_range(positions, &count, 3, 4, word_count);
+            add_range(positions, &count, 5, word_count, word_count);
+            break;
+
+        // Everything else only takes ids.
+        default:
+            add_range(positions, &count, start, word_count, word_count);
+            break;
+    }
+
+    return count;
+}
+
+static SpvSection section_of(U32 opcode) {
+    switch (opcode) {
+        case SpvOpCapability:
+            return SPV_SECTION_CAPABILITY;
+        case SpvOpExtension:
+            return SPV_SECTION_EXTENSION;
+        case SpvOpExtInstImport:
+            return SPV_SECTION_EXT_INST_IMPORT;
+        case SpvOpMemoryModel:
+            return SPV_SECTION_MEMORY_MODEL;
+        case SpvOpEntryPoint:
+            return SPV_SECTION_ENTRY_POINT;
+        case SpvOpExecutionMode:
+        case SpvOpExecutionModeId:
+            return SPV_SECTION_EXECUTION_MODE;
+        case SpvOpString:
+        case SpvOpSource:
+        case SpvOpSourceContinued:
+        case SpvOpSourceExtension:
+            return SPV_SECTION_DEBUG_SOURCE;
+        case SpvOpName:
+        case SpvOpMemberName:
+            return SPV_SECTION_DEBUG_NAME;
+        case SpvOpModuleProcessed:
+            return SPV_SECTION_DEBUG_MODULE_PROCESSED;
+        case SpvOpDecorate:
+        case SpvOpDecorateId:
+        case SpvOpDecorateString:
+        case SpvOpMemberDecorate:
+        case SpvOpMemberDecorateString:
+        case SpvOpDecorationGroup:
+        case SpvOpGroupDecorate:
+        case SpvOpGroupMemberDecorate:
+            return SPV_SECTION_ANNOTATION;
+        case SpvOpFunction:
+            return SPV_SECTION_FUNCTION;
+        default:
+            return SPV_SECTION_GLOBAL;
+    }
+}
+
+SpvModule spv_parse_module(ArArena *arena, ArStr spv) {
+    SpvModule module = {
+        .spv = spv,
+        .bound = spv_bound(spv),
+    };
+
+    const U32 *words = (const U32 *) spv.data;
+    if (spv.len < SPV_HEADER_WORDS * sizeof(U32) || words[0] != SpvMagicNumber) {
+        ar_error("SPIR-V: Invalid module header.");
+        module.bound = 0;
+        return module;
+    }
+
+    U64 offset = 0;
+    SpvInstruction inst;
+    while (spv_next_instruction(spv, &offset, &inst)) {
+        module.instruction_count++;
+    }
+
+    module.instructions = ar_arena_push_arr_no_zero(arena, SpvInstruction, module.instruction_count);
+    module.sections = ar_arena_push_arr_no_zero(arena, SpvSection, module.instruction_count);
+
+    offset = 0;
+    B8 in_functions = false;
+    for (U32 i = 0; i < module.instruction_count; i++) {
+        spv_next_instruction(spv, &offset, &module.instructions[i]);
+
+        // Everything from the first function onwards belongs to functions.
+        SpvSection section = section_of(module.instructions[i].opcode);
+        if (section == SPV_SECTION_FUNCTION) {
+            in_functions = true;
+        }
+        module.sections[i] = in_functions ? SPV_SECTION_FUNCTION : section;
+    }
+
+    return module;
+}
@@ -0,0 +1,822 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+// A small mustache-like template language for emitting other output formats
+// from the reflection data.
+//
+//     {{name}}                           Field of the current or an enclosing scope.
+//     {{#each list}} ... {{/each}}       Repeat for every item of a list.
+//     {{#if field}} ... {{else}} ... {{/if}}
+//     {{#unless field}} ... {{/unless}}
+//     {{! comment}}
+//
+// Inside a loop '@index', '@first' and '@last' refer to the innermost loop.
+// Tags on a line of their own don't leave an empty line behind.
+//
+// Templates are compiled once into a flat instruction list with every field
+// resolved to an id, rendering never looks anything up by name.
+
+typedef enum {
+    TEMPLATE_SCOPE_ROOT,
+    TEMPLATE_SCOPE_STAGE,
+    TEMPLATE_SCOPE_BLOCK,
+    TEMPLATE_SCOPE_MEMBER,
+    TEMPLATE_SCOPE_BINDING,
+
+    // Fields which aren't lists.
+    TEMPLATE_SCOPE_NONE,
+} TemplateScope;
+
+typedef enum {
+    TEMPLATE_FIELD_INDEX,
+    TEMPLATE_FIELD_FIRST,
+    TEMPLATE_FIELD_LAST,
+
+    TEMPLATE_FIELD_PROGRAM_NAME,
+    TEMPLATE_FIELD_PROGRAM_SPV,
+    TEMPLATE_FIELD_PROGRAM_SPV_SIZE,
+    TEMPLATE_FIELD_PROGRAM_STAGES,
+    TEMPLATE_FIELD_PROGRAM_BINDINGS,
+
+    TEMPLATE_FIELD_STAGE_NAME,
+    TEMPLATE_FIELD_STAGE_PREFIX,
+    TEMPLATE_FIELD_STAGE_SPV,
+    TEMPLATE_FIELD_STAGE_SPV_SIZE,
+    TEMPLATE_FIELD_STAGE_BLOCKS,
+    TEMPLATE_FIELD_STAGE_UNIFORM_BUFFERS,
+    TEMPLATE_FIELD_STAGE_PUSH_CONSTANTS,
+
+    TEMPLATE_FIELD_BLOCK_NAME,
+    TEMPLATE_FIELD_BLOCK_INSTANCE_NAME,
+    TEMPLATE_FIELD_BLOCK_KIND,
+    TEMPLATE_FIELD_BLOCK_SET,
+    TEMPLATE_FIELD_BLOCK_BINDING,
+    TEMPLATE_FIELD_BLOCK_SIZE,
+    TEMPLATE_FIELD_BLOCK_MEMBERS,
+
+    TEMPLATE_FIELD_MEMBER_NAME,
+    TEMPLATE_FIELD_MEMBER_TYPE,
+    TEMPLATE_FIELD_MEMBER_CTYPE,
+    TEMPLATE_FIELD_MEMBER_OFFSET,
+    TEMPLATE_FIELD_MEMBER_SIZE,
+    TEMPLATE_FIELD_MEMBER_ARRAY,
+    TEMPLATE_FIELD_MEMBER_ARRAY_STRIDE,
+    TEMPLATE_FIELD_MEMBER_IS_STRUCT,
+    TEMPLATE_FIELD_MEMBER_MEMBERS,
+
+    TEMPLATE_FIELD_BINDING_NAME,
+    TEMPLATE_FIELD_BINDING_TYPE,
+    TEMPLATE_FIELD_BINDING_SET,
+    TEMPLATE_FIELD_BINDING_BINDING,
+    TEMPLATE_FIELD_BINDING_COUNT,
+    TEMPLATE_FIELD_BINDING_RUNTIME_ARRAY,
+    TEMPLATE_FIELD_BINDING_VERTEX,
+    TEMPLATE_FIELD_BINDING_FRAGMENT,
+} TemplateField;
+
+typedef struct TemplateFieldDesc TemplateFieldDesc;
+struct TemplateFieldDesc {
+    TemplateScope scope;
+    ArStr name;
+    TemplateField field;
+    // Scope of the items if the field is a list.
+    TemplateScope item_scope;
+};
+
+static const TemplateFieldDesc FIELDS[] = {
+    {TEMPLATE_SCOPE_ROOT, ar_str_lit("name"), TEMPLATE_FIELD_PROGRAM_NAME, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_ROOT, ar_str_lit("spv"), TEMPLATE_FIELD_PROGRAM_SPV, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_ROOT, ar_str_lit("spv_size"), TEMPLATE_FIELD_PROGRAM_SPV_SIZE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_ROOT, ar_str_lit("stages"), TEMPLATE_FIELD_PROGRAM_STAGES, TEMPLATE_SCOPE_STAGE},
+    {TEMPLATE_SCOPE_ROOT, ar_str_lit("bindings"), TEMPLATE_FIELD_PROGRAM_BINDINGS, TEMPLATE_SCOPE_BINDING},
+
+    {TEMPLATE_SCOPE_STAGE, ar_str_lit("name"), TEMPLATE_FIELD_STAGE_NAME, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_STAGE, ar_str_lit("prefix"), TEMPLATE_FIELD_STAGE_PREFIX, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_STAGE, ar_str_lit("spv"), TEMPLATE_FIELD_STAGE_SPV, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_STAGE, ar_str_lit("spv_size"), TEMPLATE_FIELD_STAGE_SPV_SIZE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_STAGE, ar_str_lit("blocks"), TEMPLATE_FIELD_STAGE_BLOCKS, TEMPLATE_SCOPE_BLOCK},
+    {TEMPLATE_SCOPE_STAGE, ar_str_lit("uniform_buffers"), TEMPLATE_FIELD_STAGE_UNIFORM_BUFFERS, TEMPLATE_SCOPE_BLOCK},
+    {TEMPLATE_SCOPE_STAGE, ar_str_lit("push_constants"), TEMPLATE_FIELD_STAGE_PUSH_CONSTANTS, TEMPLATE_SCOPE_BLOCK},
+
+    {TEMPLATE_SCOPE_BLOCK, ar_str_lit("name"), TEMPLATE_FIELD_BLOCK_NAME, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BLOCK, ar_str_lit("instance_name"), TEMPLATE_FIELD_BLOCK_INSTANCE_NAME, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BLOCK, ar_str_lit("kind"), TEMPLATE_FIELD_BLOCK_KIND, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BLOCK, ar_str_lit("set"), TEMPLATE_FIELD_BLOCK_SET, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BLOCK, ar_str_lit("binding"), TEMPLATE_FIELD_BLOCK_BINDING, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BLOCK, ar_str_lit("size"), TEMPLATE_FIELD_BLOCK_SIZE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BLOCK, ar_str_lit("members"), TEMPLATE_FIELD_BLOCK_MEMBERS, TEMPLATE_SCOPE_MEMBER},
+
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("name"), TEMPLATE_FIELD_MEMBER_NAME, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("type"), TEMPLATE_FIELD_MEMBER_TYPE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("ctype"), TEMPLATE_FIELD_MEMBER_CTYPE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("offset"), TEMPLATE_FIELD_MEMBER_OFFSET, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("size"), TEMPLATE_FIELD_MEMBER_SIZE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("array"), TEMPLATE_FIELD_MEMBER_ARRAY, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("array_stride"), TEMPLATE_FIELD_MEMBER_ARRAY_STRIDE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("is_struct"), TEMPLATE_FIELD_MEMBER_IS_STRUCT, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_MEMBER, ar_str_lit("members"), TEMPLATE_FIELD_MEMBER_MEMBERS, TEMPLATE_SCOPE_MEMBER},
+
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("name"), TEMPLATE_FIELD_BINDING_NAME, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("type"), TEMPLATE_FIELD_BINDING_TYPE, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("set"), TEMPLATE_FIELD_BINDING_SET, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("binding"), TEMPLATE_FIELD_BINDING_BINDING, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("count"), TEMPLATE_FIELD_BINDING_COUNT, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("runtime_array"), TEMPLATE_FIELD_BINDING_RUNTIME_ARRAY, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("vertex"), TEMPLATE_FIELD_BINDING_VERTEX, TEMPLATE_SCOPE_NONE},
+    {TEMPLATE_SCOPE_BINDING, ar_str_lit("fragment"), TEMPLATE_FIELD_BINDING_FRAGMENT, TEMPLATE_SCOPE_NONE},
+};
+
+static const ArStr LOOP_FIELDS[] = {
+    [TEMPLATE_FIELD_INDEX] = ar_str_lit("@index"),
+    [TEMPLATE_FIELD_FIRST] = ar_str_lit("@first"),
+    [TEMPLATE_FIELD_LAST] = ar_str_lit("@last"),
+};
+
+static const ArStr DESCRIPTOR_TYPE_NAMES[DESCRIPTOR_TYPE_COUNT] = {
+    ar_str_lit("uniform_buffer"),
+    ar_str_lit("storage_buffer"),
+    ar_str_lit("combined_image_sampler"),
+    ar_str_lit("sampled_image"),
+    ar_str_lit("storage_image"),
+    ar_str_lit("sampler"),
+};
+
+static const ArStr BLOCK_KIND_NAMES[REFLECTION_INDEX_COUNT] = {
+    ar_str_lit("uniform_buffer"),
+    ar_str_lit("push_constant"),
+};
+
+typedef enum {
+    TEMPLATE_OP_TEXT,
+    TEMPLATE_OP_FIELD,
+    // Pushes a loop over a list, jumps past its end if empty.
+    TEMPLATE_OP_EACH,
+    // Advances the innermost loop, jumps back to its body if not done.
+    TEMPLATE_OP_NEXT,
+    TEMPLATE_OP_IF,
+    TEMPLATE_OP_UNLESS,
+    TEMPLATE_OP_JUMP,
+} TemplateOp;
+
+typedef struct TemplateInstruction TemplateInstruction;
+struct TemplateInstruction {
+    TemplateOp op;
+    ArStr text;
+    TemplateField field;
+    // Number of scopes outwards the field belongs to.
+    U32 depth;
+    U32 jump;
+};
+
+#define TEMPLATE_MAX_DEPTH 32
+
+struct Template {
+    TemplateInstruction *instructions;
+    U32 instruction_count;
+};
+
+//
+// Compiler
+//
+
+typedef struct Block Block;
+struct Block {
+    TemplateOp op;
+    U32 instruction;
+    // Index of the '{{else}}' jump, 0 if none.
+    U32 else_jump;
+};
+
+typedef struct TemplateCompiler TemplateCompiler;
+struct TemplateCompiler {
+    ArArena *arena;
+    ArStr filepath;
+    ArStr source;
+    U32 line;
+
+    TemplateInstruction *instructions;
+    U32 instruction_count;
+    U32 instruction_capacity;
+
+    // Scope of every enclosing loop, the root first.
+    TemplateScope scopes[TEMPLATE_MAX_DEPTH];
+    U32 scope_count;
+    Block blocks[TEMPLATE_MAX_DEPTH];
+    U32 block_count;
+
+    B8 failed;
+};
+
+static void compile_error(TemplateCompiler *compiler, const char *message, ArStr tag) {
+    ar_error("%.*s:%u: %s '%.*s'.",
+            (I32) compiler->filepath.len, compiler->filepath.data,
+            compiler->line, message,
+            (I32) tag.len, tag.data);
+    compiler->failed = true;
+}
+
+static U32 push_instruction(TemplateCompiler *compiler, TemplateInstruction instruction) {
+    if (compiler->instruction_count == compiler->instruction_capacity) {
+        U32 capacity = compiler->instruction_capacity * 2;
+        TemplateInstruction *instructions = ar_arena_push_arr_no_zero(compiler->arena, TemplateInstruction, capacity);
+        memcpy(instructions, compiler->instructions, compiler->instruction_count * sizeof(TemplateInstruction));
+        compiler->instructions = instructions;
+        compiler->instruction_capacity = capacity;
+    }
+
+    compiler->instructions[compiler->instruction_count] = instruction;
+    compiler->instruction_count++;
+    return compiler->instruction_count - 1;
+}
+
+// Resolves a name against the enclosing scopes, innermost first. Every
+// leading '../' skips a scope.
+static B8 resolve_field(TemplateCompiler *compiler, ArStr name, TemplateInstruction *instruction, const TemplateFieldDesc **desc) {
+    ArStr full_name = name;
+    U32 skip = 0;
+    while (name.len > 3 && ar_str_match(ar_str_sub(name, 0, 2), ar_str_lit("../"), AR_STR_MATCH_FLAG_EXACT)) {
+        name = ar_str_chop_start(name, 3);
+        skip++;
+    }
+    if (skip >= compiler->scope_count) {
+        compile_error(compiler, "No enclosing scope for", full_name);
+        return false;
+    }
+
+    for (U32 i = 0; i < ar_arrlen(LOOP_FIELDS); i++) {
+        if (ar_str_match(name, LOOP_FIELDS[i], AR_STR_MATCH_FLAG_EXACT)) {
+            if (compiler->scope_count == 1 || skip > 0) {
+                compile_error(compiler, "Loop field used outside of a loop", name);
+                return false;
+            }
+            instruction->field = i;
+            instruction->depth = 0;
+            *desc = NULL;
+            return true;
+        }
+    }
+
+    for (I32 i = compiler->scope_count - 1 - skip; i >= 0; i--) {
+        for (U32 j = 0; j < ar_arrlen(FIELDS); j++) {
+            if (FIELDS[j].scope == compiler->scopes[i] && ar_str_match(name, FIELDS[j].name, AR_STR_MATCH_FLAG_EXACT)) {
+                instruction->field = FIELDS[j].field;
+                instruction->depth = compiler->scope_count - 1 - i;
+                *desc = &FIELDS[j];
+                return true;
+            }
+        }
+    }
+
+    compile_error(compiler, "Unknown field", full_name);
+    return false;
+}
+
+static void compile_tag(TemplateCompiler *compiler, ArStr tag) {
+    TemplateInstruction instruction = {0};
+    const TemplateFieldDesc *desc = NULL;
+
+    if (tag.len > 0 && tag.data[0] == '!') {
+        return;
+    }
+
+    if (tag.len > 0 && tag.data[0] == '#') {
+        U64 space = ar_str_find_char(tag, ' ', 0);
+        if (space >= tag.len) {
+            compile_error(compiler, "Expected a field after", tag);
+            return;
+        }
+        ArStr keyword = ar_str_sub(tag, 1, space - 1);
+        ArStr name = ar_str_trim(ar_str_chop_start(tag, space + 1));
+        if (!resolve_field(compiler, name, &instruction, &desc)) {
+            return;
+        }
+
+        if (compiler->block_count == TEMPLATE_MAX_DEPTH) {
+            compile_error(compiler, "Too deeply nested", tag);
+            return;
+        }
+
+        if (ar_str_match(keyword, ar_str_lit("each"), AR_STR_MATCH_FLAG_EXACT)) {
+            if (desc == NULL || desc->item_scope == TEMPLATE_SCOPE_NONE) {
+                compile_error(compiler, "Not a list", name);
+                return;
+            }
+            // The root scope takes a slot, the renderer's frames mirror
+            // the scopes.
+            if (compiler->scope_count == TEMPLATE_MAX_DEPTH) {
+                compile_error(compiler, "Too deeply nested", tag);
+                return;
+            }
+            instruction.op = TEMPLATE_OP_EACH;
+            compiler->scopes[compiler->scope_count] = desc->item_scope;
+            compiler->scope_count++;
+        } else if (ar_str_match(keyword, ar_str_lit("if"), AR_STR_MATCH_FLAG_EXACT)) {
+            instruction.op = TEMPLATE_OP_IF;
+        } else if (ar_str_match(keyword, ar_str_lit("unless"), AR_STR_MATCH_FLAG_EXACT)) {
+            instruction.op = TEMPLATE_OP_UNLESS;
+        } else {
+            compile_error(compiler, "Unknown block", keyword);
+            return;
+        }
+
+        // Kept for reporting unclosed blocks.
+        instruction.text = tag;
+        compiler->blocks[compiler->block_count] = (Block) {
+            .op = instruction.op,
+            .instruction = push_instruction(compiler, instruction),
+        };
+        compiler->block_count++;
+        return;
+    }
+
+    if (ar_str_match(tag, ar_str_lit("else"), AR_STR_MATCH_FLAG_EXACT)) {
+        Block *block = compiler->block_count > 0 ? &compiler->blocks[compiler->block_count - 1] : NULL;
+        if (block == NULL || block->op == TEMPLATE_OP_EACH || block->else_jump != 0) {
+            compile_error(compiler, "Unexpected", tag);
+            return;
+        }
+        block->else_jump = push_instruction(compiler, (TemplateInstruction) {.op = TEMPLATE_OP_JUMP});
+        compiler->instructions[block->instruction].jump = compiler->instruction_count;
+        return;
+    }
+
+    if (tag.len > 0 && tag.data[0] == '/') {
+        ArStr keyword = ar_str_chop_start(tag, 1);
+        if (compiler->block_count == 0) {
+            compile_error(compiler, "Unexpected", tag);
+            return;
+        }
+        Block block = compiler->blocks[compiler->block_count - 1];
+        const ArStr block_names[] = {
+            [TEMPLATE_OP_EACH] = ar_str_lit("each"),
+            [TEMPLATE_OP_IF] = ar_str_lit("if"),
+            [TEMPLATE_OP_UNLESS] = ar_str_lit("unless"),
+        };
+        if (!ar_str_match(keyword, block_names[block.op], AR_STR_MATCH_FLAG_EXACT)) {
+            compile_error(compiler, "Mismatched", tag);
+            return;
+        }
+        compiler->block_count--;
+
+        if (block.op == TEMPLATE_OP_EACH) {
+            push_instruction(compiler, (TemplateInstruction) {
+                    .op = TEMPLATE_OP_NEXT,
+                    .jump = block.instruction + 1,
+                });
+            compiler->scope_count--;
+            compiler->instructions[block.instruction].jump = compiler->instruction_count;
+        } else if (block.else_jump != 0) {
+            compiler->instructions[block.else_jump].jump = compiler->instruction_count;
+        } else {
+            compiler->instructions[block.instruction].jump = compiler->instruction_count;
+        }
+        return;
+    }
+
+    if (!resolve_field(compiler, tag, &instruction, &desc)) {
+        return;
+    }
+    if (desc != NULL && desc->item_scope != TEMPLATE_SCOPE_NONE) {
+        compile_error(compiler, "Can't output a list", tag);
+        return;
+    }
+    instruction.op = TEMPLATE_OP_FIELD;
+    push_instruction(compiler, instruction);
+}
+
+static U32 count_lines(ArStr str) {
+    U32 lines = 0;
+    for (U64 i = 0; i < str.len; i++) {
+        lines += str.data[i] == '\n';
+    }
+    return lines;
+}
+
+Template *template_compile(ArArena *arena, ArStr source, ArStr filepath) {
+    TemplateCompiler compiler = {
+        .arena = arena,
+        .filepath = filepath,
+        .source = source,
+        .line = 1,
+        .instruction_capacity = 64,
+        .instructions = ar_arena_push_arr_no_zero(arena, TemplateInstruction, 64),
+        .scopes = {TEMPLATE_SCOPE_ROOT},
+        .scope_count = 1,
+    };
+
+    U64 pos = 0;
+    while (pos < source.len) {
+        ArStr rest = ar_str_chop_start(source, pos);
+        U64 open = 0;
+        while (open + 1 < rest.len && !(rest.data[open] == '{' && rest.data[open + 1] == '{')) {
+            open++;
+        }
+        if (open + 1 >= rest.len) {
+            push_instruction(&compiler, (TemplateInstruction) {.op = TEMPLATE_OP_TEXT, .text = rest});
+            break;
+        }
+
+        U64 close = open + 2;
+        while (close + 1 < rest.len && !(rest.data[close] == '}' && rest.data[close + 1] == '}')) {
+            close++;
+        }
+        if (close + 1 >= rest.len) {
+            compiler.line += count_lines(ar_str_sub(rest, 0, open));
+            compile_error(&compiler, "Unterminated tag", ar_str_chop_start(rest, open));
+            break;
+        }
+
+        ArStr text = ar_str(rest.data, open);
+        ArStr tag = ar_str_trim(ar_str(&rest.data[open + 2], close - open - 2));
+        U64 after = close + 2;
+
+        // Block tags alone on their line take the line with them.
+        B8 is_block = tag.len > 0 && (tag.data[0] == '#' || tag.data[0] == '/' || tag.data[0] == '!' ||
+                ar_str_match(tag, ar_str_lit("else"), AR_STR_MATCH_FLAG_EXACT));
+        if (is_block) {
+            U64 line_start = text.len;
+            while (line_start > 0 && (text.data[line_start - 1] == ' ' || text.data[line_start - 1] == '\t')) {
+                line_start--;
+            }
+            B8 at_line_start = line_start == 0 ? pos == 0 || source.data[pos - 1] == '\n' : text.data[line_start - 1] == '\n';
+
+            U64 line_end = after;
+            while (line_end < rest.len && (rest.data[line_end] == ' ' || rest.data[line_end] == '\t' || rest.data[line_end] == '\r')) {
+                line_end++;
+            }
+            B8 at_line_end = line_end == rest.len || rest.data[line_end] == '\n';
+
+            if (at_line_start && at_line_end) {
+                text.len = line_start;
+                after = line_end < rest.len ? line_end + 1 : line_end;
+            }
+        }
+
+        if (text.len > 0) {
+            push_instruction(&compiler, (TemplateInstruction) {.op = TEMPLATE_OP_TEXT, .text = text});
+        }
+        compiler.line += count_lines(text);
+        compile_tag(&compiler, tag);
+        compiler.line += count_lines(ar_str_sub(rest, open + 2, after - 1));
+
+        pos += after;
+    }
+
+    if (compiler.block_count > 0) {
+        compile_error(&compiler, "Unclosed block", compiler.instructions[compiler.blocks[compiler.block_count - 1].instruction].text);
+    }
+    if (compiler.failed) {
+        return NULL;
+    }
+
+    Template *template = ar_arena_push_arr(arena, Template, 1);
+    template->instructions = compiler.instructions;
+    template->instruction_count = compiler.instruction_count;
+    return template;
+}
+
+//
+// Renderer
+//
+
+typedef struct StageItem StageItem;
+struct StageItem {
+    ArStr name;
+    ArStr prefix;
+    const CompiledStage *stage;
+};
+
+typedef struct BlockItem BlockItem;
+struct BlockItem {
+    const ReflectedType *type;
+    ReflectionIndex kind;
+};
+
+typedef struct Frame Frame;
+struct Frame {
+    TemplateScope scope;
+    // StageItem, BlockItem, ReflectedType or ReflectedBinding depending on
+    // the scope.
+    const void *items;
+    U32 count;
+    U32 index;
+};
+
+typedef struct Renderer Renderer;
+struct Renderer {
+    ArArena *arena;
+    ArStrList output;
+    TemplateInput input;
+    StageItem stages[2];
+
+    Frame frames[TEMPLATE_MAX_DEPTH];
+    U32 frame_count;
+};
+
+typedef enum {
+    VALUE_STRING,
+    VALUE_NUMBER,
+    VALUE_LIST,
+} ValueKind;
+
+typedef struct Value Value;
+struct Value {
+    ValueKind kind;
+    ArStr string;
+    U64 number;
+    Frame list;
+};
+
+static Value string_value(ArStr string) {
+    return (Value) {.kind = VALUE_STRING, .string = string};
+}
+
+static Value number_value(U64 number) {
+    return (Value) {.kind = VALUE_NUMBER, .number = number};
+}
+
+static Value list_value(TemplateScope scope, const void *items, U32 count) {
+    return (Value) {
+        .kind = VALUE_LIST,
+        .list = {
+            .scope = scope,
+            .items = items,
+            .count = count,
+        },
+    };
+}
+
+// Words of a module as comma separated hex literals.
+static ArStr spv_words(ArArena *arena, ArStr spv) {
+    U64 word_count = spv.len / sizeof(U32);
+    // "0x00000000, " per word.
+    char *buffer = ar_arena_push_arr_no_zero(arena, char, word_count * 12 + 1);
+    const U32 *words = (const U32 *) spv.data;
+    U64 len = 0;
+    for (U64 i = 0; i < word_count; i++) {
+        len += snprintf(&buffer[len], 13, i + 1 < word_count ? "0x%.8x, " : "0x%.8x", words[i]);
+    }
+    return ar_str((const U8 *) buffer, len);
+}
+
+static Value block_list(Renderer *renderer, const CompiledStage *stage, U32 first, U32 last) {
+    U32 count = 0;
+    for (U32 i = first; i <= last; i++) {
+        count += stage->reflection.count[i];
+    }
+
+    BlockItem *items = ar_arena_push_arr_no_zero(renderer->arena, BlockItem, count);
+    U32 index = 0;
+    for (U32 i = first; i <= last; i++) {
+        for (U32 j = 0; j < stage->reflection.count[i]; j++) {
+            items[index] = (BlockItem) {
+                .type = &stage->reflection.types[i][j],
+                .kind = i,
+            };
+            index++;
+        }
+    }
+
+    return list_value(TEMPLATE_SCOPE_BLOCK, items, count);
+}
+
+static Value stage_field(Renderer *renderer, const StageItem *stage, TemplateField field) {
+    switch (field) {
+        case TEMPLATE_FIELD_STAGE_NAME:
+            return string_value(stage->name);
+        case TEMPLATE_FIELD_STAGE_PREFIX:
+            return string_value(stage->prefix);
+        case TEMPLATE_FIELD_STAGE_SPV:
+            return string_value(spv_words(renderer->arena, stage->stage->spv));
+        case TEMPLATE_FIELD_STAGE_SPV_SIZE:
+            return number_value(stage->stage->spv.len);
+        case TEMPLATE_FIELD_STAGE_BLOCKS:
+            return block_list(renderer, stage->stage, 0, REFLECTION_INDEX_COUNT - 1);
+        case TEMPLATE_FIELD_STAGE_UNIFORM_BUFFERS:
+            return block_list(renderer, stage->stage, REFLECTION_INDEX_UNIFORM_BUFFER, REFLECTION_INDEX_UNIFORM_BUFFER);
+        case TEMPLATE_FIELD_STAGE_PUSH_CONSTANTS:
+            return block_list(renderer, stage->stage, REFLECTION_INDEX_PUSH_CONSTANT, REFLECTION_INDEX_PUSH_CONSTANT);
+        default:
+            return string_value(ar_str_lit(""));
+    }
+}
+
+static Value block_field(const BlockItem *block, TemplateField field) {
+    switch (field) {
+        case TEMPLATE_FIELD_BLOCK_NAME:
+            return string_value(block->type->name);
+        case TEMPLATE_FIELD_BLOCK_INSTANCE_NAME:
+            return string_value(block->type->instance_name);
+        case TEMPLATE_FIELD_BLOCK_KIND:
+            return string_value(BLOCK_KIND_NAMES[block->kind]);
+        case TEMPLATE_FIELD_BLOCK_SET:
+            return number_value(block->type->set);
+        case TEMPLATE_FIELD_BLOCK_BINDING:
+            return number_value(block->type->binding);
+        case TEMPLATE_FIELD_BLOCK_SIZE:
+            return number_value(block->type->size);
+        case TEMPLATE_FIELD_BLOCK_MEMBERS:
+            return list_value(TEMPLATE_SCOPE_MEMBER, block->type->members, block->type->member_count);
+        default:
+            return string_value(ar_str_lit(""));
+    }
+}
+
+static Value member_field(Renderer *renderer, const ReflectedType *member, TemplateField field) {
+    switch (field) {
+        case TEMPLATE_FIELD_MEMBER_NAME:
+            return string_value(member->name);
+        case TEMPLATE_FIELD_MEMBER_TYPE:
+            return string_value(REFLECTED_DATA_TYPE_NAMES[member->data_type]);
+        case TEMPLATE_FIELD_MEMBER_CTYPE:
+            return string_value(renderer->input.ctypes[member->data_type]);
+        case TEMPLATE_FIELD_MEMBER_OFFSET:
+            return number_value(member->offset);
+        case TEMPLATE_FIELD_MEMBER_SIZE:
+            return number_value(member->size);
+        case TEMPLATE_FIELD_MEMBER_ARRAY_STRIDE:
+            return number_value(member->array_stride);
+        case TEMPLATE_FIELD_MEMBER_IS_STRUCT:
+            return number_value(member->data_type == REFLECTED_DATA_TYPE_STRUCT);
+        case TEMPLATE_FIELD_MEMBER_MEMBERS:
+            return list_value(TEMPLATE_SCOPE_MEMBER, member->members, member->member_count);
+        case TEMPLATE_FIELD_MEMBER_ARRAY: {
+            // Outermost dimension first, the reflection stores them reversed.
+            ArStrList dims = {0};
+            for (I32 i = member->array_dimensions - 1; i >= 0; i--) {
+                ar_str_list_push(renderer->arena, &dims, ar_str_pushf(renderer->arena, "[%u]", member->array_dimension_lengths[i]));
+            }
+            return string_value(ar_str_list_join(renderer->arena, dims));
+        }
+        default:
+            return string_value(ar_str_lit(""));
+    }
+}
+
+static Value binding_field(const ReflectedBinding *binding, TemplateField field) {
+    switch (field) {
+        case TEMPLATE_FIELD_BINDING_NAME:
+            return string_value(binding->name);
+        case TEMPLATE_FIELD_BINDING_TYPE:
+            return string_value(DESCRIPTOR_TYPE_NAMES[binding->type]);
+        case TEMPLATE_FIELD_BINDING_SET:
+            return number_value(binding->set);
+        case TEMPLATE_FIELD_BINDING_BINDING:
+            return number_value(binding->binding);
+        case TEMPLATE_FIELD_BINDING_COUNT:
+            return number_value(binding->count);
+        case TEMPLATE_FIELD_BINDING_RUNTIME_ARRAY:
+            return number_value(binding->runtime_array);
+        case TEMPLATE_FIELD_BINDING_VERTEX:
+            return number_value((binding->stages & SHADER_STAGE_VERTEX) != 0);
+        case TEMPLATE_FIELD_BINDING_FRAGMENT:
+            return number_value((binding->stages & SHADER_STAGE_FRAGMENT) != 0);
+        default:
+            return string_value(ar_str_lit(""));
+    }
+}
+
+static Value field_value(Renderer *renderer, TemplateInstruction instruction) {
+    const Frame *frame = &renderer->frames[renderer->frame_count - 1 - instruction.depth];
+    const CompiledShader *shader = &renderer->input.shader;
+
+    switch (instruction.field) {
+        case TEMPLATE_FIELD_INDEX:
+            return number_value(frame->index);
+        case TEMPLATE_FIELD_FIRST:
+            return number_value(frame->index == 0);
+        case TEMPLATE_FIELD_LAST:
+            return number_value(frame->index + 1 == frame->count);
+        default:
+            break;
+    }
+
+    switch (frame->scope) {
+        case TEMPLATE_SCOPE_ROOT:
+            switch (instruction.field) {
+                case TEMPLATE_FIELD_PROGRAM_NAME:
+                    return string_value(shader->name);
+                case TEMPLATE_FIELD_PROGRAM_SPV:
+                    return string_value(spv_words(renderer->arena, shader->spv));
+                case TEMPLATE_FIELD_PROGRAM_SPV_SIZE:
+                    return number_value(shader->spv.len);
+                case TEMPLATE_FIELD_PROGRAM_STAGES:
+                    return list_value(TEMPLATE_SCOPE_STAGE, renderer->stages, ar_arrlen(renderer->stages));
+                case TEMPLATE_FIELD_PROGRAM_BINDINGS:
+                    return list_value(TEMPLATE_SCOPE_BINDING, shader->bindings, shader->binding_count);
+                default:
+                    break;
+            }
+            break;
+        case TEMPLATE_SCOPE_STAGE:
+            return stage_field(renderer, &((const StageItem *) frame->items)[frame->index], instruction.field);
+        case TEMPLATE_SCOPE_BLOCK:
+            return block_field(&((const BlockItem *) frame->items)[frame->index], instruction.field);
+        case TEMPLATE_SCOPE_MEMBER:
+            return member_field(renderer, &((const ReflectedType *) frame->items)[frame->index], instruction.field);
+        case TEMPLATE_SCOPE_BINDING:
+            return binding_field(&((const ReflectedBinding *) frame->items)[frame->index], instruction.field);
+        default:
+            break;
+    }
+
+    return string_value(ar_str_lit(""));
+}
+
+static B8 is_truthy(Value value) {
+    switch (value.kind) {
+        case VALUE_STRING:
+            return value.string.len != 0;
+        case VALUE_NUMBER:
+            return value.number != 0;
+        case VALUE_LIST:
+            return value.list.count != 0;
+    }
+    return false;
+}
+
+ArStr template_render(ArArena *arena, const Template *template, TemplateInput input) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    Renderer renderer = {
+        .arena = scratch.arena,
+        .input = input,
+        .stages = {
+            {
+                .name = ar_str_lit("vertex"),
+                .prefix = ar_str_pushf(scratch.arena, "%.*s_VS", (I32) input.shader.name.len, input.shader.name.data),
+                .stage = &input.shader.vertex,
+            },
+            {
+                .name = ar_str_lit("fragment"),
+                .prefix = ar_str_pushf(scratch.arena, "%.*s_FS", (I32) input.shader.name.len, input.shader.name.data),
+                .stage = &input.shader.fragment,
+            },
+        },
+        .frames = {{.scope = TEMPLATE_SCOPE_ROOT, .count = 1}},
+        .frame_count = 1,
+    };
+    // Stages point into the renderer's own copy of the shader.
+    renderer.stages[0].stage = &renderer.input.shader.vertex;
+    renderer.stages[1].stage = &renderer.input.shader.fragment;
+
+    U32 pc = 0;
+    while (pc < template->instruction_count) {
+        TemplateInstruction instruction = template->instructions[pc];
+        pc++;
+
+        switch (instruction.op) {
+            case TEMPLATE_OP_TEXT:
+                ar_str_list_push(scratch.arena, &renderer.output, instruction.text);
+                break;
+
+            case TEMPLATE_OP_FIELD: {
+                Value value = field_value(&renderer, instruction);
+                if (value.kind == VALUE_STRING) {
+                    ar_str_list_push(scratch.arena, &renderer.output, value.string);
+                } else {
+                    ar_str_list_push(scratch.arena, &renderer.output, ar_str_pushf(scratch.arena, "%llu", (unsigned long long) value.number));
+                }
+            } break;
+
+            case TEMPLATE_OP_EACH: {
+                Value value = field_value(&renderer, instruction);
+                if (value.list.count == 0) {
+                    pc = instruction.jump;
+                    break;
+                }
+                renderer.frames[renderer.frame_count] = value.list;
+                renderer.frame_count++;
+            } break;
+
+            case TEMPLATE_OP_NEXT: {
+                Frame *frame = &renderer.frames[renderer.frame_count - 1];
+                frame->index++;
+                if (frame->index < frame->count) {
+                    pc = instruction.jump;
+                } else {
+                    renderer.frame_count--;
+                }
+            } break;
+
+            case TEMPLATE_OP_IF:
+            case TEMPLATE_OP_UNLESS: {
+                B8 truthy = is_truthy(field_value(&renderer, instruction));
+                if (truthy != (instruction.op == TEMPLATE_OP_IF)) {
+                    pc = instruction.jump;
+                }
+            } break;
+
+            case TEMPLATE_OP_JUMP:
+                pc = instruction.jump;
+                break;
+        }
+    }
+
+    ArStr output = ar_str_list_join(arena, renderer.output);
+
+    ar_scratch_release(&scratch);
+
+    return output;
+}
@@ -0,0 +1,33 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#ifdef HAS_SPIRV_TOOLS
+#include <spirv-tools/libspirv.h>
+
+B8 spv_validate(ArStr name, const char *stage, ArStr spv) {
+    // Same environment glslang targets in compiler.c.
+    spv_context context = spvContextCreate(SPV_ENV_VULKAN_1_2);
+    spv_diagnostic diagnostic = NULL;
+    spv_result_t result = spvValidateBinary(context, (const U32 *) spv.data, spv.len / sizeof(U32), &diagnostic);
+
+    if (result != SPV_SUCCESS) {
+        ar_error("%.*s (%s): SPIR-V validation failed.", (I32) name.len, name.data, stage);
+        if (diagnostic != NULL) {
+            ar_error("Instruction %llu: %s", (unsigned long long) diagnostic->position.index, diagnostic->error);
+        }
+    }
+
+    spvDiagnosticDestroy(diagnostic);
+    spvContextDestroy(context);
+
+    return result == SPV_SUCCESS;
+}
+#else
+B8 spv_validate(ArStr name, const char *stage, ArStr spv) {
+    (void) stage;
+    (void) spv;
+    ar_error("%.*s: Can't validate, built without SPIRV-Tools.", (I32) name.len, name.data);
+    return false;
+}
+#endif
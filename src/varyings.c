@@ -0,0 +1,370 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+#include <spirv.h>
+#include <string.h>
+
+// Removes vertex outputs the fragment stage never reads, along with the
+// computations only they needed. Every output costs interpolator bandwidth
+// and, on tiled GPUs, storage per vertex between the binning and shading
+// passes.
+//
+// Fragment inputs which are declared but never read go first, then every
+// vertex output whose locations no remaining input covers is dead. Dead
+// code is found by a fixpoint over the vertex module: stores to dead
+// variables are removed, local and private variables nothing reads anymore
+// become dead and side effect free instructions without uses are removed.
+// Function calls are kept, glslang doesn't inline without optimization so
+// work inside called functions stays.
+
+typedef struct Stage Stage;
+struct Stage {
+    SpvModule module;
+    U32 glsl_std_450;
+
+    // Per id, instruction index + 1 of the definition.
+    U32 *definitions;
+    // Per id, Location decoration + 1.
+    U32 *locations;
+    // Per variable.
+    U32 *pointee;
+    // Variable an access chain is rooted in, the variable itself for
+    // variables.
+    U32 *roots;
+
+    // Per instruction.
+    B8 *removed;
+    // Per id.
+    B8 *dead;
+    U32 *uses;
+    U32 *reads;
+};
+
+static B8 is_access_chain(U32 opcode) {
+    return opcode == SpvOpAccessChain || opcode == SpvOpInBoundsAccessChain || opcode == SpvOpPtrAccessChain;
+}
+
+// Instructions which compute their result and nothing else.
+static B8 is_pure(const Stage *stage, SpvInstruction inst) {
+    U32 opcode = inst.opcode;
+    if (opcode == SpvOpExtInst) {
+        return inst.words[3] == stage->glsl_std_450;
+    }
+    return opcode == SpvOpUndef ||
+        opcode == SpvOpLoad ||
+        is_access_chain(opcode) ||
+        (opcode >= SpvOpVectorExtractDynamic && opcode <= SpvOpTranspose) ||
+        (opcode >= SpvOpSampledImage && opcode <= SpvOpImageQuerySamples && opcode != SpvOpImageWrite) ||
+        (opcode >= SpvOpConvertFToU && opcode <= SpvOpBitCount) ||
+        (opcode >= SpvOpDPdx && opcode <= SpvOpFwidthCoarse) ||
+        opcode == SpvOpPhi;
+}
+
+static Stage analyze(ArArena *arena, ArStr spv) {
+    Stage stage = {
+        .module = spv_parse_module(arena, spv),
+    };
+    SpvModule *module = &stage.module;
+    U32 bound = module->bound;
+    if (bound == 0) {
+        return stage;
+    }
+
+    stage.definitions = ar_arena_push_arr(arena, U32, bound);
+    stage.locations = ar_arena_push_arr(arena, U32, bound);
+    stage.pointee = ar_arena_push_arr(arena, U32, bound);
+    stage.roots = ar_arena_push_arr(arena, U32, bound);
+    stage.removed = ar_arena_push_arr(arena, B8, module->instruction_count);
+    stage.dead = ar_arena_push_arr(arena, B8, bound);
+    stage.uses = ar_arena_push_arr(arena, U32, bound);
+    stage.reads = ar_arena_push_arr(arena, U32, bound);
+
+    // Definitions come before uses outside of phis, chains are rooted in a
+    // single pass.
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        U32 result = spv_result_id(inst);
+        if (result != 0 && result < bound) {
+            stage.definitions[result] = i + 1;
+        }
+
+        switch (inst.opcode) {
+            case SpvOpExtInstImport:
+                if (strcmp((const char *) &inst.words[2], "GLSL.std.450") == 0) {
+                    stage.glsl_std_450 = inst.words[1];
+                }
+                break;
+            case SpvOpDecorate:
+                if (inst.words[2] == SpvDecorationLocation && inst.word_count > 3) {
+                    stage.locations[inst.words[1]] = inst.words[3] + 1;
+                }
+                break;
+            case SpvOpVariable: {
+                U32 pointer = stage.definitions[inst.words[1]];
+                stage.pointee[result] = pointer != 0 ? module->instructions[pointer - 1].words[3] : 0;
+                stage.roots[result] = result;
+            } break;
+            case SpvOpAccessChain:
+            case SpvOpInBoundsAccessChain:
+            case SpvOpPtrAccessChain:
+                stage.roots[result] = stage.roots[inst.words[3]];
+                break;
+            default:
+                break;
+        }
+    }
+
+    return stage;
+}
+
+static SpvInstruction definition_of(const Stage *stage, U32 id) {
+    U32 index = stage->definitions[id];
+    return index != 0 ? stage->module.instructions[index - 1] : (SpvInstruction) {0};
+}
+
+// Number of locations a value of 'type' takes up in the interface.
+static U32 location_count(const Stage *stage, U32 type) {
+    SpvInstruction inst = definition_of(stage, type);
+    switch (inst.opcode) {
+        case SpvOpTypeVector: {
+            SpvInstruction component = definition_of(stage, inst.words[2]);
+            B8 wide = (component.opcode == SpvOpTypeFloat || component.opcode == SpvOpTypeInt) && component.words[2] == 64;
+            return wide && inst.words[3] > 2 ? 2 : 1;
+        }
+        case SpvOpTypeMatrix:
+            return inst.words[3] * location_count(stage, inst.words[2]);
+        case SpvOpTypeArray: {
+            SpvInstruction length = definition_of(stage, inst.words[3]);
+            U32 count = length.opcode == SpvOpConstant ? length.words[3] : 1;
+            return count * location_count(stage, inst.words[2]);
+        }
+        case SpvOpTypeStruct: {
+            U32 count = 0;
+            for (U32 i = 2; i < inst.word_count; i++) {
+                count += location_count(stage, inst.words[i]);
+            }
+            return count;
+        }
+        default:
+            return 1;
+    }
+}
+
+// Counts the uses of every id and the reads of every variable, through its
+// access chains. Storing to a variable or chaining off of it isn't a read.
+static void count_uses(Stage *stage, U16 *positions) {
+    SpvModule *module = &stage->module;
+    memset(stage->uses, 0, module->bound * sizeof(U32));
+    memset(stage->reads, 0, module->bound * sizeof(U32));
+
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (stage->removed[i] || module->sections[i] < SPV_SECTION_GLOBAL) {
+            continue;
+        }
+
+        U32 result = spv_result_id(inst);
+        U32 id_count = spv_id_operands(inst, positions);
+        for (U32 j = 0; j < id_count; j++) {
+            U32 position = positions[j];
+            U32 id = inst.words[position];
+            if (id == result || id >= module->bound) {
+                continue;
+            }
+            stage->uses[id]++;
+
+            B8 is_store = inst.opcode == SpvOpStore && position == 1;
+            B8 is_chain_base = is_access_chain(inst.opcode) && position == 3;
+            if (!is_store && !is_chain_base && stage->roots[id] != 0) {
+                stage->reads[stage->roots[id]]++;
+            }
+        }
+    }
+}
+
+// Returns the number of instructions removed.
+static U32 eliminate_dead_code(Stage *stage, U16 *positions) {
+    SpvModule *module = &stage->module;
+    U32 removed_count = 0;
+
+    B8 changed = true;
+    while (changed) {
+        changed = false;
+        count_uses(stage, positions);
+
+        for (U32 i = 0; i < module->instruction_count; i++) {
+            SpvInstruction inst = module->instructions[i];
+            if (stage->removed[i] || module->sections[i] < SPV_SECTION_GLOBAL) {
+                continue;
+            }
+
+            U32 result = spv_result_id(inst);
+            B8 remove = false;
+            if (inst.opcode == SpvOpVariable) {
+                U32 storage = inst.words[3];
+                if (!stage->dead[result] && stage->reads[result] == 0 &&
+                        (storage == SpvStorageClassFunction || storage == SpvStorageClassPrivate)) {
+                    stage->dead[result] = true;
+                    changed = true;
+                }
+                remove = stage->dead[result];
+            } else if (inst.opcode == SpvOpStore) {
+                remove = stage->dead[stage->roots[inst.words[1]]];
+            } else if (is_access_chain(inst.opcode)) {
+                remove = stage->dead[stage->roots[result]] || stage->uses[result] == 0;
+            } else if (result != 0 && is_pure(stage, inst)) {
+                remove = stage->uses[result] == 0;
+            }
+
+            if (remove) {
+                stage->removed[i] = true;
+                stage->dead[result] |= result != 0;
+                removed_count += module->sections[i] == SPV_SECTION_FUNCTION;
+                changed = true;
+            }
+        }
+    }
+
+    return removed_count;
+}
+
+// Writes the module without removed instructions and without names,
+// decorations and interface entries of dead ids.
+static ArStr rebuild(ArArena *arena, const Stage *stage, U16 *positions) {
+    const SpvModule *module = &stage->module;
+    U32 *words = ar_arena_push_arr_no_zero(arena, U32, module->spv.len / sizeof(U32));
+    memcpy(words, module->spv.data, SPV_HEADER_WORDS * sizeof(U32));
+    U64 offset = SPV_HEADER_WORDS;
+
+    for (U32 i = 0; i < module->instruction_count; i++) {
+        SpvInstruction inst = module->instructions[i];
+        if (stage->removed[i]) {
+            continue;
+        }
+
+        switch (inst.opcode) {
+            case SpvOpName:
+            case SpvOpDecorate:
+            case SpvOpDecorateId:
+            case SpvOpDecorateString:
+                if (stage->dead[inst.words[1]]) {
+                    continue;
+                }
+                break;
+            case SpvOpEntryPoint: {
+                // Interface ids follow the entry point's name.
+                U32 id_count = spv_id_operands(inst, positions);
+                U64 start = offset;
+                U32 next_id = 0;
+                for (U32 j = 0; j < inst.word_count; j++) {
+                    B8 is_id = next_id < id_count && positions[next_id] == j;
+                    next_id += is_id;
+                    if (is_id && stage->dead[inst.words[j]]) {
+                        continue;
+                    }
+                    words[offset] = inst.words[j];
+                    offset++;
+                }
+                words[start] = ((offset - start) << SpvWordCountShift) | inst.opcode;
+                continue;
+            }
+            default:
+                break;
+        }
+
+        memcpy(&words[offset], inst.words, inst.word_count * sizeof(U32));
+        offset += inst.word_count;
+    }
+
+    return ar_str((const U8 *) words, offset * sizeof(U32));
+}
+
+typedef struct LocationRange LocationRange;
+struct LocationRange {
+    U32 first;
+    U32 count;
+};
+
+B8 spv_eliminate_varyings(ArArena *arena, ArStr name, ArStr *vertex_spv, ArStr *fragment_spv) {
+    ArTemp scratch = ar_scratch_get(&arena, 1);
+
+    Stage vertex = analyze(scratch.arena, *vertex_spv);
+    Stage fragment = analyze(scratch.arena, *fragment_spv);
+    if (vertex.module.bound == 0 || fragment.module.bound == 0) {
+        ar_scratch_release(&scratch);
+        return false;
+    }
+
+    // Large enough for the operands of any instruction.
+    U16 *positions = ar_arena_push_arr_no_zero(scratch.arena, U16, 0xffff);
+
+    // Fragment inputs nothing reads.
+    count_uses(&fragment, positions);
+    U32 input_count = 0;
+    U32 removed_input_count = 0;
+    LocationRange *inputs = ar_arena_push_arr_no_zero(scratch.arena, LocationRange, fragment.module.bound);
+    for (U32 i = 0; i < fragment.module.instruction_count; i++) {
+        SpvInstruction inst = fragment.module.instructions[i];
+        if (inst.opcode != SpvOpVariable || inst.words[3] != SpvStorageClassInput) {
+            continue;
+        }
+        U32 variable = inst.words[2];
+        if (fragment.locations[variable] == 0) {
+            continue;
+        }
+        if (fragment.reads[variable] == 0) {
+            fragment.removed[i] = true;
+            fragment.dead[variable] = true;
+            removed_input_count++;
+            continue;
+        }
+        inputs[input_count] = (LocationRange) {
+            .first = fragment.locations[variable] - 1,
+            .count = location_count(&fragment, fragment.pointee[variable]),
+        };
+        input_count++;
+    }
+
+    // Vertex outputs no input covers. Outputs the vertex stage reads back
+    // are left alone.
+    count_uses(&vertex, positions);
+    U32 removed_output_count = 0;
+    for (U32 i = 0; i < vertex.module.instruction_count; i++) {
+        SpvInstruction inst = vertex.module.instructions[i];
+        if (inst.opcode != SpvOpVariable || inst.words[3] != SpvStorageClassOutput) {
+            continue;
+        }
+        U32 variable = inst.words[2];
+        if (vertex.locations[variable] == 0 || vertex.reads[variable] != 0) {
+            continue;
+        }
+
+        U32 first = vertex.locations[variable] - 1;
+        U32 count = location_count(&vertex, vertex.pointee[variable]);
+        B8 used = false;
+        for (U32 j = 0; j < input_count && !used; j++) {
+            used = first < inputs[j].first + inputs[j].count && inputs[j].first < first + count;
+        }
+        if (!used) {
+            vertex.dead[variable] = true;
+            removed_output_count++;
+        }
+    }
+
+    if (removed_output_count == 0 && removed_input_count == 0) {
+        ar_scratch_release(&scratch);
+        return true;
+    }
+
+    U32 removed_instruction_count = eliminate_dead_code(&vertex, positions);
+    *vertex_spv = rebuild(arena, &vertex, positions);
+    *fragment_spv = rebuild(arena, &fragment, positions);
+
+    ar_info("%.*s: Eliminated %u unused vertex outputs, %u unread fragment inputs and %u vertex instructions.",
+            (I32) name.len, name.data,
+            removed_output_count, removed_input_count, removed_instruction_count);
+
+    ar_scratch_release(&scratch);
+    return true;
+}
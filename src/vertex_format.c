@@ -0,0 +1,193 @@
+#include "arkin_core.h"
+#include "arkin_log.h"
+#include "internal.h"
+
+const VertexFormatInfo VERTEX_FORMATS[VERTEX_FORMAT_COUNT] = {
+    {ar_str_lit("R32_SFLOAT"), "float", 1, 4, 1, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R32G32_SFLOAT"), "float", 2, 8, 2, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R32G32B32_SFLOAT"), "float", 3, 12, 3, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R32G32B32A32_SFLOAT"), "float", 4, 16, 4, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R32_SINT"), "int", 1, 4, 1, REFLECTED_DATA_TYPE_I32},
+    {ar_str_lit("R32G32_SINT"), "int", 2, 8, 2, REFLECTED_DATA_TYPE_I32},
+    {ar_str_lit("R32G32B32_SINT"), "int", 3, 12, 3, REFLECTED_DATA_TYPE_I32},
+    {ar_str_lit("R32G32B32A32_SINT"), "int", 4, 16, 4, REFLECTED_DATA_TYPE_I32},
+    {ar_str_lit("R32_UINT"), "unsigned int", 1, 4, 1, REFLECTED_DATA_TYPE_U32},
+    {ar_str_lit("R32G32_UINT"), "unsigned int", 2, 8, 2, REFLECTED_DATA_TYPE_U32},
+    {ar_str_lit("R32G32B32_UINT"), "unsigned int", 3, 12, 3, REFLECTED_DATA_TYPE_U32},
+    {ar_str_lit("R32G32B32A32_UINT"), "unsigned int", 4, 16, 4, REFLECTED_DATA_TYPE_U32},
+
+    {ar_str_lit("R16G16_SFLOAT"), "unsigned short", 2, 4, 2, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R16G16B16A16_SFLOAT"), "unsigned short", 4, 8, 4, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R16G16_UNORM"), "unsigned short", 2, 4, 2, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R16G16_SNORM"), "short", 2, 4, 2, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R16G16B16A16_UNORM"), "unsigned short", 4, 8, 4, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R16G16B16A16_SNORM"), "short", 4, 8, 4, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R8G8B8A8_UNORM"), "unsigned char", 4, 4, 4, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("R8G8B8A8_SNORM"), "signed char", 4, 4, 4, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("A2B10G10R10_UNORM_PACK32"), "unsigned int", 1, 4, 4, REFLECTED_DATA_TYPE_F32},
+    {ar_str_lit("A2B10G10R10_SNORM_PACK32"), "unsigned int", 1, 4, 4, REFLECTED_DATA_TYPE_F32},
+};
+
+// Formats suggested for inputs whose name contains 'pattern', from the
+// usual precision needs of the attribute.
+static const struct {
+    ArStr pattern;
+    U32 min_vec_size;
+    U32 max_vec_size;
+    VertexFormat format;
+} SUGGESTIONS[] = {
+    // Unit vectors, the 2-bit alpha holds the sign of a tangent.
+    {ar_str_lit("normal"), 3, 4, VERTEX_FORMAT_A2B10G10R10_SNORM_PACK32},
+    {ar_str_lit("tangent"), 3, 4, VERTEX_FORMAT_A2B10G10R10_SNORM_PACK32},
+    {ar_str_lit("color"), 3, 4, VERTEX_FORMAT_R8G8B8A8_UNORM},
+    {ar_str_lit("colour"), 3, 4, VERTEX_FORMAT_R8G8B8A8_UNORM},
+    {ar_str_lit("weight"), 4, 4, VERTEX_FORMAT_R8G8B8A8_UNORM},
+    {ar_str_lit("uv"), 2, 2, VERTEX_FORMAT_R16G16_SFLOAT},
+    {ar_str_lit("texcoord"), 2, 2, VERTEX_FORMAT_R16G16_SFLOAT},
+    {ar_str_lit("tex_coord"), 2, 2, VERTEX_FORMAT_R16G16_SFLOAT},
+};
+
+static ReflectedDataType scalar_of(ReflectedDataType data_type) {
+    switch (data_type) {
+        case REFLECTED_DATA_TYPE_I32:
+        case REFLECTED_DATA_TYPE_IVEC2:
+        case REFLECTED_DATA_TYPE_IVEC3:
+        case REFLECTED_DATA_TYPE_IVEC4:
+            return REFLECTED_DATA_TYPE_I32;
+
+        case REFLECTED_DATA_TYPE_U32:
+        case REFLECTED_DATA_TYPE_UVEC2:
+        case REFLECTED_DATA_TYPE_UVEC3:
+        case REFLECTED_DATA_TYPE_UVEC4:
+            return REFLECTED_DATA_TYPE_U32;
+
+        case REFLECTED_DATA_TYPE_F32:
+        case REFLECTED_DATA_TYPE_VEC2:
+        case REFLECTED_DATA_TYPE_VEC3:
+        case REFLECTED_DATA_TYPE_VEC4:
+        case REFLECTED_DATA_TYPE_MAT2:
+        case REFLECTED_DATA_TYPE_MAT3:
+        case REFLECTED_DATA_TYPE_MAT4:
+            return REFLECTED_DATA_TYPE_F32;
+
+        default:
+            return REFLECTED_DATA_TYPE_UNKNOWN;
+    }
+}
+
+static B8 contains_ignore_case(ArStr str, ArStr pattern) {
+    for (U64 i = 0; i + pattern.len <= str.len; i++) {
+        B8 match = true;
+        for (U64 j = 0; j < pattern.len; j++) {
+            U8 c = str.data[i + j];
+            if (c >= 'A' && c <= 'Z') {
+                c += 'a' - 'A';
+            }
+            if (c != pattern.data[j]) {
+                match = false;
+                break;
+            }
+        }
+        if (match) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static B8 find_format(ArStr name, VertexFormat *format) {
+    ArStr prefix = ar_str_lit("VK_FORMAT_");
+    if (name.len > prefix.len && ar_str_match(ar_str_sub(name, 0, prefix.len - 1), prefix, AR_STR_MATCH_FLAG_EXACT)) {
+        name = ar_str_chop_start(name, prefix.len);
+    }
+
+    for (U32 i = 0; i < VERTEX_FORMAT_COUNT; i++) {
+        if (ar_str_match(name, VERTEX_FORMATS[i].name, AR_STR_MATCH_FLAG_EXACT)) {
+            *format = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+VertexFormat *choose_vertex_formats(ArArena *arena, ReflectedStage stage, const ArHashMap *overrides, B8 compress) {
+    VertexFormat *formats = ar_arena_push_arr(arena, VertexFormat, stage.input_count);
+    B8 failed = false;
+    U32 uncompressed_size = 0;
+    U32 size = 0;
+
+    for (U32 i = 0; i < stage.input_count; i++) {
+        ReflectedInput input = stage.inputs[i];
+        ReflectedDataType scalar = scalar_of(input.data_type);
+        I32 name_len = input.name.len;
+        const U8 *name = input.name.data;
+
+        if (scalar == REFLECTED_DATA_TYPE_UNKNOWN || input.vec_size < 1 || input.vec_size > 4) {
+            ar_error("%.*s: Unsupported vertex input type.", name_len, name);
+            failed = true;
+            continue;
+        }
+
+        // 32-bit formats matching the declared type, matrices use one per
+        // column.
+        U32 first = VERTEX_FORMAT_R32_SFLOAT;
+        if (scalar == REFLECTED_DATA_TYPE_I32) {
+            first = VERTEX_FORMAT_R32_SINT;
+        } else if (scalar == REFLECTED_DATA_TYPE_U32) {
+            first = VERTEX_FORMAT_R32_UINT;
+        }
+        formats[i] = first + input.vec_size - 1;
+        uncompressed_size += VERTEX_FORMATS[formats[i]].size * input.cols;
+
+        ArStr override = ar_hash_map_get(overrides, input.name, ArStr);
+        if (override.len != 0) {
+            VertexFormat format;
+            if (!find_format(override, &format)) {
+                ar_error("%.*s: Unknown vertex format %.*s.", name_len, name, (I32) override.len, override.data);
+                failed = true;
+            } else if (input.cols > 1) {
+                ar_error("%.*s: Matrix vertex inputs can't be given a format.", name_len, name);
+                failed = true;
+            } else if (VERTEX_FORMATS[format].data_type != scalar) {
+                ar_error("%.*s: Vertex format %.*s doesn't match the type of the input.",
+                        name_len, name, (I32) override.len, override.data);
+                failed = true;
+            } else {
+                formats[i] = format;
+            }
+            size += VERTEX_FORMATS[formats[i]].size;
+            continue;
+        }
+
+        for (U32 j = 0; j < ar_arrlen(SUGGESTIONS); j++) {
+            if (scalar != REFLECTED_DATA_TYPE_F32 || input.cols != 1 ||
+                    input.vec_size < SUGGESTIONS[j].min_vec_size ||
+                    input.vec_size > SUGGESTIONS[j].max_vec_size ||
+                    !contains_ignore_case(input.name, SUGGESTIONS[j].pattern)) {
+                continue;
+            }
+
+            VertexFormatInfo suggested = VERTEX_FORMATS[SUGGESTIONS[j].format];
+            if (compress) {
+                formats[i] = SUGGESTIONS[j].format;
+            } else {
+                ar_info("%.*s: Could be stored as %.*s in %u instead of %u bytes.",
+                        name_len, name,
+                        (I32) suggested.name.len, suggested.name.data,
+                        suggested.size, VERTEX_FORMATS[formats[i]].size);
+            }
+            break;
+        }
+        size += VERTEX_FORMATS[formats[i]].size * input.cols;
+    }
+
+    if (failed) {
+        return NULL;
+    }
+
+    if (size != uncompressed_size) {
+        ar_info("Compressed vertex inputs from %u to %u bytes per vertex.", uncompressed_size, size);
+    }
+
+    return formats;
+}